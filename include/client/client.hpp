@@ -75,6 +75,56 @@ class Client {
      */
     bool process_command(const std::vector<std::string> &command_parts);
 
+    /**
+     * @brief Receive a READ_FILE response into a local file
+     * @param local_path Path of the local file to create or overwrite
+     * @return true to continue processing commands
+     */
+    bool receive_download(const std::string &local_path);
+
+    /**
+     * @brief Receive a GET_TREE response into a new local directory
+     * @param local_path Path of the local directory to create
+     * @return true to continue processing commands
+     */
+    bool receive_tree(const std::string &local_path);
+
+    /**
+     * @brief Finish a sync: receive the remote signature and send a delta
+     *
+     * Falls back to a plain upload if the remote file does not exist, the
+     * delta would not be smaller than the file, or the server rejects it.
+     *
+     * @param local_path Path of the local file to send
+     * @param remote_filename File on the server to bring up to date
+     * @return true to continue processing commands
+     */
+    bool sync_upload(const std::string &local_path,
+                     const std::string &remote_filename);
+
+    /**
+     * @brief Finish a deduplicated upload: receive which chunks the server
+     * already stores and send the file with only the others
+     *
+     * Falls back to a plain upload if the server does not deduplicate or
+     * rejects the chunks.
+     *
+     * @param local_path Path of the local file to send
+     * @param remote_filename File on the server to write
+     * @param manifest Chunks of the local file
+     * @return true to continue processing commands
+     */
+    bool dedup_upload(const std::string &local_path,
+                      const std::string &remote_filename,
+                      const fenris::ChunkManifest &manifest);
+
+    /**
+     * @brief Request and display the remaining pages of a paged listing
+     * @param request The LIST_DIR request that produced the first page
+     * @param cursor Cursor returned with the first page
+     */
+    void receive_remaining_pages(fenris::Request request, std::string cursor);
+
     std::unique_ptr<ConnectionManager> m_connection_manager;
     std::unique_ptr<ITUI> m_tui;
     RequestManager m_request_manager;
@@ -3,6 +3,7 @@
 
 #include "common/crypto_manager.hpp"
 #include "common/logging.hpp"
+#include "common/payload.hpp"
 #include "fenris.pb.h"
 
 #include <atomic>
@@ -16,6 +17,10 @@
 namespace fenris {
 namespace client {
 
+// Largest response payload receive_response() collects into memory; larger
+// bodies have to be streamed into a sink
+constexpr uint64_t MAX_BUFFERED_RESPONSE_SIZE = 256 * 1024 * 1024;
+
 struct ServerInfo {
     uint32_t server_id;
     int32_t socket;
@@ -23,6 +28,7 @@ struct ServerInfo {
     std::string port;
     std::string current_directory;
     std::vector<uint8_t> encryption_key;
+    std::vector<uint8_t> compression_dictionary;
 };
 
 /**
@@ -101,16 +107,42 @@ class ConnectionManager {
      */
     bool send_request(const fenris::Request &request);
 
+    /**
+     * @brief Send a request followed by an out-of-band payload
+     * @param request The request header; its data field must be empty
+     * @param payload Source of the body, sent as raw payload frames
+     * @return true if send successful, false otherwise
+     */
+    bool send_request(const fenris::Request &request,
+                      common::PayloadSource &payload);
+
     /**
      * @brief Receive a response from the server
      * @return Optional containing the response if successfully received and
      * decrypted
      *
      * This method extracts the IV from the first part of the message
-     * and uses it to decrypt the response data
+     * and uses it to decrypt the response data. Dictionary-compressed
+     * payloads are expanded and out-of-band payloads collected into the
+     * data field before the response is returned. A payload over
+     * MAX_BUFFERED_RESPONSE_SIZE is drained and the response turned into
+     * an error.
      */
     std::optional<fenris::Response> receive_response();
 
+    /**
+     * @brief Receive a response, streaming any payload into a sink
+     * @param sink Destination for out-of-band payload frames
+     * @return Optional containing the response if successfully received and
+     * decrypted
+     *
+     * Payload frames are decrypted one chunk at a time and handed to the
+     * sink, so the body is never held in memory as a whole. Inline data is
+     * left in the response.
+     */
+    std::optional<fenris::Response>
+    receive_response(common::PayloadSink &sink);
+
     /**
      * @brief Check if currently connected to the server
      * @return true if connected, false otherwise
@@ -136,11 +168,25 @@ class ConnectionManager {
 
   private:
     /**
-     * @brief Perform key exchange with server and save the encryption key
+     * @brief Perform key exchange with server, save the encryption key and
+     * receive the compression dictionary
      * @returns true if key exchange was successful, false otherwise
      */
     bool perform_key_exchange();
 
+    /**
+     * @brief Receive, decrypt and decompress the next response message
+     * @returns The response, with any payload still waiting on the socket
+     */
+    std::optional<fenris::Response> receive_response_header();
+
+    /**
+     * @brief Receive the payload announced by a response into a sink
+     * @returns true if the whole payload was received and written
+     */
+    bool receive_response_payload(const fenris::Response &response,
+                                  common::PayloadSink &sink);
+
     bool m_non_blocking_mode;
     std::atomic<bool> m_connected{false};
     std::atomic<bool> m_has_connection_info{false};
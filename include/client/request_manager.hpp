@@ -2,7 +2,9 @@
 #define FENRIS_CLIENT_REQUEST_MANAGER_HPP
 
 #include "common/logging.hpp"
+#include "common/payload.hpp"
 #include "fenris.pb.h"
+#include <cstdint>
 #include <memory>
 #include <optional>
 #include <string>
@@ -12,6 +14,9 @@
 namespace fenris {
 namespace client {
 
+// Entries requested per page when listing a directory
+constexpr uint32_t LIST_DIR_PAGE_SIZE = 1000;
+
 /**
  * @class RequestManager
  * @brief Handles creation of client requests based on command line arguments
@@ -31,8 +36,22 @@ class RequestManager {
     std::optional<fenris::Request>
     generate_request(const std::vector<std::string> &args);
 
+    /**
+     * @brief Take the body of the last generated request if it is streamed
+     * @return Source reading the local file (or directory tree) chunk by
+     * chunk, or nullptr if the body (if any) is inline in the request's data
+     * field
+     *
+     * Local files and tree archives of at least common::PAYLOAD_THRESHOLD
+     * bytes are not read into memory; they are sent as payload frames
+     * straight from disk.
+     */
+    std::unique_ptr<common::PayloadSource> take_payload();
+
   private:
     common::Logger m_logger; // Added logger member
+    // Body of the last generated request when streamed from local files
+    std::unique_ptr<common::PayloadSource> m_payload;
     // Maps string command names to RequestType enum values
     const std::unordered_map<std::string, fenris::RequestType> m_command_map = {
         {"ping", fenris::RequestType::PING},
@@ -46,19 +65,42 @@ class RequestManager {
         {"ls", fenris::RequestType::LIST_DIR},
         {"cd", fenris::RequestType::CHANGE_DIR},
         {"rmdir", fenris::RequestType::DELETE_DIR},
+        {"cp", fenris::RequestType::COPY_FILE},
+        {"mv", fenris::RequestType::RENAME},
+        {"verify", fenris::RequestType::VERIFY_FILE},
         {"terminate", fenris::RequestType::TERMINATE}};
 
+    // Parse a non-negative byte offset or length argument
+    std::optional<uint64_t> parse_offset(const std::string &arg);
+
     // Helper functions for specific request types
     fenris::Request create_file_request(const std::vector<std::string> &args,
                                         size_t start_idx);
-    fenris::Request read_file_request(const std::vector<std::string> &args,
-                                      size_t start_idx);
-    fenris::Request write_file_request(const std::vector<std::string> &args,
-                                       size_t start_idx);
+    std::optional<fenris::Request>
+    read_file_request(const std::vector<std::string> &args, size_t start_idx);
+    std::optional<fenris::Request>
+    write_file_request(const std::vector<std::string> &args, size_t start_idx);
     fenris::Request append_file_request(const std::vector<std::string> &args,
                                         size_t start_idx);
     fenris::Request upload_file_request(const std::vector<std::string> &args,
                                         size_t start_idx);
+    fenris::Request download_file_request(const std::vector<std::string> &args,
+                                          size_t start_idx);
+    fenris::Request sync_file_request(const std::vector<std::string> &args,
+                                      size_t start_idx);
+    std::optional<fenris::Request>
+    dedup_file_request(const std::vector<std::string> &args,
+                       size_t start_idx);
+    std::optional<fenris::Request>
+    push_tree_request(const std::vector<std::string> &args, size_t start_idx);
+    fenris::Request pull_tree_request(const std::vector<std::string> &args,
+                                      size_t start_idx);
+    fenris::Request copy_request(const std::vector<std::string> &args,
+                                 size_t start_idx);
+
+    // Attach a local file as the request body, inline or streamed
+    bool set_local_content(const std::string &local_path,
+                           fenris::Request &request);
 };
 
 } // namespace client
@@ -92,6 +92,14 @@ class ResponseManager {
     void handle_terminated_response(const fenris::Response &response,
                                     std::vector<std::string> &result);
 
+    /**
+     * @brief Format a FILE_VERIFICATION response
+     * @param response The response object
+     * @param result Vector to add formatted strings to
+     */
+    void handle_verification_response(const fenris::Response &response,
+                                      std::vector<std::string> &result);
+
     /**
      * @brief Format file size with appropriate units (B, KB, MB, etc.)
      * @param size_bytes Size in bytes
@@ -0,0 +1,172 @@
+#ifndef FENRIS_COMMON_APPEND_COALESCER_HPP
+#define FENRIS_COMMON_APPEND_COALESCER_HPP
+
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <sys/types.h>
+#include <utility>
+#include <vector>
+
+namespace fenris {
+namespace common {
+
+// Appends waiting for one file are written once they reach this size
+constexpr size_t DEFAULT_APPEND_BUFFER_SIZE = 64 * 1024;
+
+// How long appends that queued up behind a write wait for more to join
+// them; by default they are written as soon as that write completes
+constexpr std::chrono::microseconds DEFAULT_APPEND_DELAY{0};
+
+/**
+ * @struct AppendHandle
+ * @brief O_APPEND descriptor for one file, closed when the last user drops
+ * it
+ */
+struct AppendHandle {
+    AppendHandle(int fd, dev_t device, ino_t inode);
+
+    ~AppendHandle();
+
+    AppendHandle(const AppendHandle &) = delete;
+    AppendHandle &operator=(const AppendHandle &) = delete;
+
+    int fd;
+    dev_t device;
+    ino_t inode;
+};
+
+/**
+ * @class AppendCoalescer
+ * @brief Merges small appends to the same file into one writev
+ *
+ * An append to a file with no write in flight is written at once. Appends
+ * arriving while a write of the same file is in flight join one batch and
+ * block until it has been written (and synced, as the durability mode
+ * asks): after the write ahead of them, once the batch reaches the size
+ * bound or its first append has waited the delay bound. An append is only
+ * acknowledged once its batch is written, and every appender of a batch
+ * gets that batch's outcome, so no acknowledged data is ever held in
+ * memory.
+ */
+class AppendCoalescer {
+  public:
+    /**
+     * @brief Constructor
+     * @param max_bytes Write a batch once it holds this many bytes
+     * @param max_delay Longest a batch that formed during a write waits for
+     * more appends (0 writes it as soon as that write completes)
+     */
+    explicit AppendCoalescer(
+        size_t max_bytes = DEFAULT_APPEND_BUFFER_SIZE,
+        std::chrono::microseconds max_delay = DEFAULT_APPEND_DELAY);
+
+    AppendCoalescer(const AppendCoalescer &) = delete;
+    AppendCoalescer &operator=(const AppendCoalescer &) = delete;
+
+    /**
+     * @brief Append data to the file behind handle
+     * @param handle O_APPEND descriptor of the file; kept open until the
+     * data is written
+     * @param data Data to append
+     * @return true once the data is written and synced
+     */
+    bool append(const std::shared_ptr<AppendHandle> &handle,
+                const std::string &data);
+
+    /**
+     * @brief Write every waiting batch now instead of at its delay bound
+     * @return true if every write succeeded
+     */
+    bool flush();
+
+    /**
+     * @brief Number of appends accepted so far
+     */
+    uint64_t append_count() const;
+
+    /**
+     * @brief Number of writev calls made for them
+     */
+    uint64_t write_count() const;
+
+  private:
+    // Appends written together by one writev
+    struct Batch {
+        std::vector<std::string> records;
+        size_t bytes{0};
+        bool done{false};
+        bool ok{false};
+    };
+
+    // Appends of one file
+    struct Buffer {
+        std::shared_ptr<AppendHandle> handle;
+        // Batch being filled, and when it is written at the latest
+        std::shared_ptr<Batch> open;
+        std::chrono::steady_clock::time_point deadline;
+        // Batch being written, if any
+        std::shared_ptr<Batch> writing;
+        // flush() wants the open batch written without waiting
+        bool urgent{false};
+    };
+
+    using Key = std::pair<dev_t, ino_t>;
+
+    // Wait until batch is written, writing the open batch of buffer once it
+    // is due and the file has no write in flight
+    void wait_written(std::unique_lock<std::mutex> &lock,
+                      const Key &key,
+                      const std::shared_ptr<Buffer> &buffer,
+                      const std::shared_ptr<Batch> &batch);
+
+    // Write the open batch of buffer; unlocks the lock while writing
+    void write_open(std::unique_lock<std::mutex> &lock,
+                    const Key &key,
+                    const std::shared_ptr<Buffer> &buffer);
+
+    size_t m_max_bytes;
+    std::chrono::microseconds m_max_delay;
+
+    mutable std::mutex m_mutex;
+    std::condition_variable m_written_condition;
+    std::map<Key, std::shared_ptr<Buffer>> m_buffers;
+    uint64_t m_append_count{0};
+    uint64_t m_write_count{0};
+};
+
+/**
+ * Select the process-wide append coalescing used by append_file
+ *
+ * Appends already waiting on a replaced coalescer are still written by it.
+ *
+ * @param max_bytes Per-file batch size (0 disables coalescing)
+ * @param max_delay Longest appends queued behind a write wait for more
+ */
+void set_append_coalescing(
+    size_t max_bytes,
+    std::chrono::microseconds max_delay = DEFAULT_APPEND_DELAY);
+
+/**
+ * Get the process-wide append coalescer
+ *
+ * @return The coalescer, or nullptr if coalescing is disabled
+ */
+std::shared_ptr<AppendCoalescer> get_append_coalescer();
+
+/**
+ * Write every waiting append now, e.g. before shutting down
+ *
+ * @return true on success or if coalescing is disabled
+ */
+bool flush_appends();
+
+} // namespace common
+} // namespace fenris
+
+#endif // FENRIS_COMMON_APPEND_COALESCER_HPP
@@ -0,0 +1,232 @@
+#ifndef FENRIS_COMMON_CHECKSUM_HPP
+#define FENRIS_COMMON_CHECKSUM_HPP
+
+#include "common/file_operations.hpp"
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <sys/stat.h>
+#include <utility>
+#include <vector>
+
+namespace fenris {
+namespace common {
+
+// Extended attribute holding the block checksums of a plain file
+constexpr const char *CHECKSUM_XATTR = "user.fenris.crc";
+
+// Files are checksummed in blocks of at least this size
+constexpr uint32_t MIN_CHECKSUM_BLOCK_SIZE = 64 * 1024;
+
+// Larger files use larger blocks (doubling from MIN_CHECKSUM_BLOCK_SIZE),
+// so the checksums of any file fit in a single extended attribute block
+constexpr size_t MAX_CHECKSUM_BLOCKS = 960;
+
+/**
+ * Compute the CRC32C (Castagnoli) checksum of a buffer
+ *
+ * Uses the SSE4.2 crc32 instruction when the CPU has it, and a portable
+ * table-driven implementation otherwise.
+ *
+ * @param data Buffer to checksum
+ * @param size Number of bytes in the buffer
+ * @param crc Checksum of the preceding bytes, to continue from
+ * @return Checksum of the preceding bytes followed by the buffer
+ */
+uint32_t crc32c(const void *data, size_t size, uint32_t crc = 0);
+
+/**
+ * Combine the checksums of two adjacent byte ranges
+ *
+ * @param crc1 Checksum of the first range
+ * @param crc2 Checksum of the second range
+ * @param length2 Length of the second range
+ * @return Checksum of the two ranges back to back
+ */
+uint32_t crc32c_combine(uint32_t crc1, uint32_t crc2, uint64_t length2);
+
+/**
+ * Whether crc32c runs on hardware instructions
+ */
+bool crc32c_hardware();
+
+/**
+ * @struct BlockChecksums
+ * @brief CRC32C of each block of a file, in file order
+ */
+struct BlockChecksums {
+    uint32_t block_size{MIN_CHECKSUM_BLOCK_SIZE};
+    uint64_t file_size{0};
+    // The last block may be shorter than block_size
+    std::vector<uint32_t> crcs;
+};
+
+/**
+ * @class ChecksumBuilder
+ * @brief Computes the block checksums of a file as it is written in order
+ */
+class ChecksumBuilder {
+  public:
+    /**
+     * @brief Checksum the next bytes of the file
+     */
+    void update(const void *data, size_t size);
+
+    /**
+     * @brief Checksums of every byte passed to update so far
+     */
+    BlockChecksums finish() const;
+
+  private:
+    // Double the block size by merging the checksums of adjacent blocks
+    void coarsen();
+
+    BlockChecksums m_checksums;
+    // Checksum and length of the block in progress
+    uint32_t m_crc{0};
+    uint64_t m_filled{0};
+};
+
+/**
+ * @class ChecksumVerifier
+ * @brief Checks the bytes of a file against its checksums as they are read
+ *
+ * Bytes are fed in file order from the start of a block; each block is
+ * checked once its last byte has been fed.
+ */
+class ChecksumVerifier {
+  public:
+    /**
+     * @brief Constructor
+     * @param checksums Checksums of the file
+     * @param offset First byte the caller reads; verification starts at the
+     * beginning of the block holding it
+     */
+    ChecksumVerifier(std::shared_ptr<const BlockChecksums> checksums,
+                     uint64_t offset);
+
+    /**
+     * @brief Offset of the next byte to feed
+     */
+    uint64_t offset() const;
+
+    /**
+     * @brief End of the block in progress (offset() if none is)
+     */
+    uint64_t block_end() const;
+
+    /**
+     * @brief Feed the next bytes of the file
+     * @return false once a block did not match its checksum
+     */
+    bool update(const void *data, size_t size);
+
+    /**
+     * @brief Feed the bytes from offset() up to end, read from fd
+     * @return false if a block did not match or the read failed
+     */
+    bool update_from(int fd, uint64_t end);
+
+  private:
+    std::shared_ptr<const BlockChecksums> m_checksums;
+    uint64_t m_block_start;
+    uint64_t m_filled{0};
+    uint32_t m_crc{0};
+    bool m_failed{false};
+};
+
+/**
+ * Load the checksums of a plain file
+ *
+ * Checksums are only returned while they describe the file: every write
+ * that changes its size or modification time leaves them stale.
+ *
+ * @param fd Open regular file
+ * @param st Status of fd
+ * @return Checksums, or nullptr if the file has none or they are stale
+ */
+std::shared_ptr<const BlockChecksums> load_checksums(int fd,
+                                                     const struct stat &st);
+
+/**
+ * Attach checksums to a file that has just been written
+ *
+ * Placeholders of packed and deduplicated files are skipped; their
+ * contents are checked by the stores holding them. Filesystems without
+ * user extended attributes are not an error.
+ *
+ * @param fd Regular file open for writing
+ * @param checksums Checksums of its current contents
+ * @return FileOperationResult indicating success or failure
+ */
+FileOperationResult store_checksums(int fd, const BlockChecksums &checksums);
+
+/**
+ * Remove the checksums of a file about to be changed in place
+ *
+ * @param fd Regular file open for writing
+ * @return FileOperationResult indicating success or failure
+ */
+FileOperationResult drop_checksums(int fd);
+
+/**
+ * Give a freshly copied file the checksums of its source, or none
+ *
+ * @param source_fd Open regular file
+ * @param destination_fd Copy of source_fd, open for writing
+ * @return FileOperationResult indicating success or failure
+ */
+FileOperationResult copy_checksums(int source_fd, int destination_fd);
+
+/**
+ * Compute and attach the checksums of a plain file
+ *
+ * The file is read back from disk; the checksums are only stored if the
+ * file did not change while it was read.
+ *
+ * @param fd Regular file open for reading
+ * @return Pair of (whether checksums were stored, FileOperationResult)
+ */
+std::pair<bool, FileOperationResult> seal_file(int fd);
+
+/**
+ * @struct ChecksumReport
+ * @brief Outcome of verifying a file against its checksums
+ */
+struct ChecksumReport {
+    // False when nothing covers the file's contents (no or stale checksums)
+    bool checked{false};
+    uint64_t blocks{0};
+    uint64_t bytes{0};
+    // Offsets of the blocks that did not match, in file order
+    std::vector<uint64_t> corrupted_offsets;
+};
+
+/**
+ * Verify the whole contents of a file
+ *
+ * Plain files are checked against their block checksums, packed files
+ * against the checksum of their pack record, and deduplicated files by
+ * rehashing each chunk against the manifest.
+ *
+ * @param fd Open regular file
+ * @return Pair of (ChecksumReport, FileOperationResult); a corrupted file
+ * is a successful verification with corrupted_offsets filled in
+ */
+std::pair<ChecksumReport, FileOperationResult> verify_file(int fd);
+
+/**
+ * Verify the whole contents of a file
+ *
+ * @param filepath Path to the file
+ * @return Pair of (ChecksumReport, FileOperationResult)
+ */
+std::pair<ChecksumReport, FileOperationResult>
+verify_file(const std::string &filepath);
+
+} // namespace common
+} // namespace fenris
+
+#endif // FENRIS_COMMON_CHECKSUM_HPP
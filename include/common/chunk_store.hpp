@@ -0,0 +1,487 @@
+#ifndef FENRIS_COMMON_CHUNK_STORE_HPP
+#define FENRIS_COMMON_CHUNK_STORE_HPP
+
+#include "common/file_operations.hpp"
+#include "common/payload.hpp"
+#include "fenris.pb.h"
+
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <optional>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace fenris {
+namespace common {
+
+// Bounds and target size of content-defined chunks
+constexpr size_t MIN_CHUNK_SIZE = 16 * 1024;
+constexpr size_t AVERAGE_CHUNK_SIZE = 64 * 1024;
+constexpr size_t MAX_CHUNK_SIZE = 256 * 1024;
+
+// Bytes of the hash that names a chunk (SHA-256)
+constexpr size_t CHUNK_HASH_SIZE = 32;
+
+// Extended attribute naming the manifest of a deduplicated file
+constexpr const char *MANIFEST_XATTR = "user.fenris.manifest";
+
+// Unreferenced objects younger than this are kept by garbage collection, so
+// chunks stored for an upload that has not committed yet survive it
+constexpr std::chrono::seconds DEFAULT_CHUNK_GRACE_PERIOD{3600};
+
+// How often a reader streaming a deduplicated file marks its manifest as
+// recently used; must stay well below the grace period of any collection
+constexpr std::chrono::seconds CHUNK_PIN_INTERVAL{60};
+
+/**
+ * Find the end of the next content-defined chunk
+ *
+ * Boundaries are picked by a gear hash over the data (FastCDC), so an
+ * insertion or deletion only moves the boundaries next to it and the rest
+ * of the chunks of an edited file are unchanged.
+ *
+ * @param data Remaining data
+ * @param size Bytes remaining
+ * @return Length of the chunk, between MIN_CHUNK_SIZE and MAX_CHUNK_SIZE
+ * unless less data remains
+ */
+size_t next_chunk_boundary(const uint8_t *data, size_t size);
+
+/**
+ * Hash naming a chunk
+ *
+ * @param data Chunk contents
+ * @param size Chunk size
+ * @return CHUNK_HASH_SIZE bytes
+ */
+std::string chunk_hash(const uint8_t *data, size_t size);
+
+/**
+ * Split a file into content-defined chunks
+ *
+ * @param filepath Path to the file
+ * @return Pair of (ChunkManifest, FileOperationResult)
+ */
+std::pair<fenris::ChunkManifest, FileOperationResult>
+chunk_file(const std::string &filepath);
+
+/**
+ * @struct ChunkCollectionStats
+ * @brief What a garbage collection of the chunk store removed
+ */
+struct ChunkCollectionStats {
+    uint64_t manifests_removed{0};
+    uint64_t chunks_removed{0};
+    uint64_t bytes_freed{0};
+};
+
+/**
+ * @class ChunkWriteBatch
+ * @brief Chunks stored for one file, made durable together
+ *
+ * Each chunk is written to a staging file that commit() renames into place
+ * once one pass has flushed all of them, so no chunk is visible under its
+ * hash before its contents are on disk, and a file costs one flush per
+ * chunk and one per fan-out directory rather than a commit per chunk.
+ * Chunks still staged when the batch is destroyed are discarded.
+ */
+class ChunkWriteBatch {
+  public:
+    ChunkWriteBatch() = default;
+    ~ChunkWriteBatch();
+
+    ChunkWriteBatch(const ChunkWriteBatch &) = delete;
+    ChunkWriteBatch &operator=(const ChunkWriteBatch &) = delete;
+
+    /**
+     * @brief Flush the staged chunks and publish them under their hashes
+     * @return FileOperationResult; the batch is empty afterwards
+     */
+    FileOperationResult commit();
+
+  private:
+    friend class ChunkStore;
+
+    // Staging file and the path it is published at
+    std::vector<std::pair<StagingFile, std::string>> m_objects;
+};
+
+/**
+ * @class ChunkStore
+ * @brief Content-addressed storage of file chunks
+ *
+ * Every unique chunk is stored once under its hash, and every file stored
+ * through the store is described by a manifest, itself stored under the
+ * hash of its encoding. A deduplicated file stays in the namespace as a
+ * sparse placeholder of its full size whose MANIFEST_XATTR names the
+ * manifest, so listings, sizes, renames and deletes need no special case.
+ * Objects are written through staging files, so concurrent writers of the
+ * same chunk never expose a partial one.
+ */
+class ChunkStore {
+  public:
+    /**
+     * @brief Constructor
+     * @param root Directory holding the chunks and manifests
+     */
+    explicit ChunkStore(std::string root);
+
+    /**
+     * @brief Create the store directories if they do not exist
+     */
+    FileOperationResult initialize();
+
+    const std::string &root() const;
+
+    /**
+     * @brief Whether a chunk is stored
+     * @param hash CHUNK_HASH_SIZE byte hash of the chunk
+     */
+    bool has_chunk(const std::string &hash) const;
+
+    /**
+     * @brief Store a chunk unless it is already present
+     * @param hash Hash the chunk is expected to have
+     * @param data Chunk contents
+     * @param size Chunk size
+     * @param batch Batch to stage the chunk in, or nullptr to commit it
+     * right away
+     * @return INVALID_PATH if the contents do not match the hash
+     */
+    FileOperationResult put_chunk(const std::string &hash,
+                                  const uint8_t *data,
+                                  size_t size,
+                                  ChunkWriteBatch *batch = nullptr);
+
+    /**
+     * @brief Store a manifest
+     * @return Pair of (manifest id, FileOperationResult)
+     */
+    std::pair<std::string, FileOperationResult>
+    put_manifest(const fenris::ChunkManifest &manifest);
+
+    /**
+     * @brief Load a manifest by id
+     */
+    std::pair<fenris::ChunkManifest, FileOperationResult>
+    load_manifest(const std::string &id) const;
+
+    /**
+     * @brief Copy a byte range of a chunked file into a sink
+     * @param manifest Chunks of the file
+     * @param offset First byte to copy
+     * @param length Bytes to copy; clamped to the end of the file
+     * @param sink Destination
+     * @return true if every byte was copied
+     */
+    bool read_range(const fenris::ChunkManifest &manifest,
+                    uint64_t offset,
+                    uint64_t length,
+                    PayloadSink &sink) const;
+
+    /**
+     * @brief Assemble a byte range of a chunked file into an unlinked file
+     *
+     * Callers that need a descriptor or a mapping (readers streaming or
+     * mapping the file) get one backed by the page cache instead of by
+     * anonymous memory.
+     *
+     * @return Pair of (descriptor positioned at 0 holding the range, or -1,
+     * FileOperationResult)
+     */
+    std::pair<int, FileOperationResult>
+    assemble(const fenris::ChunkManifest &manifest,
+             uint64_t offset,
+             uint64_t length) const;
+
+    /**
+     * @brief Replace the contents of an open file by a manifest
+     *
+     * The file is chunked, its chunks stored, and it becomes a placeholder
+     * naming the manifest. Files shorter than MIN_CHUNK_SIZE, and files on
+     * filesystems without user extended attributes, are left as they are.
+     *
+     * @param fd Regular file open for writing
+     */
+    FileOperationResult deduplicate(int fd);
+
+    /**
+     * @brief Turn an open empty file into the placeholder of a manifest
+     *
+     * Every chunk of the manifest must already be stored. Where extended
+     * attributes are not supported the contents are written out instead.
+     *
+     * @param fd Empty regular file open for writing
+     * @param manifest Chunks of the file
+     */
+    FileOperationResult link_manifest(int fd,
+                                      const fenris::ChunkManifest &manifest);
+
+    /**
+     * @brief Remove manifests no file refers to and chunks no manifest uses
+     * @param namespace_root Directory tree holding the placeholders
+     * @param grace_period Objects modified more recently are kept
+     * @return Pair of (ChunkCollectionStats, FileOperationResult)
+     */
+    std::pair<ChunkCollectionStats, FileOperationResult> collect_garbage(
+        const std::string &namespace_root,
+        std::chrono::seconds grace_period = DEFAULT_CHUNK_GRACE_PERIOD);
+
+  private:
+    friend class ChunkedPayloadSource;
+
+    std::string chunk_path(const std::string &hash) const;
+    std::string manifest_path(const std::string &id) const;
+
+    // Stage an object in its fan-out directory, to be published by batch
+    FileOperationResult put_object(const std::string &path,
+                                   const void *data,
+                                   size_t size,
+                                   ChunkWriteBatch &batch);
+
+    // Mark a manifest as recently used, so a collection keeps it and the
+    // chunks it names
+    bool pin_manifest(const std::string &id) const;
+
+    std::string m_root;
+};
+
+/**
+ * Select the process-wide chunk store used by the file operations
+ *
+ * Files already deduplicated are readable as long as a store is set; new
+ * whole-file writes are only deduplicated when deduplicate_writes is set.
+ *
+ * @param store Chunk store, or nullptr to use none
+ * @param deduplicate_writes Store newly written files as chunks
+ */
+void set_chunk_store(std::shared_ptr<ChunkStore> store,
+                     bool deduplicate_writes);
+
+/**
+ * Get the process-wide chunk store
+ *
+ * @return Current store, or nullptr if none is set
+ */
+std::shared_ptr<ChunkStore> get_chunk_store();
+
+/**
+ * Whether whole-file writes are currently deduplicated
+ */
+bool deduplicating_writes();
+
+/**
+ * Manifest of a deduplicated file
+ *
+ * @param fd Open regular file
+ * @return Pair of (manifest, or nullopt for a plain file or when no store is
+ * set, FileOperationResult); IO_ERROR if the manifest is missing
+ */
+std::pair<std::optional<fenris::ChunkManifest>, FileOperationResult>
+file_manifest(int fd);
+
+/**
+ * Whether a file is the placeholder of a deduplicated file
+ *
+ * @param filepath Path to the file
+ * @return true if a chunk store is set and the file names a manifest
+ */
+bool is_deduplicated_file(const std::string &filepath);
+
+/**
+ * Open a byte range of a deduplicated (or packed) file as a payload source
+ *
+ * A deduplicated file is streamed from its chunks without being assembled.
+ *
+ * @param fd Open regular file
+ * @param offset First byte to send
+ * @param length Bytes to send; clamped to the end of the file
+ * @return Pair of (source, or nullptr for a plain file,
+ * FileOperationResult)
+ */
+std::pair<std::unique_ptr<PayloadSource>, FileOperationResult>
+open_chunked_payload(int fd, uint64_t offset, uint64_t length);
+
+/**
+ * Open the contents of a deduplicated (or packed) file for reading
+ *
+ * The range is assembled into an unlinked file, for callers that need to
+ * map it or read it out of order; a sequential reader should use
+ * open_chunked_payload instead.
+ *
+ * @param fd Open regular file
+ * @param offset First byte the caller will read
+ * @param length Bytes the caller will read
+ * @return Pair of (descriptor positioned at 0 holding that range, assembled
+ * from the chunks, or -1 for a plain file, FileOperationResult)
+ */
+std::pair<int, FileOperationResult>
+open_chunked_range(int fd, uint64_t offset, uint64_t length);
+
+/**
+ * Make an empty file a copy of a deduplicated (or packed) file, sharing its
+ * chunks (or pack record)
+ *
+ * @param source_fd Open regular file
+ * @param destination_fd Empty file open for writing
+ * @return Pair of (whether source was deduplicated and has been copied,
+ * FileOperationResult)
+ */
+std::pair<bool, FileOperationResult> copy_placeholder(int source_fd,
+                                                      int destination_fd);
+
+/**
+ * Deduplicate an open file if whole-file writes are deduplicated
+ *
+ * @param fd Regular file open for writing, usually a staging file
+ * @return FileOperationResult indicating success or failure
+ */
+FileOperationResult deduplicate_file(int fd);
+
+/**
+ * Rewrite a deduplicated or packed file as a plain file, before it is
+ * modified in place. Plain files are left alone.
+ *
+ * @param filepath Path to the file
+ * @return FileOperationResult indicating success or failure
+ */
+FileOperationResult materialize_file(const std::string &filepath);
+
+/**
+ * @class ChunkUploadSource
+ * @brief Streams selected chunks of a local file for a PUT_CHUNKS request
+ *
+ * Each chunk is sent as its little-endian u32 index in the manifest
+ * followed by its bytes.
+ */
+class ChunkUploadSource : public PayloadSource {
+  public:
+    /**
+     * @brief Constructor
+     * @param file Mapped local file the manifest was computed from
+     * @param manifest Chunks of the file
+     * @param indices Chunks to send, in increasing order
+     */
+    ChunkUploadSource(std::shared_ptr<const MappedFile> file,
+                      const fenris::ChunkManifest &manifest,
+                      std::vector<uint32_t> indices);
+
+    uint64_t size() const override;
+    bool read(uint8_t *buffer, size_t size) override;
+
+  private:
+    std::shared_ptr<const MappedFile> m_file;
+    // Offset and length of each chunk to send
+    std::vector<std::pair<uint64_t, uint32_t>> m_chunks;
+    std::vector<uint32_t> m_indices;
+    uint64_t m_size{0};
+
+    size_t m_current{0};
+    uint64_t m_position{0}; // Within the current chunk and its index
+};
+
+/**
+ * @class ChunkedPayloadSource
+ * @brief Streams a byte range of a deduplicated file from its chunks
+ *
+ * Chunks are opened one at a time as the range is read. The manifest is
+ * marked as recently used when the source is opened and again every
+ * CHUNK_PIN_INTERVAL while it is read, so a garbage collection running
+ * meanwhile keeps the chunks even if the file is deleted or rewritten.
+ */
+class ChunkedPayloadSource : public PayloadSource {
+  public:
+    /**
+     * @brief Open a byte range of a stored manifest
+     * @param store Store holding the chunks
+     * @param id Manifest id
+     * @param offset First byte to send
+     * @param length Bytes to send; clamped to the end of the file
+     * @return Pair of (source, or nullptr on failure, FileOperationResult)
+     */
+    static std::pair<std::unique_ptr<ChunkedPayloadSource>,
+                     FileOperationResult>
+    open(std::shared_ptr<const ChunkStore> store,
+         const std::string &id,
+         uint64_t offset,
+         uint64_t length);
+
+    ~ChunkedPayloadSource() override;
+
+    ChunkedPayloadSource(const ChunkedPayloadSource &) = delete;
+    ChunkedPayloadSource &operator=(const ChunkedPayloadSource &) = delete;
+
+    uint64_t size() const override;
+    bool read(uint8_t *buffer, size_t size) override;
+
+  private:
+    ChunkedPayloadSource(std::shared_ptr<const ChunkStore> store,
+                         std::string id,
+                         fenris::ChunkManifest manifest,
+                         uint64_t offset,
+                         uint64_t end);
+
+    std::shared_ptr<const ChunkStore> m_store;
+    std::string m_id;
+    fenris::ChunkManifest m_manifest;
+    uint64_t m_offset; // First byte of the range
+    uint64_t m_position;
+    uint64_t m_end;
+
+    int m_chunk{0};            // Chunk holding m_position
+    uint64_t m_chunk_start{0}; // File offset of that chunk
+    int m_fd{-1};              // That chunk, once opened
+    std::chrono::steady_clock::time_point m_pinned;
+};
+
+/**
+ * @class ChunkReceiver
+ * @brief Stores the chunks of a PUT_CHUNKS payload as they arrive
+ *
+ * The chunks are staged in a batch and published together by finish().
+ */
+class ChunkReceiver : public PayloadSink {
+  public:
+    ChunkReceiver(ChunkStore &store, const fenris::ChunkManifest &manifest);
+
+    bool write(const uint8_t *data, size_t size) override;
+
+    /**
+     * @brief Publish the chunks received so far
+     * @return true if they were stored and the payload ended on a chunk
+     * boundary
+     */
+    bool finish();
+
+  private:
+    ChunkStore &m_store;
+    const fenris::ChunkManifest &m_manifest;
+    ChunkWriteBatch m_batch;
+    std::string m_field;
+    std::string m_chunk;
+    int64_t m_index{-1}; // Chunk being received, -1 while reading an index
+    bool m_failed{false};
+};
+
+/**
+ * Create or replace a file from a manifest and the chunks missing from the
+ * store
+ *
+ * @param filepath Path to the file
+ * @param manifest Chunks of the file
+ * @param payload Missing chunks as sent by ChunkUploadSource, or nullptr
+ * when the store already had all of them
+ * @return FileOperationResult indicating success or failure; FILE_NOT_FOUND
+ * if chunks are still missing once the payload is read
+ */
+FileOperationResult
+write_file_from_chunks(const std::string &filepath,
+                       const fenris::ChunkManifest &manifest,
+                       IncomingPayload *payload);
+
+} // namespace common
+} // namespace fenris
+
+#endif // FENRIS_COMMON_CHUNK_STORE_HPP
@@ -11,6 +11,12 @@ namespace fenris {
 namespace common {
 namespace compress {
 
+// zlib only looks back 32 KB, so a longer dictionary is never used
+constexpr size_t MAX_DICTIONARY_SIZE = 32768;
+
+// Payloads above this size compress well on their own and skip the dictionary
+constexpr size_t DICTIONARY_PAYLOAD_LIMIT = 16384;
+
 /**
  * Result of compression/decompression operations
  */
@@ -60,6 +66,48 @@ class CompressionManager {
      */
     std::pair<std::vector<uint8_t>, CompressionResult>
     decompress(const std::vector<uint8_t> &input, size_t original_size);
+
+    /**
+     * Compresses data using zlib primed with a preset dictionary
+     *
+     * @param input The data to compress
+     * @param level Compression level (0-9)
+     * @param dictionary Preset dictionary shared with the decompressing side
+     * (an empty dictionary behaves like plain compress())
+     * @return A pair containing the compressed data and a CompressionResult
+     */
+    std::pair<std::vector<uint8_t>, CompressionResult>
+    compress_with_dictionary(const std::vector<uint8_t> &input,
+                             int level,
+                             const std::vector<uint8_t> &dictionary);
+
+    /**
+     * Decompresses data produced by compress_with_dictionary
+     *
+     * @param input The compressed data
+     * @param original_size The original uncompressed size
+     * @param dictionary The same preset dictionary used for compression
+     * @return A pair containing the decompressed data and a CompressionResult
+     */
+    std::pair<std::vector<uint8_t>, CompressionResult>
+    decompress_with_dictionary(const std::vector<uint8_t> &input,
+                               size_t original_size,
+                               const std::vector<uint8_t> &dictionary);
+
+    /**
+     * Builds a preset dictionary from sample payloads
+     *
+     * Picks the sample segments whose substrings recur across the most
+     * samples and lays them out with the most common content last, where
+     * deflate reaches it with the shortest distances.
+     *
+     * @param samples Representative payloads (small files, listings, ...)
+     * @param max_size Upper bound on the dictionary size
+     * @return The trained dictionary (empty if the samples share nothing)
+     */
+    std::vector<uint8_t>
+    train_dictionary(const std::vector<std::vector<uint8_t>> &samples,
+                     size_t max_size = MAX_DICTIONARY_SIZE);
 };
 
 } // namespace compress
@@ -89,6 +89,34 @@ class CryptoManager {
                  const std::vector<uint8_t> &key,
                  const std::vector<uint8_t> &iv);
 
+    /**
+     * @brief Encrypts a buffer in place using AES-GCM.
+     * @param data The plaintext, overwritten with the ciphertext.
+     * @param size The plaintext size. The buffer must have AES_GCM_TAG_SIZE
+     * writable bytes after it, where the authentication tag is stored.
+     * @param key The encryption key (16, 24, or 32 bytes).
+     * @param iv The initialization vector (AES_GCM_IV_SIZE bytes).
+     * @return EncryptionResult indicating success or failure type
+     */
+    EncryptionResult encrypt_in_place(uint8_t *data,
+                                      size_t size,
+                                      const std::vector<uint8_t> &key,
+                                      const uint8_t *iv);
+
+    /**
+     * @brief Decrypts a buffer in place using AES-GCM.
+     * @param data The ciphertext followed by the authentication tag. On
+     * success its first size - AES_GCM_TAG_SIZE bytes hold the plaintext.
+     * @param size The ciphertext size including the tag.
+     * @param key The decryption key (16, 24, or 32 bytes).
+     * @param iv The initialization vector (AES_GCM_IV_SIZE bytes).
+     * @return EncryptionResult indicating success or failure type
+     */
+    EncryptionResult decrypt_in_place(uint8_t *data,
+                                      size_t size,
+                                      const std::vector<uint8_t> &key,
+                                      const uint8_t *iv);
+
     /**
      * @brief Generates an ECDH key pair using the NIST P-256 (secp256r1) curve.
      * @return A tuple containing the private key, public key, and an error
@@ -0,0 +1,206 @@
+#ifndef FENRIS_COMMON_DELTA_HPP
+#define FENRIS_COMMON_DELTA_HPP
+
+#include "common/file_operations.hpp"
+#include "common/payload.hpp"
+#include "fenris.pb.h"
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <utility>
+
+namespace CryptoPP {
+class SHA256;
+}
+
+namespace fenris {
+namespace common {
+
+// Bytes of the strong checksum kept per block in a FileSignature
+constexpr size_t STRONG_SUM_SIZE = 16;
+
+// Bounds on the signature block size chosen for a file
+constexpr uint32_t MIN_DELTA_BLOCK_SIZE = 2048;
+constexpr uint32_t MAX_DELTA_BLOCK_SIZE = 1024 * 1024;
+
+// Bytes of the whole-file digest that ends a delta
+constexpr size_t DELTA_DIGEST_SIZE = 32;
+
+/**
+ * Pick the signature block size for a file
+ *
+ * The size grows with the square root of the file, so the signature and
+ * the granularity of a delta both stay reasonable from kilobytes to
+ * gigabytes.
+ *
+ * @param file_size Size of the file in bytes
+ * @return Power of two between MIN_DELTA_BLOCK_SIZE and MAX_DELTA_BLOCK_SIZE
+ */
+uint32_t delta_block_size(uint64_t file_size);
+
+/**
+ * @class RollingChecksum
+ * @brief rsync's weak checksum over a sliding window
+ *
+ * The window can be moved forward one byte in constant time, which is what
+ * lets a delta find blocks at any offset of the new file.
+ */
+class RollingChecksum {
+  public:
+    /**
+     * @brief Start a new window over data
+     */
+    void reset(const uint8_t *data, size_t size);
+
+    /**
+     * @brief Slide the window one byte forward
+     * @param out Byte leaving the window
+     * @param in Byte entering the window
+     */
+    void roll(uint8_t out, uint8_t in);
+
+    /**
+     * @brief Checksum of the current window
+     */
+    uint32_t value() const;
+
+  private:
+    uint32_t m_a{0};
+    uint32_t m_b{0};
+    size_t m_size{0};
+};
+
+/**
+ * Strong checksum of a block (truncated SHA-256)
+ *
+ * @param data Block contents
+ * @param size Block size
+ * @return STRONG_SUM_SIZE bytes
+ */
+std::string strong_sum(const uint8_t *data, size_t size);
+
+/**
+ * Compute the block signature of a file
+ *
+ * @param filepath Path to the file
+ * @param block_size Block size to use, or 0 to pick one from the file size
+ * @return Pair of (FileSignature, FileOperationResult)
+ */
+std::pair<fenris::FileSignature, FileOperationResult>
+compute_file_signature(const std::string &filepath, uint32_t block_size = 0);
+
+/**
+ * @struct DeltaStats
+ * @brief How much of a file a delta sends and how much it reuses
+ */
+struct DeltaStats {
+    uint64_t literal_bytes{0}; // Sent as new data
+    uint64_t copied_bytes{0};  // Rebuilt from blocks of the old file
+    uint64_t delta_bytes{0};   // Size of the encoded delta
+};
+
+/**
+ * Encode a file as a delta against the signature of an older version
+ *
+ * The delta is a header (magic and block size) followed by instructions
+ * that either copy a run of blocks of the old file or insert literal
+ * bytes. It ends with the SHA-256 of the new file, so the receiver can
+ * tell when the old file no longer matches the signature.
+ *
+ * @param filepath Path to the new version of the file
+ * @param signature Signature of the old version
+ * @param sink Destination for the encoded delta
+ * @return Pair of (DeltaStats, FileOperationResult)
+ */
+std::pair<DeltaStats, FileOperationResult>
+compute_delta(const std::string &filepath,
+              const fenris::FileSignature &signature,
+              PayloadSink &sink);
+
+/**
+ * @class DeltaApplier
+ * @brief Rebuilds a file from the old version and a streamed delta
+ *
+ * The delta may arrive in chunks of any size. Copied blocks are read from
+ * the old file, literals are written as they arrive, and the result is
+ * checked against the digest at the end of the delta.
+ */
+class DeltaApplier : public PayloadSink {
+  public:
+    /**
+     * @brief Constructor
+     * @param base_fd Old version of the file; the caller keeps ownership
+     * @param base_size Size of the old version
+     * @param output_fd File receiving the new version, written from its
+     * current position; the caller keeps ownership
+     */
+    DeltaApplier(int base_fd, uint64_t base_size, int output_fd);
+
+    ~DeltaApplier() override;
+
+    DeltaApplier(const DeltaApplier &) = delete;
+    DeltaApplier &operator=(const DeltaApplier &) = delete;
+
+    bool write(const uint8_t *data, size_t size) override;
+
+    /**
+     * @brief Whether the whole delta was applied and the result matches
+     * @return true if the end of the delta was reached and the digest of
+     * the rebuilt file is the one the sender computed
+     */
+    bool finish();
+
+  private:
+    enum class State {
+        HEADER,
+        OPCODE,
+        COPY,
+        LITERAL_LENGTH,
+        LITERAL,
+        DIGEST,
+        DONE,
+        FAILED,
+    };
+
+    // Bytes of the fixed-size field the current state is collecting
+    size_t field_size() const;
+
+    // Act on a complete fixed-size field in m_field
+    bool handle_field();
+
+    bool copy_blocks(uint64_t first_block, uint32_t count);
+
+    bool emit(const uint8_t *data, size_t size);
+
+    int m_base_fd;
+    uint64_t m_base_size;
+    FilePayloadSink m_output;
+    std::unique_ptr<CryptoPP::SHA256> m_hash;
+
+    State m_state{State::HEADER};
+    std::string m_field;
+    uint32_t m_block_size{0};
+    uint64_t m_literal_remaining{0};
+    bool m_digest_matches{false};
+};
+
+/**
+ * Replace a file with the version rebuilt from a delta request body
+ *
+ * The new version is staged next to the file and renamed over it only if
+ * the delta applied cleanly, so a stale or corrupt delta leaves the file
+ * untouched. Permissions are checked before the body is touched, so a
+ * rejected patch leaves the body unconsumed for the caller to discard.
+ *
+ * @param filepath Path to the file to patch
+ * @param payload Delta produced by compute_delta
+ * @return FileOperationResult indicating success or failure
+ */
+FileOperationResult patch_file_from_payload(const std::string &filepath,
+                                            IncomingPayload &payload);
+
+} // namespace common
+} // namespace fenris
+
+#endif // FENRIS_COMMON_DELTA_HPP
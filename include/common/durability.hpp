@@ -0,0 +1,161 @@
+#ifndef FENRIS_COMMON_DURABILITY_HPP
+#define FENRIS_COMMON_DURABILITY_HPP
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace fenris {
+namespace common {
+
+// How long a group commit waits for other writers to join a batch
+constexpr std::chrono::microseconds DEFAULT_GROUP_COMMIT_WINDOW{2000};
+
+// A batch is flushed early once this many writers are waiting on it
+constexpr size_t DEFAULT_GROUP_COMMIT_BATCH = 64;
+
+/**
+ * @enum DurabilityMode
+ * @brief When written data is forced to stable storage
+ */
+enum class DurabilityMode {
+    NONE,         // Leave flushing to the kernel's writeback
+    FSYNC,        // fdatasync every write before acknowledging it
+    GROUP_COMMIT, // Flush concurrent writes together and acknowledge at once
+};
+
+/**
+ * Convert DurabilityMode to string representation
+ *
+ * @param mode DurabilityMode to convert
+ * @return "none", "fsync" or "group"
+ */
+std::string durability_mode_to_string(DurabilityMode mode);
+
+/**
+ * Parse a DurabilityMode from its string representation
+ *
+ * @param name "none", "fsync" or "group"
+ * @return The mode, or std::nullopt if name is not recognised
+ */
+std::optional<DurabilityMode> durability_mode_from_string(
+    const std::string &name);
+
+/**
+ * @class GroupCommitter
+ * @brief Batches flushes of concurrent writers into shared flushes
+ *
+ * Writers hand their file descriptor to commit() and block. A committer
+ * thread collects the writers that arrive within the commit window (or
+ * until the batch is full), flushes the batch and releases all of them
+ * together. Each file in a batch is flushed with fdatasync, and each
+ * distinct parent directory handed in by sync_parent_directory is flushed
+ * once for the whole batch.
+ */
+class GroupCommitter {
+  public:
+    /**
+     * @brief Constructor
+     * @param window How long to wait for more writers after the first
+     * @param max_batch Flush as soon as this many writers are waiting
+     */
+    explicit GroupCommitter(
+        std::chrono::microseconds window = DEFAULT_GROUP_COMMIT_WINDOW,
+        size_t max_batch = DEFAULT_GROUP_COMMIT_BATCH);
+
+    /**
+     * @brief Destructor; flushes anything still waiting, then stops
+     */
+    ~GroupCommitter();
+
+    GroupCommitter(const GroupCommitter &) = delete;
+    GroupCommitter &operator=(const GroupCommitter &) = delete;
+
+    /**
+     * @brief Block until the data written to fd is on stable storage
+     * @param fd Open file descriptor; must stay open until commit returns
+     * @return true if the flush succeeded
+     */
+    bool commit(int fd);
+
+    /**
+     * @brief Number of batches flushed so far
+     */
+    uint64_t flush_count() const;
+
+  private:
+    struct Waiter {
+        int fd;
+        bool done{false};
+        bool ok{false};
+    };
+
+    void run();
+
+    // Flush every file in the batch and record the outcome in each waiter
+    static void flush(const std::vector<Waiter *> &batch);
+
+    std::chrono::microseconds m_window;
+    size_t m_max_batch;
+
+    mutable std::mutex m_mutex;
+    std::condition_variable m_pending_condition;
+    std::condition_variable m_done_condition;
+    std::vector<Waiter *> m_pending;
+    uint64_t m_flush_count{0};
+    bool m_stopping{false};
+    std::thread m_thread;
+};
+
+/**
+ * Select the process-wide durability mode used by the file operations
+ *
+ * @param mode Durability mode
+ * @param window Group commit window (GROUP_COMMIT only)
+ * @param max_batch Group commit batch limit (GROUP_COMMIT only)
+ */
+void set_durability_mode(
+    DurabilityMode mode,
+    std::chrono::microseconds window = DEFAULT_GROUP_COMMIT_WINDOW,
+    size_t max_batch = DEFAULT_GROUP_COMMIT_BATCH);
+
+/**
+ * Get the process-wide durability mode
+ *
+ * @return Current DurabilityMode (NONE unless set)
+ */
+DurabilityMode get_durability_mode();
+
+/**
+ * Get the number of batches flushed by the process-wide group committer
+ *
+ * @return Flush count of the current committer, or 0 outside GROUP_COMMIT
+ */
+uint64_t group_commit_flush_count();
+
+/**
+ * Make data written to fd durable according to the current mode
+ *
+ * @param fd Open file (or directory) descriptor
+ * @return true on success or if the mode is NONE
+ */
+bool sync_file(int fd);
+
+/**
+ * Make a directory entry change (create, rename) under path durable
+ * according to the current mode
+ *
+ * @param path Path whose parent directory should be flushed
+ * @return true on success or if the mode is NONE
+ */
+bool sync_parent_directory(const std::string &path);
+
+} // namespace common
+} // namespace fenris
+
+#endif // FENRIS_COMMON_DURABILITY_HPP
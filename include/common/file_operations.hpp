@@ -5,7 +5,10 @@
 #include <cstdint>
 #include <filesystem>
 #include <fstream>
+#include <memory>
 #include <string>
+#include <string_view>
+#include <sys/types.h>
 #include <system_error>
 #include <utility>
 #include <vector>
@@ -13,6 +16,10 @@
 namespace fenris {
 namespace common {
 
+struct AppendHandle;
+struct BlockChecksums;
+class ReadHint;
+
 /**
  * Result of file operations
  */
@@ -26,6 +33,8 @@ enum class FileOperationResult {
     IO_ERROR,
     INVALID_PATH,
     DIRECTORY_ALREADY_EXISTS,
+    // Contents no longer match their stored checksum
+    DATA_CORRUPTED,
     UNKNOWN_ERROR
 };
 
@@ -46,10 +55,129 @@ std::string file_operation_result_to_string(FileOperationResult result);
 std::pair<std::string, FileOperationResult>
 read_file(const std::string &filepath);
 
+/**
+ * Read a byte range of a file with pread
+ *
+ * Reading past the end of the file is not an error; the result is simply
+ * shorter than requested (empty if offset is at or beyond the end).
+ *
+ * @param filepath Path to the file to read
+ * @param offset Offset of the first byte to read
+ * @param length Maximum number of bytes to read
+ * @return Pair of (bytes read, FileOperationResult)
+ */
+std::pair<std::string, FileOperationResult>
+read_file_range(const std::string &filepath, uint64_t offset, uint64_t length);
+
+/**
+ * Read a byte range of an open file with pread
+ *
+ * If the file has block checksums (see common/checksum.hpp), the blocks
+ * holding the range are read whole and verified, and DATA_CORRUPTED is
+ * returned if one does not match.
+ *
+ * @param fd File descriptor open for reading; it is left open
+ * @param offset Offset of the first byte to read
+ * @param length Maximum number of bytes to read
+ * @return Pair of (bytes read, FileOperationResult)
+ */
+std::pair<std::string, FileOperationResult>
+read_file_range(int fd, uint64_t offset, uint64_t length);
+
+/**
+ * @class MappedFile
+ * @brief Read-only memory-mapped view of a file
+ *
+ * The mapping is released when the handle is destroyed. Holders must not
+ * let the file be truncated while they still read from the view; the same
+ * exclusion that protects any other read of the file applies.
+ */
+class MappedFile {
+  public:
+    MappedFile() = default;
+    ~MappedFile();
+
+    MappedFile(const MappedFile &) = delete;
+    MappedFile &operator=(const MappedFile &) = delete;
+
+    /**
+     * @brief Start of the mapped contents (nullptr for an empty file)
+     */
+    const char *data() const;
+
+    /**
+     * @brief Number of mapped bytes
+     */
+    size_t size() const;
+
+    /**
+     * @brief Mapped contents as a string view
+     */
+    std::string_view view() const;
+
+    /**
+     * @brief Block checksums the contents are still to be verified against,
+     * or nullptr if there are none or they were verified when mapping
+     */
+    const std::shared_ptr<const BlockChecksums> &checksums() const;
+
+    /**
+     * @brief The bytes before end have been consumed by the single reader
+     * streaming the mapping
+     *
+     * The pages of a bulk mapping (see common/page_cache.hpp) are then
+     * unmapped and dropped from the page cache; others are kept.
+     */
+    void release(size_t end) const;
+
+  private:
+    friend std::pair<std::shared_ptr<const MappedFile>, FileOperationResult>
+    map_file(int fd);
+
+    MappedFile(void *address, size_t size);
+
+    void *m_address{nullptr};
+    size_t m_size{0};
+    std::shared_ptr<const BlockChecksums> m_checksums;
+    // Descriptor and hint of a bulk mapping whose pages are dropped
+    int m_fd{-1};
+    std::unique_ptr<ReadHint> m_hint;
+};
+
+/**
+ * Map a whole file read-only for sequential access
+ *
+ * Unlike read_file, no buffer is allocated, zero-filled or copied into; the
+ * kernel is asked to read ahead (MADV_SEQUENTIAL, and MADV_WILLNEED unless
+ * the file is a bulk transfer that would flood the page cache).
+ *
+ * @param filepath Path to the file to map
+ * @return Pair of (mapped view, or nullptr on failure, FileOperationResult)
+ */
+std::pair<std::shared_ptr<const MappedFile>, FileOperationResult>
+map_file(const std::string &filepath);
+
+/**
+ * Map a whole open file read-only for sequential access
+ *
+ * A file with block checksums (see common/checksum.hpp) that fits in a
+ * single block is verified before it is returned; larger ones are verified
+ * by whoever streams the mapping, through MappedFile::checksums.
+ *
+ * @param fd File descriptor open for reading; it is left open
+ * @return Pair of (mapped view, or nullptr on failure, FileOperationResult)
+ */
+std::pair<std::shared_ptr<const MappedFile>, FileOperationResult>
+map_file(int fd);
+
 /**
  * Write data to a file (creates the file if it doesn't exist, otherwise
  * overwrites)
  *
+ * The data is written to a staging file that is renamed over the target,
+ * so the replace is atomic. It is flushed according to the current
+ * durability mode (see common/durability.hpp) before this returns.
+ *
  * @param filepath Path to the file to write
  * @param data Data to write to the file
  * @return FileOperationResult indicating success or failure
@@ -57,9 +185,115 @@ read_file(const std::string &filepath);
 FileOperationResult write_file(const std::string &filepath,
                                const std::string &data);
 
+/**
+ * @struct StagingFile
+ * @brief Temporary file that atomically replaces a target once committed
+ */
+struct StagingFile {
+    int fd{-1};       // Open for writing until committed or discarded
+    std::string path; // Hidden file in the target's directory
+};
+
+/**
+ * Create a staging file next to filepath
+ *
+ * @param filepath File the staging file will replace
+ * @param mode Permission bits for the new file
+ * @return Pair of (StagingFile, FileOperationResult)
+ */
+std::pair<StagingFile, FileOperationResult>
+create_staging_file(const std::string &filepath, mode_t mode);
+
+/**
+ * Flush a staging file per the durability mode and rename it over filepath
+ *
+ * The staging file is closed in every case and removed if the commit fails.
+ *
+ * @param staging Staging file from create_staging_file
+ * @param filepath File to replace
+ * @return FileOperationResult indicating success or failure
+ */
+FileOperationResult commit_staging_file(StagingFile &staging,
+                                        const std::string &filepath);
+
+/**
+ * Close and remove a staging file without touching the target
+ *
+ * @param staging Staging file from create_staging_file
+ */
+void discard_staging_file(StagingFile &staging);
+
+/**
+ * Create an empty hidden staging directory next to directory
+ *
+ * @param directory Directory the staging directory will become
+ * @return Pair of (staging directory path, FileOperationResult)
+ */
+std::pair<std::string, FileOperationResult>
+create_staging_directory(const std::string &directory);
+
+/**
+ * Rename a staging directory to directory and flush the parent per the
+ * durability mode
+ *
+ * An existing directory is never replaced. The staging directory is
+ * removed if the commit fails.
+ *
+ * @param staging Staging directory from create_staging_directory
+ * @param directory Path of the directory to create; must not exist
+ * @return FileOperationResult indicating success or failure
+ */
+FileOperationResult commit_staging_directory(const std::string &staging,
+                                             const std::string &directory);
+
+/**
+ * Remove a staging directory and everything in it
+ *
+ * @param staging Staging directory from create_staging_directory
+ */
+void discard_staging_directory(const std::string &staging);
+
+/**
+ * Allocate disk space for a byte range of an open file
+ *
+ * The size of the file is left alone, so later writes to the range land
+ * in extents laid out up front without the file appearing longer than
+ * what has been written. Filesystems that cannot preallocate are treated
+ * as success.
+ *
+ * @param fd File descriptor open for writing
+ * @param offset Start of the range to allocate
+ * @param length Number of bytes to allocate
+ * @return FileOperationResult; IO_ERROR if the space is not available
+ */
+FileOperationResult preallocate_file(int fd, uint64_t offset, uint64_t length);
+
+/**
+ * Overwrite a byte range of a file with pwrite (creates the file if it
+ * doesn't exist; never truncates)
+ *
+ * Writing past the end of the file extends it, leaving a hole if offset is
+ * beyond the current size. The range is flushed according to the current
+ * durability mode.
+ *
+ * @param filepath Path to the file to write
+ * @param offset Offset of the first byte to write
+ * @param data Data to write at offset
+ * @return FileOperationResult indicating success or failure
+ */
+FileOperationResult write_file_range(const std::string &filepath,
+                                     uint64_t offset,
+                                     const std::string &data);
+
 /**
  * Append data to a file (the file must exist)
  *
+ * Recently appended-to files keep an O_APPEND descriptor open, so an append
+ * costs one stat and the write itself, independent of the file size. The
+ * descriptor is reopened if the path no longer names the same file. With
+ * append coalescing enabled (set_append_coalescing), concurrent appends to
+ * the same file are merged into one write; each returns once it is written.
+ *
  * @param filepath Path to the file to append to
  * @param data Data to append to the file
  * @return FileOperationResult indicating success or failure
@@ -67,6 +301,18 @@ FileOperationResult write_file(const std::string &filepath,
 FileOperationResult append_file(const std::string &filepath,
                                 const std::string &data);
 
+/**
+ * Get the cached O_APPEND descriptor append_file writes through
+ *
+ * Checks the same rules as append_file (the file must exist and be
+ * writable) and turns a deduplicated or packed file into a plain one first.
+ *
+ * @param filepath Path to the file to append to
+ * @return Pair of (handle, or nullptr on failure, FileOperationResult)
+ */
+std::pair<std::shared_ptr<AppendHandle>, FileOperationResult>
+open_append_handle(const std::string &filepath);
+
 /**
  * Create a new empty file
  *
@@ -92,6 +338,37 @@ FileOperationResult delete_file(const std::string &filepath);
 std::pair<fenris::FileInfo, FileOperationResult>
 get_file_info(const std::string &filepath);
 
+/**
+ * Create a new empty file in an open directory
+ *
+ * Only the last path component is resolved, relative to dirfd, instead of
+ * the whole path.
+ *
+ * @param dirfd Descriptor of the directory
+ * @param name Name of the file, a single path component
+ * @return FileOperationResult indicating success or failure
+ */
+FileOperationResult create_file_at(int dirfd, const std::string &name);
+
+/**
+ * Delete a file from an open directory
+ *
+ * @param dirfd Descriptor of the directory
+ * @param name Name of the file, a single path component
+ * @return FileOperationResult indicating success or failure
+ */
+FileOperationResult delete_file_at(int dirfd, const std::string &name);
+
+/**
+ * Get information about an entry of an open directory
+ *
+ * @param dirfd Descriptor of the directory
+ * @param name Name of the entry, a single path component
+ * @return Pair of (FileInfo named name, FileOperationResult)
+ */
+std::pair<fenris::FileInfo, FileOperationResult>
+get_file_info_at(int dirfd, const std::string &name);
+
 /**
  * Check if a file exists
  *
@@ -136,6 +413,35 @@ FileOperationResult delete_directory(const std::string &dirpath,
 std::pair<std::vector<fenris::FileInfo>, FileOperationResult>
 list_directory(const std::string &dirpath);
 
+/**
+ * One page of a directory listing
+ */
+struct DirectoryPage {
+    std::vector<fenris::FileInfo> entries;
+    // Directory position to resume from for the next page
+    uint64_t next_offset{0};
+    // True once the end of the directory has been reached
+    bool complete{false};
+};
+
+/**
+ * List up to page_size entries of a directory, starting at offset
+ *
+ * Entries are read with getdents64 in fixed-size batches and stat'ed
+ * relative to the directory, so only as much of the directory as the page
+ * needs is read. Offsets are the directory's own positions (d_off), which
+ * stay valid across calls as long as the directory is not rewritten.
+ *
+ * @param dirpath Path of the directory to list
+ * @param offset Position returned as next_offset by the previous page, or 0
+ * @param page_size Maximum number of entries to return
+ * @return Pair of (directory page, FileOperationResult)
+ */
+std::pair<DirectoryPage, FileOperationResult>
+list_directory_page(const std::string &dirpath,
+                    uint64_t offset,
+                    size_t page_size);
+
 /**
  * Change the current working directory
  *
@@ -154,6 +460,10 @@ std::pair<std::string, FileOperationResult> get_current_directory();
 /**
  * Rename a file or directory
  *
+ * Uses renameat2 with RENAME_NOREPLACE, so the move is a single atomic
+ * step that fails rather than replacing an existing newpath. The parent
+ * directories of both paths are flushed per the durability mode.
+ *
  * @param oldpath Current path
  * @param newpath New path
  * @return FileOperationResult indicating success or failure
@@ -161,9 +471,28 @@ std::pair<std::string, FileOperationResult> get_current_directory();
 FileOperationResult rename_path(const std::string &oldpath,
                                 const std::string &newpath);
 
+/**
+ * Copy a file into a staging file next to destination
+ *
+ * The data never leaves the kernel: the staging file is reflinked to the
+ * source where the filesystem supports it (FICLONE), and otherwise filled
+ * with copy_file_range, falling back to sendfile across filesystems.
+ * Nothing at destination is touched until commit_staging_file.
+ *
+ * @param source Source file path
+ * @param destination File the copy will replace or create
+ * @return Pair of (StagingFile, FileOperationResult)
+ */
+std::pair<StagingFile, FileOperationResult>
+stage_file_copy(const std::string &source, const std::string &destination);
+
 /**
  * Copy a file
  *
+ * The copy is staged with stage_file_copy and renamed into place, so an
+ * existing destination is replaced atomically and left untouched if the
+ * copy fails.
+ *
  * @param source Source file path
  * @param destination Destination file path
  * @return FileOperationResult indicating success or failure
@@ -171,6 +500,36 @@ FileOperationResult rename_path(const std::string &oldpath,
 FileOperationResult copy_file(const std::string &source,
                               const std::string &destination);
 
+/**
+ * Recursively copy a directory into a staging directory next to
+ * destination
+ *
+ * Regular files are copied like copy_file does and symlinks are recreated;
+ * other special files are skipped. Files and directories are flushed per
+ * the durability mode. The destination must not exist and must not lie
+ * inside the source. A failed copy leaves nothing behind.
+ *
+ * @param source Source directory path
+ * @param destination Directory the copy will become
+ * @return Pair of (staging directory, FileOperationResult)
+ */
+std::pair<std::string, FileOperationResult>
+stage_directory_copy(const std::string &source,
+                     const std::string &destination);
+
+/**
+ * Recursively copy a directory
+ *
+ * The copy is staged with stage_directory_copy and renamed into place
+ * once complete.
+ *
+ * @param source Source directory path
+ * @param destination Destination directory path
+ * @return FileOperationResult indicating success or failure
+ */
+FileOperationResult copy_directory(const std::string &source,
+                                   const std::string &destination);
+
 /**
  * Get file size
  *
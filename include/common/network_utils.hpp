@@ -13,6 +13,9 @@ namespace network {
 
 static const uint32_t DELAY = 100;
 
+// Size of the length prefix that precedes every message on the wire
+constexpr size_t FRAME_HEADER_SIZE = sizeof(uint32_t);
+
 /**
  * @enum NetworkResult
  * @brief Represents different kinds of network operation errors
@@ -104,6 +107,19 @@ NetworkResult receive_prefixed_data(uint32_t socket,
                                     std::vector<uint8_t> &data,
                                     bool non_blocking_mode = false);
 
+/**
+ * @brief Sends a frame whose first FRAME_HEADER_SIZE bytes are reserved for
+ * the size prefix, so the prefix and payload go out from a single buffer.
+ * @param socket The socket to send the data to.
+ * @param frame The header room followed by the payload; the header is filled
+ * in by this function.
+ * @param non_blocking_mode True if the socket is in non-blocking mode, false
+ * @return NetworkResult indicating success or failure type
+ */
+NetworkResult send_frame(uint32_t socket,
+                         std::vector<uint8_t> &frame,
+                         bool non_blocking_mode = false);
+
 } // namespace network
 } // namespace common
 } // namespace fenris
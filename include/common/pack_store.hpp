@@ -0,0 +1,318 @@
+#ifndef FENRIS_COMMON_PACK_STORE_HPP
+#define FENRIS_COMMON_PACK_STORE_HPP
+
+#include "common/file_operations.hpp"
+
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <set>
+#include <string>
+#include <sys/stat.h>
+#include <unordered_map>
+#include <utility>
+
+namespace fenris {
+namespace common {
+
+// Files shorter than this are packed; larger ones keep blocks of their own
+// (and, from this size up, may be deduplicated instead)
+constexpr size_t MAX_PACKED_FILE_SIZE = 16 * 1024;
+
+// A pack is sealed and a new one started once it would grow past this
+constexpr uint64_t DEFAULT_MAX_PACK_SIZE = 64 * 1024 * 1024;
+
+// Extended attribute naming the pack record of a packed file
+constexpr const char *PACK_XATTR = "user.fenris.pack";
+
+// Sealed packs with less than this fraction of live bytes are compacted
+constexpr double DEFAULT_COMPACTION_RATIO = 0.5;
+
+// Packs written to more recently are left alone by compaction, so records
+// appended for a write that has not set its placeholder yet survive it
+constexpr std::chrono::seconds DEFAULT_PACK_GRACE_PERIOD{60};
+
+// Upper bound on the packed files whose record is remembered in memory
+constexpr size_t MAX_PACK_INDEX_SIZE = 1 << 20;
+
+/**
+ * @struct PackLocation
+ * @brief Where the contents of a packed file are stored
+ */
+struct PackLocation {
+    uint32_t pack{0};
+    uint32_t length{0};
+    uint64_t offset{0};
+    // CRC32C of the record (see common/checksum.hpp)
+    uint32_t crc{0};
+};
+
+/**
+ * @struct PackCompactionStats
+ * @brief What a compaction of the pack store did
+ */
+struct PackCompactionStats {
+    uint64_t files_moved{0};
+    uint64_t packs_removed{0};
+    uint64_t bytes_freed{0};
+};
+
+/**
+ * @class PackStore
+ * @brief Append-only pack files holding the contents of small files
+ *
+ * A packed file stays in the namespace as a sparse placeholder of its full
+ * size whose PACK_XATTR names its record, so listings, sizes, renames and
+ * deletes need no special case, while its contents take no block of their
+ * own. Records are only ever appended to the newest pack; the space of
+ * overwritten and deleted files is reclaimed by compaction, which moves
+ * the live records out of sparse packs and then removes them.
+ *
+ * Every pack is held open, and the records of recently read placeholders
+ * are remembered by inode, so reading a packed file whose descriptor is
+ * already open is a single pread.
+ */
+class PackStore {
+  public:
+    /**
+     * @brief Constructor
+     * @param root Directory holding the packs
+     * @param max_pack_size Size at which a pack is sealed
+     */
+    explicit PackStore(std::string root,
+                       uint64_t max_pack_size = DEFAULT_MAX_PACK_SIZE);
+
+    /**
+     * @brief Create the store directory and open the packs it holds
+     */
+    FileOperationResult initialize();
+
+    const std::string &root() const;
+
+    /**
+     * @brief Number of packs, including the one being appended to
+     */
+    size_t pack_count() const;
+
+    /**
+     * @brief Append a record to the newest pack
+     *
+     * The record is flushed according to the current durability mode.
+     *
+     * @return Pair of (location of the record, FileOperationResult)
+     */
+    std::pair<PackLocation, FileOperationResult> append(const void *data,
+                                                        size_t size);
+
+    /**
+     * @brief Read a byte range of a record
+     *
+     * The whole record is read and checked against its checksum, and
+     * DATA_CORRUPTED is returned if it does not match.
+     *
+     * @param location Record to read
+     * @param offset First byte of the record to read
+     * @param length Bytes to read; clamped to the end of the record
+     * @return Pair of (bytes read, FileOperationResult)
+     */
+    std::pair<std::string, FileOperationResult>
+    read(const PackLocation &location, uint64_t offset, uint64_t length) const;
+
+    /**
+     * @brief Replace the contents of an open small file by a pack record
+     *
+     * Files of MAX_PACKED_FILE_SIZE bytes or more, empty files, and files
+     * on filesystems without user extended attributes are left as they are.
+     *
+     * @param fd Regular file open for writing, usually a staging file
+     */
+    FileOperationResult pack(int fd);
+
+    /**
+     * @brief Record of a packed file
+     * @param fd Open regular file
+     * @param st Status of fd
+     * @return Pair of (location, or nullopt for a plain file,
+     * FileOperationResult)
+     */
+    std::pair<std::optional<PackLocation>, FileOperationResult>
+    locate(int fd, const struct stat &st);
+
+    /**
+     * @brief Make an empty file a copy of a packed file
+     *
+     * The copy shares the record unless its pack is being retired, in which
+     * case the record is copied to the newest pack.
+     *
+     * @param source_fd Open regular file
+     * @param destination_fd Empty file open for writing
+     * @return Pair of (whether source was packed and has been copied,
+     * FileOperationResult)
+     */
+    std::pair<bool, FileOperationResult> copy(int source_fd,
+                                              int destination_fd);
+
+    /**
+     * @brief Move live records out of sparse packs and remove empty ones
+     *
+     * Placeholders are found by walking the namespace, which cannot be done
+     * atomically while files are renamed. A pack is therefore only removed
+     * by a later compaction that finds no placeholder referring to it
+     * after it was retired by an earlier one.
+     *
+     * @param namespace_root Directory tree holding the placeholders
+     * @param ratio Sealed packs with less than this fraction of live bytes
+     * are retired
+     * @param grace_period Packs modified more recently are kept
+     * @return Pair of (PackCompactionStats, FileOperationResult)
+     */
+    std::pair<PackCompactionStats, FileOperationResult>
+    compact(const std::string &namespace_root,
+            double ratio = DEFAULT_COMPACTION_RATIO,
+            std::chrono::seconds grace_period = DEFAULT_PACK_GRACE_PERIOD);
+
+  private:
+    struct Pack {
+        explicit Pack(int fd, uint64_t size);
+        ~Pack();
+
+        int fd;
+        uint64_t size; // Guarded by m_mutex
+    };
+
+    struct InodeKey {
+        dev_t device;
+        ino_t inode;
+
+        bool operator==(const InodeKey &other) const
+        {
+            return device == other.device && inode == other.inode;
+        }
+    };
+
+    struct InodeKeyHash {
+        size_t operator()(const InodeKey &key) const
+        {
+            return std::hash<uint64_t>()(static_cast<uint64_t>(key.inode) ^
+                                         (static_cast<uint64_t>(key.device)
+                                          << 40));
+        }
+    };
+
+    // A record remembered for a placeholder; a changed ctime means the
+    // placeholder changed (or the inode was reused) since
+    struct IndexEntry {
+        PackLocation location;
+        struct timespec ctime;
+    };
+
+    std::string pack_path(uint32_t id) const;
+
+    std::shared_ptr<Pack> find_pack(uint32_t id) const;
+
+    // Append a record with a known checksum; records moved or copied keep
+    // theirs, so a damaged record stays detectably damaged
+    std::pair<PackLocation, FileOperationResult>
+    append_record(const void *data, size_t size, uint32_t crc);
+
+    // Read a whole record without checking it
+    std::pair<std::string, FileOperationResult>
+    read_record(const PackLocation &location) const;
+
+    // Open a new pack after the newest one; m_mutex must be held
+    FileOperationResult start_pack();
+
+    void remember(const struct stat &st, const PackLocation &location);
+
+    std::string m_root;
+    uint64_t m_max_pack_size;
+
+    mutable std::mutex m_mutex;
+    std::map<uint32_t, std::shared_ptr<Pack>> m_packs;
+    uint32_t m_active{0};
+
+    // Serializes changes to the record of existing placeholders between
+    // copies and compaction, and guards m_retired
+    std::mutex m_placeholder_mutex;
+    std::set<uint32_t> m_retired;
+
+    mutable std::mutex m_index_mutex;
+    std::unordered_map<InodeKey, IndexEntry, InodeKeyHash> m_index;
+};
+
+/**
+ * Select the process-wide pack store used by the file operations
+ *
+ * Files already packed are readable as long as a store is set; new
+ * whole-file writes are only packed when pack_writes is set.
+ *
+ * @param store Pack store, or nullptr to use none
+ * @param pack_writes Pack newly written small files
+ */
+void set_pack_store(std::shared_ptr<PackStore> store, bool pack_writes);
+
+/**
+ * Get the process-wide pack store
+ *
+ * @return Current store, or nullptr if none is set
+ */
+std::shared_ptr<PackStore> get_pack_store();
+
+/**
+ * Pack an open file if whole-file writes are packed
+ *
+ * @param fd Regular file open for writing, usually a staging file
+ * @return FileOperationResult indicating success or failure
+ */
+FileOperationResult pack_file(int fd);
+
+/**
+ * Read a byte range of a packed file from its pack
+ *
+ * @param fd Open regular file
+ * @param st Status of fd
+ * @param offset First byte to read
+ * @param length Bytes to read; clamped to the end of the file
+ * @return Pair of (bytes read, or nullopt for a plain file or when no
+ * store is set, FileOperationResult)
+ */
+std::pair<std::optional<std::string>, FileOperationResult>
+read_packed_range(int fd,
+                  const struct stat &st,
+                  uint64_t offset,
+                  uint64_t length);
+
+/**
+ * Open a byte range of a packed file for reading
+ *
+ * @param fd Open regular file
+ * @param offset First byte the caller will read
+ * @param length Bytes the caller will read
+ * @return Pair of (descriptor positioned at 0 holding that range, or -1 for
+ * a plain file, FileOperationResult)
+ */
+std::pair<int, FileOperationResult>
+open_packed_range(int fd, uint64_t offset, uint64_t length);
+
+/**
+ * Make an empty file a copy of a packed file, sharing its record
+ *
+ * A plain source leaves no stale record on the destination.
+ *
+ * @param source_fd Open regular file
+ * @param destination_fd Empty file open for writing
+ * @return Pair of (whether source was packed and has been copied,
+ * FileOperationResult)
+ */
+std::pair<bool, FileOperationResult> copy_packed_placeholder(
+    int source_fd,
+    int destination_fd);
+
+} // namespace common
+} // namespace fenris
+
+#endif // FENRIS_COMMON_PACK_STORE_HPP
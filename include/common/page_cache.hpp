@@ -0,0 +1,261 @@
+#ifndef FENRIS_COMMON_PAGE_CACHE_HPP
+#define FENRIS_COMMON_PAGE_CACHE_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <optional>
+#include <string>
+#include <sys/types.h>
+
+namespace fenris {
+namespace common {
+
+// Reads and writes of at least this many bytes are bulk transfers
+constexpr uint64_t DEFAULT_BULK_TRANSFER_SIZE = 16 * 1024 * 1024;
+
+// Files up to this size are prefetched whole when they are opened for reads
+constexpr uint64_t DEFAULT_HOT_FILE_SIZE = 256 * 1024;
+
+// Bulk writes are flushed and dropped from the page cache in windows of
+// this size, one window behind the writer
+constexpr uint64_t WRITE_BEHIND_WINDOW = 8 * 1024 * 1024;
+
+// Offset, length and buffer alignment of O_DIRECT reads
+constexpr size_t DIRECT_IO_ALIGNMENT = 4096;
+
+// Bytes fetched by each O_DIRECT read
+constexpr size_t DIRECT_IO_BUFFER_SIZE = 1024 * 1024;
+
+/**
+ * @enum BulkIoPolicy
+ * @brief How bulk transfers use the page cache
+ */
+enum class BulkIoPolicy {
+    CACHED, // Leave bulk transfers to the page cache like any other I/O
+    DROP,   // Drop their pages (POSIX_FADV_DONTNEED) once streamed
+    DIRECT, // Stream reads with O_DIRECT where supported, otherwise DROP
+};
+
+/**
+ * Convert BulkIoPolicy to string representation
+ *
+ * @param policy BulkIoPolicy to convert
+ * @return "cached", "drop" or "direct"
+ */
+std::string bulk_io_policy_to_string(BulkIoPolicy policy);
+
+/**
+ * Parse a BulkIoPolicy from its string representation
+ *
+ * @param name "cached", "drop" or "direct"
+ * @return The policy, or std::nullopt if name is not recognised
+ */
+std::optional<BulkIoPolicy> bulk_io_policy_from_string(const std::string &name);
+
+/**
+ * Select the process-wide page cache policy used by the file operations
+ *
+ * @param policy How bulk transfers use the page cache
+ * @param bulk_size Transfers of at least this many bytes are bulk
+ * @param hot_size Files up to this size are prefetched when opened for
+ * reads (0 disables prefetching)
+ */
+void set_page_cache_policy(BulkIoPolicy policy,
+                           uint64_t bulk_size = DEFAULT_BULK_TRANSFER_SIZE,
+                           uint64_t hot_size = DEFAULT_HOT_FILE_SIZE);
+
+/**
+ * Get the process-wide bulk I/O policy
+ *
+ * @return Current BulkIoPolicy (CACHED unless set)
+ */
+BulkIoPolicy get_bulk_io_policy();
+
+/**
+ * Whether a transfer of length bytes bypasses the page cache under the
+ * current policy
+ */
+bool is_bulk_transfer(uint64_t length);
+
+/**
+ * @struct PageCacheStats
+ * @brief Page cache counters of the file operations since the last reset
+ */
+struct PageCacheStats {
+    // Reads below the bulk size, and how many of their bytes were already
+    // in the page cache when they started
+    uint64_t reads{0};
+    uint64_t read_bytes{0};
+    uint64_t cached_bytes{0};
+    // Bulk reads, and how many of them were made with O_DIRECT
+    uint64_t bulk_reads{0};
+    uint64_t bulk_read_bytes{0};
+    uint64_t direct_reads{0};
+    // Bulk writes; their bytes are counted as dropped
+    uint64_t bulk_writes{0};
+    uint64_t dropped_bytes{0};
+    // Hot files prefetched with POSIX_FADV_WILLNEED
+    uint64_t prefetches{0};
+
+    /**
+     * @brief Fraction of read_bytes that were served from the page cache
+     * (0 before any read was measured)
+     */
+    double hit_rate() const;
+};
+
+/**
+ * Get the page cache counters
+ *
+ * Cache residency is measured with cachestat(2); on kernels without it the
+ * byte counts of reads stay at zero.
+ */
+PageCacheStats get_page_cache_stats();
+
+/**
+ * Reset the page cache counters
+ */
+void reset_page_cache_stats();
+
+/**
+ * @class ReadHint
+ * @brief Page cache handling of one read of a file range
+ *
+ * Constructed just before the range is read: it records how much of the
+ * range is already cached and tells the kernel how it will be read. The
+ * pages of a bulk read are dropped from the cache as the reader releases
+ * them, so a one-off transfer does not push out the hot working set. A
+ * bulk range that was mostly cached already is someone's working set and
+ * is left alone.
+ */
+class ReadHint {
+  public:
+    /**
+     * @brief Constructor
+     * @param fd File about to be read; must stay open while the hint is used
+     * @param offset First byte of the range
+     * @param length Number of bytes in the range
+     */
+    ReadHint(int fd, uint64_t offset, uint64_t length);
+
+    /**
+     * @brief Whether released pages are dropped from the page cache
+     */
+    bool dropping() const;
+
+    /**
+     * @brief Whether the range should be read with O_DIRECT
+     */
+    bool direct() const;
+
+    /**
+     * @brief The bytes of the range before end have been consumed
+     */
+    void release(uint64_t end);
+
+  private:
+    int m_fd;
+    uint64_t m_released;
+    uint64_t m_end;
+    bool m_drop{false};
+    bool m_direct{false};
+};
+
+/**
+ * @class DirectReader
+ * @brief Reads a file with O_DIRECT through an aligned buffer
+ *
+ * The file is reopened with O_DIRECT, so the caller's descriptor keeps its
+ * ordinary cached semantics. Reads are fetched in aligned blocks of
+ * DIRECT_IO_BUFFER_SIZE and served from the buffer, so callers may read
+ * at any offset and size.
+ */
+class DirectReader {
+  public:
+    /**
+     * @brief Constructor
+     * @param fd Open file descriptor; the caller keeps ownership
+     */
+    explicit DirectReader(int fd);
+
+    ~DirectReader();
+
+    DirectReader(const DirectReader &) = delete;
+    DirectReader &operator=(const DirectReader &) = delete;
+
+    /**
+     * @brief Whether the file could be opened with O_DIRECT
+     */
+    bool valid() const;
+
+    /**
+     * @brief Read like pread, bypassing the page cache
+     * @return Bytes read (0 at the end of the file), or -1 with errno set
+     */
+    ssize_t read(void *buffer, size_t size, uint64_t offset);
+
+  private:
+    int m_fd{-1};
+    uint8_t *m_buffer{nullptr};
+    uint64_t m_buffer_offset{0};
+    size_t m_buffer_length{0};
+};
+
+/**
+ * @class WriteBehind
+ * @brief Flushes and drops the pages of a bulk file as it is written
+ *
+ * Writeback of each WRITE_BEHIND_WINDOW is started as soon as the writer
+ * has filled it, and the window before it is waited for and dropped from
+ * the page cache, so a bulk write neither fills the cache with dirty pages
+ * nor stalls on one huge flush at the end. Durability is unaffected: data
+ * is only guaranteed on stable storage by the durability mode's flush.
+ */
+class WriteBehind {
+  public:
+    /**
+     * @brief Constructor
+     * @param fd File being written sequentially from start
+     * @param start Offset of the first byte to be written
+     * @param length Announced size of the write; writes below the bulk
+     * size are left alone
+     */
+    WriteBehind(int fd, uint64_t start, uint64_t length);
+
+    /**
+     * @brief The bytes before end have been written
+     */
+    void written(uint64_t end);
+
+  private:
+    int m_fd;
+    bool m_active;
+    // Writeback has been started up to here, and pages dropped up to here
+    uint64_t m_started;
+    uint64_t m_dropped;
+};
+
+/**
+ * Hint that a small file opened for reads will be read again soon
+ *
+ * Files up to the hot size are prefetched with POSIX_FADV_WILLNEED.
+ *
+ * @param fd Open regular file
+ */
+void prefetch_hot_file(int fd);
+
+/**
+ * Flush and drop from the page cache a range that has been written
+ *
+ * Only bulk ranges are dropped; smaller ones are left cached.
+ *
+ * @param fd File that was written
+ * @param offset First byte of the range
+ * @param length Number of bytes in the range
+ */
+void drop_written(int fd, uint64_t offset, uint64_t length);
+
+} // namespace common
+} // namespace fenris
+
+#endif // FENRIS_COMMON_PAGE_CACHE_HPP
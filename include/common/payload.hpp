@@ -0,0 +1,472 @@
+#ifndef FENRIS_COMMON_PAYLOAD_HPP
+#define FENRIS_COMMON_PAYLOAD_HPP
+
+#include "common/checksum.hpp"
+#include "common/crypto_manager.hpp"
+#include "common/file_operations.hpp"
+#include "common/page_cache.hpp"
+
+#include <cstdint>
+#include <memory>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+namespace fenris {
+namespace common {
+
+// Bodies at least this large travel as raw payload frames after the message
+constexpr size_t PAYLOAD_THRESHOLD = 64 * 1024;
+
+// Maximum plaintext bytes carried by a single payload frame
+constexpr size_t PAYLOAD_CHUNK_SIZE = 1024 * 1024;
+
+// Smallest run of zero bytes a sparse file sink leaves as a hole
+constexpr size_t SPARSE_BLOCK_SIZE = 4096;
+
+/**
+ * @enum PayloadResult
+ * @brief Result of sending or receiving an out-of-band payload
+ */
+enum class PayloadResult {
+    SUCCESS,          // Whole payload transferred
+    NETWORK_ERROR,    // Socket send/receive failed
+    ENCRYPTION_ERROR, // IV generation, encryption or decryption failed
+    SOURCE_ERROR,     // Reading from the payload source failed
+    SINK_ERROR,       // Writing to the payload sink failed
+    INVALID_FRAME,    // Frame size does not match the announced payload
+    ALREADY_CONSUMED, // Incoming payload was already read or discarded
+};
+
+/**
+ * Convert PayloadResult to string representation
+ *
+ * @param result PayloadResult to convert
+ * @return String representation of the result
+ */
+std::string payload_result_to_string(PayloadResult result);
+
+/**
+ * @class PayloadSource
+ * @brief Supplies the bytes of an outgoing payload in order
+ */
+class PayloadSource {
+  public:
+    virtual ~PayloadSource() = default;
+
+    /**
+     * @brief Total number of bytes in the payload
+     */
+    virtual uint64_t size() const = 0;
+
+    /**
+     * @brief Copy the next chunk of the payload
+     * @param buffer Destination for exactly size bytes
+     * @param size Number of bytes to read
+     * @return true on success, false on I/O error
+     */
+    virtual bool read(uint8_t *buffer, size_t size) = 0;
+};
+
+/**
+ * @class PayloadSink
+ * @brief Consumes the bytes of an incoming payload in order
+ */
+class PayloadSink {
+  public:
+    virtual ~PayloadSink() = default;
+
+    /**
+     * @brief Consume the next chunk of the payload
+     * @param data Chunk contents
+     * @param size Chunk size
+     * @return true on success, false on I/O error
+     */
+    virtual bool write(const uint8_t *data, size_t size) = 0;
+};
+
+/**
+ * @class BufferPayloadSource
+ * @brief Payload served from a caller-owned buffer
+ */
+class BufferPayloadSource : public PayloadSource {
+  public:
+    /**
+     * @brief Constructor
+     * @param data Buffer holding the payload; must outlive the source
+     * @param size Number of bytes in the buffer
+     */
+    BufferPayloadSource(const void *data, size_t size);
+
+    uint64_t size() const override;
+    bool read(uint8_t *buffer, size_t size) override;
+
+  private:
+    const uint8_t *m_data;
+    size_t m_size;
+    size_t m_offset{0};
+};
+
+/**
+ * @class FilePayloadSource
+ * @brief Payload streamed from an open file with pread
+ *
+ * With checksums, each block the payload touches is verified as it is
+ * read (the parts of the first and last block outside the payload are read
+ * too), and read fails on the first block that does not match.
+ *
+ * A bulk payload (see common/page_cache.hpp) is dropped from the page cache
+ * as it is sent, or read with O_DIRECT under that policy.
+ */
+class FilePayloadSource : public PayloadSource {
+  public:
+    /**
+     * @brief Constructor
+     * @param fd Open file descriptor; ownership passes to the source
+     * @param size Number of bytes to send starting at offset
+     * @param offset File offset of the first payload byte
+     * @param checksums Block checksums of the file, if any
+     */
+    FilePayloadSource(int fd,
+                      uint64_t size,
+                      uint64_t offset = 0,
+                      std::shared_ptr<const BlockChecksums> checksums = {});
+
+    ~FilePayloadSource() override;
+
+    FilePayloadSource(const FilePayloadSource &) = delete;
+    FilePayloadSource &operator=(const FilePayloadSource &) = delete;
+
+    uint64_t size() const override;
+    bool read(uint8_t *buffer, size_t size) override;
+
+  private:
+    int m_fd;
+    uint64_t m_size;
+    uint64_t m_offset;
+    uint64_t m_position{0};
+    std::optional<ChecksumVerifier> m_verifier;
+    ReadHint m_hint;
+    std::unique_ptr<DirectReader> m_direct;
+};
+
+/**
+ * @class MappedPayloadSource
+ * @brief Payload served from a memory-mapped file
+ *
+ * Frames are filled straight from the mapped pages, so the file is never
+ * copied into an intermediate buffer. Blocks the mapping still has to be
+ * verified against are checked as they are sent.
+ */
+class MappedPayloadSource : public PayloadSource {
+  public:
+    /**
+     * @brief Constructor
+     * @param file Mapped file; the source keeps the mapping alive
+     */
+    explicit MappedPayloadSource(std::shared_ptr<const MappedFile> file);
+
+    uint64_t size() const override;
+    bool read(uint8_t *buffer, size_t size) override;
+
+  private:
+    std::shared_ptr<const MappedFile> m_file;
+    size_t m_offset{0};
+    std::optional<ChecksumVerifier> m_verifier;
+};
+
+/**
+ * Open a file, or a byte range of it, as a payload source
+ *
+ * The range is clamped to the end of the file, so the source may be shorter
+ * than length (empty if offset is at or beyond the end).
+ *
+ * @param filepath Path to the file to send
+ * @param offset Offset of the first byte to send
+ * @param length Maximum number of bytes to send
+ * @return Pair of (source, or nullptr on failure, FileOperationResult)
+ */
+std::pair<std::unique_ptr<PayloadSource>, FileOperationResult>
+open_file_payload(const std::string &filepath,
+                  uint64_t offset = 0,
+                  uint64_t length = UINT64_MAX);
+
+/**
+ * Open a byte range of an open file as a payload source
+ *
+ * The source reads through a duplicate of fd, so the caller may close fd
+ * (or keep it cached) independently of the source.
+ *
+ * @param fd File descriptor open for reading; it is left open
+ * @param offset Offset of the first byte to send
+ * @param length Maximum number of bytes to send
+ * @return Pair of (source, or nullptr on failure, FileOperationResult)
+ */
+std::pair<std::unique_ptr<PayloadSource>, FileOperationResult>
+open_file_payload(int fd, uint64_t offset, uint64_t length);
+
+/**
+ * @class BufferPayloadSink
+ * @brief Appends an incoming payload to a string
+ */
+class BufferPayloadSink : public PayloadSink {
+  public:
+    /**
+     * @brief Constructor
+     * @param buffer Destination string; must outlive the sink
+     */
+    explicit BufferPayloadSink(std::string &buffer);
+
+    bool write(const uint8_t *data, size_t size) override;
+
+  private:
+    std::string &m_buffer;
+};
+
+/**
+ * @class DiscardPayloadSink
+ * @brief Drops an incoming payload, so the stream stays on a frame boundary
+ * without holding the body anywhere
+ */
+class DiscardPayloadSink : public PayloadSink {
+  public:
+    bool write(const uint8_t *data, size_t size) override;
+};
+
+/**
+ * @class FilePayloadSink
+ * @brief Writes an incoming payload to an open file
+ *
+ * A sparse sink does not write runs of at least SPARSE_BLOCK_SIZE zero
+ * bytes. It punches a hole over them instead, which also releases any
+ * blocks that were preallocated or held older data there. On filesystems
+ * without hole punching the zeros are written as usual.
+ *
+ * A sink told to expect a bulk payload (see common/page_cache.hpp) flushes
+ * and drops what it has written from the page cache as it goes.
+ */
+class FilePayloadSink : public PayloadSink {
+  public:
+    /**
+     * @brief Constructor
+     * @param fd Open file descriptor; the caller keeps ownership
+     * @param sparse Punch holes for zero runs instead of writing them
+     * @param expected_size Announced size of the payload, if known
+     */
+    explicit FilePayloadSink(int fd,
+                             bool sparse = false,
+                             uint64_t expected_size = 0);
+
+    bool write(const uint8_t *data, size_t size) override;
+
+    /**
+     * @brief Extend the file over a hole left at the end of the payload
+     * @return true on success
+     */
+    bool finish();
+
+  private:
+    bool write_all(const uint8_t *data, size_t size);
+
+    // Account for size more bytes of the payload, written or skipped
+    bool written(size_t size);
+
+    // Punch a hole of size bytes at the file position and skip past it
+    bool skip_hole(size_t size);
+
+    int m_fd;
+    bool m_sparse;
+    // File position, tracked only for a bulk payload
+    uint64_t m_position{0};
+    std::optional<WriteBehind> m_write_behind;
+};
+
+/**
+ * Send a payload as a sequence of encrypted frames
+ *
+ * Each frame has the same layout as a message frame (size prefix, IV,
+ * AES-GCM ciphertext and tag) and carries at most PAYLOAD_CHUNK_SIZE bytes
+ * read straight from the source into the frame buffer.
+ *
+ * @param socket Socket to send on
+ * @param source Payload to send
+ * @param crypto_manager Crypto manager used for encryption
+ * @param key Session encryption key
+ * @param non_blocking_mode True if the socket is in non-blocking mode
+ * @return PayloadResult indicating success or failure type
+ */
+PayloadResult send_payload(uint32_t socket,
+                           PayloadSource &source,
+                           crypto::CryptoManager &crypto_manager,
+                           const std::vector<uint8_t> &key,
+                           bool non_blocking_mode = false);
+
+/**
+ * Receive a payload sent by send_payload
+ *
+ * If the sink fails part way, the remaining frames are still read and
+ * discarded so the connection stays in step, and SINK_ERROR is returned.
+ *
+ * @param socket Socket to receive from
+ * @param size Payload size announced in the preceding message
+ * @param sink Destination for the decrypted bytes
+ * @param crypto_manager Crypto manager used for decryption
+ * @param key Session encryption key
+ * @param non_blocking_mode True if the socket is in non-blocking mode
+ * @return PayloadResult indicating success or failure type
+ */
+PayloadResult receive_payload(uint32_t socket,
+                              uint64_t size,
+                              PayloadSink &sink,
+                              crypto::CryptoManager &crypto_manager,
+                              const std::vector<uint8_t> &key,
+                              bool non_blocking_mode = false);
+
+/**
+ * @class IncomingPayload
+ * @brief Request body whose decoding is deferred until a handler asks for it
+ *
+ * The body is either a slice of the received message or payload frames that
+ * are still waiting on the socket. It can be consumed exactly once, either
+ * by reading it into a sink or by discarding it.
+ */
+class IncomingPayload {
+  public:
+    virtual ~IncomingPayload() = default;
+
+    /**
+     * @brief Total number of bytes in the body
+     */
+    virtual uint64_t size() const = 0;
+
+    /**
+     * @brief Deliver the body to a sink
+     * @param sink Destination for the body bytes
+     * @return PayloadResult indicating success or failure type
+     */
+    PayloadResult read_into(PayloadSink &sink);
+
+    /**
+     * @brief Drop the body without materializing it
+     * @return PayloadResult indicating success or failure type
+     */
+    PayloadResult discard();
+
+    /**
+     * @brief Whether the body has been read or discarded
+     */
+    bool consumed() const;
+
+    /**
+     * @brief Result of consuming the body (SUCCESS while still pending)
+     */
+    PayloadResult result() const;
+
+  protected:
+    virtual PayloadResult do_read(PayloadSink *sink) = 0;
+
+  private:
+    bool m_consumed{false};
+    PayloadResult m_result{PayloadResult::SUCCESS};
+};
+
+/**
+ * @class InlineIncomingPayload
+ * @brief Body carried in the data field, kept as a slice of the message
+ */
+class InlineIncomingPayload : public IncomingPayload {
+  public:
+    /**
+     * @brief Constructor
+     * @param data Slice of the received message; must outlive the payload
+     */
+    explicit InlineIncomingPayload(std::string_view data);
+
+    uint64_t size() const override;
+
+  protected:
+    PayloadResult do_read(PayloadSink *sink) override;
+
+  private:
+    std::string_view m_data;
+};
+
+/**
+ * @class StreamedIncomingPayload
+ * @brief Body sent as payload frames that have not been received yet
+ */
+class StreamedIncomingPayload : public IncomingPayload {
+  public:
+    /**
+     * @brief Constructor
+     * @param socket Socket the frames arrive on
+     * @param size Payload size announced in the request
+     * @param crypto_manager Crypto manager used for decryption
+     * @param key Session encryption key; must outlive the payload
+     * @param non_blocking_mode True if the socket is in non-blocking mode
+     */
+    StreamedIncomingPayload(uint32_t socket,
+                            uint64_t size,
+                            crypto::CryptoManager &crypto_manager,
+                            const std::vector<uint8_t> &key,
+                            bool non_blocking_mode);
+
+    uint64_t size() const override;
+
+  protected:
+    PayloadResult do_read(PayloadSink *sink) override;
+
+  private:
+    uint32_t m_socket;
+    uint64_t m_size;
+    crypto::CryptoManager &m_crypto_manager;
+    const std::vector<uint8_t> &m_key;
+    bool m_non_blocking_mode;
+};
+
+/**
+ * Write a request body to a file, creating it if needed
+ *
+ * Without an offset the body replaces the file: it is staged in a
+ * temporary file in the same directory and renamed over the target once
+ * complete. With one, the body overwrites the file from that offset like
+ * write_file_range.
+ * Permissions are checked before the body is touched, so a rejected write
+ * leaves the body unconsumed for the caller to discard.
+ *
+ * When the final size of the file is announced, the space for the body is
+ * reserved before the body is read so the file is laid out contiguously,
+ * and a full disk is reported before any of the body is consumed. The
+ * announced size must be where the body ends. Runs of zeros in the body
+ * are left as holes.
+ *
+ * @param filepath Path to the file to write
+ * @param payload Body to stream into the file
+ * @param offset Offset to write the body at, if any
+ * @param expected_size Offset plus the size of the body, or 0 if not
+ *                      announced
+ * @return FileOperationResult indicating success or failure; IO_ERROR if
+ *         expected_size does not match the body
+ */
+FileOperationResult
+write_file_from_payload(const std::string &filepath,
+                        IncomingPayload &payload,
+                        std::optional<uint64_t> offset = std::nullopt,
+                        uint64_t expected_size = 0);
+
+/**
+ * Append a request body to an existing file through an O_APPEND descriptor
+ *
+ * @param filepath Path to the file to append to
+ * @param payload Body to stream onto the end of the file
+ * @return FileOperationResult indicating success or failure
+ */
+FileOperationResult append_file_from_payload(const std::string &filepath,
+                                             IncomingPayload &payload);
+
+} // namespace common
+} // namespace fenris
+
+#endif // FENRIS_COMMON_PAYLOAD_HPP
@@ -3,14 +3,37 @@
 
 #include "fenris.pb.h"
 #include <string>
+#include <string_view>
 
 namespace fenris {
 namespace common {
 
 std::vector<uint8_t> serialize_request(const fenris::Request &request);
 
+// Serializes into buffer, leaving headroom bytes before and tailroom bytes
+// after the message so a frame can be built around it without copying
+bool serialize_request_into(const fenris::Request &request,
+                            std::vector<uint8_t> &buffer,
+                            size_t headroom,
+                            size_t tailroom);
+
 fenris::Request deserialize_request(const std::vector<uint8_t> &data);
 
+fenris::Request deserialize_request(const uint8_t *data, size_t size);
+
+// Parses into an existing (possibly arena-allocated) request; on failure the
+// request is left empty and false is returned
+bool deserialize_request_into(const uint8_t *data,
+                              size_t size,
+                              fenris::Request &request);
+
+// Parses every field except data, which is returned as a slice of the input
+// instead of being copied into the message; false on malformed input
+bool deserialize_request_header(const uint8_t *data,
+                                size_t size,
+                                fenris::Request &request,
+                                std::string_view &body);
+
 std::string request_to_json(const fenris::Request &request);
 
 } // namespace common
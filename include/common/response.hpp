@@ -2,17 +2,43 @@
 #define FENRIS_COMMON_RESPONSE_HPP
 
 #include "fenris.pb.h"
+#include <cstdint>
+#include <optional>
 #include <string>
+#include <vector>
 
 namespace fenris {
 namespace common {
 
 std::vector<uint8_t> serialize_response(const fenris::Response &response);
 
+// Serializes into buffer, leaving headroom bytes before and tailroom bytes
+// after the message so a frame can be built around it without copying
+bool serialize_response_into(const fenris::Response &response,
+                             std::vector<uint8_t> &buffer,
+                             size_t headroom,
+                             size_t tailroom);
+
 fenris::Response deserialize_response(const std::vector<uint8_t> &data);
 
+fenris::Response deserialize_response(const uint8_t *data, size_t size);
+
 std::string response_to_json(const fenris::Response &response);
 
+// Returns a dictionary-compressed copy of a small FILE_CONTENT or DIR_LISTING
+// response, or nullopt when compression does not apply or does not pay off
+std::optional<fenris::Response>
+compress_response(const fenris::Response &response,
+                  const std::vector<uint8_t> &dictionary,
+                  size_t max_payload_size);
+
+// Restores a response produced by compress_response; false on corrupt data
+// or when the announced size exceeds max_payload_size, which is checked
+// before anything is allocated
+bool decompress_response(fenris::Response &response,
+                         const std::vector<uint8_t> &dictionary,
+                         size_t max_payload_size);
+
 } // namespace common
 } // namespace fenris
 
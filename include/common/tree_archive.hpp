@@ -0,0 +1,260 @@
+#ifndef FENRIS_COMMON_TREE_ARCHIVE_HPP
+#define FENRIS_COMMON_TREE_ARCHIVE_HPP
+
+#include "common/checksum.hpp"
+#include "common/file_operations.hpp"
+#include "common/payload.hpp"
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace fenris {
+namespace common {
+
+// Bytes of the fixed part of an entry header:
+// type (1) | mode (4) | mtime in ns (8) | size (8) | path length (4),
+// all little-endian, followed by the path and then size bytes of body
+constexpr size_t TREE_HEADER_SIZE = 25;
+
+// Longest relative path an archive entry may carry
+constexpr size_t MAX_TREE_PATH_SIZE = 4096;
+
+// Threads walking a directory tree to build an archive
+constexpr size_t DEFAULT_TREE_WALKERS = 8;
+
+/**
+ * @enum TreeEntryType
+ * @brief Kind of an entry in a tree archive
+ */
+enum class TreeEntryType : uint8_t {
+    DIRECTORY = 1, // No body
+    FILE = 2,      // Body holds the file contents
+};
+
+/**
+ * @struct TreeEntry
+ * @brief One directory or regular file of a tree archive
+ */
+struct TreeEntry {
+    // Path relative to the root of the tree, '/'-separated
+    std::string path;
+    TreeEntryType type{TreeEntryType::FILE};
+    // Permission bits
+    uint32_t mode{0};
+    // Modification time in nanoseconds since the epoch
+    int64_t mtime{0};
+    // Body size (0 for directories)
+    uint64_t size{0};
+};
+
+/**
+ * Encode the header of an archive entry
+ *
+ * @param entry Entry to encode
+ * @return TREE_HEADER_SIZE bytes followed by the path
+ */
+std::string encode_tree_header(const TreeEntry &entry);
+
+/**
+ * Whether path is safe to extract below a root: relative, and without
+ * empty, "." or ".." components
+ */
+bool is_valid_tree_path(const std::string &path);
+
+/**
+ * List a directory tree with several threads
+ *
+ * Each walker takes a directory off a shared queue, lists it and queues the
+ * subdirectories it finds, so wide trees are listed with as many stats in
+ * flight as there are walkers. Symbolic links, sockets, FIFOs and devices
+ * are skipped. Entries are returned sorted by path, which puts every
+ * directory before its contents.
+ *
+ * @param root Directory to list; not itself part of the result
+ * @param walkers Number of threads listing directories
+ * @return Pair of (entries, FileOperationResult)
+ */
+std::pair<std::vector<TreeEntry>, FileOperationResult>
+walk_tree(const std::string &root, size_t walkers = DEFAULT_TREE_WALKERS);
+
+/**
+ * @class TreeArchiveSource
+ * @brief Streams a directory tree as one archive of headers and bodies
+ *
+ * The listing is taken up front so the archive size is known before the
+ * first byte is sent. Files are opened one at a time as the stream reaches
+ * them and read like any other payload, so deduplicated and packed files
+ * are sent with their contents and checksums are verified on the way. A
+ * file that grew since the listing is cut at its listed size, and one that
+ * shrank, vanished or could not be read is padded with zeros to it, so the
+ * stream always matches its headers and announced size.
+ */
+class TreeArchiveSource : public PayloadSource {
+  public:
+    /**
+     * @brief Constructor
+     * @param root Directory the entry paths are relative to
+     * @param entries Entries to send, parents before their contents
+     */
+    TreeArchiveSource(std::string root, std::vector<TreeEntry> entries);
+
+    uint64_t size() const override;
+    bool read(uint8_t *buffer, size_t size) override;
+
+    /**
+     * @brief Entries in the archive
+     */
+    const std::vector<TreeEntry> &entries() const;
+
+    /**
+     * @brief Number of files padded so far because they changed since the
+     * listing
+     */
+    uint64_t padded_files() const;
+
+  private:
+    // Move on to the next entry, opening its body
+    bool next_entry();
+
+    std::string m_root;
+    std::vector<TreeEntry> m_entries;
+    uint64_t m_size{0};
+
+    // Entry being sent, its encoded header and what is left of both
+    size_t m_index{0};
+    std::string m_header;
+    size_t m_header_offset{0};
+    uint64_t m_body_remaining{0};
+    // File being sent and how much of the body it still holds; the rest is
+    // zeros
+    std::unique_ptr<PayloadSource> m_body;
+    uint64_t m_body_available{0};
+    uint64_t m_padded{0};
+};
+
+/**
+ * Open a directory tree as an archive payload
+ *
+ * @param root Directory to send
+ * @param walkers Number of threads listing the tree
+ * @return Pair of (source, or nullptr on failure, FileOperationResult)
+ */
+std::pair<std::unique_ptr<TreeArchiveSource>, FileOperationResult>
+open_tree_archive(const std::string &root,
+                  size_t walkers = DEFAULT_TREE_WALKERS);
+
+/**
+ * @class TreeArchiveSink
+ * @brief Extracts a tree archive below a directory as it arrives
+ *
+ * Headers are parsed as their bytes come in and each body is written
+ * straight to its file, so an archive of any size is extracted with one
+ * payload frame in memory. Entries must name new paths below the root
+ * whose parent came earlier in the archive. Files are synced according to
+ * the durability mode, and directory permissions and times are applied by
+ * finish() once their contents are in place.
+ */
+class TreeArchiveSink : public PayloadSink {
+  public:
+    /**
+     * @brief Constructor
+     * @param root Existing directory to extract into
+     * @param store Store each file like write_file does: packed,
+     * deduplicated and checksummed according to the current policies
+     */
+    explicit TreeArchiveSink(std::string root, bool store = false);
+
+    ~TreeArchiveSink() override;
+
+    TreeArchiveSink(const TreeArchiveSink &) = delete;
+    TreeArchiveSink &operator=(const TreeArchiveSink &) = delete;
+
+    bool write(const uint8_t *data, size_t size) override;
+
+    /**
+     * @brief Check that the archive ended after a whole entry and apply
+     * the directory attributes
+     * @return FileOperationResult of the extraction
+     */
+    FileOperationResult finish();
+
+    /**
+     * @brief Number of directories and files extracted so far
+     */
+    uint64_t directories() const;
+    uint64_t files() const;
+
+    /**
+     * @brief Bytes of file contents extracted so far
+     */
+    uint64_t bytes() const;
+
+  private:
+    // Act on a complete header
+    bool start_entry();
+
+    // Close the current file once its body is complete
+    bool finish_file();
+
+    // Record the first failure; later writes are ignored
+    bool fail(FileOperationResult result);
+
+    std::string m_root;
+    bool m_store;
+    FileOperationResult m_result{FileOperationResult::SUCCESS};
+
+    // Header being assembled, and the entry it describes once complete
+    std::string m_header;
+    TreeEntry m_entry;
+
+    // File being written and what is left of its body
+    int m_fd{-1};
+    uint64_t m_body_remaining{0};
+    std::unique_ptr<FilePayloadSink> m_file;
+    ChecksumBuilder m_checksums;
+
+    // Directories created, in archive order
+    std::vector<TreeEntry> m_directories;
+    uint64_t m_files{0};
+    uint64_t m_bytes{0};
+};
+
+/**
+ * Extract a tree archive sent as a request body into a staging directory
+ *
+ * The staging directory is created next to directory and stays invisible
+ * until commit_staging_directory, so the archive can be read from a slow
+ * client without holding anything up. A failed extraction leaves nothing
+ * behind.
+ *
+ * @param directory Path of the directory the tree will become; must not
+ * exist
+ * @param payload Archive to extract
+ * @return Pair of (staging directory, FileOperationResult)
+ */
+std::pair<std::string, FileOperationResult>
+stage_tree_from_payload(const std::string &directory,
+                        IncomingPayload &payload);
+
+/**
+ * Create a directory from a tree archive sent as a request body
+ *
+ * The tree is extracted into a staging directory next to directory and
+ * renamed into place once complete, so an interrupted or rejected upload
+ * never leaves a partial tree behind.
+ *
+ * @param directory Path of the directory to create; must not exist
+ * @param payload Archive to extract
+ * @return FileOperationResult indicating success or failure
+ */
+FileOperationResult extract_tree_from_payload(const std::string &directory,
+                                              IncomingPayload &payload);
+
+} // namespace common
+} // namespace fenris
+
+#endif // FENRIS_COMMON_TREE_ARCHIVE_HPP
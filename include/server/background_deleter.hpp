@@ -0,0 +1,108 @@
+#ifndef FENRIS_SERVER_BACKGROUND_DELETER_HPP
+#define FENRIS_SERVER_BACKGROUND_DELETER_HPP
+
+#include "common/file_operations.hpp"
+#include "common/logging.hpp"
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace fenris {
+namespace server {
+
+/**
+ * @class BackgroundDeleter
+ * @brief Removes directory trees off the request path
+ *
+ * A tree is first renamed into a private trash directory, which is a single
+ * atomic step, and the space is reclaimed later by a small pool of idle
+ * priority threads. Unlinks are rate limited across the pool so a large
+ * delete cannot starve foreground I/O. Anything left in the trash by a
+ * previous run is reclaimed when the pool starts.
+ */
+class BackgroundDeleter {
+  public:
+    /**
+     * @brief Constructor
+     * @param trash_dir Directory holding trees waiting to be reclaimed; it
+     * should be on the same filesystem as the trees being deleted
+     * @param num_threads Number of reclaim threads
+     * @param max_unlinks_per_second Upper bound on unlinks across all threads
+     * @param logger_name Name for the logger instance
+     */
+    explicit BackgroundDeleter(
+        const std::string &trash_dir,
+        size_t num_threads = 2,
+        size_t max_unlinks_per_second = 20000,
+        const std::string &logger_name = "BackgroundDeleter");
+
+    /**
+     * @brief Destructor; stops the pool, leaving unfinished trees in trash
+     */
+    ~BackgroundDeleter();
+
+    BackgroundDeleter(const BackgroundDeleter &) = delete;
+    BackgroundDeleter &operator=(const BackgroundDeleter &) = delete;
+
+    /**
+     * @brief Move a file or directory into the trash and schedule reclaim
+     * @param path Path to delete
+     * @return FileOperationResult of the rename; falls back to deleting
+     * synchronously if the path is on another filesystem than the trash
+     */
+    common::FileOperationResult remove(const std::string &path);
+
+    /**
+     * @brief Number of trees waiting for or undergoing reclaim
+     */
+    size_t pending() const;
+
+    /**
+     * @brief Stop the reclaim threads
+     */
+    void stop();
+
+  private:
+    // Create the trash directory and start the pool on first use
+    bool start();
+
+    void worker();
+
+    // Unlink everything below parent_fd/name, then name itself
+    bool remove_tree(int parent_fd, const std::string &name);
+
+    // Block until the rate limit allows one more unlink
+    void throttle();
+
+    std::string m_trash_dir;
+    size_t m_num_threads;
+    std::chrono::nanoseconds m_unlink_interval;
+
+    common::Logger m_logger;
+
+    mutable std::mutex m_mutex;
+    std::condition_variable m_condition;
+    // Trash entry names waiting to be reclaimed
+    std::deque<std::string> m_queue;
+    size_t m_active{0};
+    bool m_started{false};
+    std::atomic<bool> m_stopping{false};
+    uint64_t m_sequence{0};
+    std::vector<std::thread> m_threads;
+
+    // Earliest time the next unlink may run
+    std::mutex m_throttle_mutex;
+    std::chrono::steady_clock::time_point m_next_unlink;
+};
+
+} // namespace server
+} // namespace fenris
+
+#endif // FENRIS_SERVER_BACKGROUND_DELETER_HPP
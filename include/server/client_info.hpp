@@ -1,7 +1,10 @@
 #ifndef FENRIS_CLIENT_INFO_HPP
 #define FENRIS_CLIENT_INFO_HPP
 
+#include "common/payload.hpp"
+
 #include <atomic>
+#include <condition_variable>
 #include <cstdint>
 #include <memory>
 #include <mutex>
@@ -12,6 +15,12 @@ namespace fenris {
 namespace server {
 
 const std::string DEFAULT_SERVER_DIR = "/fenris_server";
+// Trees deleted in the background wait here, outside the client namespace
+const std::string DEFAULT_TRASH_DIR = DEFAULT_SERVER_DIR + ".trash";
+// Chunks and manifests of deduplicated files (see common/chunk_store.hpp)
+const std::string DEFAULT_CHUNK_STORE_DIR = DEFAULT_SERVER_DIR + ".chunks";
+// Pack files holding the contents of small files (see common/pack_store.hpp)
+const std::string DEFAULT_PACK_STORE_DIR = DEFAULT_SERVER_DIR + ".packs";
 
 struct Node {
     std::string name;
@@ -20,6 +29,22 @@ struct Node {
     std::weak_ptr<Node> parent;
     std::atomic<int> access_count{0};
     std::mutex node_mutex;
+
+    // Signalled when access_count drops; only ever locked on its own
+    std::mutex access_mutex;
+    std::condition_variable access_condition;
+
+    // Drop an access taken with access_count++ and wake anyone waiting for
+    // the node to become unused
+    void release();
+
+    // Wait until no access is in progress, without holding any lock
+    void wait_unused();
+
+    // Lock node_mutex with no access in progress. Accesses are taken under
+    // node_mutex, so none can start while the lock is held; node_mutex is
+    // released while waiting, so other operations on the node go on
+    std::unique_lock<std::mutex> lock_unused();
 };
 
 class FileSystemTree {
@@ -32,6 +57,9 @@ class FileSystemTree {
     // Removes a node from the tree
     bool remove_node(const std::string &path);
 
+    // Moves the node at from, with its subtree, to the path to
+    bool move_node(const std::string &from, const std::string &to);
+
     // Finds a node by its path
     std::shared_ptr<Node> find_node(const std::string &path);
 
@@ -65,6 +93,13 @@ struct ClientInfo {
     std::shared_ptr<Node>
         current_node; // Pointer to the current node in the file system tree
 
+    // Body of the current request, left undecoded until the handler reads
+    // it; anything left unread is discarded after the handler returns
+    std::shared_ptr<common::IncomingPayload> request_payload;
+
+    // Raw payload sent after the current response, bypassing protobuf
+    std::shared_ptr<common::PayloadSource> response_payload;
+
     ClientInfo(uint32_t client_id, uint32_t client_socket)
         : client_id(client_id), socket(client_socket), keep_connection(true),
           current_node(nullptr)
@@ -83,7 +118,7 @@ struct ClientInfo {
     {
         // Ensure that current_node is root before deleting the client info
         if (current_node) {
-            current_node->access_count--;
+            current_node->release();
         }
     }
 };
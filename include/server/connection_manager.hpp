@@ -3,6 +3,7 @@
 
 #include "common/crypto_manager.hpp"
 #include "common/logging.hpp"
+#include "common/payload.hpp"
 #include "fenris.pb.h"
 #include "server/client_info.hpp"
 
@@ -20,6 +21,10 @@
 namespace fenris {
 namespace server {
 
+// Block sizes of the per-connection arena holding request/response messages
+constexpr size_t ARENA_INITIAL_BLOCK_SIZE = 64 * 1024;
+constexpr size_t ARENA_MAX_BLOCK_SIZE = 1024 * 1024;
+
 /**
  * @class IClientHandler
  * @brief Interface for handling client requests
@@ -38,6 +43,24 @@ class IClientHandler {
      */
     virtual fenris::Response handle_request(const fenris::Request &request,
                                             ClientInfo &client_info) = 0;
+
+    /**
+     * @brief Process a client request into a caller-owned response.
+     * @param request The deserialized client request.
+     * @param client_info Connection state of the requesting client.
+     * @param response Freshly constructed response to fill in. The connection
+     * manager allocates it on a per-connection arena, so handlers that build
+     * large messages should override this to avoid heap-allocating them.
+     *
+     * The request body is not decoded up front: request.data() is empty and
+     * the body waits in client_info.request_payload. The default
+     * implementation materializes it into a copy of the request for
+     * handle_request; overriding handlers can stream it or reject the
+     * request without reading it.
+     */
+    virtual void handle_request_into(const fenris::Request &request,
+                                     ClientInfo &client_info,
+                                     fenris::Response &response);
 };
 
 /**
@@ -93,6 +116,15 @@ class ConnectionManager {
      */
     size_t get_active_client_count() const;
 
+    /**
+     * @brief Set the compression dictionary sent to clients at handshake
+     * @param dictionary Preset zlib dictionary (empty disables compression)
+     *
+     * Small FILE_CONTENT payloads and directory listings are compressed with
+     * this dictionary before encryption.
+     */
+    void set_compression_dictionary(std::vector<uint8_t> dictionary);
+
     /**
      * @brief Send a response to a client
      * @param client_info ClientInfo struct containing client connection
@@ -107,17 +139,27 @@ class ConnectionManager {
                        const fenris::Response &response);
 
     /**
-     * @brief Receive a request from a client
+     * @brief Send the out-of-band payload announced by the last response
      * @param client_info ClientInfo struct containing client connection
      * information
-     * @return Optional containing the request if successfully received and
-     * decrypted
-     *
-     * This method extracts the IV from the first part of the message
-     * and uses it to decrypt the request data
+     * @param payload Source of the payload bytes
+     * @return true if send successful, false otherwise
      */
-    std::optional<fenris::Request>
-    receive_request(const ClientInfo &client_info);
+    bool send_payload(const ClientInfo &client_info,
+                      common::PayloadSource &payload);
+
+    /**
+     * @brief Receive a request without decoding its body
+     * @param client_info ClientInfo struct containing client connection
+     * information; its request_payload is set to the pending body
+     * @param request Message to parse every field but data into
+     * @param buffer Receive buffer; inline bodies point into it, so it must
+     * outlive the request_payload
+     * @return true if the request was received and decrypted, false otherwise
+     */
+    bool receive_request_header(ClientInfo &client_info,
+                                fenris::Request &request,
+                                std::vector<uint8_t> &buffer);
 
   private:
     /**
@@ -145,13 +187,33 @@ class ConnectionManager {
     void remove_client(uint32_t client_id);
 
     /**
-     * @brief Perform key exchange with client and save the encryption key in
-     * the client info struct
+     * @brief Perform key exchange with client, save the encryption key in
+     * the client info struct and send the compression dictionary
      * @param client_info ClientInfo struct containing client connection
      * @return true if key exchange was successful, false otherwise
      */
     bool perform_key_exchange(ClientInfo &client_info);
 
+    /**
+     * @brief Receive one encrypted message and decrypt it in place
+     * @param client_info ClientInfo struct containing client connection
+     * @param buffer Receive buffer holding the frame
+     * @param message Set to the start of the plaintext inside buffer
+     * @param message_size Set to the plaintext size
+     * @return true if a message was received and decrypted, false otherwise
+     */
+    bool receive_message(const ClientInfo &client_info,
+                         std::vector<uint8_t> &buffer,
+                         uint8_t *&message,
+                         size_t &message_size);
+
+    /**
+     * @brief Discard the unread part of the current request body
+     * @param client_info ClientInfo struct containing client connection
+     * @return false if the connection can no longer be used
+     */
+    bool finish_request_payload(ClientInfo &client_info);
+
     std::string m_hostname;
     std::string m_port;
     std::unique_ptr<IClientHandler> m_client_handler;
@@ -160,6 +222,7 @@ class ConnectionManager {
     std::thread m_listen_thread;
     bool m_non_blocking_mode;
     common::crypto::CryptoManager m_crypto_manager;
+    std::vector<uint8_t> m_compression_dictionary;
     common::Logger m_logger;
 
     // Client management
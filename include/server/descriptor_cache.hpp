@@ -0,0 +1,132 @@
+#ifndef FENRIS_SERVER_DESCRIPTOR_CACHE_HPP
+#define FENRIS_SERVER_DESCRIPTOR_CACHE_HPP
+
+#include "server/client_info.hpp"
+
+#include <cstddef>
+#include <cstdint>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+namespace fenris {
+namespace server {
+
+// Descriptors held open by the handler's cache
+constexpr size_t DEFAULT_DESCRIPTOR_CACHE_SIZE = 512;
+
+/**
+ * @class Descriptor
+ * @brief Open file descriptor, closed when the last holder releases it
+ */
+class Descriptor {
+  public:
+    explicit Descriptor(int fd);
+    ~Descriptor();
+
+    Descriptor(const Descriptor &) = delete;
+    Descriptor &operator=(const Descriptor &) = delete;
+
+    int get() const;
+
+  private:
+    int m_fd;
+};
+
+/**
+ * @class DescriptorCache
+ * @brief Bounded LRU cache of open descriptors of FST nodes
+ *
+ * Directories are held open so operations on their entries resolve a
+ * single path component with openat, fstatat or unlinkat instead of the
+ * whole path, and recently read files are held open read-only so repeated
+ * reads skip open and close. Small files are prefetched into the page cache
+ * when they are first opened. Entries hold a reference to their node, so a
+ * node freed and reallocated at the same address is never mistaken for a
+ * cached one.
+ *
+ * A descriptor follows its file or directory across renames. Callers must
+ * invalidate a file whose contents they replace (atomic writes put a new
+ * file in its place) or delete, and clear the cache when they remove a
+ * directory tree, whose descriptors would otherwise keep it allocated.
+ */
+class DescriptorCache {
+  public:
+    /**
+     * @brief Constructor
+     * @param capacity Maximum number of descriptors held open
+     */
+    explicit DescriptorCache(size_t capacity = DEFAULT_DESCRIPTOR_CACHE_SIZE);
+
+    /**
+     * @brief Get the descriptor of a directory, opening it on a miss
+     * @param node FST node of the directory
+     * @param path Absolute path of the directory, used only on a miss
+     * @return Descriptor, or nullptr if the directory cannot be opened
+     */
+    std::shared_ptr<const Descriptor>
+    directory(const std::shared_ptr<Node> &node, const std::string &path);
+
+    /**
+     * @brief Get a read-only descriptor of a file, opening it on a miss
+     * @param node FST node of the file
+     * @param dirfd Descriptor of the directory holding the file
+     * @param name Name of the file in that directory
+     * @return Descriptor, or nullptr if the file cannot be opened
+     */
+    std::shared_ptr<const Descriptor> file(const std::shared_ptr<Node> &node,
+                                           int dirfd,
+                                           const std::string &name);
+
+    /**
+     * @brief Drop the descriptor of a node, if cached
+     *
+     * Holders of the descriptor keep it open until they release it.
+     */
+    void invalidate(const std::shared_ptr<Node> &node);
+
+    /**
+     * @brief Drop every cached descriptor
+     */
+    void clear();
+
+    /**
+     * @brief Number of cached descriptors
+     */
+    size_t size() const;
+
+  private:
+    struct Entry {
+        std::shared_ptr<Node> node;
+        std::shared_ptr<const Descriptor> descriptor;
+        std::list<const Node *>::iterator position;
+    };
+
+    // Return a cached descriptor and mark it most recently used
+    std::shared_ptr<const Descriptor> lookup(const Node *node);
+
+    // Cache a freshly opened descriptor unless an invalidation happened
+    // since generation was read
+    std::shared_ptr<const Descriptor> insert(const std::shared_ptr<Node> &node,
+                                             int fd,
+                                             uint64_t generation);
+
+    std::unordered_map<const Node *, Entry> m_entries;
+
+    // Most recently used first
+    std::list<const Node *> m_lru_list;
+
+    // Bumped by every invalidation, so a descriptor opened before one is
+    // not cached after it
+    uint64_t m_generation{0};
+
+    size_t m_capacity;
+    mutable std::mutex m_mutex;
+};
+
+} // namespace server
+} // namespace fenris
+
+#endif // FENRIS_SERVER_DESCRIPTOR_CACHE_HPP
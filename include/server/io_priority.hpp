@@ -0,0 +1,18 @@
+#ifndef FENRIS_SERVER_IO_PRIORITY_HPP
+#define FENRIS_SERVER_IO_PRIORITY_HPP
+
+namespace fenris {
+namespace server {
+
+/**
+ * Give the calling thread the lowest CPU and I/O priority
+ *
+ * Only the calling thread is affected, so background work started from a
+ * dedicated thread yields to request handling.
+ */
+void lower_thread_priority();
+
+} // namespace server
+} // namespace fenris
+
+#endif // FENRIS_SERVER_IO_PRIORITY_HPP
@@ -0,0 +1,86 @@
+#ifndef FENRIS_SERVER_PACK_COMPACTOR_HPP
+#define FENRIS_SERVER_PACK_COMPACTOR_HPP
+
+#include "common/logging.hpp"
+#include "common/pack_store.hpp"
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+
+namespace fenris {
+namespace server {
+
+// Time between two background compactions of the pack store
+constexpr std::chrono::seconds DEFAULT_PACK_COMPACTION_INTERVAL{600};
+
+/**
+ * @class PackCompactor
+ * @brief Periodically compacts the pack store off the request path
+ *
+ * A single thread walks the client namespace every interval and moves the
+ * live records out of sparse packs. Packs retired by one pass are removed
+ * by the next, once it finds no placeholder still referring to them.
+ */
+class PackCompactor {
+  public:
+    /**
+     * @brief Constructor
+     * @param store Pack store to compact
+     * @param namespace_root Directory tree holding the placeholders
+     * @param interval Time between two compactions
+     * @param logger_name Name for the logger instance
+     */
+    PackCompactor(std::shared_ptr<common::PackStore> store,
+                  std::string namespace_root,
+                  std::chrono::seconds interval =
+                      DEFAULT_PACK_COMPACTION_INTERVAL,
+                  const std::string &logger_name = "PackCompactor");
+
+    /**
+     * @brief Destructor; stops the compaction thread
+     */
+    ~PackCompactor();
+
+    PackCompactor(const PackCompactor &) = delete;
+    PackCompactor &operator=(const PackCompactor &) = delete;
+
+    /**
+     * @brief Start the compaction thread
+     */
+    void start();
+
+    /**
+     * @brief Stop the compaction thread, waiting for a running pass
+     */
+    void stop();
+
+    /**
+     * @brief Number of compactions completed so far
+     */
+    uint64_t passes() const;
+
+  private:
+    void worker();
+
+    std::shared_ptr<common::PackStore> m_store;
+    std::string m_namespace_root;
+    std::chrono::seconds m_interval;
+
+    common::Logger m_logger;
+
+    mutable std::mutex m_mutex;
+    std::condition_variable m_condition;
+    bool m_stopping{false};
+    uint64_t m_passes{0};
+    std::thread m_thread;
+};
+
+} // namespace server
+} // namespace fenris
+
+#endif // FENRIS_SERVER_PACK_COMPACTOR_HPP
@@ -4,20 +4,30 @@
 #include "common/file_operations.hpp"
 #include "common/logging.hpp"
 #include "fenris.pb.h"
+#include "server/background_deleter.hpp"
 #include "server/client_info.hpp"
 #include "server/connection_manager.hpp"
+#include "server/descriptor_cache.hpp"
 
 namespace fenris {
 namespace server {
 
+// Upper bound on the entries returned by one paged LIST_DIR request
+constexpr uint32_t MAX_LIST_PAGE_SIZE = 10000;
+
 class ClientHandler : public IClientHandler {
   public:
     // Default constructor that uses the server's main logger
-    ClientHandler() : m_logger(common::get_logger("fenris_server")) {}
+    ClientHandler()
+        : m_logger(common::get_logger("fenris_server")),
+          m_deleter(DEFAULT_TRASH_DIR)
+    {
+    }
 
     // Constructor that accepts a specific logger name
     explicit ClientHandler(const std::string &logger_name)
-        : m_logger(common::get_logger(logger_name))
+        : m_logger(common::get_logger(logger_name)),
+          m_deleter(DEFAULT_TRASH_DIR, 2, 20000, logger_name)
     {
     }
 
@@ -41,14 +51,44 @@ class ClientHandler : public IClientHandler {
                       std::shared_ptr<Node> &current_node);
 
     fenris::Response handle_request(const fenris::Request &request,
-                                    ClientInfo &client_info);
+                                    ClientInfo &client_info) override;
+
+    void handle_request_into(const fenris::Request &request,
+                             ClientInfo &client_info,
+                             fenris::Response &response) override;
 
     // void initialize_file_system_tree();
 
     FileSystemTree FST;
 
   private:
+    // Add the directory at path, and everything below it on disk, to FST
+    void add_subtree(const std::string &path);
+
+    // Cached descriptor of the directory node at tree path directory_path
+    std::shared_ptr<const Descriptor>
+    directory_descriptor(const std::shared_ptr<Node> &directory,
+                         const std::string &directory_path);
+
+    // Cached read-only descriptor of the file node named name in directory
+    std::shared_ptr<const Descriptor>
+    file_descriptor(const std::shared_ptr<Node> &directory,
+                    const std::string &directory_path,
+                    const std::shared_ptr<Node> &file,
+                    const std::string &name);
+
+    // Fill response with one page of a paged LIST_DIR request
+    void handle_list_page(const fenris::Request &request,
+                          const std::string &absolute_filepath,
+                          fenris::Response &response);
+
     common::Logger m_logger;
+
+    // Reclaims directories deleted with DELETE_DIR's background flag
+    BackgroundDeleter m_deleter;
+
+    // Open descriptors of recently used directories and files
+    DescriptorCache m_descriptors;
 };
 
 } // namespace server
@@ -0,0 +1,108 @@
+#ifndef FENRIS_SERVER_SCRUBBER_HPP
+#define FENRIS_SERVER_SCRUBBER_HPP
+
+#include "common/logging.hpp"
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <thread>
+
+namespace fenris {
+namespace server {
+
+// Time between two scrubs of the client namespace
+constexpr std::chrono::seconds DEFAULT_SCRUB_INTERVAL{24 * 60 * 60};
+
+// Files modified more recently are not sealed, as they may still be
+// being written in place
+constexpr std::chrono::seconds DEFAULT_SEAL_GRACE_PERIOD{300};
+
+/**
+ * @struct ScrubStats
+ * @brief What a scrub of the client namespace found
+ */
+struct ScrubStats {
+    uint64_t files_checked{0};
+    uint64_t bytes_checked{0};
+    uint64_t files_corrupted{0};
+    uint64_t files_sealed{0};
+};
+
+/**
+ * @class Scrubber
+ * @brief Periodically verifies stored files against their checksums
+ *
+ * A single thread with the lowest CPU and I/O priority walks the client
+ * namespace every interval, verifies every file (see common/checksum.hpp)
+ * and logs the ones that no longer match. Plain files left without valid
+ * checksums by an in-place write are sealed once they have been quiet for
+ * the grace period, so they are covered by the next read and scrub.
+ */
+class Scrubber {
+  public:
+    /**
+     * @brief Constructor
+     * @param namespace_root Directory tree to scrub
+     * @param interval Time between two scrubs
+     * @param grace_period Files modified more recently are not sealed
+     * @param logger_name Name for the logger instance
+     */
+    Scrubber(std::string namespace_root,
+             std::chrono::seconds interval = DEFAULT_SCRUB_INTERVAL,
+             std::chrono::seconds grace_period = DEFAULT_SEAL_GRACE_PERIOD,
+             const std::string &logger_name = "Scrubber");
+
+    /**
+     * @brief Destructor; stops the scrub thread
+     */
+    ~Scrubber();
+
+    Scrubber(const Scrubber &) = delete;
+    Scrubber &operator=(const Scrubber &) = delete;
+
+    /**
+     * @brief Start the scrub thread
+     */
+    void start();
+
+    /**
+     * @brief Stop the scrub thread, abandoning a running scrub
+     */
+    void stop();
+
+    /**
+     * @brief Scrub the namespace once on the calling thread
+     * @return What the scrub found
+     */
+    ScrubStats scrub();
+
+    /**
+     * @brief Number of scrubs completed by the scrub thread so far
+     */
+    uint64_t passes() const;
+
+  private:
+    void worker();
+
+    bool stopping() const;
+
+    std::string m_namespace_root;
+    std::chrono::seconds m_interval;
+    std::chrono::seconds m_grace_period;
+
+    common::Logger m_logger;
+
+    mutable std::mutex m_mutex;
+    std::condition_variable m_condition;
+    bool m_stopping{false};
+    uint64_t m_passes{0};
+    std::thread m_thread;
+};
+
+} // namespace server
+} // namespace fenris
+
+#endif // FENRIS_SERVER_SCRUBBER_HPP
@@ -50,6 +50,16 @@ class Server {
      */
     void set_non_blocking_mode(bool enabled);
 
+    /**
+     * @brief Train a compression dictionary from files under a storage root
+     * @param root_dir Directory whose small files and listings are sampled
+     * @return Size of the trained dictionary in bytes (0 if none was built)
+     *
+     * The dictionary is sent to every client at handshake and used for
+     * small file contents and directory listings.
+     */
+    size_t train_compression_dictionary(const std::string &root_dir);
+
     /**
      * @brief Start the server
      * @return true if started successfully, false otherwise
@@ -1,9 +1,17 @@
 #include "client/client.hpp"
 #include "client/response_manager.hpp"
+#include "common/chunk_store.hpp"
+#include "common/delta.hpp"
 #include "common/logging.hpp"
+#include "common/payload.hpp"
+#include "common/tree_archive.hpp"
 #include <chrono>
+#include <fcntl.h>
+#include <filesystem>
 #include <iostream>
+#include <sys/stat.h>
 #include <thread>
+#include <unistd.h>
 
 namespace fenris {
 namespace client {
@@ -108,13 +116,48 @@ bool Client::process_command(const std::vector<std::string> &command_parts)
         return true;
     }
 
-    if (!m_connection_manager->send_request(request_opt.value())) {
+    auto &request = request_opt.value();
+    auto local_payload = m_request_manager.take_payload();
+    bool sent;
+    if (local_payload) {
+        // Large local files and trees are streamed from disk chunk by chunk
+        sent = m_connection_manager->send_request(request, *local_payload);
+    } else if (request.data().size() >= PAYLOAD_THRESHOLD) {
+        // Move large bodies out of the message and send them as raw
+        // payload frames instead
+        std::string body;
+        body.swap(*request.mutable_data());
+        BufferPayloadSource payload(body.data(), body.size());
+        sent = m_connection_manager->send_request(request, payload);
+    } else {
+        sent = m_connection_manager->send_request(request);
+    }
+
+    if (!sent) {
         m_logger->error("failed to send request to server");
         m_tui->display_result(false, "Failed to send request to server");
 
         return true;
     }
 
+    if (command_parts[0] == "download") {
+        return receive_download(command_parts[2]);
+    }
+
+    if (command_parts[0] == "pull") {
+        return receive_tree(command_parts[2]);
+    }
+
+    if (command_parts[0] == "sync") {
+        return sync_upload(command_parts[1], command_parts[2]);
+    }
+
+    if (command_parts[0] == "dedup") {
+        return dedup_upload(command_parts[1],
+                            command_parts[2],
+                            request.manifest());
+    }
+
     auto response_opt = m_connection_manager->receive_response();
     if (!response_opt.has_value()) {
         m_logger->error("failed to receive response from server");
@@ -144,6 +187,13 @@ bool Client::process_command(const std::vector<std::string> &command_parts)
                                       : "Operation failed");
     }
 
+    // Paged listings continue until the server stops returning a cursor
+    if (success && response.has_directory_listing() &&
+        !response.directory_listing().next_cursor().empty()) {
+        receive_remaining_pages(request,
+                                response.directory_listing().next_cursor());
+    }
+
     // Update current directory if it was a cd command that succeeded
     if (command_parts[0] == "cd" && success && command_parts.size() > 1) {
         m_tui->update_current_directory(response.data());
@@ -152,6 +202,345 @@ bool Client::process_command(const std::vector<std::string> &command_parts)
     return true;
 }
 
+void Client::receive_remaining_pages(fenris::Request request,
+                                     std::string cursor)
+{
+    while (!cursor.empty()) {
+        request.set_cursor(cursor);
+        if (!m_connection_manager->send_request(request)) {
+            m_logger->error("failed to send request to server");
+            m_tui->display_result(false, "Failed to send request to server");
+            return;
+        }
+
+        auto response_opt = m_connection_manager->receive_response();
+        if (!response_opt.has_value()) {
+            m_logger->error("failed to receive response from server");
+            m_tui->display_result(false,
+                                  "Failed to receive response from server");
+            return;
+        }
+
+        const auto &response = response_opt.value();
+        std::vector<std::string> formatted_response =
+            m_response_manager.handle_response(response);
+        bool success = (formatted_response.size() > 0 &&
+                        formatted_response[0] == "Success");
+        if (!success) {
+            for (size_t i = 1; i < formatted_response.size(); ++i) {
+                m_tui->display_result(false, formatted_response[i]);
+            }
+            return;
+        }
+
+        // A trailing empty page only marks the end of the listing
+        if (response.directory_listing().entries_size() > 0) {
+            for (size_t i = 1; i < formatted_response.size(); ++i) {
+                m_tui->display_result(true, formatted_response[i]);
+            }
+        }
+        cursor = response.directory_listing().next_cursor();
+    }
+}
+
+bool Client::receive_download(const std::string &local_path)
+{
+    // Download next to the target and rename over it only once the whole
+    // file has arrived, so a failed download leaves any old copy intact
+    std::filesystem::path target(local_path);
+    std::string staging =
+        (target.parent_path() / ("." + target.filename().string() + ".XXXXXX"))
+            .string();
+    int fd = mkostemp(staging.data(), O_CLOEXEC);
+    if (fd < 0) {
+        m_logger->error("could not open local file '{}' for download",
+                        local_path);
+        // The response still has to be drained from the connection
+        DiscardPayloadSink discard_sink;
+        m_connection_manager->receive_response(discard_sink);
+        m_tui->display_result(false, "Could not open local file");
+
+        return true;
+    }
+
+    // The payload goes straight from the socket to the local file
+    FilePayloadSink sink(fd);
+    auto response_opt = m_connection_manager->receive_response(sink);
+    bool success = response_opt.has_value() && response_opt->success();
+    uint64_t size = 0;
+    if (success) {
+        const auto &data = response_opt->data();
+        size = response_opt->payload_size();
+        if (size == 0) {
+            // Small files arrive inline
+            size = data.size();
+            success = sink.write(reinterpret_cast<const uint8_t *>(data.data()),
+                                 data.size());
+        }
+    }
+    if (success) {
+        // Keep the permissions of the file being replaced
+        struct stat st;
+        mode_t mode = stat(local_path.c_str(), &st) == 0 ? st.st_mode & 07777
+                                                          : 0644;
+        success = fchmod(fd, mode) == 0;
+    }
+    if (close(fd) != 0) {
+        success = false;
+    }
+    if (success && rename(staging.c_str(), local_path.c_str()) != 0) {
+        m_logger->error("could not replace local file '{}'", local_path);
+        success = false;
+    }
+    if (!success) {
+        unlink(staging.c_str());
+    }
+
+    if (!response_opt.has_value()) {
+        m_logger->error("failed to receive response from server");
+        m_tui->display_result(false, "Failed to receive response from server");
+    } else if (!success) {
+        m_tui->display_result(false,
+                              response_opt->error_message().empty()
+                                  ? "Download failed"
+                                  : response_opt->error_message());
+    } else {
+        m_tui->display_result(true,
+                              "Downloaded " + std::to_string(size) +
+                                  " bytes to " + local_path);
+    }
+
+    return true;
+}
+
+bool Client::receive_tree(const std::string &local_path)
+{
+    namespace fs = std::filesystem;
+    std::error_code ec;
+    if (!fs::create_directory(local_path, ec)) {
+        m_logger->error("could not create local directory '{}' for download",
+                        local_path);
+        // The response still has to be drained from the connection
+        DiscardPayloadSink discard_sink;
+        m_connection_manager->receive_response(discard_sink);
+        m_tui->display_result(false, "Could not create local directory");
+
+        return true;
+    }
+
+    // Entries are extracted as their bytes arrive from the socket
+    TreeArchiveSink sink(local_path);
+    auto response_opt = m_connection_manager->receive_response(sink);
+    bool success = response_opt.has_value() && response_opt->success();
+    if (success && response_opt->payload_size() == 0) {
+        // Small trees arrive inline
+        const auto &data = response_opt->data();
+        success = sink.write(reinterpret_cast<const uint8_t *>(data.data()),
+                             data.size());
+    }
+    auto result = sink.finish();
+    if (success && result != FileOperationResult::SUCCESS) {
+        m_logger->error("could not extract tree into '{}': {}",
+                        local_path,
+                        file_operation_result_to_string(result));
+        success = false;
+    }
+
+    if (!success) {
+        // Nothing of a failed download is kept
+        fs::remove_all(local_path, ec);
+    }
+
+    if (!response_opt.has_value()) {
+        m_logger->error("failed to receive response from server");
+        m_tui->display_result(false, "Failed to receive response from server");
+    } else if (!success) {
+        m_tui->display_result(false,
+                              response_opt->error_message().empty()
+                                  ? "Download failed"
+                                  : response_opt->error_message());
+    } else {
+        m_tui->display_result(
+            true,
+            "Downloaded " + std::to_string(sink.directories()) +
+                " directories and " + std::to_string(sink.files()) +
+                " files (" + std::to_string(sink.bytes()) + " bytes) to " +
+                local_path);
+    }
+
+    return true;
+}
+
+bool Client::sync_upload(const std::string &local_path,
+                         const std::string &remote_filename)
+{
+    std::string encoded;
+    BufferPayloadSink signature_sink(encoded);
+    auto response_opt = m_connection_manager->receive_response(signature_sink);
+    if (!response_opt.has_value()) {
+        m_logger->error("failed to receive response from server");
+        m_tui->display_result(false, "Failed to receive response from server");
+
+        return true;
+    }
+    if (response_opt->payload_size() == 0) {
+        encoded = response_opt->data();
+    }
+
+    fenris::FileSignature signature;
+    if (!response_opt->success() || !signature.ParseFromString(encoded)) {
+        m_logger->info("no usable signature for '{}', uploading whole file",
+                       remote_filename);
+        return process_command({"upload", local_path, remote_filename});
+    }
+
+    // The delta is spooled to an anonymous scratch file, since it can be
+    // as large as the local file when little of it matches
+    int fd = open(std::filesystem::temp_directory_path().c_str(),
+                  O_RDWR | O_TMPFILE | O_CLOEXEC,
+                  0600);
+    if (fd < 0) {
+        m_logger->warn("could not create scratch file for delta");
+        return process_command({"upload", local_path, remote_filename});
+    }
+    FilePayloadSink delta_sink(fd);
+    auto [stats, result] = compute_delta(local_path, signature, delta_sink);
+    if (result != FileOperationResult::SUCCESS) {
+        close(fd);
+        m_logger->error("could not compute delta for '{}'", local_path);
+        m_tui->display_result(false, "Could not read local file");
+
+        return true;
+    }
+    if (stats.delta_bytes >= stats.literal_bytes + stats.copied_bytes) {
+        close(fd);
+        m_logger->info("delta for '{}' saves nothing, uploading whole file",
+                       remote_filename);
+        return process_command({"upload", local_path, remote_filename});
+    }
+
+    m_logger->info("sending {} byte delta ({} literal, {} reused bytes)",
+                   stats.delta_bytes,
+                   stats.literal_bytes,
+                   stats.copied_bytes);
+    fenris::Request patch;
+    patch.set_command(fenris::RequestType::PATCH_FILE);
+    patch.set_filename(remote_filename);
+    FilePayloadSource delta(fd, stats.delta_bytes);
+    if (!m_connection_manager->send_request(patch, delta)) {
+        m_logger->error("failed to send request to server");
+        m_tui->display_result(false, "Failed to send request to server");
+
+        return true;
+    }
+
+    auto patch_response = m_connection_manager->receive_response();
+    if (!patch_response.has_value()) {
+        m_logger->error("failed to receive response from server");
+        m_tui->display_result(false, "Failed to receive response from server");
+
+        return true;
+    }
+    if (!patch_response->success()) {
+        // Most likely the remote file changed after its signature was taken
+        m_logger->warn("server rejected delta for '{}': {}",
+                       remote_filename,
+                       patch_response->error_message());
+        return process_command({"upload", local_path, remote_filename});
+    }
+
+    m_tui->display_result(true,
+                          "Synced " + remote_filename + ": sent " +
+                              std::to_string(stats.delta_bytes) + " of " +
+                              std::to_string(stats.literal_bytes +
+                                             stats.copied_bytes) +
+                              " bytes");
+
+    return true;
+}
+
+bool Client::dedup_upload(const std::string &local_path,
+                          const std::string &remote_filename,
+                          const fenris::ChunkManifest &manifest)
+{
+    std::string present;
+    BufferPayloadSink present_sink(present);
+    auto response_opt = m_connection_manager->receive_response(present_sink);
+    if (!response_opt.has_value()) {
+        m_logger->error("failed to receive response from server");
+        m_tui->display_result(false, "Failed to receive response from server");
+
+        return true;
+    }
+    if (response_opt->payload_size() == 0) {
+        present = response_opt->data();
+    }
+
+    if (!response_opt->success() ||
+        present.size() != static_cast<size_t>(manifest.lengths_size())) {
+        m_logger->info("server does not deduplicate '{}', uploading whole "
+                       "file",
+                       remote_filename);
+        return process_command({"upload", local_path, remote_filename});
+    }
+
+    std::vector<uint32_t> missing;
+    for (size_t i = 0; i < present.size(); i++) {
+        if (present[i] == 0) {
+            missing.push_back(static_cast<uint32_t>(i));
+        }
+    }
+
+    auto [file, result] = map_file(local_path);
+    if (result != FileOperationResult::SUCCESS) {
+        m_logger->error("could not read local file '{}'", local_path);
+        m_tui->display_result(false, "Could not read local file");
+
+        return true;
+    }
+
+    m_logger->info("sending {} of {} chunks",
+                   missing.size(),
+                   manifest.lengths_size());
+    fenris::Request put;
+    put.set_command(fenris::RequestType::PUT_CHUNKS);
+    put.set_filename(remote_filename);
+    *put.mutable_manifest() = manifest;
+    ChunkUploadSource chunks(file, manifest, std::move(missing));
+    bool sent = chunks.size() > 0
+                    ? m_connection_manager->send_request(put, chunks)
+                    : m_connection_manager->send_request(put);
+    if (!sent) {
+        m_logger->error("failed to send request to server");
+        m_tui->display_result(false, "Failed to send request to server");
+
+        return true;
+    }
+
+    auto put_response = m_connection_manager->receive_response();
+    if (!put_response.has_value()) {
+        m_logger->error("failed to receive response from server");
+        m_tui->display_result(false, "Failed to receive response from server");
+
+        return true;
+    }
+    if (!put_response->success()) {
+        // The local file changed, or the server lost chunks in between
+        m_logger->warn("server rejected chunks for '{}': {}",
+                       remote_filename,
+                       put_response->error_message());
+        return process_command({"upload", local_path, remote_filename});
+    }
+
+    m_tui->display_result(true,
+                          "Uploaded " + remote_filename + ": sent " +
+                              std::to_string(chunks.size()) + " of " +
+                              std::to_string(manifest.file_size()) +
+                              " bytes");
+
+    return true;
+}
+
 void Client::run()
 {
     m_logger->info("fenris client starting");
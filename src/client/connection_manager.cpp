@@ -1,6 +1,8 @@
 #include "client/connection_manager.hpp"
+#include "common/compression_manager.hpp"
 #include "common/logging.hpp"
 #include "common/network_utils.hpp"
+#include "common/payload.hpp"
 #include "common/request.hpp"
 #include "common/response.hpp"
 #include "fenris.pb.h"
@@ -214,6 +216,20 @@ bool ConnectionManager::perform_key_exchange()
 
     // Set the derived key in the crypto manager
     m_server_info.encryption_key = std::move(derived_key);
+
+    // The server follows up with the dictionary for compressed responses
+    auto dictionary_response = receive_response();
+    if (!dictionary_response.has_value() ||
+        dictionary_response->type() != fenris::ResponseType::DICTIONARY) {
+        m_logger->error("failed to receive compression dictionary");
+        return false;
+    }
+    m_server_info.compression_dictionary.assign(
+        dictionary_response->data().begin(),
+        dictionary_response->data().end());
+    m_logger->debug("received {} byte compression dictionary",
+                    m_server_info.compression_dictionary.size());
+
     return true;
 }
 
@@ -247,7 +263,14 @@ bool ConnectionManager::send_request(const fenris::Request &request)
         return false;
     }
 
-    std::vector<uint8_t> serialized_request = serialize_request(request);
+    // Serialize straight into the frame, leaving room for the size prefix
+    // and IV in front and the authentication tag behind
+    constexpr size_t headroom = FRAME_HEADER_SIZE + AES_GCM_IV_SIZE;
+    std::vector<uint8_t> frame;
+    if (!serialize_request_into(request, frame, headroom, AES_GCM_TAG_SIZE)) {
+        m_logger->error("failed to serialize request");
+        return false;
+    }
 
     // Generate a random IV
     auto [iv, iv_gen_result] = m_crypto_manager.generate_random_iv();
@@ -256,30 +279,23 @@ bool ConnectionManager::send_request(const fenris::Request &request)
                         crypto::encryption_result_to_string(iv_gen_result));
         return false;
     }
-
-    // Encrypt the serialized request
-    auto [encrypted_request, encrypt_result] =
-        m_crypto_manager.encrypt_data(serialized_request,
-                                      m_server_info.encryption_key,
-                                      iv);
+    std::copy(iv.begin(), iv.end(), frame.begin() + FRAME_HEADER_SIZE);
+
+    // Encrypt the serialized request in place
+    auto encrypt_result = m_crypto_manager.encrypt_in_place(
+        frame.data() + headroom,
+        frame.size() - headroom - AES_GCM_TAG_SIZE,
+        m_server_info.encryption_key,
+        frame.data() + FRAME_HEADER_SIZE);
     if (encrypt_result != crypto::EncryptionResult::SUCCESS) {
         m_logger->error("failed to encrypt request: {}",
                         crypto::encryption_result_to_string(encrypt_result));
         return false;
     }
 
-    // Create the final message with IV prefixed to encrypted data
-    std::vector<uint8_t> message_with_iv;
-    message_with_iv.reserve(iv.size() + encrypted_request.size());
-    message_with_iv.insert(message_with_iv.end(), iv.begin(), iv.end());
-    message_with_iv.insert(message_with_iv.end(),
-                           encrypted_request.begin(),
-                           encrypted_request.end());
-
     // Send the IV-prefixed encrypted request
-    NetworkResult send_result = send_prefixed_data(m_server_info.socket,
-                                                   message_with_iv,
-                                                   m_non_blocking_mode);
+    NetworkResult send_result =
+        send_frame(m_server_info.socket, frame, m_non_blocking_mode);
     if (send_result != NetworkResult::SUCCESS) {
         m_logger->error("failed to send encrypted request: {}",
                         network_result_to_string(send_result));
@@ -289,7 +305,86 @@ bool ConnectionManager::send_request(const fenris::Request &request)
     return true;
 }
 
+bool ConnectionManager::send_request(const fenris::Request &request,
+                                     PayloadSource &payload)
+{
+    fenris::Request header(request);
+    header.set_payload_size(payload.size());
+    if (!send_request(header)) {
+        return false;
+    }
+
+    PayloadResult result = send_payload(m_server_info.socket,
+                                        payload,
+                                        m_crypto_manager,
+                                        m_server_info.encryption_key,
+                                        m_non_blocking_mode);
+    if (result != PayloadResult::SUCCESS) {
+        m_logger->error("failed to send request payload: {}",
+                        payload_result_to_string(result));
+        return false;
+    }
+
+    return true;
+}
+
 std::optional<fenris::Response> ConnectionManager::receive_response()
+{
+    auto response = receive_response_header();
+    if (!response || response->payload_size() == 0) {
+        return response;
+    }
+
+    // The size comes from the server; refuse to hold more than the cap,
+    // but still drain the frames so the next response can be read
+    if (response->payload_size() > MAX_BUFFERED_RESPONSE_SIZE) {
+        m_logger->error("{} byte response payload is too large to buffer",
+                        response->payload_size());
+        DiscardPayloadSink discard;
+        if (!receive_response_payload(*response, discard)) {
+            return std::nullopt;
+        }
+        response->set_type(fenris::ResponseType::ERROR);
+        response->set_success(false);
+        response->set_error_message("Response too large; use download");
+        response->clear_payload_size();
+        return response;
+    }
+
+    // Large bodies follow the response as raw payload frames
+    std::string *data = response->mutable_data();
+    data->clear();
+    try {
+        data->reserve(response->payload_size());
+    } catch (const std::exception &) {
+        m_logger->error("cannot allocate {} byte response payload",
+                        response->payload_size());
+        return std::nullopt;
+    }
+    BufferPayloadSink sink(*data);
+    if (!receive_response_payload(*response, sink)) {
+        return std::nullopt;
+    }
+
+    return response;
+}
+
+std::optional<fenris::Response>
+ConnectionManager::receive_response(PayloadSink &sink)
+{
+    auto response = receive_response_header();
+    if (!response || response->payload_size() == 0) {
+        return response;
+    }
+
+    if (!receive_response_payload(*response, sink)) {
+        return std::nullopt;
+    }
+
+    return response;
+}
+
+std::optional<fenris::Response> ConnectionManager::receive_response_header()
 {
     if (!m_connected || m_server_info.socket == -1) {
         m_logger->error("cannot receive response: not connected to server");
@@ -315,20 +410,15 @@ std::optional<fenris::Response> ConnectionManager::receive_response()
         return std::nullopt;
     }
 
-    // Extract IV from the beginning of the message
-    std::vector<uint8_t> iv(encrypted_data.begin(),
-                            encrypted_data.begin() + AES_GCM_IV_SIZE);
-
-    // Extract the encrypted response data (after the IV)
-    std::vector<uint8_t> encrypted_response(encrypted_data.begin() +
-                                                AES_GCM_IV_SIZE,
-                                            encrypted_data.end());
-
-    // Decrypt the response using the extracted IV
-    auto [decrypted_data, decrypt_result] =
-        m_crypto_manager.decrypt_data(encrypted_response,
-                                      m_server_info.encryption_key,
-                                      iv);
+    // Decrypt the response in place; the IV leads the message and the
+    // plaintext overwrites the ciphertext that follows it
+    uint8_t *encrypted_response = encrypted_data.data() + AES_GCM_IV_SIZE;
+    size_t encrypted_size = encrypted_data.size() - AES_GCM_IV_SIZE;
+    auto decrypt_result =
+        m_crypto_manager.decrypt_in_place(encrypted_response,
+                                          encrypted_size,
+                                          m_server_info.encryption_key,
+                                          encrypted_data.data());
 
     if (decrypt_result != crypto::EncryptionResult::SUCCESS) {
         m_logger->error("failed to decrypt response: {}",
@@ -337,7 +427,36 @@ std::optional<fenris::Response> ConnectionManager::receive_response()
     }
 
     // Deserialize the response
-    return deserialize_response(decrypted_data);
+    fenris::Response response =
+        deserialize_response(encrypted_response,
+                             encrypted_size - AES_GCM_TAG_SIZE);
+    if (!decompress_response(response,
+                             m_server_info.compression_dictionary,
+                             compress::DICTIONARY_PAYLOAD_LIMIT)) {
+        m_logger->error("failed to decompress response payload");
+        return std::nullopt;
+    }
+
+    return response;
+}
+
+bool ConnectionManager::receive_response_payload(
+    const fenris::Response &response,
+    PayloadSink &sink)
+{
+    PayloadResult result = receive_payload(m_server_info.socket,
+                                           response.payload_size(),
+                                           sink,
+                                           m_crypto_manager,
+                                           m_server_info.encryption_key,
+                                           m_non_blocking_mode);
+    if (result != PayloadResult::SUCCESS) {
+        m_logger->error("failed to receive response payload: {}",
+                        payload_result_to_string(result));
+        return false;
+    }
+
+    return true;
 }
 
 } // namespace client
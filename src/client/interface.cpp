@@ -13,36 +13,73 @@ TUI::TUI() : curr_dir("/")
 {
     // Initialize valid command prefixes
     valid_commands = {
-        "cd",     // Change directory
-        "ls",     // List directory
-        "cat",    // Display file contents
-        "upload", // Upload file
-        "ping",   // Ping server
-        "write",  // Write to file
-        "append", // Append to file
-        "rm",     // Remove file
-        "info",   // Get file info
-        "mkdir",  // Create directory
-        "rmdir",  // Remove directory
-        "help",   // Display help information
-        "exit"    // Exit client
+        "cd",       // Change directory
+        "ls",       // List directory
+        "cat",      // Display file contents
+        "upload",   // Upload file
+        "download", // Download file
+        "sync",     // Upload only the changed parts of a file
+        "dedup",    // Upload only chunks the server does not store yet
+        "push",     // Upload a directory tree
+        "pull",     // Download a directory tree
+        "ping",     // Ping server
+        "write",    // Write to file
+        "append",   // Append to file
+        "rm",       // Remove file
+        "info",     // Get file info
+        "mkdir",    // Create directory
+        "rmdir",    // Remove directory
+        "cp",       // Copy file or directory
+        "mv",       // Move or rename file or directory
+        "verify",   // Check a file against its stored checksums
+        "help",     // Display help information
+        "exit"      // Exit client
     };
 
     // Initialize command descriptions for help
     command_descriptions = {
         {"cd", "Change the current directory (cd <directory>)"},
         {"ls", "List contents of a directory (ls [directory])"},
-        {"cat", "Display contents of a file (cat <file>)"},
+        {"cat",
+         "Display contents of a file, or length bytes from offset "
+         "(cat <file> [offset [length]])"},
         {"upload",
          "Upload a local file to the server (upload <local_file> "
          "<remote_filename>)"},
+        {"download",
+         "Download a server file to a local file (download <remote_filename> "
+         "<local_file>)"},
+        {"sync",
+         "Bring a server file up to date with a local file, sending only "
+         "what changed (sync <local_file> <remote_filename>)"},
+        {"dedup",
+         "Upload a local file, skipping chunks of it the server already "
+         "stores (dedup <local_file> <remote_filename>)"},
+        {"push",
+         "Upload a local directory tree as a new server directory "
+         "(push <local_directory> <remote_directory>)"},
+        {"pull",
+         "Download a server directory tree into a new local directory "
+         "(pull <remote_directory> <local_directory>)"},
         {"ping", "Check if server is responsive (ping)"},
-        {"write", "Create a new file with content (write <file> <content>)"},
+        {"write",
+         "Create a new file with content, or overwrite from offset "
+         "(write <file> [-o <offset>] <content>)"},
         {"rm", "Remove a file (rm <file>)"},
         {"info", "Display file information (info <file>)"},
         {"mkdir", "Create a new directory (mkdir <directory>)"},
         {"cd", "Change the current directory (cd <directory>)"},
-        {"rmdir", "Remove a directory (rmdir <directory>)"},
+        {"rmdir",
+         "Remove a directory, reclaiming its space in the background with -b "
+         "(rmdir [-b] <directory>)"},
+        {"cp",
+         "Copy a file, or a directory with -r, on the server "
+         "(cp [-r] <source> <destination>)"},
+        {"mv",
+         "Move or rename a file or directory (mv <source> <destination>)"},
+        {"verify",
+         "Check a file on the server against its stored checksums "
+         "(verify <file>)"},
         {"help", "Display available commands (help)"},
         {"exit", "Exit the client (exit)"}};
 }
@@ -154,16 +191,24 @@ bool TUI::validate_command(const std::vector<std::string> &command_parts)
         command_args = {// command -> {min_args, max_args}
                         {"cd", {1, 1}},
                         {"ls", {0, 1}},
-                        {"cat", {1, 1}},
+                        {"cat", {1, 3}},
                         {"upload", {2, 2}},
+                        {"download", {2, 2}},
+                        {"sync", {2, 2}},
+                        {"dedup", {2, 2}},
+                        {"push", {2, 2}},
+                        {"pull", {2, 2}},
                         {"ping", {0, 0}},
-                        {"write", {2, 2}},
+                        {"write", {2, 4}},
                         {"append", {2, 2}},
                         {"rm", {1, 1}},
                         {"info", {1, 1}},
                         {"mkdir", {1, 1}},
                         {"cd", {1, 1}},
-                        {"rmdir", {1, 1}},
+                        {"rmdir", {1, 2}},
+                        {"cp", {2, 3}},
+                        {"mv", {2, 2}},
+                        {"verify", {1, 1}},
                         {"help", {0, 0}},
                         {"exit", {0, 0}}};
 
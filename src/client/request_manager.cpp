@@ -1,7 +1,11 @@
 #include "client/request_manager.hpp"
+#include "common/chunk_store.hpp"
 #include "common/request.hpp"
+#include "common/tree_archive.hpp"
+#include <charconv>
 #include <fstream>
 #include <sstream>
+#include <utility>
 
 namespace fenris {
 namespace client {
@@ -14,6 +18,9 @@ RequestManager::generate_request(const std::vector<std::string> &args)
         return std::nullopt;
     }
 
+    // A streamed body only belongs to the request it was opened for
+    m_payload.reset();
+
     // Get the command from the first argument
     const std::string &cmd = args[0];
 
@@ -27,6 +34,51 @@ RequestManager::generate_request(const std::vector<std::string> &args)
         return upload_file_request(args, 1);
     }
 
+    if (cmd == "sync") {
+        if (args.size() < 3) {
+            m_logger->error("sync command requires a local file path and "
+                            "remote filename");
+            return std::nullopt;
+        }
+        return sync_file_request(args, 1);
+    }
+
+    if (cmd == "dedup") {
+        if (args.size() < 3) {
+            m_logger->error("dedup command requires a local file path and "
+                            "remote filename");
+            return std::nullopt;
+        }
+        return dedup_file_request(args, 1);
+    }
+
+    if (cmd == "download") {
+        if (args.size() < 3) {
+            m_logger->error("download command requires a remote filename and "
+                            "local file path");
+            return std::nullopt;
+        }
+        return download_file_request(args, 1);
+    }
+
+    if (cmd == "push") {
+        if (args.size() < 3) {
+            m_logger->error("push command requires a local directory and "
+                            "remote directory");
+            return std::nullopt;
+        }
+        return push_tree_request(args, 1);
+    }
+
+    if (cmd == "pull") {
+        if (args.size() < 3) {
+            m_logger->error("pull command requires a remote directory and "
+                            "local directory");
+            return std::nullopt;
+        }
+        return pull_tree_request(args, 1);
+    }
+
     // Find the command in our map
     auto cmd_iter = m_command_map.find(cmd);
     if (cmd_iter == m_command_map.end()) {
@@ -63,6 +115,10 @@ RequestManager::generate_request(const std::vector<std::string> &args)
                             "-f <filepath>)");
             return std::nullopt;
         }
+        if (args[2] == "-o" && args.size() < 5) {
+            m_logger->error("write -o requires an offset and content");
+            return std::nullopt;
+        }
         return write_file_request(args, 1);
 
     case fenris::RequestType::APPEND_FILE:
@@ -104,6 +160,8 @@ RequestManager::generate_request(const std::vector<std::string> &args)
         } else {
             request.set_filename(args[1]);
         }
+        // Large directories arrive a page at a time
+        request.set_page_size(LIST_DIR_PAGE_SIZE);
         break;
     case fenris::RequestType::CHANGE_DIR:
         if (args.size() < 2) {
@@ -114,10 +172,40 @@ RequestManager::generate_request(const std::vector<std::string> &args)
         break;
 
     case fenris::RequestType::DELETE_DIR:
-        if (args.size() < 2) {
+        if (args.size() < 2 || (args[1] == "-b" && args.size() < 3)) {
             m_logger->error("rmdir command requires a directory name");
             return std::nullopt;
         }
+        if (args[1] == "-b") {
+            // Reply at once and let the server reclaim the space later
+            request.set_background(true);
+            request.set_filename(args[2]);
+        } else {
+            request.set_filename(args[1]);
+        }
+        break;
+
+    case fenris::RequestType::COPY_FILE:
+        if (args.size() < 3 || (args[1] == "-r" && args.size() < 4)) {
+            m_logger->error("cp command requires a source and destination");
+            return std::nullopt;
+        }
+        return copy_request(args, 1);
+
+    case fenris::RequestType::RENAME:
+        if (args.size() < 3) {
+            m_logger->error("mv command requires a source and destination");
+            return std::nullopt;
+        }
+        request.set_filename(args[1]);
+        request.set_destination(args[2]);
+        break;
+
+    case fenris::RequestType::VERIFY_FILE:
+        if (args.size() < 2) {
+            m_logger->error("verify command requires a filename");
+            return std::nullopt;
+        }
         request.set_filename(args[1]);
         break;
 
@@ -171,7 +259,19 @@ RequestManager::create_file_request(const std::vector<std::string> &args,
     return request;
 }
 
-fenris::Request
+std::optional<uint64_t> RequestManager::parse_offset(const std::string &arg)
+{
+    uint64_t value = 0;
+    const char *last = arg.data() + arg.size();
+    auto [end, ec] = std::from_chars(arg.data(), last, value);
+    if (ec != std::errc() || end != last) {
+        m_logger->error("invalid offset or length '{}'", arg);
+        return std::nullopt;
+    }
+    return value;
+}
+
+std::optional<fenris::Request>
 RequestManager::read_file_request(const std::vector<std::string> &args,
                                   size_t start_idx)
 {
@@ -180,10 +280,26 @@ RequestManager::read_file_request(const std::vector<std::string> &args,
     request.set_command(fenris::RequestType::READ_FILE);
     request.set_filename(args[start_idx]);
 
+    // Optional byte range: cat <file> [offset [length]]
+    if (args.size() > start_idx + 1) {
+        auto offset = parse_offset(args[start_idx + 1]);
+        if (!offset) {
+            return std::nullopt;
+        }
+        request.set_offset(*offset);
+    }
+    if (args.size() > start_idx + 2) {
+        auto length = parse_offset(args[start_idx + 2]);
+        if (!length) {
+            return std::nullopt;
+        }
+        request.set_length(*length);
+    }
+
     return request;
 }
 
-fenris::Request
+std::optional<fenris::Request>
 RequestManager::write_file_request(const std::vector<std::string> &args,
                                    size_t start_idx)
 {
@@ -192,18 +308,23 @@ RequestManager::write_file_request(const std::vector<std::string> &args,
     request.set_command(fenris::RequestType::WRITE_FILE);
     request.set_filename(args[start_idx]);
 
+    // Optional in-place write: write <file> -o <offset> <content>
+    if (args.size() > start_idx + 2 && args[start_idx + 1] == "-o") {
+        auto offset = parse_offset(args[start_idx + 2]);
+        if (!offset) {
+            return std::nullopt;
+        }
+        request.set_offset(*offset);
+        start_idx += 2;
+    }
+
     // Handle content
     if (args.size() > start_idx + 1) {
         if (args[start_idx + 1] == "-f" && args.size() > start_idx + 2) {
-            // Read content from file
-            std::ifstream file(args[start_idx + 2], std::ios::binary);
-            if (!file) {
+            // Read content from file, or stream it if it is large
+            if (!set_local_content(args[start_idx + 2], request)) {
                 m_logger->warn("could not open file '{}' for write content",
                                args[start_idx + 2]);
-            } else {
-                std::string content((std::istreambuf_iterator<char>(file)),
-                                    std::istreambuf_iterator<char>());
-                request.set_data(content);
             }
         } else {
             // Use argument as content (concatenate remaining args)
@@ -271,22 +392,173 @@ RequestManager::upload_file_request(const std::vector<std::string> &args,
 
     request.set_filename(remote_filename);
 
-    // Read content from local file
-    std::ifstream file(local_path, std::ios::binary);
-    if (!file) {
+    // Read content from local file, or stream it if it is large
+    if (!set_local_content(local_path, request)) {
         m_logger->error("could not open local file '{}' for upload",
                         local_path);
+    } else if (m_payload) {
+        m_logger->info("streaming {} bytes from '{}' for upload",
+                       m_payload->size(),
+                       local_path);
     } else {
-        std::string content((std::istreambuf_iterator<char>(file)),
-                            std::istreambuf_iterator<char>());
-        request.set_data(content);
         m_logger->info("read {} bytes from '{}' for upload",
-                       content.size(),
+                       request.data().size(),
                        local_path);
     }
 
     return request;
 }
 
+fenris::Request
+RequestManager::sync_file_request(const std::vector<std::string> &args,
+                                  size_t start_idx)
+{
+    // args[start_idx] is the local file and args[start_idx + 1] the remote
+    // copy to bring up to date; the client first asks for the signature of
+    // the remote copy, then sends a delta against it
+    fenris::Request request;
+    request.set_command(fenris::RequestType::GET_SIGNATURE);
+    request.set_filename(args[start_idx + 1]);
+
+    return request;
+}
+
+std::optional<fenris::Request>
+RequestManager::dedup_file_request(const std::vector<std::string> &args,
+                                   size_t start_idx)
+{
+    // args[start_idx] is the local file and args[start_idx + 1] the remote
+    // file to write; the client first asks which chunks of the local file
+    // the server already stores, then sends only the others
+    const std::string &local_path = args[start_idx];
+    auto [manifest, result] = common::chunk_file(local_path);
+    if (result != common::FileOperationResult::SUCCESS) {
+        m_logger->error("could not open local file '{}' for upload",
+                        local_path);
+        return std::nullopt;
+    }
+    m_logger->info("split '{}' into {} chunks",
+                   local_path,
+                   manifest.lengths_size());
+
+    fenris::Request request;
+    request.set_command(fenris::RequestType::HAS_CHUNKS);
+    request.set_filename(args[start_idx + 1]);
+    *request.mutable_manifest() = std::move(manifest);
+
+    return request;
+}
+
+fenris::Request
+RequestManager::download_file_request(const std::vector<std::string> &args,
+                                      size_t start_idx)
+{
+    // args[start_idx] is the remote file to read; the client streams the
+    // response payload into the local path at args[start_idx + 1]
+    fenris::Request request;
+    request.set_command(fenris::RequestType::READ_FILE);
+    request.set_filename(args[start_idx]);
+
+    return request;
+}
+
+std::optional<fenris::Request>
+RequestManager::push_tree_request(const std::vector<std::string> &args,
+                                  size_t start_idx)
+{
+    // args[start_idx] is the local directory and args[start_idx + 1] the
+    // remote directory to create from it
+    const std::string &local_path = args[start_idx];
+    auto [archive, result] = common::open_tree_archive(local_path);
+    if (result != common::FileOperationResult::SUCCESS) {
+        m_logger->error("could not read local directory '{}' for upload",
+                        local_path);
+        return std::nullopt;
+    }
+    m_logger->info("sending {} entries ({} bytes) from '{}'",
+                   archive->entries().size(),
+                   archive->size(),
+                   local_path);
+
+    fenris::Request request;
+    request.set_command(fenris::RequestType::PUT_TREE);
+    request.set_filename(args[start_idx + 1]);
+
+    if (archive->size() >= common::PAYLOAD_THRESHOLD) {
+        m_payload = std::move(archive);
+        return request;
+    }
+
+    std::string *data = request.mutable_data();
+    data->resize(archive->size());
+    if (!archive->read(reinterpret_cast<uint8_t *>(data->data()),
+                       data->size())) {
+        m_logger->error("could not read local directory '{}' for upload",
+                        local_path);
+        return std::nullopt;
+    }
+    return request;
+}
+
+fenris::Request
+RequestManager::pull_tree_request(const std::vector<std::string> &args,
+                                  size_t start_idx)
+{
+    // args[start_idx] is the remote directory to read; the client extracts
+    // the archive in the response into args[start_idx + 1] as it arrives
+    fenris::Request request;
+    request.set_command(fenris::RequestType::GET_TREE);
+    request.set_filename(args[start_idx]);
+
+    return request;
+}
+
+fenris::Request
+RequestManager::copy_request(const std::vector<std::string> &args,
+                             size_t start_idx)
+{
+    // cp [-r] <source> <destination>; -r copies a whole directory tree
+    fenris::Request request;
+    request.set_command(fenris::RequestType::COPY_FILE);
+    if (args[start_idx] == "-r") {
+        request.set_command(fenris::RequestType::COPY_DIR);
+        start_idx++;
+    }
+    request.set_filename(args[start_idx]);
+    request.set_destination(args[start_idx + 1]);
+
+    return request;
+}
+
+bool RequestManager::set_local_content(const std::string &local_path,
+                                       fenris::Request &request)
+{
+    auto [source, result] = common::open_file_payload(local_path);
+    if (result != common::FileOperationResult::SUCCESS) {
+        return false;
+    }
+
+    if (source->size() >= common::PAYLOAD_THRESHOLD) {
+        // Lets the server reserve the whole file before the body arrives
+        request.set_expected_size(request.offset() + source->size());
+        m_payload = std::move(source);
+        return true;
+    }
+
+    std::string *data = request.mutable_data();
+    data->resize(source->size());
+    if (!source->read(reinterpret_cast<uint8_t *>(data->data()),
+                      data->size())) {
+        data->clear();
+        return false;
+    }
+    return true;
+}
+
+std::unique_ptr<common::PayloadSource> RequestManager::take_payload()
+{
+    return std::move(m_payload);
+}
+
 } // namespace client
 } // namespace fenris
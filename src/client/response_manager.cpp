@@ -64,6 +64,11 @@ ResponseManager::handle_response(const fenris::Response &response)
         handle_terminated_response(response, result);
         break;
 
+    case ResponseType::FILE_VERIFICATION:
+        m_logger->debug("Processing FILE_VERIFICATION response");
+        handle_verification_response(response, result);
+        break;
+
     default:
         // Unknown response type
         result.push_back("Unknown response type");
@@ -269,6 +274,32 @@ void ResponseManager::handle_terminated_response(
     }
 }
 
+void ResponseManager::handle_verification_response(
+    const fenris::Response &response,
+    std::vector<std::string> &result)
+{
+    const auto &verification = response.verification();
+    if (!verification.checked()) {
+        result.push_back("No checksums cover this file yet");
+        return;
+    }
+
+    result.push_back("Blocks checked: " +
+                     std::to_string(verification.blocks()));
+    if (verification.corrupted_offsets_size() == 0) {
+        result.push_back("File is intact");
+        return;
+    }
+
+    m_logger->warn("Server reported {} corrupted blocks",
+                   verification.corrupted_offsets_size());
+    result.push_back("Corrupted blocks: " +
+                     std::to_string(verification.corrupted_offsets_size()));
+    for (uint64_t offset : verification.corrupted_offsets()) {
+        result.push_back("  at offset " + std::to_string(offset));
+    }
+}
+
 std::string ResponseManager::format_file_size(uint64_t size_bytes)
 {
     constexpr double KB = 1024.0;
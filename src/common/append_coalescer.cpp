@@ -0,0 +1,234 @@
+#include "common/append_coalescer.hpp"
+#include "common/durability.hpp"
+
+#include <algorithm>
+#include <cerrno>
+#include <climits>
+#include <sys/uio.h>
+#include <unistd.h>
+
+namespace fenris {
+namespace common {
+
+namespace {
+
+// Write every record with as few writev calls as IOV_MAX allows
+bool write_records(int fd, const std::vector<std::string> &records)
+{
+    std::vector<struct iovec> iov;
+    iov.reserve(records.size());
+    for (const auto &record : records) {
+        if (!record.empty()) {
+            iov.push_back({const_cast<char *>(record.data()), record.size()});
+        }
+    }
+
+    size_t first = 0;
+    while (first < iov.size()) {
+        int count = static_cast<int>(std::min<size_t>(iov.size() - first,
+                                                      IOV_MAX));
+        ssize_t bytes = writev(fd, iov.data() + first, count);
+        if (bytes < 0 && errno == EINTR) {
+            continue;
+        }
+        if (bytes <= 0) {
+            return false;
+        }
+
+        // Skip what was written; a short write resumes inside a record
+        auto remaining = static_cast<size_t>(bytes);
+        while (first < iov.size() && remaining >= iov[first].iov_len) {
+            remaining -= iov[first].iov_len;
+            first++;
+        }
+        if (remaining > 0) {
+            iov[first].iov_base =
+                static_cast<char *>(iov[first].iov_base) + remaining;
+            iov[first].iov_len -= remaining;
+        }
+    }
+    return true;
+}
+
+} // namespace
+
+AppendHandle::AppendHandle(int fd, dev_t device, ino_t inode)
+    : fd(fd), device(device), inode(inode)
+{
+}
+
+AppendHandle::~AppendHandle()
+{
+    close(fd);
+}
+
+AppendCoalescer::AppendCoalescer(size_t max_bytes,
+                                 std::chrono::microseconds max_delay)
+    : m_max_bytes(std::max<size_t>(max_bytes, 1)), m_max_delay(max_delay)
+{
+}
+
+bool AppendCoalescer::append(const std::shared_ptr<AppendHandle> &handle,
+                             const std::string &data)
+{
+    Key key{handle->device, handle->inode};
+
+    std::unique_lock<std::mutex> lock(m_mutex);
+    auto &slot = m_buffers[key];
+    if (!slot) {
+        slot = std::make_shared<Buffer>();
+        slot->handle = handle;
+    }
+    auto buffer = slot;
+
+    if (!buffer->open) {
+        // Only appends that have to wait for a write anyway wait for more
+        buffer->open = std::make_shared<Batch>();
+        buffer->deadline = std::chrono::steady_clock::now();
+        if (buffer->writing) {
+            buffer->deadline += m_max_delay;
+        }
+    }
+    auto batch = buffer->open;
+    batch->records.push_back(data);
+    batch->bytes += data.size();
+    m_append_count++;
+
+    if (batch->bytes >= m_max_bytes) {
+        // Wake whoever waits for the batch's deadline
+        m_written_condition.notify_all();
+    }
+
+    wait_written(lock, key, buffer, batch);
+    return batch->ok;
+}
+
+bool AppendCoalescer::flush()
+{
+    std::unique_lock<std::mutex> lock(m_mutex);
+
+    // Only the batches accepted by now are waited for, so appenders that
+    // keep arriving cannot hold the flush up
+    struct Waited {
+        Key key;
+        std::shared_ptr<Buffer> buffer;
+        std::shared_ptr<Batch> batch;
+    };
+    std::vector<Waited> waited;
+    for (auto &[key, buffer] : m_buffers) {
+        if (buffer->open) {
+            buffer->urgent = true;
+        }
+        for (const auto &batch : {buffer->writing, buffer->open}) {
+            if (batch) {
+                waited.push_back({key, buffer, batch});
+            }
+        }
+    }
+    m_written_condition.notify_all();
+
+    bool ok = true;
+    for (const auto &[key, buffer, batch] : waited) {
+        wait_written(lock, key, buffer, batch);
+        ok = ok && batch->ok;
+    }
+    return ok;
+}
+
+uint64_t AppendCoalescer::append_count() const
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_append_count;
+}
+
+uint64_t AppendCoalescer::write_count() const
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_write_count;
+}
+
+void AppendCoalescer::wait_written(std::unique_lock<std::mutex> &lock,
+                                   const Key &key,
+                                   const std::shared_ptr<Buffer> &buffer,
+                                   const std::shared_ptr<Batch> &batch)
+{
+    while (!batch->done) {
+        if (buffer->writing || buffer->open != batch) {
+            // An earlier batch is being written
+            m_written_condition.wait(lock);
+        } else if (buffer->urgent || batch->bytes >= m_max_bytes ||
+                   std::chrono::steady_clock::now() >= buffer->deadline) {
+            write_open(lock, key, buffer);
+        } else {
+            m_written_condition.wait_until(lock, buffer->deadline);
+        }
+    }
+}
+
+void AppendCoalescer::write_open(std::unique_lock<std::mutex> &lock,
+                                 const Key &key,
+                                 const std::shared_ptr<Buffer> &buffer)
+{
+    auto batch = std::move(buffer->open);
+    buffer->open.reset();
+    buffer->urgent = false;
+    buffer->writing = batch;
+    lock.unlock();
+
+    // O_APPEND places the whole batch at the end of the file, after
+    // anything written to it before
+    bool ok = write_records(buffer->handle->fd, batch->records) &&
+              sync_file(buffer->handle->fd);
+
+    lock.lock();
+    m_write_count++;
+    buffer->writing.reset();
+    batch->ok = ok;
+    batch->done = true;
+
+    // Idle files do not keep their descriptor or an entry
+    if (!buffer->open) {
+        auto it = m_buffers.find(key);
+        if (it != m_buffers.end() && it->second == buffer) {
+            m_buffers.erase(it);
+        }
+    }
+    m_written_condition.notify_all();
+}
+
+namespace {
+
+std::mutex g_coalescer_mutex;
+std::shared_ptr<AppendCoalescer> g_coalescer;
+
+} // namespace
+
+void set_append_coalescing(size_t max_bytes,
+                           std::chrono::microseconds max_delay)
+{
+    std::shared_ptr<AppendCoalescer> previous;
+    {
+        std::lock_guard<std::mutex> lock(g_coalescer_mutex);
+        previous = std::move(g_coalescer);
+        if (max_bytes > 0) {
+            g_coalescer = std::make_shared<AppendCoalescer>(max_bytes,
+                                                            max_delay);
+        }
+    }
+    // Appenders still holding the old coalescer finish their batches on it
+}
+
+std::shared_ptr<AppendCoalescer> get_append_coalescer()
+{
+    std::lock_guard<std::mutex> lock(g_coalescer_mutex);
+    return g_coalescer;
+}
+
+bool flush_appends()
+{
+    auto coalescer = get_append_coalescer();
+    return !coalescer || coalescer->flush();
+}
+
+} // namespace common
+} // namespace fenris
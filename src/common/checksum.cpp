@@ -0,0 +1,704 @@
+#include "common/checksum.hpp"
+#include "common/chunk_store.hpp"
+#include "common/pack_store.hpp"
+
+#include <algorithm>
+#include <array>
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <string>
+#include <system_error>
+#include <sys/xattr.h>
+#include <unistd.h>
+
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#endif
+
+namespace fenris {
+namespace common {
+
+namespace {
+
+// CRC-32C polynomial, reflected
+constexpr uint32_t CRC32C_POLY = 0x82f63b78;
+
+// Slicing-by-8 tables for the portable implementation
+constexpr std::array<std::array<uint32_t, 256>, 8> make_crc_tables()
+{
+    std::array<std::array<uint32_t, 256>, 8> tables{};
+    for (uint32_t n = 0; n < 256; n++) {
+        uint32_t crc = n;
+        for (int k = 0; k < 8; k++) {
+            crc = crc & 1 ? (crc >> 1) ^ CRC32C_POLY : crc >> 1;
+        }
+        tables[0][n] = crc;
+    }
+    for (uint32_t n = 0; n < 256; n++) {
+        for (size_t k = 1; k < 8; k++) {
+            uint32_t previous = tables[k - 1][n];
+            tables[k][n] = (previous >> 8) ^ tables[0][previous & 0xff];
+        }
+    }
+    return tables;
+}
+
+constexpr auto CRC_TABLES = make_crc_tables();
+
+uint32_t crc32c_software(uint32_t crc, const uint8_t *data, size_t size)
+{
+    crc = ~crc;
+    while (size >= 8) {
+        uint64_t word;
+        std::memcpy(&word, data, 8);
+        word ^= crc;
+        crc = CRC_TABLES[7][word & 0xff] ^ CRC_TABLES[6][(word >> 8) & 0xff] ^
+              CRC_TABLES[5][(word >> 16) & 0xff] ^
+              CRC_TABLES[4][(word >> 24) & 0xff] ^
+              CRC_TABLES[3][(word >> 32) & 0xff] ^
+              CRC_TABLES[2][(word >> 40) & 0xff] ^
+              CRC_TABLES[1][(word >> 48) & 0xff] ^ CRC_TABLES[0][word >> 56];
+        data += 8;
+        size -= 8;
+    }
+    while (size-- > 0) {
+        crc = (crc >> 8) ^ CRC_TABLES[0][(crc ^ *data++) & 0xff];
+    }
+    return ~crc;
+}
+
+// GF(2) matrix helpers for shifting a CRC over runs of zero bytes
+uint32_t gf2_matrix_times(const uint32_t *matrix, uint32_t vector)
+{
+    uint32_t sum = 0;
+    while (vector != 0) {
+        if (vector & 1) {
+            sum ^= *matrix;
+        }
+        vector >>= 1;
+        matrix++;
+    }
+    return sum;
+}
+
+void gf2_matrix_square(uint32_t *square, const uint32_t *matrix)
+{
+    for (int n = 0; n < 32; n++) {
+        square[n] = gf2_matrix_times(matrix, matrix[n]);
+    }
+}
+
+// Operators for one and two zero bits
+void zero_bit_operators(uint32_t *odd, uint32_t *even)
+{
+    odd[0] = CRC32C_POLY;
+    uint32_t row = 1;
+    for (int n = 1; n < 32; n++) {
+        odd[n] = row;
+        row <<= 1;
+    }
+    gf2_matrix_square(even, odd);
+}
+
+#if defined(__x86_64__)
+
+// Bytes per stream of the interleaved hardware loops. The crc32 instruction
+// has a latency of three cycles but a throughput of one per cycle, so three
+// independent streams keep it busy; their results are then shifted into
+// place with the tables below and combined
+constexpr size_t LONG_STREAM = 8192;
+constexpr size_t SHORT_STREAM = 256;
+
+using ShiftTable = std::array<std::array<uint32_t, 256>, 4>;
+
+// Table applying the operator for length zero bytes, a power of two
+ShiftTable make_shift_table(size_t length)
+{
+    uint32_t odd[32];
+    uint32_t even[32];
+    zero_bit_operators(odd, even);
+    // Four zero bits in odd; each square below doubles the count
+    gf2_matrix_square(odd, even);
+    const uint32_t *op = nullptr;
+    while (true) {
+        gf2_matrix_square(even, odd);
+        length >>= 1;
+        if (length == 0) {
+            op = even;
+            break;
+        }
+        gf2_matrix_square(odd, even);
+        length >>= 1;
+        if (length == 0) {
+            op = odd;
+            break;
+        }
+    }
+
+    ShiftTable table;
+    for (uint32_t n = 0; n < 256; n++) {
+        table[0][n] = gf2_matrix_times(op, n);
+        table[1][n] = gf2_matrix_times(op, n << 8);
+        table[2][n] = gf2_matrix_times(op, n << 16);
+        table[3][n] = gf2_matrix_times(op, n << 24);
+    }
+    return table;
+}
+
+uint32_t shift(const ShiftTable &table, uint32_t crc)
+{
+    return table[0][crc & 0xff] ^ table[1][(crc >> 8) & 0xff] ^
+           table[2][(crc >> 16) & 0xff] ^ table[3][crc >> 24];
+}
+
+const ShiftTable &long_shift()
+{
+    static const ShiftTable table = make_shift_table(LONG_STREAM);
+    return table;
+}
+
+const ShiftTable &short_shift()
+{
+    static const ShiftTable table = make_shift_table(SHORT_STREAM);
+    return table;
+}
+
+// Checksum whole runs of three streams of stream bytes each
+__attribute__((target("sse4.2"))) void
+crc32c_interleaved(uint64_t &crc0,
+                   const uint8_t *&data,
+                   size_t &size,
+                   size_t stream,
+                   const ShiftTable &table)
+{
+    while (size >= 3 * stream) {
+        uint64_t crc1 = 0;
+        uint64_t crc2 = 0;
+        const uint8_t *end = data + stream;
+        do {
+            uint64_t word0;
+            uint64_t word1;
+            uint64_t word2;
+            std::memcpy(&word0, data, 8);
+            std::memcpy(&word1, data + stream, 8);
+            std::memcpy(&word2, data + 2 * stream, 8);
+            crc0 = _mm_crc32_u64(crc0, word0);
+            crc1 = _mm_crc32_u64(crc1, word1);
+            crc2 = _mm_crc32_u64(crc2, word2);
+            data += 8;
+        } while (data < end);
+        crc0 = shift(table, static_cast<uint32_t>(crc0)) ^ crc1;
+        crc0 = shift(table, static_cast<uint32_t>(crc0)) ^ crc2;
+        data += 2 * stream;
+        size -= 3 * stream;
+    }
+}
+
+__attribute__((target("sse4.2"))) uint32_t
+crc32c_sse42(uint32_t crc, const uint8_t *data, size_t size)
+{
+    uint64_t crc0 = ~crc;
+    while (size > 0 && (reinterpret_cast<uintptr_t>(data) & 7) != 0) {
+        crc0 = _mm_crc32_u8(static_cast<uint32_t>(crc0), *data++);
+        size--;
+    }
+
+    crc32c_interleaved(crc0, data, size, LONG_STREAM, long_shift());
+    crc32c_interleaved(crc0, data, size, SHORT_STREAM, short_shift());
+
+    while (size >= 8) {
+        uint64_t word;
+        std::memcpy(&word, data, 8);
+        crc0 = _mm_crc32_u64(crc0, word);
+        data += 8;
+        size -= 8;
+    }
+    while (size-- > 0) {
+        crc0 = _mm_crc32_u8(static_cast<uint32_t>(crc0), *data++);
+    }
+    return ~static_cast<uint32_t>(crc0);
+}
+
+#endif
+
+using CrcFunction = uint32_t (*)(uint32_t, const uint8_t *, size_t);
+
+CrcFunction select_crc32c()
+{
+#if defined(__x86_64__)
+    // Runs before main, possibly ahead of the runtime's own CPU detection
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("sse4.2")) {
+        return crc32c_sse42;
+    }
+#endif
+    return crc32c_software;
+}
+
+const CrcFunction CRC32C = select_crc32c();
+
+// Encoded BlockChecksums: block size as u32, file size as u64, and the
+// modification time they were computed at as u64 seconds and u32
+// nanoseconds, all little-endian, followed by one u32 per block
+constexpr size_t HEADER_SIZE = 24;
+
+void put_le(std::string &bytes, size_t at, uint64_t value, int width)
+{
+    for (int i = 0; i < width; i++) {
+        bytes[at + i] = static_cast<char>((value >> (8 * i)) & 0xff);
+    }
+}
+
+uint64_t get_le(const char *bytes, int width)
+{
+    uint64_t value = 0;
+    for (int i = width - 1; i >= 0; i--) {
+        value = (value << 8) | static_cast<uint8_t>(bytes[i]);
+    }
+    return value;
+}
+
+uint64_t block_count(uint64_t file_size, uint32_t block_size)
+{
+    return (file_size + block_size - 1) / block_size;
+}
+
+bool xattrs_unsupported(int error)
+{
+    return error == ENOTSUP || error == EOPNOTSUPP;
+}
+
+bool pread_all(int fd, char *buffer, size_t size, uint64_t offset)
+{
+    size_t total = 0;
+    while (total < size) {
+        ssize_t bytes = pread(fd,
+                              buffer + total,
+                              size - total,
+                              static_cast<off_t>(offset + total));
+        if (bytes < 0 && errno == EINTR) {
+            continue;
+        }
+        if (bytes <= 0) {
+            return false;
+        }
+        total += static_cast<size_t>(bytes);
+    }
+    return true;
+}
+
+// Whether fd is the placeholder of a packed or deduplicated file
+bool is_placeholder(int fd)
+{
+    return (get_pack_store() && fgetxattr(fd, PACK_XATTR, nullptr, 0) > 0) ||
+           (get_chunk_store() &&
+            fgetxattr(fd, MANIFEST_XATTR, nullptr, 0) > 0);
+}
+
+// Store checksums computed for the file as it was at st
+FileOperationResult store_checksums_at(int fd,
+                                       const BlockChecksums &checksums,
+                                       const struct stat &st)
+{
+    if (checksums.file_size != static_cast<uint64_t>(st.st_size) ||
+        checksums.crcs.size() !=
+            block_count(checksums.file_size, checksums.block_size)) {
+        return FileOperationResult::INVALID_PATH;
+    }
+
+    std::string bytes(HEADER_SIZE + 4 * checksums.crcs.size(), '\0');
+    put_le(bytes, 0, checksums.block_size, 4);
+    put_le(bytes, 4, checksums.file_size, 8);
+    put_le(bytes, 12, static_cast<uint64_t>(st.st_mtim.tv_sec), 8);
+    put_le(bytes, 20, static_cast<uint64_t>(st.st_mtim.tv_nsec), 4);
+    for (size_t i = 0; i < checksums.crcs.size(); i++) {
+        put_le(bytes, HEADER_SIZE + 4 * i, checksums.crcs[i], 4);
+    }
+    if (fsetxattr(fd, CHECKSUM_XATTR, bytes.data(), bytes.size(), 0) != 0 &&
+        !xattrs_unsupported(errno)) {
+        return FileOperationResult::IO_ERROR;
+    }
+    return FileOperationResult::SUCCESS;
+}
+
+// Check every block of a plain file against its checksums
+FileOperationResult
+verify_blocks(int fd, const BlockChecksums &checksums, ChecksumReport &report)
+{
+    std::vector<char> buffer(checksums.block_size);
+    for (size_t i = 0; i < checksums.crcs.size(); i++) {
+        uint64_t offset = i * checksums.block_size;
+        size_t length = static_cast<size_t>(std::min<uint64_t>(
+            checksums.block_size,
+            checksums.file_size - offset));
+        if (!pread_all(fd, buffer.data(), length, offset)) {
+            return FileOperationResult::IO_ERROR;
+        }
+        if (crc32c(buffer.data(), length) != checksums.crcs[i]) {
+            report.corrupted_offsets.push_back(offset);
+        }
+        report.blocks++;
+        report.bytes += length;
+    }
+    return FileOperationResult::SUCCESS;
+}
+
+// Rehash each chunk of a deduplicated file against its manifest
+FileOperationResult verify_chunks(const fenris::ChunkManifest &manifest,
+                                  ChecksumReport &report)
+{
+    auto store = get_chunk_store();
+    if (!store) {
+        return FileOperationResult::IO_ERROR;
+    }
+
+    uint64_t offset = 0;
+    std::string chunk;
+    for (int i = 0; i < manifest.lengths_size(); i++) {
+        uint32_t length = manifest.lengths(i);
+        chunk.clear();
+        BufferPayloadSink sink(chunk);
+        // A missing chunk is as lost as a damaged one
+        if (!store->read_range(manifest, offset, length, sink) ||
+            chunk_hash(reinterpret_cast<const uint8_t *>(chunk.data()),
+                       chunk.size()) !=
+                manifest.hashes().substr(i * CHUNK_HASH_SIZE,
+                                         CHUNK_HASH_SIZE)) {
+            report.corrupted_offsets.push_back(offset);
+        }
+        report.blocks++;
+        report.bytes += length;
+        offset += length;
+    }
+    return FileOperationResult::SUCCESS;
+}
+
+} // namespace
+
+uint32_t crc32c(const void *data, size_t size, uint32_t crc)
+{
+    return CRC32C(crc, static_cast<const uint8_t *>(data), size);
+}
+
+uint32_t crc32c_combine(uint32_t crc1, uint32_t crc2, uint64_t length2)
+{
+    if (length2 == 0) {
+        return crc1;
+    }
+
+    // Apply length2 zero bytes to crc1, one power of two at a time
+    uint32_t odd[32];
+    uint32_t even[32];
+    zero_bit_operators(odd, even);
+    gf2_matrix_square(odd, even);
+    do {
+        gf2_matrix_square(even, odd);
+        if (length2 & 1) {
+            crc1 = gf2_matrix_times(even, crc1);
+        }
+        length2 >>= 1;
+        if (length2 == 0) {
+            break;
+        }
+        gf2_matrix_square(odd, even);
+        if (length2 & 1) {
+            crc1 = gf2_matrix_times(odd, crc1);
+        }
+        length2 >>= 1;
+    } while (length2 != 0);
+    return crc1 ^ crc2;
+}
+
+bool crc32c_hardware()
+{
+    return CRC32C != crc32c_software;
+}
+
+void ChecksumBuilder::update(const void *data, size_t size)
+{
+    auto bytes = static_cast<const uint8_t *>(data);
+    while (size > 0) {
+        size_t take = static_cast<size_t>(std::min<uint64_t>(
+            size,
+            m_checksums.block_size - m_filled));
+        m_crc = crc32c(bytes, take, m_crc);
+        m_filled += take;
+        m_checksums.file_size += take;
+        bytes += take;
+        size -= take;
+
+        if (m_filled == m_checksums.block_size) {
+            m_checksums.crcs.push_back(m_crc);
+            m_crc = 0;
+            m_filled = 0;
+        }
+        if (m_checksums.crcs.size() + (m_filled > 0 ? 1 : 0) >
+            MAX_CHECKSUM_BLOCKS) {
+            coarsen();
+        }
+    }
+}
+
+BlockChecksums ChecksumBuilder::finish() const
+{
+    BlockChecksums checksums = m_checksums;
+    if (m_filled > 0) {
+        checksums.crcs.push_back(m_crc);
+    }
+    return checksums;
+}
+
+void ChecksumBuilder::coarsen()
+{
+    auto &crcs = m_checksums.crcs;
+    uint64_t block_size = m_checksums.block_size;
+    size_t merged = 0;
+    for (size_t i = 0; i + 1 < crcs.size(); i += 2) {
+        crcs[merged++] = crc32c_combine(crcs[i], crcs[i + 1], block_size);
+    }
+    if (crcs.size() % 2 != 0) {
+        // The odd block out starts the block in progress
+        m_crc = crc32c_combine(crcs.back(), m_crc, m_filled);
+        m_filled += block_size;
+    }
+    crcs.resize(merged);
+    m_checksums.block_size *= 2;
+}
+
+ChecksumVerifier::ChecksumVerifier(
+    std::shared_ptr<const BlockChecksums> checksums,
+    uint64_t offset)
+    : m_checksums(std::move(checksums)),
+      m_block_start(offset - offset % m_checksums->block_size)
+{
+}
+
+uint64_t ChecksumVerifier::offset() const
+{
+    return m_block_start + m_filled;
+}
+
+uint64_t ChecksumVerifier::block_end() const
+{
+    if (m_filled == 0) {
+        return m_block_start;
+    }
+    return std::min(m_block_start + m_checksums->block_size,
+                    m_checksums->file_size);
+}
+
+bool ChecksumVerifier::update(const void *data, size_t size)
+{
+    auto bytes = static_cast<const uint8_t *>(data);
+    while (!m_failed && size > 0 &&
+           m_block_start < m_checksums->file_size) {
+        uint64_t block_length =
+            std::min<uint64_t>(m_checksums->block_size,
+                               m_checksums->file_size - m_block_start);
+        size_t take = static_cast<size_t>(
+            std::min<uint64_t>(size, block_length - m_filled));
+        m_crc = crc32c(bytes, take, m_crc);
+        m_filled += take;
+        bytes += take;
+        size -= take;
+
+        if (m_filled == block_length) {
+            size_t block = m_block_start / m_checksums->block_size;
+            m_failed = m_crc != m_checksums->crcs[block];
+            m_block_start += block_length;
+            m_filled = 0;
+            m_crc = 0;
+        }
+    }
+    return !m_failed;
+}
+
+bool ChecksumVerifier::update_from(int fd, uint64_t end)
+{
+    char buffer[16 * 1024];
+    while (!m_failed && offset() < end) {
+        size_t length =
+            static_cast<size_t>(std::min<uint64_t>(sizeof(buffer),
+                                                   end - offset()));
+        if (!pread_all(fd, buffer, length, offset())) {
+            return false;
+        }
+        update(buffer, length);
+    }
+    return !m_failed;
+}
+
+std::shared_ptr<const BlockChecksums> load_checksums(int fd,
+                                                     const struct stat &st)
+{
+    ssize_t size = fgetxattr(fd, CHECKSUM_XATTR, nullptr, 0);
+    if (size < static_cast<ssize_t>(HEADER_SIZE)) {
+        return nullptr;
+    }
+
+    std::string bytes(static_cast<size_t>(size), '\0');
+    size = fgetxattr(fd, CHECKSUM_XATTR, bytes.data(), bytes.size());
+    if (size != static_cast<ssize_t>(bytes.size())) {
+        return nullptr;
+    }
+
+    auto checksums = std::make_shared<BlockChecksums>();
+    checksums->block_size = static_cast<uint32_t>(get_le(bytes.data(), 4));
+    checksums->file_size = get_le(bytes.data() + 4, 8);
+    auto mtime_sec = static_cast<int64_t>(get_le(bytes.data() + 12, 8));
+    auto mtime_nsec = static_cast<int64_t>(get_le(bytes.data() + 20, 4));
+    uint32_t block_size = checksums->block_size;
+    if (block_size < MIN_CHECKSUM_BLOCK_SIZE ||
+        (block_size & (block_size - 1)) != 0 ||
+        checksums->file_size != static_cast<uint64_t>(st.st_size) ||
+        mtime_sec != st.st_mtim.tv_sec || mtime_nsec != st.st_mtim.tv_nsec ||
+        bytes.size() !=
+            HEADER_SIZE + 4 * block_count(checksums->file_size, block_size)) {
+        return nullptr;
+    }
+
+    size_t count = (bytes.size() - HEADER_SIZE) / 4;
+    checksums->crcs.resize(count);
+    for (size_t i = 0; i < count; i++) {
+        checksums->crcs[i] =
+            static_cast<uint32_t>(get_le(bytes.data() + HEADER_SIZE + 4 * i,
+                                         4));
+    }
+    return checksums;
+}
+
+FileOperationResult store_checksums(int fd, const BlockChecksums &checksums)
+{
+    struct stat st;
+    if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode)) {
+        return FileOperationResult::IO_ERROR;
+    }
+    if (st.st_size == 0 || is_placeholder(fd)) {
+        return FileOperationResult::SUCCESS;
+    }
+    return store_checksums_at(fd, checksums, st);
+}
+
+FileOperationResult drop_checksums(int fd)
+{
+    if (fremovexattr(fd, CHECKSUM_XATTR) != 0 && errno != ENODATA &&
+        !xattrs_unsupported(errno)) {
+        return FileOperationResult::IO_ERROR;
+    }
+    return FileOperationResult::SUCCESS;
+}
+
+FileOperationResult copy_checksums(int source_fd, int destination_fd)
+{
+    struct stat st;
+    if (fstat(source_fd, &st) != 0) {
+        return FileOperationResult::IO_ERROR;
+    }
+    auto checksums = load_checksums(source_fd, st);
+    if (!checksums) {
+        return drop_checksums(destination_fd);
+    }
+    return store_checksums(destination_fd, *checksums);
+}
+
+std::pair<bool, FileOperationResult> seal_file(int fd)
+{
+    struct stat before;
+    if (fstat(fd, &before) != 0 || !S_ISREG(before.st_mode)) {
+        return {false, FileOperationResult::IO_ERROR};
+    }
+    if (before.st_size == 0 || is_placeholder(fd)) {
+        return {false, FileOperationResult::SUCCESS};
+    }
+
+    ChecksumBuilder builder;
+    std::vector<char> buffer(MIN_CHECKSUM_BLOCK_SIZE);
+    auto size = static_cast<uint64_t>(before.st_size);
+    for (uint64_t offset = 0; offset < size; offset += buffer.size()) {
+        size_t length =
+            static_cast<size_t>(std::min<uint64_t>(buffer.size(),
+                                                   size - offset));
+        if (!pread_all(fd, buffer.data(), length, offset)) {
+            return {false, FileOperationResult::IO_ERROR};
+        }
+        builder.update(buffer.data(), length);
+    }
+
+    // A write while the file was read would leave checksums of a mix of
+    // old and new contents
+    struct stat after;
+    if (fstat(fd, &after) != 0) {
+        return {false, FileOperationResult::IO_ERROR};
+    }
+    if (after.st_size != before.st_size ||
+        after.st_mtim.tv_sec != before.st_mtim.tv_sec ||
+        after.st_mtim.tv_nsec != before.st_mtim.tv_nsec) {
+        return {false, FileOperationResult::SUCCESS};
+    }
+    auto result = store_checksums_at(fd, builder.finish(), before);
+    return {result == FileOperationResult::SUCCESS, result};
+}
+
+std::pair<ChecksumReport, FileOperationResult> verify_file(int fd)
+{
+    ChecksumReport report;
+    struct stat st;
+    if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode)) {
+        return {report, FileOperationResult::INVALID_PATH};
+    }
+
+    if (auto store = get_pack_store()) {
+        auto [location, result] = store->locate(fd, st);
+        if (result != FileOperationResult::SUCCESS) {
+            return {report, result};
+        }
+        if (location) {
+            auto [content, read_result] =
+                store->read(*location, 0, location->length);
+            if (read_result == FileOperationResult::DATA_CORRUPTED) {
+                report.corrupted_offsets.push_back(0);
+            } else if (read_result != FileOperationResult::SUCCESS) {
+                return {report, read_result};
+            }
+            report.checked = true;
+            report.blocks = 1;
+            report.bytes = location->length;
+            return {report, FileOperationResult::SUCCESS};
+        }
+    }
+
+    auto [manifest, manifest_result] = file_manifest(fd);
+    if (manifest_result != FileOperationResult::SUCCESS) {
+        return {report, manifest_result};
+    }
+    if (manifest) {
+        report.checked = true;
+        return {report, verify_chunks(*manifest, report)};
+    }
+
+    auto checksums = load_checksums(fd, st);
+    if (!checksums) {
+        return {report, FileOperationResult::SUCCESS};
+    }
+    report.checked = true;
+    return {report, verify_blocks(fd, *checksums, report)};
+}
+
+std::pair<ChecksumReport, FileOperationResult>
+verify_file(const std::string &filepath)
+{
+    int fd = open(filepath.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return {ChecksumReport{},
+                system_error_to_file_operation_result(
+                    std::error_code(errno, std::generic_category()))};
+    }
+
+    auto result = verify_file(fd);
+    close(fd);
+    return result;
+}
+
+} // namespace common
+} // namespace fenris
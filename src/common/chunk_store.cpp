@@ -0,0 +1,1143 @@
+#include "common/chunk_store.hpp"
+#include "common/durability.hpp"
+#include "common/pack_store.hpp"
+
+#include <cryptopp/sha.h>
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cerrno>
+#include <fcntl.h>
+#include <filesystem>
+#include <mutex>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/xattr.h>
+#include <system_error>
+#include <tuple>
+#include <unistd.h>
+#include <unordered_set>
+
+namespace fs = std::filesystem;
+
+namespace fenris {
+namespace common {
+
+namespace {
+
+// Gear hash table: one pseudo-random word per byte value (splitmix64)
+constexpr std::array<uint64_t, 256> make_gear_table()
+{
+    std::array<uint64_t, 256> table{};
+    uint64_t state = 0;
+    for (auto &entry : table) {
+        state += 0x9E3779B97F4A7C15ULL;
+        uint64_t z = state;
+        z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+        z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+        entry = z ^ (z >> 31);
+    }
+    return table;
+}
+
+constexpr std::array<uint64_t, 256> GEAR = make_gear_table();
+
+// Normalized chunking: a stricter mask before the average size and a looser
+// one after it keep chunk sizes close to AVERAGE_CHUNK_SIZE. The masks test
+// the high bits, which depend on the last 64 bytes rolled in.
+constexpr uint64_t top_bits(int count)
+{
+    return ~0ULL << (64 - count);
+}
+
+constexpr uint64_t MASK_SMALL = top_bits(18);
+constexpr uint64_t MASK_LARGE = top_bits(14);
+
+constexpr size_t HEX_HASH_SIZE = 2 * CHUNK_HASH_SIZE;
+
+std::string to_hex(const std::string &bytes)
+{
+    static constexpr char digits[] = "0123456789abcdef";
+    std::string hex;
+    hex.reserve(bytes.size() * 2);
+    for (unsigned char byte : bytes) {
+        hex.push_back(digits[byte >> 4]);
+        hex.push_back(digits[byte & 0xf]);
+    }
+    return hex;
+}
+
+bool is_hex_hash(const std::string &name)
+{
+    return name.size() == HEX_HASH_SIZE &&
+           std::all_of(name.begin(), name.end(), [](char c) {
+               return (c >= '0' && c <= '9') || (c >= 'a' && c <= 'f');
+           });
+}
+
+std::string hash_at(const fenris::ChunkManifest &manifest, int index)
+{
+    return manifest.hashes().substr(
+        static_cast<size_t>(index) * CHUNK_HASH_SIZE,
+        CHUNK_HASH_SIZE);
+}
+
+// Manifests come from clients and from disk; anything inconsistent is
+// rejected before it is used to address chunks
+bool valid_manifest(const fenris::ChunkManifest &manifest)
+{
+    auto chunks = static_cast<size_t>(manifest.lengths_size());
+    if (manifest.hashes().size() != chunks * CHUNK_HASH_SIZE) {
+        return false;
+    }
+    uint64_t total = 0;
+    for (uint32_t length : manifest.lengths()) {
+        if (length == 0 || length > MAX_CHUNK_SIZE) {
+            return false;
+        }
+        total += length;
+    }
+    return total == manifest.file_size();
+}
+
+bool write_all(int fd, const void *data, size_t size)
+{
+    auto bytes = static_cast<const uint8_t *>(data);
+    size_t total_written = 0;
+    while (total_written < size) {
+        ssize_t written =
+            ::write(fd, bytes + total_written, size - total_written);
+        if (written < 0 && errno == EINTR) {
+            continue;
+        }
+        if (written <= 0) {
+            return false;
+        }
+        total_written += static_cast<size_t>(written);
+    }
+    return true;
+}
+
+bool pread_all(int fd, uint8_t *buffer, size_t size, uint64_t offset)
+{
+    size_t total_read = 0;
+    while (total_read < size) {
+        ssize_t bytes = pread(fd,
+                              buffer + total_read,
+                              size - total_read,
+                              static_cast<off_t>(offset + total_read));
+        if (bytes < 0 && errno == EINTR) {
+            continue;
+        }
+        if (bytes <= 0) {
+            return false;
+        }
+        total_read += static_cast<size_t>(bytes);
+    }
+    return true;
+}
+
+FileOperationResult errno_result(int error)
+{
+    return system_error_to_file_operation_result(
+        std::error_code(error, std::generic_category()));
+}
+
+bool xattrs_unsupported(int error)
+{
+    return error == ENOTSUP || error == EOPNOTSUPP;
+}
+
+// Call fn for every entry of a two-level fan-out directory
+template <typename F> void for_each_object(const fs::path &directory, F fn)
+{
+    std::error_code ec;
+    for (fs::directory_iterator fan_out(directory, ec), end;
+         !ec && fan_out != end;
+         fan_out.increment(ec)) {
+        std::error_code inner_ec;
+        for (fs::directory_iterator it(fan_out->path(), inner_ec);
+             !inner_ec && it != end;
+             it.increment(inner_ec)) {
+            fn(*it);
+        }
+    }
+}
+
+std::atomic<bool> g_has_chunk_store{false};
+std::atomic<bool> g_deduplicate_writes{false};
+std::mutex g_chunk_store_mutex;
+std::shared_ptr<ChunkStore> g_chunk_store;
+
+} // namespace
+
+size_t next_chunk_boundary(const uint8_t *data, size_t size)
+{
+    if (size <= MIN_CHUNK_SIZE) {
+        return size;
+    }
+
+    size_t normal = std::min(AVERAGE_CHUNK_SIZE, size);
+    size_t limit = std::min(MAX_CHUNK_SIZE, size);
+    uint64_t hash = 0;
+    size_t i = MIN_CHUNK_SIZE;
+    for (; i < normal; i++) {
+        hash = (hash << 1) + GEAR[data[i]];
+        if ((hash & MASK_SMALL) == 0) {
+            return i + 1;
+        }
+    }
+    for (; i < limit; i++) {
+        hash = (hash << 1) + GEAR[data[i]];
+        if ((hash & MASK_LARGE) == 0) {
+            return i + 1;
+        }
+    }
+    return limit;
+}
+
+std::string chunk_hash(const uint8_t *data, size_t size)
+{
+    uint8_t digest[CryptoPP::SHA256::DIGESTSIZE];
+    CryptoPP::SHA256().CalculateDigest(digest, data, size);
+    return std::string(reinterpret_cast<const char *>(digest),
+                       CHUNK_HASH_SIZE);
+}
+
+std::pair<fenris::ChunkManifest, FileOperationResult>
+chunk_file(const std::string &filepath)
+{
+    fenris::ChunkManifest manifest;
+    auto [file, result] = map_file(filepath);
+    if (result != FileOperationResult::SUCCESS) {
+        return {manifest, result};
+    }
+
+    auto data = reinterpret_cast<const uint8_t *>(file->data());
+    size_t size = file->size();
+    manifest.set_file_size(size);
+    for (size_t offset = 0; offset < size;) {
+        size_t length = next_chunk_boundary(data + offset, size - offset);
+        manifest.add_lengths(static_cast<uint32_t>(length));
+        manifest.mutable_hashes()->append(chunk_hash(data + offset, length));
+        offset += length;
+    }
+
+    return {manifest, FileOperationResult::SUCCESS};
+}
+
+ChunkStore::ChunkStore(std::string root) : m_root(std::move(root)) {}
+
+FileOperationResult ChunkStore::initialize()
+{
+    std::error_code ec;
+    fs::create_directories(fs::path(m_root) / "chunks", ec);
+    if (!ec) {
+        fs::create_directories(fs::path(m_root) / "manifests", ec);
+    }
+    return ec ? system_error_to_file_operation_result(ec)
+              : FileOperationResult::SUCCESS;
+}
+
+const std::string &ChunkStore::root() const
+{
+    return m_root;
+}
+
+std::string ChunkStore::chunk_path(const std::string &hash) const
+{
+    std::string hex = to_hex(hash);
+    return m_root + "/chunks/" + hex.substr(0, 2) + "/" + hex;
+}
+
+std::string ChunkStore::manifest_path(const std::string &id) const
+{
+    return m_root + "/manifests/" + id.substr(0, 2) + "/" + id;
+}
+
+bool ChunkStore::has_chunk(const std::string &hash) const
+{
+    return hash.size() == CHUNK_HASH_SIZE &&
+           access(chunk_path(hash).c_str(), F_OK) == 0;
+}
+
+ChunkWriteBatch::~ChunkWriteBatch()
+{
+    for (auto &object : m_objects) {
+        discard_staging_file(object.first);
+    }
+}
+
+FileOperationResult ChunkWriteBatch::commit()
+{
+    // One pass over the batch instead of a commit per object; the group
+    // committer would hold each of them for its own window
+    bool durable = get_durability_mode() != DurabilityMode::NONE;
+    auto result = FileOperationResult::SUCCESS;
+    if (durable) {
+        for (auto &object : m_objects) {
+            if (fdatasync(object.first.fd) != 0) {
+                result = FileOperationResult::IO_ERROR;
+            }
+        }
+    }
+
+    // Concurrent writers of the same object rename identical contents
+    std::vector<std::string> directories;
+    for (auto &[staging, path] : m_objects) {
+        bool closed = close(staging.fd) == 0;
+        staging.fd = -1;
+        if (result != FileOperationResult::SUCCESS || !closed ||
+            rename(staging.path.c_str(), path.c_str()) != 0) {
+            discard_staging_file(staging);
+            result = FileOperationResult::IO_ERROR;
+            continue;
+        }
+        std::string directory = fs::path(path).parent_path().string();
+        if (std::find(directories.begin(), directories.end(), directory) ==
+            directories.end()) {
+            directories.push_back(std::move(directory));
+        }
+    }
+    m_objects.clear();
+
+    if (durable) {
+        for (const auto &directory : directories) {
+            int fd = open(directory.c_str(),
+                          O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+            if (fd < 0 || fsync(fd) != 0) {
+                result = FileOperationResult::IO_ERROR;
+            }
+            if (fd >= 0) {
+                close(fd);
+            }
+        }
+    }
+    return result;
+}
+
+FileOperationResult ChunkStore::put_object(const std::string &path,
+                                           const void *data,
+                                           size_t size,
+                                           ChunkWriteBatch &batch)
+{
+    // An object that is already stored only needs to look recently used,
+    // so a collection running now does not take it away from its new user
+    if (utimensat(AT_FDCWD, path.c_str(), nullptr, 0) == 0) {
+        return FileOperationResult::SUCCESS;
+    }
+
+    std::string directory = fs::path(path).parent_path().string();
+    if (mkdir(directory.c_str(), 0755) != 0 && errno != EEXIST) {
+        return errno_result(errno);
+    }
+
+    auto [staging, result] = create_staging_file(path, 0444);
+    if (result != FileOperationResult::SUCCESS) {
+        return result;
+    }
+    if (!write_all(staging.fd, data, size)) {
+        discard_staging_file(staging);
+        return FileOperationResult::IO_ERROR;
+    }
+    batch.m_objects.emplace_back(std::move(staging), path);
+    return FileOperationResult::SUCCESS;
+}
+
+bool ChunkStore::pin_manifest(const std::string &id) const
+{
+    return utimensat(AT_FDCWD, manifest_path(id).c_str(), nullptr, 0) == 0;
+}
+
+FileOperationResult ChunkStore::put_chunk(const std::string &hash,
+                                          const uint8_t *data,
+                                          size_t size,
+                                          ChunkWriteBatch *batch)
+{
+    if (hash.size() != CHUNK_HASH_SIZE || chunk_hash(data, size) != hash) {
+        return FileOperationResult::INVALID_PATH;
+    }
+    if (batch) {
+        return put_object(chunk_path(hash), data, size, *batch);
+    }
+    ChunkWriteBatch own_batch;
+    auto result = put_object(chunk_path(hash), data, size, own_batch);
+    return result == FileOperationResult::SUCCESS ? own_batch.commit()
+                                                  : result;
+}
+
+std::pair<std::string, FileOperationResult>
+ChunkStore::put_manifest(const fenris::ChunkManifest &manifest)
+{
+    std::string encoded;
+    manifest.SerializeToString(&encoded);
+    std::string id = to_hex(chunk_hash(
+        reinterpret_cast<const uint8_t *>(encoded.data()),
+        encoded.size()));
+    ChunkWriteBatch batch;
+    auto result =
+        put_object(manifest_path(id), encoded.data(), encoded.size(), batch);
+    if (result == FileOperationResult::SUCCESS) {
+        result = batch.commit();
+    }
+    return {id, result};
+}
+
+std::pair<fenris::ChunkManifest, FileOperationResult>
+ChunkStore::load_manifest(const std::string &id) const
+{
+    fenris::ChunkManifest manifest;
+    if (!is_hex_hash(id)) {
+        return {manifest, FileOperationResult::INVALID_PATH};
+    }
+    auto [encoded, result] = read_file(manifest_path(id));
+    if (result != FileOperationResult::SUCCESS) {
+        return {manifest, result};
+    }
+    if (!manifest.ParseFromString(encoded) || !valid_manifest(manifest)) {
+        return {manifest, FileOperationResult::IO_ERROR};
+    }
+    return {manifest, FileOperationResult::SUCCESS};
+}
+
+bool ChunkStore::read_range(const fenris::ChunkManifest &manifest,
+                            uint64_t offset,
+                            uint64_t length,
+                            PayloadSink &sink) const
+{
+    uint64_t file_size = manifest.file_size();
+    if (offset >= file_size) {
+        return true;
+    }
+    uint64_t end = offset + std::min(length, file_size - offset);
+
+    std::vector<uint8_t> buffer;
+    uint64_t chunk_start = 0;
+    for (int i = 0; i < manifest.lengths_size() && chunk_start < end; i++) {
+        uint64_t chunk_end = chunk_start + manifest.lengths(i);
+        if (chunk_end > offset) {
+            uint64_t from = std::max(offset, chunk_start) - chunk_start;
+            uint64_t to = std::min(end, chunk_end) - chunk_start;
+            int fd = open(chunk_path(hash_at(manifest, i)).c_str(),
+                          O_RDONLY | O_CLOEXEC);
+            if (fd < 0) {
+                return false;
+            }
+            buffer.resize(static_cast<size_t>(to - from));
+            bool copied = pread_all(fd, buffer.data(), buffer.size(), from);
+            close(fd);
+            if (!copied || !sink.write(buffer.data(), buffer.size())) {
+                return false;
+            }
+        }
+        chunk_start = chunk_end;
+    }
+    return true;
+}
+
+std::pair<int, FileOperationResult>
+ChunkStore::assemble(const fenris::ChunkManifest &manifest,
+                     uint64_t offset,
+                     uint64_t length) const
+{
+    int fd = open(m_root.c_str(), O_RDWR | O_TMPFILE | O_CLOEXEC, 0600);
+    if (fd < 0) {
+        return {-1, errno_result(errno)};
+    }
+
+    FilePayloadSink sink(fd);
+    if (!read_range(manifest, offset, length, sink) ||
+        lseek(fd, 0, SEEK_SET) != 0) {
+        close(fd);
+        return {-1, FileOperationResult::IO_ERROR};
+    }
+    return {fd, FileOperationResult::SUCCESS};
+}
+
+FileOperationResult ChunkStore::deduplicate(int fd)
+{
+    struct stat st;
+    if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode)) {
+        return FileOperationResult::INVALID_PATH;
+    }
+    // Below one chunk the manifest and the chunk cost more than the file
+    auto size = static_cast<size_t>(st.st_size);
+    if (size < MIN_CHUNK_SIZE) {
+        return FileOperationResult::SUCCESS;
+    }
+
+    void *address = mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+    if (address == MAP_FAILED) {
+        return FileOperationResult::IO_ERROR;
+    }
+    madvise(address, size, MADV_SEQUENTIAL);
+
+    auto data = static_cast<const uint8_t *>(address);
+    fenris::ChunkManifest manifest;
+    manifest.set_file_size(size);
+    ChunkWriteBatch batch;
+    auto result = FileOperationResult::SUCCESS;
+    for (size_t offset = 0; offset < size;) {
+        size_t length = next_chunk_boundary(data + offset, size - offset);
+        std::string hash = chunk_hash(data + offset, length);
+        result = put_object(chunk_path(hash), data + offset, length, batch);
+        if (result != FileOperationResult::SUCCESS) {
+            break;
+        }
+        manifest.add_lengths(static_cast<uint32_t>(length));
+        manifest.mutable_hashes()->append(hash);
+        offset += length;
+    }
+    munmap(address, size);
+    // Every chunk is on disk before the manifest naming them is published
+    if (result == FileOperationResult::SUCCESS) {
+        result = batch.commit();
+    }
+    if (result != FileOperationResult::SUCCESS) {
+        return result;
+    }
+
+    auto [id, manifest_result] = put_manifest(manifest);
+    if (manifest_result != FileOperationResult::SUCCESS) {
+        return manifest_result;
+    }
+    if (fsetxattr(fd, MANIFEST_XATTR, id.data(), id.size(), 0) != 0) {
+        // The chunks stored above are reclaimed by the next collection
+        return xattrs_unsupported(errno) ? FileOperationResult::SUCCESS
+                                         : FileOperationResult::IO_ERROR;
+    }
+
+    // Dropping the contents and extending the file again leaves a hole of
+    // the original size
+    if (ftruncate(fd, 0) != 0 || ftruncate(fd, st.st_size) != 0) {
+        return FileOperationResult::IO_ERROR;
+    }
+    return FileOperationResult::SUCCESS;
+}
+
+FileOperationResult
+ChunkStore::link_manifest(int fd, const fenris::ChunkManifest &manifest)
+{
+    if (!valid_manifest(manifest)) {
+        return FileOperationResult::INVALID_PATH;
+    }
+    for (int i = 0; i < manifest.lengths_size(); i++) {
+        if (!has_chunk(hash_at(manifest, i))) {
+            return FileOperationResult::FILE_NOT_FOUND;
+        }
+    }
+
+    if (manifest.file_size() >= MIN_CHUNK_SIZE) {
+        auto [id, result] = put_manifest(manifest);
+        if (result != FileOperationResult::SUCCESS) {
+            return result;
+        }
+        if (fsetxattr(fd, MANIFEST_XATTR, id.data(), id.size(), 0) == 0) {
+            return ftruncate(fd, static_cast<off_t>(manifest.file_size())) ==
+                           0
+                       ? FileOperationResult::SUCCESS
+                       : FileOperationResult::IO_ERROR;
+        }
+        if (!xattrs_unsupported(errno)) {
+            return FileOperationResult::IO_ERROR;
+        }
+    }
+
+    // Small files, and filesystems that cannot hold a placeholder, get
+    // their contents written out
+    FilePayloadSink sink(fd, true);
+    if (!read_range(manifest, 0, manifest.file_size(), sink) ||
+        !sink.finish()) {
+        return FileOperationResult::IO_ERROR;
+    }
+    return FileOperationResult::SUCCESS;
+}
+
+std::pair<ChunkCollectionStats, FileOperationResult>
+ChunkStore::collect_garbage(const std::string &namespace_root,
+                            std::chrono::seconds grace_period)
+{
+    ChunkCollectionStats stats;
+
+    // Mark: every manifest a placeholder in the namespace refers to. A
+    // partial walk could miss references, so any error stops the collection
+    std::unordered_set<std::string> referenced;
+    std::error_code ec;
+    for (fs::recursive_directory_iterator it(namespace_root, ec), end;
+         !ec && it != end;
+         it.increment(ec)) {
+        std::error_code status_ec;
+        if (!it->is_regular_file(status_ec) || it->is_symlink(status_ec)) {
+            continue;
+        }
+        char id[HEX_HASH_SIZE];
+        ssize_t size =
+            lgetxattr(it->path().c_str(), MANIFEST_XATTR, id, sizeof(id));
+        if (size == static_cast<ssize_t>(sizeof(id))) {
+            referenced.emplace(id, sizeof(id));
+        }
+    }
+    if (ec) {
+        return {stats, system_error_to_file_operation_result(ec)};
+    }
+
+    auto cutoff = fs::file_time_type::clock::now() - grace_period;
+    auto is_stale = [cutoff](const fs::directory_entry &entry) {
+        std::error_code time_ec;
+        auto modified = entry.last_write_time(time_ec);
+        return !time_ec && modified < cutoff;
+    };
+    auto remove = [&stats](const fs::directory_entry &entry) {
+        std::error_code remove_ec;
+        uintmax_t size = entry.file_size(remove_ec);
+        if (fs::remove(entry.path(), remove_ec)) {
+            stats.bytes_freed += remove_ec ? 0 : size;
+            return true;
+        }
+        return false;
+    };
+
+    // Manifests nobody refers to go; the chunks of the others stay
+    std::unordered_set<std::string> live_chunks;
+    auto result = FileOperationResult::SUCCESS;
+    for_each_object(fs::path(m_root) / "manifests",
+                    [&](const fs::directory_entry &entry) {
+                        std::string id = entry.path().filename().string();
+                        bool stale = is_stale(entry);
+                        if (!is_hex_hash(id)) {
+                            // Staging file left by an interrupted write
+                            if (stale) {
+                                remove(entry);
+                            }
+                            return;
+                        }
+                        if (stale && !referenced.count(id)) {
+                            if (remove(entry)) {
+                                stats.manifests_removed++;
+                            }
+                            return;
+                        }
+
+                        auto [manifest, load_result] = load_manifest(id);
+                        if (load_result != FileOperationResult::SUCCESS) {
+                            result = FileOperationResult::IO_ERROR;
+                            return;
+                        }
+                        for (int i = 0; i < manifest.lengths_size(); i++) {
+                            live_chunks.insert(to_hex(hash_at(manifest, i)));
+                        }
+                    });
+    if (result != FileOperationResult::SUCCESS) {
+        // Without the chunk list of every live manifest no chunk is safe
+        // to remove
+        return {stats, result};
+    }
+
+    for_each_object(fs::path(m_root) / "chunks",
+                    [&](const fs::directory_entry &entry) {
+                        std::string hex = entry.path().filename().string();
+                        if (!live_chunks.count(hex) && is_stale(entry) &&
+                            remove(entry) && is_hex_hash(hex)) {
+                            stats.chunks_removed++;
+                        }
+                    });
+
+    return {stats, FileOperationResult::SUCCESS};
+}
+
+void set_chunk_store(std::shared_ptr<ChunkStore> store,
+                     bool deduplicate_writes)
+{
+    std::lock_guard<std::mutex> lock(g_chunk_store_mutex);
+    g_has_chunk_store = store != nullptr;
+    g_deduplicate_writes = store != nullptr && deduplicate_writes;
+    g_chunk_store = std::move(store);
+}
+
+std::shared_ptr<ChunkStore> get_chunk_store()
+{
+    // Every read checks for a store, so the common case takes no lock
+    if (!g_has_chunk_store) {
+        return nullptr;
+    }
+    std::lock_guard<std::mutex> lock(g_chunk_store_mutex);
+    return g_chunk_store;
+}
+
+bool deduplicating_writes()
+{
+    return g_deduplicate_writes;
+}
+
+namespace {
+
+// Id of the manifest a placeholder names, or nullopt for a plain file
+std::pair<std::optional<std::string>, FileOperationResult> manifest_id(int fd)
+{
+    char id[HEX_HASH_SIZE];
+    ssize_t size = fgetxattr(fd, MANIFEST_XATTR, id, sizeof(id));
+    if (size < 0) {
+        if (errno == ENODATA || xattrs_unsupported(errno)) {
+            return {std::nullopt, FileOperationResult::SUCCESS};
+        }
+        return {std::nullopt, FileOperationResult::IO_ERROR};
+    }
+    return {std::string(id, static_cast<size_t>(size)),
+            FileOperationResult::SUCCESS};
+}
+
+} // namespace
+
+std::pair<std::optional<fenris::ChunkManifest>, FileOperationResult>
+file_manifest(int fd)
+{
+    auto store = get_chunk_store();
+    if (!store) {
+        return {std::nullopt, FileOperationResult::SUCCESS};
+    }
+
+    auto [id, id_result] = manifest_id(fd);
+    if (id_result != FileOperationResult::SUCCESS || !id) {
+        return {std::nullopt, id_result};
+    }
+
+    auto [manifest, result] = store->load_manifest(*id);
+    if (result != FileOperationResult::SUCCESS) {
+        // The placeholder holds none of the data, so there is nothing to
+        // fall back to
+        return {std::nullopt, FileOperationResult::IO_ERROR};
+    }
+    return {std::move(manifest), FileOperationResult::SUCCESS};
+}
+
+bool is_deduplicated_file(const std::string &filepath)
+{
+    if (!get_chunk_store()) {
+        return false;
+    }
+    char id[HEX_HASH_SIZE];
+    return getxattr(filepath.c_str(), MANIFEST_XATTR, id, sizeof(id)) ==
+           static_cast<ssize_t>(sizeof(id));
+}
+
+std::pair<std::unique_ptr<PayloadSource>, FileOperationResult>
+open_chunked_payload(int fd, uint64_t offset, uint64_t length)
+{
+    // Packed small files are sent from a copy of their pack record
+    auto [packed_fd, packed_result] = open_packed_range(fd, offset, length);
+    if (packed_result != FileOperationResult::SUCCESS) {
+        return {nullptr, packed_result};
+    }
+    if (packed_fd >= 0) {
+        struct stat st;
+        if (fstat(packed_fd, &st) != 0) {
+            close(packed_fd);
+            return {nullptr, FileOperationResult::IO_ERROR};
+        }
+        return {std::make_unique<FilePayloadSource>(
+                    packed_fd,
+                    static_cast<uint64_t>(st.st_size)),
+                FileOperationResult::SUCCESS};
+    }
+
+    auto store = get_chunk_store();
+    if (!store) {
+        return {nullptr, FileOperationResult::SUCCESS};
+    }
+    auto [id, result] = manifest_id(fd);
+    if (result != FileOperationResult::SUCCESS || !id) {
+        return {nullptr, result};
+    }
+    return ChunkedPayloadSource::open(std::move(store), *id, offset, length);
+}
+
+std::pair<int, FileOperationResult>
+open_chunked_range(int fd, uint64_t offset, uint64_t length)
+{
+    // Packed small files are opened from their pack record instead
+    auto [packed_fd, packed_result] = open_packed_range(fd, offset, length);
+    if (packed_result != FileOperationResult::SUCCESS || packed_fd >= 0) {
+        return {packed_fd, packed_result};
+    }
+
+    auto [manifest, result] = file_manifest(fd);
+    if (result != FileOperationResult::SUCCESS || !manifest) {
+        return {-1, result};
+    }
+    auto store = get_chunk_store();
+    if (!store) {
+        return {-1, FileOperationResult::IO_ERROR};
+    }
+    return store->assemble(*manifest, offset, length);
+}
+
+std::pair<bool, FileOperationResult> copy_placeholder(int source_fd,
+                                                      int destination_fd)
+{
+    // A packed source shares its pack record instead
+    auto [packed, packed_result] =
+        copy_packed_placeholder(source_fd, destination_fd);
+    if (packed || packed_result != FileOperationResult::SUCCESS) {
+        return {packed, packed_result};
+    }
+
+    if (!get_chunk_store()) {
+        return {false, FileOperationResult::SUCCESS};
+    }
+
+    char id[HEX_HASH_SIZE];
+    ssize_t size = fgetxattr(source_fd, MANIFEST_XATTR, id, sizeof(id));
+    if (size < 0) {
+        if (errno != ENODATA && !xattrs_unsupported(errno)) {
+            return {false, FileOperationResult::IO_ERROR};
+        }
+        // A plain copy must not inherit the manifest of the file it
+        // replaces
+        if (fremovexattr(destination_fd, MANIFEST_XATTR) != 0 &&
+            errno != ENODATA && !xattrs_unsupported(errno)) {
+            return {false, FileOperationResult::IO_ERROR};
+        }
+        return {false, FileOperationResult::SUCCESS};
+    }
+
+    struct stat st;
+    if (fstat(source_fd, &st) != 0 ||
+        fsetxattr(destination_fd,
+                  MANIFEST_XATTR,
+                  id,
+                  static_cast<size_t>(size),
+                  0) != 0 ||
+        ftruncate(destination_fd, st.st_size) != 0) {
+        return {true, FileOperationResult::IO_ERROR};
+    }
+    return {true, FileOperationResult::SUCCESS};
+}
+
+FileOperationResult deduplicate_file(int fd)
+{
+    if (!g_deduplicate_writes) {
+        return FileOperationResult::SUCCESS;
+    }
+    auto store = get_chunk_store();
+    return store ? store->deduplicate(fd) : FileOperationResult::SUCCESS;
+}
+
+FileOperationResult materialize_file(const std::string &filepath)
+{
+    auto store = get_chunk_store();
+    if (!store && !get_pack_store()) {
+        return FileOperationResult::SUCCESS;
+    }
+
+    int fd = open(filepath.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        // Missing files are the caller's to report
+        return errno == ENOENT ? FileOperationResult::SUCCESS
+                               : errno_result(errno);
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode)) {
+        close(fd);
+        return FileOperationResult::SUCCESS;
+    }
+
+    // A packed file is small enough to read whole
+    auto [packed, result] =
+        read_packed_range(fd, st, 0, static_cast<uint64_t>(st.st_size));
+    std::optional<fenris::ChunkManifest> manifest;
+    if (result == FileOperationResult::SUCCESS && !packed) {
+        std::tie(manifest, result) = file_manifest(fd);
+    }
+    close(fd);
+    if (result != FileOperationResult::SUCCESS || (!packed && !manifest)) {
+        return result;
+    }
+
+    // The plain copy replaces the placeholder in one rename
+    auto [staging, staging_result] =
+        create_staging_file(filepath, st.st_mode & 07777);
+    if (staging_result != FileOperationResult::SUCCESS) {
+        return staging_result;
+    }
+    FilePayloadSink sink(staging.fd, true);
+    bool copied =
+        packed ? sink.write(reinterpret_cast<const uint8_t *>(packed->data()),
+                            packed->size())
+               : store->read_range(*manifest, 0, manifest->file_size(), sink);
+    if (!copied || !sink.finish()) {
+        discard_staging_file(staging);
+        return FileOperationResult::IO_ERROR;
+    }
+    return commit_staging_file(staging, filepath);
+}
+
+ChunkUploadSource::ChunkUploadSource(std::shared_ptr<const MappedFile> file,
+                                     const fenris::ChunkManifest &manifest,
+                                     std::vector<uint32_t> indices)
+    : m_file(std::move(file)), m_indices(std::move(indices))
+{
+    std::vector<uint64_t> offsets;
+    offsets.reserve(manifest.lengths_size());
+    uint64_t offset = 0;
+    for (uint32_t length : manifest.lengths()) {
+        offsets.push_back(offset);
+        offset += length;
+    }
+    for (uint32_t index : m_indices) {
+        uint32_t length = manifest.lengths(static_cast<int>(index));
+        m_chunks.emplace_back(offsets[index], length);
+        m_size += sizeof(uint32_t) + length;
+    }
+}
+
+uint64_t ChunkUploadSource::size() const
+{
+    return m_size;
+}
+
+bool ChunkUploadSource::read(uint8_t *buffer, size_t size)
+{
+    while (size > 0) {
+        if (m_current >= m_chunks.size()) {
+            return false;
+        }
+        auto [offset, length] = m_chunks[m_current];
+        if (offset + length > m_file->size()) {
+            // The local file shrank after it was chunked
+            return false;
+        }
+
+        size_t copied;
+        if (m_position < sizeof(uint32_t)) {
+            uint32_t value = m_indices[m_current];
+            uint8_t index[sizeof(uint32_t)];
+            for (size_t i = 0; i < sizeof(index); i++) {
+                index[i] = static_cast<uint8_t>(value >> (8 * i));
+            }
+            copied = std::min<size_t>(size, sizeof(index) - m_position);
+            std::copy(index + m_position, index + m_position + copied, buffer);
+        } else {
+            uint64_t within = m_position - sizeof(uint32_t);
+            copied = static_cast<size_t>(
+                std::min<uint64_t>(size, length - within));
+            auto start = m_file->data() + offset + within;
+            std::copy(start, start + copied, buffer);
+        }
+
+        buffer += copied;
+        size -= copied;
+        m_position += copied;
+        if (m_position == sizeof(uint32_t) + length) {
+            m_current++;
+            m_position = 0;
+        }
+    }
+    return true;
+}
+
+std::pair<std::unique_ptr<ChunkedPayloadSource>, FileOperationResult>
+ChunkedPayloadSource::open(std::shared_ptr<const ChunkStore> store,
+                           const std::string &id,
+                           uint64_t offset,
+                           uint64_t length)
+{
+    // Pinned before the manifest is read, so nothing collects it between
+    // the two
+    if (!store->pin_manifest(id)) {
+        return {nullptr, FileOperationResult::IO_ERROR};
+    }
+    auto [manifest, result] = store->load_manifest(id);
+    if (result != FileOperationResult::SUCCESS) {
+        // The placeholder holds none of the data, so there is nothing to
+        // fall back to
+        return {nullptr, FileOperationResult::IO_ERROR};
+    }
+
+    uint64_t file_size = manifest.file_size();
+    offset = std::min(offset, file_size);
+    uint64_t end = offset + std::min(length, file_size - offset);
+    return {std::unique_ptr<ChunkedPayloadSource>(
+                new ChunkedPayloadSource(std::move(store),
+                                         id,
+                                         std::move(manifest),
+                                         offset,
+                                         end)),
+            FileOperationResult::SUCCESS};
+}
+
+ChunkedPayloadSource::ChunkedPayloadSource(
+    std::shared_ptr<const ChunkStore> store,
+    std::string id,
+    fenris::ChunkManifest manifest,
+    uint64_t offset,
+    uint64_t end)
+    : m_store(std::move(store)), m_id(std::move(id)),
+      m_manifest(std::move(manifest)), m_offset(offset), m_position(offset),
+      m_end(end), m_pinned(std::chrono::steady_clock::now())
+{
+}
+
+ChunkedPayloadSource::~ChunkedPayloadSource()
+{
+    if (m_fd >= 0) {
+        close(m_fd);
+    }
+}
+
+uint64_t ChunkedPayloadSource::size() const
+{
+    return m_end - m_offset;
+}
+
+bool ChunkedPayloadSource::read(uint8_t *buffer, size_t size)
+{
+    while (size > 0) {
+        if (m_position >= m_end) {
+            return false;
+        }
+
+        // Move on to the chunk holding the next byte
+        uint64_t chunk_end = m_chunk_start + m_manifest.lengths(m_chunk);
+        while (chunk_end <= m_position) {
+            if (m_fd >= 0) {
+                close(m_fd);
+                m_fd = -1;
+            }
+            m_chunk_start = chunk_end;
+            m_chunk++;
+            chunk_end += m_manifest.lengths(m_chunk);
+        }
+
+        if (m_fd < 0) {
+            auto now = std::chrono::steady_clock::now();
+            if (now - m_pinned >= CHUNK_PIN_INTERVAL) {
+                m_store->pin_manifest(m_id);
+                m_pinned = now;
+            }
+            m_fd = ::open(
+                m_store->chunk_path(hash_at(m_manifest, m_chunk)).c_str(),
+                O_RDONLY | O_CLOEXEC);
+            if (m_fd < 0) {
+                return false;
+            }
+        }
+
+        size_t copied = static_cast<size_t>(
+            std::min<uint64_t>(size, std::min(m_end, chunk_end) - m_position));
+        if (!pread_all(m_fd, buffer, copied, m_position - m_chunk_start)) {
+            return false;
+        }
+        buffer += copied;
+        size -= copied;
+        m_position += copied;
+    }
+    return true;
+}
+
+ChunkReceiver::ChunkReceiver(ChunkStore &store,
+                             const fenris::ChunkManifest &manifest)
+    : m_store(store), m_manifest(manifest)
+{
+}
+
+bool ChunkReceiver::write(const uint8_t *data, size_t size)
+{
+    if (m_failed) {
+        return false;
+    }
+
+    while (size > 0) {
+        size_t taken;
+        if (m_index < 0) {
+            taken = std::min(sizeof(uint32_t) - m_field.size(), size);
+            m_field.append(reinterpret_cast<const char *>(data), taken);
+            if (m_field.size() == sizeof(uint32_t)) {
+                uint32_t index = 0;
+                for (size_t i = 0; i < sizeof(index); i++) {
+                    index |= static_cast<uint32_t>(
+                                 static_cast<uint8_t>(m_field[i]))
+                             << (8 * i);
+                }
+                m_field.clear();
+                if (index >= static_cast<uint32_t>(m_manifest.lengths_size())) {
+                    m_failed = true;
+                    return false;
+                }
+                m_index = index;
+                m_chunk.clear();
+            }
+        } else {
+            uint32_t length = m_manifest.lengths(static_cast<int>(m_index));
+            taken = std::min<size_t>(length - m_chunk.size(), size);
+            m_chunk.append(reinterpret_cast<const char *>(data), taken);
+            if (m_chunk.size() == length) {
+                // put_chunk checks the contents against the manifest
+                if (m_store.put_chunk(
+                        hash_at(m_manifest, static_cast<int>(m_index)),
+                        reinterpret_cast<const uint8_t *>(m_chunk.data()),
+                        m_chunk.size(),
+                        &m_batch) != FileOperationResult::SUCCESS) {
+                    m_failed = true;
+                    return false;
+                }
+                m_index = -1;
+            }
+        }
+        data += taken;
+        size -= taken;
+    }
+    return true;
+}
+
+bool ChunkReceiver::finish()
+{
+    bool complete = !m_failed && m_index < 0 && m_field.empty();
+    return m_batch.commit() == FileOperationResult::SUCCESS && complete;
+}
+
+FileOperationResult
+write_file_from_chunks(const std::string &filepath,
+                       const fenris::ChunkManifest &manifest,
+                       IncomingPayload *payload)
+{
+    auto store = get_chunk_store();
+    if (!store || !valid_manifest(manifest)) {
+        return FileOperationResult::INVALID_PATH;
+    }
+
+    // Same permission rules as write_file, checked before the body is read
+    struct stat st;
+    bool exists = stat(filepath.c_str(), &st) == 0;
+    if (exists) {
+        if ((st.st_mode & S_IWUSR) == 0) {
+            return FileOperationResult::PERMISSION_DENIED;
+        }
+    } else if (errno != ENOENT) {
+        return errno_result(errno);
+    }
+
+    if (payload) {
+        // Chunks that did arrive are kept for a retry of the upload
+        ChunkReceiver receiver(*store, manifest);
+        bool received = payload->read_into(receiver) == PayloadResult::SUCCESS;
+        if (!receiver.finish() || !received) {
+            return FileOperationResult::IO_ERROR;
+        }
+    }
+
+    auto [staging, staging_result] =
+        create_staging_file(filepath, exists ? (st.st_mode & 07777) : 0644);
+    if (staging_result != FileOperationResult::SUCCESS) {
+        return staging_result;
+    }
+    auto result = store->link_manifest(staging.fd, manifest);
+    if (result != FileOperationResult::SUCCESS) {
+        discard_staging_file(staging);
+        return result;
+    }
+    return commit_staging_file(staging, filepath);
+}
+
+} // namespace common
+} // namespace fenris
@@ -1,5 +1,9 @@
 #include "common/compression_manager.hpp"
+#include <algorithm>
 #include <stdexcept>
+#include <string_view>
+#include <unordered_map>
+#include <unordered_set>
 #include <vector>
 #include <zlib.h>
 
@@ -101,6 +105,220 @@ CompressionManager::decompress(const std::vector<uint8_t> &input,
     return {decompressed_data, CompressionResult::SUCCESS};
 }
 
+std::pair<std::vector<uint8_t>, CompressionResult>
+CompressionManager::compress_with_dictionary(
+    const std::vector<uint8_t> &input,
+    int level,
+    const std::vector<uint8_t> &dictionary)
+{
+    if (level < 0 || level > 9) {
+        return {std::vector<uint8_t>(), CompressionResult::INVALID_LEVEL};
+    }
+
+    z_stream stream{};
+    int zlib_result = deflateInit(&stream, level);
+    if (zlib_result != Z_OK) {
+        return {std::vector<uint8_t>(),
+                zlib_error_to_compression_result(zlib_result)};
+    }
+
+    if (!dictionary.empty()) {
+        zlib_result =
+            deflateSetDictionary(&stream,
+                                 dictionary.data(),
+                                 static_cast<uInt>(dictionary.size()));
+        if (zlib_result != Z_OK) {
+            deflateEnd(&stream);
+            return {std::vector<uint8_t>(),
+                    zlib_error_to_compression_result(zlib_result)};
+        }
+    }
+
+    std::vector<uint8_t> compressed_data(deflateBound(&stream, input.size()));
+
+    stream.next_in = const_cast<Bytef *>(input.data());
+    stream.avail_in = static_cast<uInt>(input.size());
+    stream.next_out = compressed_data.data();
+    stream.avail_out = static_cast<uInt>(compressed_data.size());
+
+    zlib_result = deflate(&stream, Z_FINISH);
+    size_t compressed_size = stream.total_out;
+    deflateEnd(&stream);
+
+    if (zlib_result != Z_STREAM_END) {
+        return {std::vector<uint8_t>(), CompressionResult::COMPRESSION_FAILED};
+    }
+
+    compressed_data.resize(compressed_size);
+    return {compressed_data, CompressionResult::SUCCESS};
+}
+
+std::pair<std::vector<uint8_t>, CompressionResult>
+CompressionManager::decompress_with_dictionary(
+    const std::vector<uint8_t> &input,
+    size_t original_size,
+    const std::vector<uint8_t> &dictionary)
+{
+    z_stream stream{};
+    int zlib_result = inflateInit(&stream);
+    if (zlib_result != Z_OK) {
+        return {std::vector<uint8_t>(),
+                CompressionResult::DECOMPRESSION_FAILED};
+    }
+
+    std::vector<uint8_t> decompressed_data(original_size);
+
+    stream.next_in = const_cast<Bytef *>(input.data());
+    stream.avail_in = static_cast<uInt>(input.size());
+    stream.next_out = decompressed_data.data();
+    stream.avail_out = static_cast<uInt>(decompressed_data.size());
+
+    zlib_result = inflate(&stream, Z_FINISH);
+    if (zlib_result == Z_NEED_DICT) {
+        if (dictionary.empty()) {
+            inflateEnd(&stream);
+            return {std::vector<uint8_t>(), CompressionResult::INVALID_DATA};
+        }
+
+        zlib_result =
+            inflateSetDictionary(&stream,
+                                 dictionary.data(),
+                                 static_cast<uInt>(dictionary.size()));
+        if (zlib_result == Z_OK) {
+            zlib_result = inflate(&stream, Z_FINISH);
+        }
+    }
+
+    size_t decompressed_size = stream.total_out;
+    inflateEnd(&stream);
+
+    if (zlib_result != Z_STREAM_END) {
+        // A full output buffer without the end of stream means the caller's
+        // original_size was too small
+        CompressionResult result =
+            (zlib_result == Z_BUF_ERROR && stream.avail_out == 0)
+                ? CompressionResult::BUFFER_TOO_SMALL
+                : CompressionResult::INVALID_DATA;
+        return {std::vector<uint8_t>(), result};
+    }
+
+    decompressed_data.resize(decompressed_size);
+    return {decompressed_data, CompressionResult::SUCCESS};
+}
+
+std::vector<uint8_t> CompressionManager::train_dictionary(
+    const std::vector<std::vector<uint8_t>> &samples,
+    size_t max_size)
+{
+    // Substrings shorter than this are cheap for deflate to encode anyway
+    constexpr size_t KMER_SIZE = 8;
+    constexpr size_t SEGMENT_SIZE = 64;
+
+    max_size = std::min(max_size, MAX_DICTIONARY_SIZE);
+    if (samples.empty() || max_size == 0) {
+        return {};
+    }
+
+    auto kmer_at = [](const std::vector<uint8_t> &sample, size_t pos) {
+        return std::string_view(
+            reinterpret_cast<const char *>(sample.data()) + pos,
+            KMER_SIZE);
+    };
+
+    // Count in how many samples each k-mer occurs
+    std::unordered_map<std::string_view, uint32_t> sample_frequency;
+    for (const auto &sample : samples) {
+        if (sample.size() < KMER_SIZE) {
+            continue;
+        }
+        std::unordered_set<std::string_view> seen;
+        for (size_t pos = 0; pos + KMER_SIZE <= sample.size(); ++pos) {
+            if (seen.insert(kmer_at(sample, pos)).second) {
+                sample_frequency[kmer_at(sample, pos)]++;
+            }
+        }
+    }
+
+    struct Segment {
+        uint64_t score;
+        size_t sample;
+        size_t offset;
+        size_t length;
+    };
+
+    // Score overlapping segments by how much shared content they carry
+    std::vector<Segment> candidates;
+    for (size_t index = 0; index < samples.size(); ++index) {
+        const auto &sample = samples[index];
+        for (size_t offset = 0; offset + KMER_SIZE <= sample.size();
+             offset += SEGMENT_SIZE / 2) {
+            size_t length = std::min(SEGMENT_SIZE, sample.size() - offset);
+            uint64_t score = 0;
+            for (size_t pos = offset; pos + KMER_SIZE <= offset + length;
+                 ++pos) {
+                uint32_t frequency = sample_frequency[kmer_at(sample, pos)];
+                if (frequency > 1) {
+                    score += frequency;
+                }
+            }
+            if (score > 0) {
+                candidates.push_back({score, index, offset, length});
+            }
+        }
+    }
+
+    std::stable_sort(candidates.begin(),
+                     candidates.end(),
+                     [](const Segment &a, const Segment &b) {
+                         return a.score > b.score;
+                     });
+
+    // Greedily take segments that still add content not already covered
+    std::unordered_set<std::string_view> covered;
+    std::vector<const Segment *> chosen;
+    size_t total_size = 0;
+    for (const auto &candidate : candidates) {
+        if (total_size + candidate.length > max_size) {
+            continue;
+        }
+
+        const auto &sample = samples[candidate.sample];
+        uint64_t gain = 0;
+        for (size_t pos = candidate.offset;
+             pos + KMER_SIZE <= candidate.offset + candidate.length;
+             ++pos) {
+            auto kmer = kmer_at(sample, pos);
+            uint32_t frequency = sample_frequency[kmer];
+            if (frequency > 1 && !covered.count(kmer)) {
+                gain += frequency;
+            }
+        }
+        if (gain == 0) {
+            continue;
+        }
+
+        for (size_t pos = candidate.offset;
+             pos + KMER_SIZE <= candidate.offset + candidate.length;
+             ++pos) {
+            covered.insert(kmer_at(sample, pos));
+        }
+        chosen.push_back(&candidate);
+        total_size += candidate.length;
+    }
+
+    // Most valuable segments go last, closest to the data being compressed
+    std::vector<uint8_t> dictionary;
+    dictionary.reserve(total_size);
+    for (auto it = chosen.rbegin(); it != chosen.rend(); ++it) {
+        const auto &sample = samples[(*it)->sample];
+        dictionary.insert(dictionary.end(),
+                          sample.begin() + (*it)->offset,
+                          sample.begin() + (*it)->offset + (*it)->length);
+    }
+
+    return dictionary;
+}
+
 } // namespace compress
 } // namespace common
 } // namespace fenris
@@ -137,6 +137,70 @@ CryptoManager::decrypt_data(const std::vector<uint8_t> &ciphertext,
     }
 }
 
+EncryptionResult
+CryptoManager::encrypt_in_place(uint8_t *data,
+                                size_t size,
+                                const std::vector<uint8_t> &key,
+                                const uint8_t *iv)
+{
+    if (key.size() != 16 && key.size() != 24 && key.size() != 32) {
+        return EncryptionResult::INVALID_KEY_SIZE;
+    }
+
+    try {
+        GCM<AES>::Encryption encryptor;
+        encryptor.SetKeyWithIV(key.data(), key.size(), iv, AES_GCM_IV_SIZE);
+        // The tag lands directly after the ciphertext, matching the layout
+        // produced by encrypt_data
+        encryptor.EncryptAndAuthenticate(data,
+                                         data + size,
+                                         AES_GCM_TAG_SIZE,
+                                         iv,
+                                         AES_GCM_IV_SIZE,
+                                         nullptr,
+                                         0,
+                                         data,
+                                         size);
+        return EncryptionResult::SUCCESS;
+    } catch (...) {
+        return EncryptionResult::ENCRYPTION_FAILED;
+    }
+}
+
+EncryptionResult
+CryptoManager::decrypt_in_place(uint8_t *data,
+                                size_t size,
+                                const std::vector<uint8_t> &key,
+                                const uint8_t *iv)
+{
+    if (key.size() != 16 && key.size() != 24 && key.size() != 32) {
+        return EncryptionResult::INVALID_KEY_SIZE;
+    }
+
+    if (size < AES_GCM_TAG_SIZE) {
+        return EncryptionResult::INVALID_DATA;
+    }
+
+    size_t ciphertext_size = size - AES_GCM_TAG_SIZE;
+    try {
+        GCM<AES>::Decryption decryptor;
+        decryptor.SetKeyWithIV(key.data(), key.size(), iv, AES_GCM_IV_SIZE);
+        bool verified = decryptor.DecryptAndVerify(data,
+                                                   data + ciphertext_size,
+                                                   AES_GCM_TAG_SIZE,
+                                                   iv,
+                                                   AES_GCM_IV_SIZE,
+                                                   nullptr,
+                                                   0,
+                                                   data,
+                                                   ciphertext_size);
+        return verified ? EncryptionResult::SUCCESS
+                        : EncryptionResult::DECRYPTION_FAILED;
+    } catch (...) {
+        return EncryptionResult::DECRYPTION_FAILED;
+    }
+}
+
 std::tuple<std::vector<uint8_t>, std::vector<uint8_t>, ECDHResult>
 CryptoManager::generate_ecdh_keypair()
 {
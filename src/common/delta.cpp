@@ -0,0 +1,579 @@
+#include "common/delta.hpp"
+#include "common/chunk_store.hpp"
+#include "common/pack_store.hpp"
+
+#include <cryptopp/sha.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <system_error>
+#include <unistd.h>
+#include <unordered_map>
+#include <vector>
+
+namespace fenris {
+namespace common {
+
+namespace {
+
+constexpr char DELTA_MAGIC[4] = {'F', 'D', 'L', 'T'};
+
+// Instruction opcodes of the delta stream
+constexpr uint8_t OP_END = 0;     // Followed by the digest of the new file
+constexpr uint8_t OP_COPY = 1;    // u64 first block, u32 block count
+constexpr uint8_t OP_LITERAL = 2; // u32 length, then that many bytes
+
+// Longest literal carried by one instruction
+constexpr size_t MAX_LITERAL_SIZE = PAYLOAD_CHUNK_SIZE;
+
+// Encoded instructions are batched up to this size before reaching the sink
+constexpr size_t DELTA_BUFFER_SIZE = 64 * 1024;
+
+void put_u32(std::string &out, uint32_t value)
+{
+    for (int i = 0; i < 4; i++) {
+        out.push_back(static_cast<char>(value >> (8 * i)));
+    }
+}
+
+void put_u64(std::string &out, uint64_t value)
+{
+    for (int i = 0; i < 8; i++) {
+        out.push_back(static_cast<char>(value >> (8 * i)));
+    }
+}
+
+uint32_t get_u32(const char *in)
+{
+    uint32_t value = 0;
+    for (int i = 0; i < 4; i++) {
+        value |= static_cast<uint32_t>(static_cast<uint8_t>(in[i])) << (8 * i);
+    }
+    return value;
+}
+
+uint64_t get_u64(const char *in)
+{
+    uint64_t value = 0;
+    for (int i = 0; i < 8; i++) {
+        value |= static_cast<uint64_t>(static_cast<uint8_t>(in[i])) << (8 * i);
+    }
+    return value;
+}
+
+// Writes delta instructions to a sink, merging adjacent block copies
+class DeltaEncoder {
+  public:
+    explicit DeltaEncoder(PayloadSink &sink) : m_sink(sink) {}
+
+    bool header(uint32_t block_size)
+    {
+        m_buffer.append(DELTA_MAGIC, sizeof(DELTA_MAGIC));
+        put_u32(m_buffer, block_size);
+        return true;
+    }
+
+    // Block that would extend the current run of copies, if any
+    int64_t next_block() const
+    {
+        return m_run_count > 0 ? static_cast<int64_t>(m_run_first +
+                                                      m_run_count)
+                               : -1;
+    }
+
+    bool copy(uint64_t block, size_t length)
+    {
+        m_stats.copied_bytes += length;
+        if (m_run_count > 0 && m_run_first + m_run_count == block &&
+            m_run_count < UINT32_MAX) {
+            m_run_count++;
+            return true;
+        }
+        if (!flush_run()) {
+            return false;
+        }
+        m_run_first = block;
+        m_run_count = 1;
+        return true;
+    }
+
+    bool literal(const uint8_t *data, size_t size)
+    {
+        if (size == 0) {
+            return true;
+        }
+        if (!flush_run()) {
+            return false;
+        }
+        m_stats.literal_bytes += size;
+        while (size > 0) {
+            size_t length = std::min(size, MAX_LITERAL_SIZE);
+            m_buffer.push_back(static_cast<char>(OP_LITERAL));
+            put_u32(m_buffer, static_cast<uint32_t>(length));
+            // The literal itself goes to the sink without another copy
+            if (!flush() || !m_sink.write(data, length)) {
+                return false;
+            }
+            m_stats.delta_bytes += length;
+            data += length;
+            size -= length;
+        }
+        return true;
+    }
+
+    bool end(const uint8_t *digest)
+    {
+        if (!flush_run()) {
+            return false;
+        }
+        m_buffer.push_back(static_cast<char>(OP_END));
+        m_buffer.append(reinterpret_cast<const char *>(digest),
+                        DELTA_DIGEST_SIZE);
+        return flush();
+    }
+
+    const DeltaStats &stats() const
+    {
+        return m_stats;
+    }
+
+  private:
+    bool flush_run()
+    {
+        if (m_run_count == 0) {
+            return true;
+        }
+        m_buffer.push_back(static_cast<char>(OP_COPY));
+        put_u64(m_buffer, m_run_first);
+        put_u32(m_buffer, static_cast<uint32_t>(m_run_count));
+        m_run_count = 0;
+        return m_buffer.size() < DELTA_BUFFER_SIZE || flush();
+    }
+
+    bool flush()
+    {
+        if (m_buffer.empty()) {
+            return true;
+        }
+        m_stats.delta_bytes += m_buffer.size();
+        bool ok = m_sink.write(reinterpret_cast<const uint8_t *>(
+                                   m_buffer.data()),
+                               m_buffer.size());
+        m_buffer.clear();
+        return ok;
+    }
+
+    PayloadSink &m_sink;
+    std::string m_buffer;
+    DeltaStats m_stats;
+    uint64_t m_run_first{0};
+    uint64_t m_run_count{0};
+};
+
+} // namespace
+
+uint32_t delta_block_size(uint64_t file_size)
+{
+    uint32_t block_size = MIN_DELTA_BLOCK_SIZE;
+    while (block_size < MAX_DELTA_BLOCK_SIZE &&
+           static_cast<uint64_t>(block_size) * block_size < file_size) {
+        block_size <<= 1;
+    }
+    return block_size;
+}
+
+void RollingChecksum::reset(const uint8_t *data, size_t size)
+{
+    m_a = 0;
+    m_b = 0;
+    m_size = size;
+    for (size_t i = 0; i < size; i++) {
+        m_a += data[i];
+        m_b += static_cast<uint32_t>(size - i) * data[i];
+    }
+}
+
+void RollingChecksum::roll(uint8_t out, uint8_t in)
+{
+    // Sums wrap modulo 2^32; only their low 16 bits are used
+    m_a += static_cast<uint32_t>(in) - out;
+    m_b += m_a - static_cast<uint32_t>(m_size) * out;
+}
+
+uint32_t RollingChecksum::value() const
+{
+    return (m_a & 0xffff) | (m_b << 16);
+}
+
+std::string strong_sum(const uint8_t *data, size_t size)
+{
+    uint8_t digest[CryptoPP::SHA256::DIGESTSIZE];
+    CryptoPP::SHA256().CalculateDigest(digest, data, size);
+    return std::string(reinterpret_cast<const char *>(digest),
+                       STRONG_SUM_SIZE);
+}
+
+std::pair<fenris::FileSignature, FileOperationResult>
+compute_file_signature(const std::string &filepath, uint32_t block_size)
+{
+    fenris::FileSignature signature;
+    auto [file, result] = map_file(filepath);
+    if (result != FileOperationResult::SUCCESS) {
+        return {signature, result};
+    }
+
+    auto data = reinterpret_cast<const uint8_t *>(file->data());
+    size_t size = file->size();
+    if (block_size == 0) {
+        block_size = delta_block_size(size);
+    }
+    signature.set_block_size(block_size);
+    signature.set_file_size(size);
+
+    size_t blocks = (size + block_size - 1) / block_size;
+    signature.mutable_weak_sums()->Reserve(static_cast<int>(blocks));
+    std::string *strong_sums = signature.mutable_strong_sums();
+    strong_sums->reserve(blocks * STRONG_SUM_SIZE);
+
+    RollingChecksum checksum;
+    for (size_t offset = 0; offset < size; offset += block_size) {
+        size_t length = std::min<size_t>(block_size, size - offset);
+        checksum.reset(data + offset, length);
+        signature.add_weak_sums(checksum.value());
+        strong_sums->append(strong_sum(data + offset, length));
+    }
+
+    return {signature, FileOperationResult::SUCCESS};
+}
+
+std::pair<DeltaStats, FileOperationResult>
+compute_delta(const std::string &filepath,
+              const fenris::FileSignature &signature,
+              PayloadSink &sink)
+{
+    size_t block_size = signature.block_size();
+    size_t blocks = signature.weak_sums_size();
+    if (block_size < MIN_DELTA_BLOCK_SIZE ||
+        block_size > MAX_DELTA_BLOCK_SIZE ||
+        signature.strong_sums().size() != blocks * STRONG_SUM_SIZE ||
+        (signature.file_size() + block_size - 1) / block_size != blocks) {
+        return {DeltaStats{}, FileOperationResult::IO_ERROR};
+    }
+
+    auto [file, result] = map_file(filepath);
+    if (result != FileOperationResult::SUCCESS) {
+        return {DeltaStats{}, result};
+    }
+    auto data = reinterpret_cast<const uint8_t *>(file->data());
+    size_t size = file->size();
+
+    // Only full-size blocks can match at an arbitrary offset; a short last
+    // block is only tried against the end of the new file
+    std::unordered_map<uint32_t, std::vector<uint32_t>> table;
+    size_t last_length = 0;
+    for (size_t i = 0; i < blocks; i++) {
+        size_t length =
+            std::min<uint64_t>(block_size,
+                               signature.file_size() - i * block_size);
+        if (length == block_size) {
+            table[signature.weak_sums(static_cast<int>(i))].push_back(
+                static_cast<uint32_t>(i));
+        } else {
+            last_length = length;
+        }
+    }
+    auto strong_matches = [&signature](size_t block, const std::string &sum) {
+        return std::memcmp(signature.strong_sums().data() +
+                               block * STRONG_SUM_SIZE,
+                           sum.data(),
+                           STRONG_SUM_SIZE) == 0;
+    };
+
+    DeltaEncoder encoder(sink);
+    bool ok = encoder.header(static_cast<uint32_t>(block_size));
+
+    size_t position = 0;
+    size_t literal_start = 0;
+    RollingChecksum checksum;
+    if (size >= block_size) {
+        checksum.reset(data, block_size);
+    }
+    while (ok && position + block_size <= size) {
+        int64_t match = -1;
+        auto candidates = table.find(checksum.value());
+        if (candidates != table.end()) {
+            std::string sum = strong_sum(data + position, block_size);
+            for (uint32_t block : candidates->second) {
+                if (!strong_matches(block, sum)) {
+                    continue;
+                }
+                match = block;
+                // Prefer the block that extends the current run of copies
+                if (match == encoder.next_block()) {
+                    break;
+                }
+            }
+        }
+
+        if (match >= 0) {
+            ok = encoder.literal(data + literal_start,
+                                 position - literal_start) &&
+                 encoder.copy(static_cast<uint64_t>(match), block_size);
+            position += block_size;
+            literal_start = position;
+            if (position + block_size <= size) {
+                checksum.reset(data + position, block_size);
+            }
+        } else if (position + block_size < size) {
+            checksum.roll(data[position], data[position + block_size]);
+            position++;
+        } else {
+            break;
+        }
+    }
+
+    size_t literal_end = size;
+    if (ok && last_length > 0 && size - literal_start >= last_length) {
+        const uint8_t *tail = data + size - last_length;
+        checksum.reset(tail, last_length);
+        if (checksum.value() ==
+                signature.weak_sums(static_cast<int>(blocks - 1)) &&
+            strong_matches(blocks - 1, strong_sum(tail, last_length))) {
+            literal_end = size - last_length;
+        }
+    }
+    ok = ok && encoder.literal(data + literal_start,
+                               literal_end - literal_start);
+    if (ok && literal_end < size) {
+        ok = encoder.copy(blocks - 1, size - literal_end);
+    }
+
+    uint8_t digest[DELTA_DIGEST_SIZE];
+    CryptoPP::SHA256().CalculateDigest(digest, data, size);
+    ok = ok && encoder.end(digest);
+
+    if (!ok) {
+        return {encoder.stats(), FileOperationResult::IO_ERROR};
+    }
+    return {encoder.stats(), FileOperationResult::SUCCESS};
+}
+
+DeltaApplier::DeltaApplier(int base_fd, uint64_t base_size, int output_fd)
+    : m_base_fd(base_fd), m_base_size(base_size), m_output(output_fd),
+      m_hash(std::make_unique<CryptoPP::SHA256>())
+{
+}
+
+DeltaApplier::~DeltaApplier() = default;
+
+bool DeltaApplier::write(const uint8_t *data, size_t size)
+{
+    size_t consumed = 0;
+    while (consumed < size) {
+        if (m_state == State::LITERAL) {
+            size_t length =
+                std::min<uint64_t>(size - consumed, m_literal_remaining);
+            if (!emit(data + consumed, length)) {
+                m_state = State::FAILED;
+                return false;
+            }
+            consumed += length;
+            m_literal_remaining -= length;
+            if (m_literal_remaining == 0) {
+                m_state = State::OPCODE;
+            }
+            continue;
+        }
+        if (m_state == State::DONE || m_state == State::FAILED) {
+            // Nothing may follow the digest
+            m_state = State::FAILED;
+            return false;
+        }
+
+        size_t length =
+            std::min(field_size() - m_field.size(), size - consumed);
+        m_field.append(reinterpret_cast<const char *>(data + consumed),
+                       length);
+        consumed += length;
+        if (m_field.size() == field_size()) {
+            bool ok = handle_field();
+            m_field.clear();
+            if (!ok) {
+                m_state = State::FAILED;
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+bool DeltaApplier::finish()
+{
+    return m_state == State::DONE && m_digest_matches;
+}
+
+size_t DeltaApplier::field_size() const
+{
+    switch (m_state) {
+    case State::HEADER:
+        return sizeof(DELTA_MAGIC) + 4;
+    case State::OPCODE:
+        return 1;
+    case State::COPY:
+        return 12;
+    case State::LITERAL_LENGTH:
+        return 4;
+    case State::DIGEST:
+        return DELTA_DIGEST_SIZE;
+    default:
+        return 0;
+    }
+}
+
+bool DeltaApplier::handle_field()
+{
+    const char *field = m_field.data();
+    switch (m_state) {
+    case State::HEADER:
+        m_block_size = get_u32(field + sizeof(DELTA_MAGIC));
+        if (std::memcmp(field, DELTA_MAGIC, sizeof(DELTA_MAGIC)) != 0 ||
+            m_block_size < MIN_DELTA_BLOCK_SIZE ||
+            m_block_size > MAX_DELTA_BLOCK_SIZE) {
+            return false;
+        }
+        m_state = State::OPCODE;
+        return true;
+    case State::OPCODE:
+        switch (static_cast<uint8_t>(field[0])) {
+        case OP_COPY:
+            m_state = State::COPY;
+            return true;
+        case OP_LITERAL:
+            m_state = State::LITERAL_LENGTH;
+            return true;
+        case OP_END:
+            m_state = State::DIGEST;
+            return true;
+        default:
+            return false;
+        }
+    case State::COPY:
+        m_state = State::OPCODE;
+        return copy_blocks(get_u64(field), get_u32(field + 8));
+    case State::LITERAL_LENGTH:
+        m_literal_remaining = get_u32(field);
+        m_state =
+            m_literal_remaining > 0 ? State::LITERAL : State::OPCODE;
+        return true;
+    case State::DIGEST: {
+        uint8_t digest[DELTA_DIGEST_SIZE];
+        m_hash->Final(digest);
+        m_digest_matches =
+            std::memcmp(digest, field, DELTA_DIGEST_SIZE) == 0;
+        m_state = State::DONE;
+        return true;
+    }
+    default:
+        return false;
+    }
+}
+
+bool DeltaApplier::copy_blocks(uint64_t first_block, uint32_t count)
+{
+    uint64_t blocks = (m_base_size + m_block_size - 1) / m_block_size;
+    if (first_block >= blocks || count > blocks - first_block) {
+        return false;
+    }
+
+    uint64_t offset = first_block * m_block_size;
+    uint64_t end = std::min(offset + uint64_t{count} * m_block_size,
+                            m_base_size);
+    std::vector<uint8_t> buffer(
+        std::min<uint64_t>(end - offset, PAYLOAD_CHUNK_SIZE));
+    while (offset < end) {
+        size_t length = std::min<uint64_t>(end - offset, buffer.size());
+        ssize_t bytes = pread(m_base_fd,
+                              buffer.data(),
+                              length,
+                              static_cast<off_t>(offset));
+        if (bytes < 0 && errno == EINTR) {
+            continue;
+        }
+        if (bytes <= 0 ||
+            !emit(buffer.data(), static_cast<size_t>(bytes))) {
+            return false;
+        }
+        offset += static_cast<uint64_t>(bytes);
+    }
+    return true;
+}
+
+bool DeltaApplier::emit(const uint8_t *data, size_t size)
+{
+    m_hash->Update(data, size);
+    return m_output.write(data, size);
+}
+
+FileOperationResult patch_file_from_payload(const std::string &filepath,
+                                            IncomingPayload &payload)
+{
+    // Same permission rules as write_file, checked before the body is read
+    int base_fd = open(filepath.c_str(), O_RDONLY | O_CLOEXEC);
+    if (base_fd < 0) {
+        return system_error_to_file_operation_result(
+            std::error_code(errno, std::generic_category()));
+    }
+    struct stat st;
+    if (fstat(base_fd, &st) != 0 || !S_ISREG(st.st_mode)) {
+        close(base_fd);
+        return FileOperationResult::INVALID_PATH;
+    }
+    if ((st.st_mode & S_IWUSR) == 0) {
+        close(base_fd);
+        return FileOperationResult::PERMISSION_DENIED;
+    }
+
+    // Blocks of a deduplicated file are copied from its assembled contents
+    auto [chunked_fd, chunked_result] =
+        open_chunked_range(base_fd, 0, static_cast<uint64_t>(st.st_size));
+    if (chunked_result != FileOperationResult::SUCCESS) {
+        close(base_fd);
+        return chunked_result;
+    }
+    if (chunked_fd >= 0) {
+        close(base_fd);
+        base_fd = chunked_fd;
+    }
+
+    auto [staging, staging_result] =
+        create_staging_file(filepath, st.st_mode & 07777);
+    if (staging_result != FileOperationResult::SUCCESS) {
+        close(base_fd);
+        return staging_result;
+    }
+
+    DeltaApplier applier(base_fd, static_cast<uint64_t>(st.st_size),
+                         staging.fd);
+    bool applied = payload.read_into(applier) == PayloadResult::SUCCESS &&
+                   applier.finish();
+    close(base_fd);
+    if (!applied) {
+        discard_staging_file(staging);
+        return FileOperationResult::IO_ERROR;
+    }
+    auto store_result = pack_file(staging.fd);
+    if (store_result == FileOperationResult::SUCCESS) {
+        store_result = deduplicate_file(staging.fd);
+    }
+    if (store_result != FileOperationResult::SUCCESS) {
+        discard_staging_file(staging);
+        return store_result;
+    }
+    return commit_staging_file(staging, filepath);
+}
+
+} // namespace common
+} // namespace fenris
@@ -0,0 +1,223 @@
+#include "common/durability.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <fcntl.h>
+#include <filesystem>
+#include <memory>
+#include <sys/stat.h>
+#include <tuple>
+#include <unistd.h>
+#include <utility>
+
+namespace fs = std::filesystem;
+
+namespace fenris {
+namespace common {
+
+std::string durability_mode_to_string(DurabilityMode mode)
+{
+    switch (mode) {
+    case DurabilityMode::NONE:
+        return "none";
+    case DurabilityMode::FSYNC:
+        return "fsync";
+    case DurabilityMode::GROUP_COMMIT:
+        return "group";
+    default:
+        return "unknown";
+    }
+}
+
+std::optional<DurabilityMode> durability_mode_from_string(
+    const std::string &name)
+{
+    if (name == "none") {
+        return DurabilityMode::NONE;
+    }
+    if (name == "fsync") {
+        return DurabilityMode::FSYNC;
+    }
+    if (name == "group") {
+        return DurabilityMode::GROUP_COMMIT;
+    }
+    return std::nullopt;
+}
+
+GroupCommitter::GroupCommitter(std::chrono::microseconds window,
+                               size_t max_batch)
+    : m_window(window), m_max_batch(std::max<size_t>(max_batch, 1)),
+      m_thread(&GroupCommitter::run, this)
+{
+}
+
+GroupCommitter::~GroupCommitter()
+{
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_stopping = true;
+    }
+    m_pending_condition.notify_all();
+    m_thread.join();
+}
+
+bool GroupCommitter::commit(int fd)
+{
+    Waiter waiter{fd};
+
+    std::unique_lock<std::mutex> lock(m_mutex);
+    m_pending.push_back(&waiter);
+    if (m_pending.size() == 1 || m_pending.size() >= m_max_batch) {
+        m_pending_condition.notify_one();
+    }
+    m_done_condition.wait(lock, [&waiter]() { return waiter.done; });
+    return waiter.ok;
+}
+
+uint64_t GroupCommitter::flush_count() const
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_flush_count;
+}
+
+void GroupCommitter::run()
+{
+    std::unique_lock<std::mutex> lock(m_mutex);
+    while (true) {
+        m_pending_condition.wait(
+            lock,
+            [this]() { return m_stopping || !m_pending.empty(); });
+        if (m_pending.empty()) {
+            return;
+        }
+
+        // Give concurrent writers the window to join this batch
+        m_pending_condition.wait_for(lock, m_window, [this]() {
+            return m_stopping || m_pending.size() >= m_max_batch;
+        });
+
+        std::vector<Waiter *> batch = std::move(m_pending);
+        m_pending.clear();
+        lock.unlock();
+
+        flush(batch);
+
+        lock.lock();
+        m_flush_count++;
+        for (Waiter *waiter : batch) {
+            waiter->done = true;
+        }
+        m_done_condition.notify_all();
+    }
+}
+
+void GroupCommitter::flush(const std::vector<Waiter *> &batch)
+{
+    // Files are flushed one by one; directory entries changed by several
+    // writers in the batch (the usual case for a shared parent) are
+    // flushed once for all of them
+    std::vector<std::tuple<dev_t, ino_t, bool>> directories;
+    for (Waiter *waiter : batch) {
+        struct stat st;
+        if (fstat(waiter->fd, &st) != 0) {
+            waiter->ok = false;
+            continue;
+        }
+        if (!S_ISDIR(st.st_mode)) {
+            waiter->ok = fdatasync(waiter->fd) == 0;
+            continue;
+        }
+
+        auto it = std::find_if(directories.begin(),
+                               directories.end(),
+                               [&st](const auto &directory) {
+                                   return std::get<0>(directory) ==
+                                              st.st_dev &&
+                                          std::get<1>(directory) == st.st_ino;
+                               });
+        if (it == directories.end()) {
+            directories.emplace_back(
+                st.st_dev, st.st_ino, fsync(waiter->fd) == 0);
+            it = directories.end() - 1;
+        }
+        waiter->ok = std::get<2>(*it);
+    }
+}
+
+namespace {
+
+std::atomic<DurabilityMode> g_durability_mode{DurabilityMode::NONE};
+
+std::mutex g_committer_mutex;
+std::shared_ptr<GroupCommitter> g_committer;
+
+std::shared_ptr<GroupCommitter> group_committer()
+{
+    std::lock_guard<std::mutex> lock(g_committer_mutex);
+    return g_committer;
+}
+
+} // namespace
+
+void set_durability_mode(DurabilityMode mode,
+                         std::chrono::microseconds window,
+                         size_t max_batch)
+{
+    std::shared_ptr<GroupCommitter> previous;
+    {
+        std::lock_guard<std::mutex> lock(g_committer_mutex);
+        previous = std::move(g_committer);
+        if (mode == DurabilityMode::GROUP_COMMIT) {
+            g_committer = std::make_shared<GroupCommitter>(window, max_batch);
+        }
+        g_durability_mode = mode;
+    }
+    // The old committer is stopped outside the lock; writers still waiting
+    // on it hold their own reference until they are released
+}
+
+DurabilityMode get_durability_mode()
+{
+    return g_durability_mode;
+}
+
+uint64_t group_commit_flush_count()
+{
+    auto committer = group_committer();
+    return committer ? committer->flush_count() : 0;
+}
+
+bool sync_file(int fd)
+{
+    switch (g_durability_mode.load()) {
+    case DurabilityMode::FSYNC:
+        return fdatasync(fd) == 0;
+    case DurabilityMode::GROUP_COMMIT:
+        if (auto committer = group_committer()) {
+            return committer->commit(fd);
+        }
+        return fdatasync(fd) == 0;
+    default:
+        return true;
+    }
+}
+
+bool sync_parent_directory(const std::string &path)
+{
+    if (g_durability_mode == DurabilityMode::NONE) {
+        return true;
+    }
+
+    std::string parent = fs::path(path).parent_path().string();
+    int fd = open(parent.empty() ? "." : parent.c_str(),
+                  O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0) {
+        return false;
+    }
+    bool ok = sync_file(fd);
+    close(fd);
+    return ok;
+}
+
+} // namespace common
+} // namespace fenris
@@ -1,9 +1,32 @@
 #include "common/file_operations.hpp"
+#include "common/append_coalescer.hpp"
+#include "common/checksum.hpp"
+#include "common/chunk_store.hpp"
+#include "common/durability.hpp"
+#include "common/pack_store.hpp"
+#include "common/page_cache.hpp"
+#include <algorithm>
+#include <cerrno>
 #include <cstdio>
+#include <cstring>
+#include <dirent.h>
+#include <fcntl.h>
 #include <filesystem>
 #include <fstream>
 #include <iostream>
+#include <limits>
+#include <linux/fs.h>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
 #include <system_error>
+#include <unistd.h>
+#include <unordered_map>
 
 namespace fs = std::filesystem;
 
@@ -31,6 +54,8 @@ std::string file_operation_result_to_string(FileOperationResult result)
         return "invalid path";
     case FileOperationResult::DIRECTORY_ALREADY_EXISTS:
         return "directory already exists";
+    case FileOperationResult::DATA_CORRUPTED:
+        return "data corrupted";
     case FileOperationResult::UNKNOWN_ERROR:
         return "unknown error";
     default:
@@ -74,31 +99,292 @@ system_error_to_file_operation_result(const std::error_code &ec)
 std::pair<std::string, FileOperationResult>
 read_file(const std::string &filepath)
 {
-    std::string content;
+    // Deduplicated and packed files hold no data of their own, and files
+    // with checksums are verified as they are read; the ranged read handles
+    // all of them
     std::error_code ec;
     if (!fs::exists(filepath, ec)) {
-        return {content, FileOperationResult::FILE_NOT_FOUND};
+        return {"", FileOperationResult::FILE_NOT_FOUND};
     }
+    return read_file_range(filepath, 0, std::numeric_limits<uint64_t>::max());
+}
 
-    std::ifstream file(filepath, std::ios::binary);
-    if (!file) {
-        return {content, FileOperationResult::IO_ERROR};
+std::pair<std::string, FileOperationResult>
+read_file_range(const std::string &filepath, uint64_t offset, uint64_t length)
+{
+    int fd = open(filepath.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return {"",
+                system_error_to_file_operation_result(
+                    std::error_code(errno, std::generic_category()))};
     }
 
-    // Get file size
-    file.seekg(0, std::ios::end);
-    const auto file_size = file.tellg();
-    file.seekg(0, std::ios::beg);
+    auto result = read_file_range(fd, offset, length);
+    close(fd);
+    return result;
+}
+
+std::pair<std::string, FileOperationResult>
+read_file_range(int fd, uint64_t offset, uint64_t length)
+{
+    struct stat st;
+    if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode)) {
+        return {"", FileOperationResult::IO_ERROR};
+    }
 
-    content.resize(static_cast<size_t>(file_size));
+    // A packed file is a single pread from its pack
+    auto [packed, packed_result] = read_packed_range(fd, st, offset, length);
+    if (packed_result != FileOperationResult::SUCCESS) {
+        return {"", packed_result};
+    }
+    if (packed) {
+        return {std::move(*packed), FileOperationResult::SUCCESS};
+    }
 
-    if (!file.read(content.data(), file_size)) {
+    // A deduplicated file is read straight from its chunks
+    auto [chunked, chunked_result] = open_chunked_payload(fd, offset, length);
+    if (chunked_result != FileOperationResult::SUCCESS) {
+        return {"", chunked_result};
+    }
+    if (chunked) {
+        std::string content(static_cast<size_t>(chunked->size()), '\0');
+        if (!chunked->read(reinterpret_cast<uint8_t *>(content.data()),
+                           content.size())) {
+            return {"", FileOperationResult::IO_ERROR};
+        }
+        return {content, FileOperationResult::SUCCESS};
+    }
+    auto checksums = load_checksums(fd, st);
+
+    // Clamp to the end of the file so the buffer is never oversized
+    auto file_size = static_cast<uint64_t>(st.st_size);
+    uint64_t available = offset < file_size ? file_size - offset : 0;
+    std::string content(static_cast<size_t>(std::min(length, available)),
+                        '\0');
+
+    ReadHint hint(fd, offset, content.size());
+    std::optional<DirectReader> direct;
+    if (hint.direct()) {
+        direct.emplace(fd);
+        if (!direct->valid()) {
+            direct.reset();
+        }
+    }
+
+    size_t total_read = 0;
+    bool failed = false;
+    while (total_read < content.size()) {
+        ssize_t bytes =
+            direct ? direct->read(content.data() + total_read,
+                                  content.size() - total_read,
+                                  offset + total_read)
+                   : pread(fd,
+                           content.data() + total_read,
+                           content.size() - total_read,
+                           static_cast<off_t>(offset + total_read));
+        if (bytes < 0 && errno == EINTR) {
+            continue;
+        }
+        if (bytes < 0) {
+            failed = true;
+            break;
+        }
+        if (bytes == 0) {
+            // The file shrank since fstat
+            break;
+        }
+        total_read += static_cast<size_t>(bytes);
+    }
+    hint.release(offset + total_read);
+    direct.reset();
+    if (failed) {
         return {"", FileOperationResult::IO_ERROR};
     }
 
+    // The blocks the range starts and ends in are read whole to check them
+    if (checksums && total_read == content.size() && total_read > 0) {
+        ChecksumVerifier verifier(checksums, offset);
+        if (!verifier.update_from(fd, offset) ||
+            !verifier.update(content.data(), content.size()) ||
+            !verifier.update_from(fd, verifier.block_end())) {
+            return {"", FileOperationResult::DATA_CORRUPTED};
+        }
+    }
+
+    content.resize(total_read);
     return {content, FileOperationResult::SUCCESS};
 }
 
+MappedFile::MappedFile(void *address, size_t size)
+    : m_address(address), m_size(size)
+{
+}
+
+MappedFile::~MappedFile()
+{
+    if (m_address != nullptr) {
+        munmap(m_address, m_size);
+    }
+    if (m_fd >= 0) {
+        close(m_fd);
+    }
+}
+
+const char *MappedFile::data() const
+{
+    return static_cast<const char *>(m_address);
+}
+
+size_t MappedFile::size() const
+{
+    return m_size;
+}
+
+std::string_view MappedFile::view() const
+{
+    return {data(), m_size};
+}
+
+const std::shared_ptr<const BlockChecksums> &MappedFile::checksums() const
+{
+    return m_checksums;
+}
+
+void MappedFile::release(size_t end) const
+{
+    if (!m_hint || !m_hint->dropping()) {
+        return;
+    }
+
+    // Pages still mapped cannot be dropped from the page cache, so the
+    // consumed ones are unmapped first; touching them again faults them
+    // back in from the file
+    static const auto page_size = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+    size_t mapped_end = std::min(end, m_size) / page_size * page_size;
+    if (mapped_end > 0) {
+        madvise(m_address, mapped_end, MADV_DONTNEED);
+    }
+    m_hint->release(end);
+}
+
+std::pair<std::shared_ptr<const MappedFile>, FileOperationResult>
+map_file(const std::string &filepath)
+{
+    int fd = open(filepath.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return {nullptr,
+                system_error_to_file_operation_result(
+                    std::error_code(errno, std::generic_category()))};
+    }
+
+    // The mapping keeps its own reference to the file
+    auto result = map_file(fd);
+    close(fd);
+    return result;
+}
+
+std::pair<std::shared_ptr<const MappedFile>, FileOperationResult>
+map_file(int fd)
+{
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        return {nullptr, FileOperationResult::IO_ERROR};
+    }
+    if (!S_ISREG(st.st_mode)) {
+        return {nullptr, FileOperationResult::INVALID_PATH};
+    }
+
+    // A packed file is read from its pack into anonymous memory; it is
+    // small, so that costs less than assembling a file to map
+    auto [packed, packed_result] =
+        read_packed_range(fd, st, 0, std::numeric_limits<uint64_t>::max());
+    if (packed_result != FileOperationResult::SUCCESS) {
+        return {nullptr, packed_result};
+    }
+    if (packed) {
+        void *address = mmap(nullptr,
+                             packed->size(),
+                             PROT_READ | PROT_WRITE,
+                             MAP_PRIVATE | MAP_ANONYMOUS,
+                             -1,
+                             0);
+        if (address == MAP_FAILED) {
+            return {nullptr, FileOperationResult::IO_ERROR};
+        }
+        std::memcpy(address, packed->data(), packed->size());
+        mprotect(address, packed->size(), PROT_READ);
+        return {std::shared_ptr<const MappedFile>(
+                    new MappedFile(address, packed->size())),
+                FileOperationResult::SUCCESS};
+    }
+
+    // A deduplicated file is mapped from a copy assembled from its chunks
+    auto [chunked_fd, chunked_result] =
+        open_chunked_range(fd, 0, std::numeric_limits<uint64_t>::max());
+    if (chunked_result != FileOperationResult::SUCCESS) {
+        return {nullptr, chunked_result};
+    }
+    int map_fd = fd;
+    if (chunked_fd >= 0) {
+        map_fd = chunked_fd;
+        if (fstat(map_fd, &st) != 0) {
+            close(chunked_fd);
+            return {nullptr, FileOperationResult::IO_ERROR};
+        }
+    }
+
+    // mmap rejects zero-length mappings, so empty files get an empty view
+    auto size = static_cast<size_t>(st.st_size);
+    void *address = nullptr;
+    if (size != 0) {
+        address = mmap(nullptr, size, PROT_READ, MAP_SHARED, map_fd, 0);
+    }
+    if (size == 0 || address == MAP_FAILED) {
+        if (chunked_fd >= 0) {
+            close(chunked_fd);
+        }
+        if (size == 0) {
+            return {std::shared_ptr<const MappedFile>(new MappedFile()),
+                    FileOperationResult::SUCCESS};
+        }
+        return {nullptr, FileOperationResult::IO_ERROR};
+    }
+
+    // Hints only; a failure here does not affect correctness
+    std::shared_ptr<MappedFile> mapping(new MappedFile(address, size));
+    madvise(address, size, MADV_SEQUENTIAL);
+    if (is_bulk_transfer(size)) {
+        // A bulk file is dropped as it is streamed, which needs a
+        // descriptor of its own once map_fd is closed
+        int hint_fd = chunked_fd >= 0 ? chunked_fd
+                                      : fcntl(map_fd, F_DUPFD_CLOEXEC, 0);
+        chunked_fd = -1;
+        if (hint_fd >= 0) {
+            mapping->m_fd = hint_fd;
+            mapping->m_hint = std::make_unique<ReadHint>(hint_fd, 0, size);
+        }
+    } else {
+        // The hint only counts the read; small files stay cached
+        ReadHint(map_fd, 0, size);
+        madvise(address, size, MADV_WILLNEED);
+    }
+    if (chunked_fd >= 0) {
+        close(chunked_fd);
+    }
+    if (chunked_fd < 0) {
+        // A single block is read whole by any caller anyway; larger files
+        // are checked as they are streamed, so no extra pass is made
+        mapping->m_checksums = load_checksums(fd, st);
+        if (mapping->m_checksums && size <= mapping->m_checksums->block_size) {
+            if (crc32c(address, size) != mapping->m_checksums->crcs[0]) {
+                return {nullptr, FileOperationResult::DATA_CORRUPTED};
+            }
+            mapping->m_checksums.reset();
+        }
+    }
+    return {mapping, FileOperationResult::SUCCESS};
+}
+
 FileOperationResult write_file(const std::string &filepath,
                                const std::string &data)
 {
@@ -131,57 +417,318 @@ FileOperationResult write_file(const std::string &filepath,
         }
     }
 
-    std::ofstream file(filepath, std::ios::binary | std::ios::trunc);
-    if (!file) {
+    // The new contents replace the file in one rename, so readers and
+    // crashes see either the old file or the new one, never a mix
+    struct stat st;
+    mode_t mode = stat(filepath.c_str(), &st) == 0 ? (st.st_mode & 07777)
+                                                   : 0644;
+    auto [staging, result] = create_staging_file(filepath, mode);
+    if (result != FileOperationResult::SUCCESS) {
+        return result;
+    }
+
+    size_t total_written = 0;
+    while (total_written < data.size()) {
+        ssize_t bytes = ::write(staging.fd,
+                                data.data() + total_written,
+                                data.size() - total_written);
+        if (bytes < 0 && errno == EINTR) {
+            continue;
+        }
+        if (bytes <= 0) {
+            discard_staging_file(staging);
+            return FileOperationResult::IO_ERROR;
+        }
+        total_written += static_cast<size_t>(bytes);
+    }
+
+    // Small files are packed and large ones deduplicated, where enabled;
+    // files that stay plain get block checksums of the data just written
+    result = pack_file(staging.fd);
+    if (result == FileOperationResult::SUCCESS) {
+        result = deduplicate_file(staging.fd);
+    }
+    if (result == FileOperationResult::SUCCESS) {
+        ChecksumBuilder checksums;
+        checksums.update(data.data(), data.size());
+        result = store_checksums(staging.fd, checksums.finish());
+    }
+    if (result != FileOperationResult::SUCCESS) {
+        discard_staging_file(staging);
+        return result;
+    }
+    // A bulk write is not kept in the page cache once it has been stored
+    drop_written(staging.fd, 0, data.size());
+    return commit_staging_file(staging, filepath);
+}
+
+std::pair<StagingFile, FileOperationResult>
+create_staging_file(const std::string &filepath, mode_t mode)
+{
+    fs::path path(filepath);
+    StagingFile staging;
+    staging.path =
+        (path.parent_path() / ("." + path.filename().string() + ".XXXXXX"))
+            .string();
+    staging.fd = mkostemp(staging.path.data(), O_CLOEXEC);
+    if (staging.fd < 0) {
         if (errno == EACCES || errno == EPERM) {
-            return FileOperationResult::PERMISSION_DENIED;
+            return {staging, FileOperationResult::PERMISSION_DENIED};
         }
-        return FileOperationResult::IO_ERROR;
+        return {staging, FileOperationResult::IO_ERROR};
     }
+    fchmod(staging.fd, mode);
+    return {staging, FileOperationResult::SUCCESS};
+}
 
-    if (!file.write(data.data(), data.size())) {
+FileOperationResult commit_staging_file(StagingFile &staging,
+                                        const std::string &filepath)
+{
+    bool synced = sync_file(staging.fd);
+    if (close(staging.fd) != 0 || !synced ||
+        rename(staging.path.c_str(), filepath.c_str()) != 0) {
+        staging.fd = -1;
+        discard_staging_file(staging);
         return FileOperationResult::IO_ERROR;
     }
+    staging.fd = -1;
 
+    if (!sync_parent_directory(filepath)) {
+        return FileOperationResult::IO_ERROR;
+    }
     return FileOperationResult::SUCCESS;
 }
 
-FileOperationResult append_file(const std::string &filepath,
-                                const std::string &data)
+void discard_staging_file(StagingFile &staging)
 {
-    std::error_code ec;
-
-    // Check if file exists
-    if (!fs::exists(filepath, ec)) {
-        return FileOperationResult::FILE_NOT_FOUND;
+    if (staging.fd >= 0) {
+        close(staging.fd);
+        staging.fd = -1;
     }
+    unlink(staging.path.c_str());
+}
 
-    // Check file permissions
-    fs::file_status file_status = fs::status(filepath, ec);
-    if (ec) {
-        return system_error_to_file_operation_result(ec);
+FileOperationResult preallocate_file(int fd, uint64_t offset, uint64_t length)
+{
+    if (length == 0) {
+        return FileOperationResult::SUCCESS;
     }
 
-    // Check write permissions on the file
-    if ((file_status.permissions() & fs::perms::owner_write) ==
-        fs::perms::none) {
-        return FileOperationResult::PERMISSION_DENIED;
+    int rc;
+    do {
+        rc = fallocate(fd,
+                       FALLOC_FL_KEEP_SIZE,
+                       static_cast<off_t>(offset),
+                       static_cast<off_t>(length));
+    } while (rc != 0 && errno == EINTR);
+    if (rc != 0 && errno != EOPNOTSUPP && errno != ENOSYS) {
+        return FileOperationResult::IO_ERROR;
     }
+    return FileOperationResult::SUCCESS;
+}
 
-    // Open file in binary mode with append flag
-    std::ofstream file(filepath, std::ios::binary | std::ios::app);
-    if (!file) {
-        // Check specifically for permission errors
-        if (errno == EACCES || errno == EPERM) {
+FileOperationResult write_file_range(const std::string &filepath,
+                                     uint64_t offset,
+                                     const std::string &data)
+{
+    // Same permission rule as write_file for existing files
+    struct stat st;
+    bool exists = stat(filepath.c_str(), &st) == 0;
+    if (exists) {
+        if ((st.st_mode & S_IWUSR) == 0) {
             return FileOperationResult::PERMISSION_DENIED;
         }
+    } else if (errno != ENOENT) {
+        return system_error_to_file_operation_result(
+            std::error_code(errno, std::generic_category()));
+    }
+
+    // Deduplicated files are rewritten as plain files before any in-place
+    // change
+    if (exists) {
+        auto result = materialize_file(filepath);
+        if (result != FileOperationResult::SUCCESS) {
+            return result;
+        }
+    }
+
+    int fd = open(filepath.c_str(), O_WRONLY | O_CREAT | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        return system_error_to_file_operation_result(
+            std::error_code(errno, std::generic_category()));
+    }
+
+    // The checksums would not describe the file once it is changed in place
+    if (drop_checksums(fd) != FileOperationResult::SUCCESS) {
+        close(fd);
         return FileOperationResult::IO_ERROR;
     }
 
-    if (!file.write(data.data(), data.size())) {
+    size_t total_written = 0;
+    while (total_written < data.size()) {
+        ssize_t bytes = pwrite(fd,
+                               data.data() + total_written,
+                               data.size() - total_written,
+                               static_cast<off_t>(offset + total_written));
+        if (bytes < 0 && errno == EINTR) {
+            continue;
+        }
+        if (bytes <= 0) {
+            close(fd);
+            return FileOperationResult::IO_ERROR;
+        }
+        total_written += static_cast<size_t>(bytes);
+    }
+
+    bool synced = sync_file(fd);
+    drop_written(fd, offset, data.size());
+    if (close(fd) != 0 || !synced ||
+        (!exists && !sync_parent_directory(filepath))) {
         return FileOperationResult::IO_ERROR;
     }
+    return FileOperationResult::SUCCESS;
+}
+
+namespace {
+
+// Most append targets kept open at once
+constexpr size_t MAX_APPEND_HANDLES = 64;
+
+// LRU cache of O_APPEND descriptors keyed by path. A cached descriptor is
+// only reused while the path still names the same inode, so files that are
+// deleted, renamed or replaced are reopened rather than appended to blindly.
+class AppendHandleCache {
+  public:
+    std::pair<std::shared_ptr<AppendHandle>, int>
+    acquire(const std::string &filepath, const struct stat &st)
+    {
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            auto it = m_handles.find(filepath);
+            if (it != m_handles.end()) {
+                const auto &handle = it->second.first;
+                if (handle->device == st.st_dev && handle->inode == st.st_ino) {
+                    m_lru.splice(m_lru.begin(), m_lru, it->second.second);
+                    return {handle, 0};
+                }
+                m_lru.erase(it->second.second);
+                m_handles.erase(it);
+            }
+        }
+
+        int fd = open(filepath.c_str(), O_WRONLY | O_APPEND | O_CLOEXEC);
+        if (fd < 0) {
+            return {nullptr, errno};
+        }
+        struct stat opened;
+        if (fstat(fd, &opened) != 0) {
+            int error = errno;
+            close(fd);
+            return {nullptr, error};
+        }
+        auto handle =
+            std::make_shared<AppendHandle>(fd, opened.st_dev, opened.st_ino);
+
+        std::lock_guard<std::mutex> lock(m_mutex);
+        auto it = m_handles.find(filepath);
+        if (it != m_handles.end()) {
+            m_lru.erase(it->second.second);
+            m_handles.erase(it);
+        }
+        m_lru.push_front(filepath);
+        m_handles[filepath] = {handle, m_lru.begin()};
+        if (m_handles.size() > MAX_APPEND_HANDLES) {
+            m_handles.erase(m_lru.back());
+            m_lru.pop_back();
+        }
+        return {handle, 0};
+    }
+
+  private:
+    std::mutex m_mutex;
+    // Paths ordered from most to least recently used
+    std::list<std::string> m_lru;
+    std::unordered_map<std::string,
+                       std::pair<std::shared_ptr<AppendHandle>,
+                                 std::list<std::string>::iterator>>
+        m_handles;
+};
+
+AppendHandleCache &append_handle_cache()
+{
+    static AppendHandleCache cache;
+    return cache;
+}
+
+} // namespace
+
+std::pair<std::shared_ptr<AppendHandle>, FileOperationResult>
+open_append_handle(const std::string &filepath)
+{
+    // A deduplicated file becomes a new plain file first, so the stat below
+    // sees the inode the data is appended to
+    auto materialize_result = materialize_file(filepath);
+    if (materialize_result != FileOperationResult::SUCCESS) {
+        return {nullptr, materialize_result};
+    }
+
+    // One stat covers existence, permissions and the identity check for
+    // the cached descriptor
+    struct stat st;
+    if (stat(filepath.c_str(), &st) != 0) {
+        return {nullptr,
+                system_error_to_file_operation_result(
+                    std::error_code(errno, std::generic_category()))};
+    }
 
+    // Check write permissions on the file
+    if ((st.st_mode & S_IWUSR) == 0) {
+        return {nullptr, FileOperationResult::PERMISSION_DENIED};
+    }
+
+    auto [handle, error] = append_handle_cache().acquire(filepath, st);
+    if (!handle) {
+        if (error == EACCES || error == EPERM) {
+            return {nullptr, FileOperationResult::PERMISSION_DENIED};
+        }
+        return {nullptr, FileOperationResult::IO_ERROR};
+    }
+    return {handle, FileOperationResult::SUCCESS};
+}
+
+FileOperationResult append_file(const std::string &filepath,
+                                const std::string &data)
+{
+    auto [handle, result] = open_append_handle(filepath);
+    if (result != FileOperationResult::SUCCESS) {
+        return result;
+    }
+
+    // The new size leaves any checksums of the file stale, so they need no
+    // update
+    if (auto coalescer = get_append_coalescer()) {
+        return coalescer->append(handle, data) ? FileOperationResult::SUCCESS
+                                               : FileOperationResult::IO_ERROR;
+    }
+
+    // O_APPEND places every write at the current end of the file
+    size_t total_written = 0;
+    while (total_written < data.size()) {
+        ssize_t bytes = ::write(handle->fd,
+                                data.data() + total_written,
+                                data.size() - total_written);
+        if (bytes < 0 && errno == EINTR) {
+            continue;
+        }
+        if (bytes <= 0) {
+            return FileOperationResult::IO_ERROR;
+        }
+        total_written += static_cast<size_t>(bytes);
+    }
+
+    if (!sync_file(handle->fd)) {
+        return FileOperationResult::IO_ERROR;
+    }
     return FileOperationResult::SUCCESS;
 }
 
@@ -249,65 +796,124 @@ FileOperationResult delete_file(const std::string &filepath)
     return FileOperationResult::SUCCESS;
 }
 
+namespace {
+
+FileOperationResult errno_to_file_operation_result(int error)
+{
+    if (error == ENOTDIR) {
+        return FileOperationResult::INVALID_PATH;
+    }
+    return system_error_to_file_operation_result(
+        std::error_code(error, std::generic_category()));
+}
+
+// Fill file_info for path (relative to dirfd) from a single statx call
+FileOperationResult fill_file_info(int dirfd,
+                                   const char *path,
+                                   const std::string &name,
+                                   FileInfo &file_info)
+{
+    struct statx stx;
+    if (statx(dirfd,
+              path,
+              AT_STATX_SYNC_AS_STAT,
+              STATX_TYPE | STATX_MODE | STATX_SIZE | STATX_MTIME,
+              &stx) != 0) {
+        return errno_to_file_operation_result(errno);
+    }
+
+    file_info.set_name(name);
+
+    // Only regular files report a size; directories and others are 0
+    bool is_regular = S_ISREG(stx.stx_mode);
+    file_info.set_size(is_regular ? stx.stx_size : 0);
+    file_info.set_is_directory(S_ISDIR(stx.stx_mode));
+    file_info.set_modified_time(static_cast<uint64_t>(stx.stx_mtime.tv_sec));
+    file_info.set_permissions(stx.stx_mode & 0777);
+
+    return FileOperationResult::SUCCESS;
+}
+
+} // namespace
+
 std::pair<fenris::FileInfo, FileOperationResult>
 get_file_info(const std::string &filepath)
 {
-    std::error_code ec;
     FileInfo file_info;
+    auto result =
+        fill_file_info(AT_FDCWD, filepath.c_str(), filepath, file_info);
+    return {file_info, result};
+}
 
-    // Check if file exists
-    if (!fs::exists(filepath, ec)) {
-        return {file_info, FileOperationResult::FILE_NOT_FOUND};
-    }
+namespace {
 
-    // Set file name
-    file_info.set_name(filepath);
+// Names given to the *_at operations must stay inside their directory
+bool is_single_component(const std::string &name)
+{
+    return !name.empty() && name != "." && name != ".." &&
+           name.find('/') == std::string::npos;
+}
 
-    // Set file size (for regular files)
-    if (fs::is_regular_file(filepath, ec)) {
-        if (ec) {
-            return {file_info, system_error_to_file_operation_result(ec)};
-        }
+} // namespace
 
-        uintmax_t size = fs::file_size(filepath, ec);
-        if (ec) {
-            return {file_info, system_error_to_file_operation_result(ec)};
-        }
-        file_info.set_size(size);
-    } else {
-        // For directories or other types, size is 0
-        file_info.set_size(0);
+FileOperationResult create_file_at(int dirfd, const std::string &name)
+{
+    if (!is_single_component(name)) {
+        return FileOperationResult::INVALID_PATH;
     }
 
-    // Check if it's a directory
-    file_info.set_is_directory(fs::is_directory(filepath, ec));
-    if (ec) {
-        return {file_info, system_error_to_file_operation_result(ec)};
+    // Same permission check as create_file, made on the open directory
+    struct stat st;
+    if (fstat(dirfd, &st) != 0) {
+        return errno_to_file_operation_result(errno);
+    }
+    if ((st.st_mode & S_IWUSR) == 0) {
+        return FileOperationResult::PERMISSION_DENIED;
     }
 
-    // Get last modified time
-    auto last_write = fs::last_write_time(filepath, ec);
-    if (ec) {
-        return {file_info, system_error_to_file_operation_result(ec)};
+    int fd = openat(dirfd,
+                    name.c_str(),
+                    O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC,
+                    0666);
+    if (fd < 0) {
+        if (errno == EPERM) {
+            return FileOperationResult::PERMISSION_DENIED;
+        }
+        return errno_to_file_operation_result(errno);
     }
+    close(fd);
+    return FileOperationResult::SUCCESS;
+}
 
-    auto systime = std::chrono::file_clock::to_sys(last_write);
-    auto unix_timestamp = std::chrono::duration_cast<std::chrono::seconds>(
-                              systime.time_since_epoch())
-                              .count();
-    file_info.set_modified_time(static_cast<uint64_t>(unix_timestamp));
+FileOperationResult delete_file_at(int dirfd, const std::string &name)
+{
+    if (!is_single_component(name)) {
+        return FileOperationResult::INVALID_PATH;
+    }
 
-    // Get permissions
-    fs::file_status status = fs::status(filepath, ec);
-    if (ec) {
-        return {file_info, system_error_to_file_operation_result(ec)};
+    struct stat st;
+    if (fstatat(dirfd, name.c_str(), &st, 0) != 0) {
+        return errno_to_file_operation_result(errno);
+    }
+    if (!S_ISREG(st.st_mode)) {
+        return FileOperationResult::INVALID_PATH;
     }
-    auto perms = status.permissions();
-    file_info.set_permissions(static_cast<uint32_t>(
-        perms &
-        (fs::perms::owner_all | fs::perms::group_all | fs::perms::others_all)));
 
-    return {file_info, FileOperationResult::SUCCESS};
+    if (unlinkat(dirfd, name.c_str(), 0) != 0) {
+        return errno_to_file_operation_result(errno);
+    }
+    return FileOperationResult::SUCCESS;
+}
+
+std::pair<fenris::FileInfo, FileOperationResult>
+get_file_info_at(int dirfd, const std::string &name)
+{
+    FileInfo file_info;
+    if (!is_single_component(name)) {
+        return {file_info, FileOperationResult::INVALID_PATH};
+    }
+    auto result = fill_file_info(dirfd, name.c_str(), name, file_info);
+    return {file_info, result};
 }
 
 bool file_exists(const std::string &filepath)
@@ -385,36 +991,120 @@ FileOperationResult delete_directory(const std::string &dirpath, bool recursive)
 std::pair<std::vector<fenris::FileInfo>, FileOperationResult>
 list_directory(const std::string &dirpath)
 {
-    std::vector<std::string> entries;
-    std::error_code ec;
     std::vector<fenris::FileInfo> file_info_list;
 
-    if (!fs::exists(dirpath, ec)) {
-        return {file_info_list, FileOperationResult::FILE_NOT_FOUND};
+    int dirfd = open(dirpath.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (dirfd < 0) {
+        return {file_info_list, errno_to_file_operation_result(errno)};
     }
 
-    if (!fs::is_directory(dirpath, ec)) {
-        return {file_info_list, FileOperationResult::INVALID_PATH};
+    // The stream takes ownership of dirfd; entries are read in getdents
+    // batches and each one is stat'ed relative to the open directory
+    DIR *dir = fdopendir(dirfd);
+    if (dir == nullptr) {
+        close(dirfd);
+        return {file_info_list, FileOperationResult::IO_ERROR};
     }
 
-    for (const auto &entry : fs::directory_iterator(dirpath, ec)) {
-        entries.push_back(entry.path().filename().string());
-    }
+    fs::path dir_path(dirpath);
+    FileOperationResult result = FileOperationResult::SUCCESS;
+    errno = 0;
+    while (struct dirent *entry = readdir(dir)) {
+        if (std::strcmp(entry->d_name, ".") == 0 ||
+            std::strcmp(entry->d_name, "..") == 0) {
+            continue;
+        }
 
-    for (const auto &entry : entries) {
-        fs::path dir_path(dirpath);
-        fs::path entry_path(entry);
         std::string full_path =
-            (dir_path / entry_path).lexically_normal().string();
-
-        auto [file_info, result] = get_file_info(full_path);
+            (dir_path / entry->d_name).lexically_normal().string();
+        FileInfo file_info;
+        result = fill_file_info(dirfd, entry->d_name, full_path, file_info);
         if (result != FileOperationResult::SUCCESS) {
-            return {file_info_list, result};
+            break;
+        }
+        file_info_list.push_back(std::move(file_info));
+        errno = 0;
+    }
+    if (result == FileOperationResult::SUCCESS && errno != 0) {
+        result = FileOperationResult::IO_ERROR;
+    }
+    closedir(dir);
+
+    return {file_info_list, result};
+}
+
+std::pair<DirectoryPage, FileOperationResult>
+list_directory_page(const std::string &dirpath,
+                    uint64_t offset,
+                    size_t page_size)
+{
+    // Size of the buffer handed to each getdents64 call
+    constexpr size_t DIRENT_BATCH_SIZE = 32 * 1024;
+
+    DirectoryPage page;
+    page.next_offset = offset;
+
+    int dirfd = open(dirpath.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (dirfd < 0) {
+        return {page, errno_to_file_operation_result(errno)};
+    }
+    if (offset != 0 &&
+        lseek(dirfd, static_cast<off_t>(offset), SEEK_SET) < 0) {
+        close(dirfd);
+        return {page, FileOperationResult::IO_ERROR};
+    }
+
+    fs::path dir_path(dirpath);
+    std::vector<char> buffer(DIRENT_BATCH_SIZE);
+    FileOperationResult result = FileOperationResult::SUCCESS;
+    bool page_full = false;
+    while (!page_full && result == FileOperationResult::SUCCESS) {
+        ssize_t bytes = getdents64(dirfd, buffer.data(), buffer.size());
+        if (bytes < 0 && errno == EINTR) {
+            continue;
+        }
+        if (bytes < 0) {
+            result = errno_to_file_operation_result(errno);
+            break;
+        }
+        if (bytes == 0) {
+            page.complete = true;
+            break;
+        }
+
+        for (ssize_t pos = 0; pos < bytes;) {
+            if (page.entries.size() >= page_size) {
+                // The rest of the batch is left for the next page
+                page_full = true;
+                break;
+            }
+
+            auto *entry =
+                reinterpret_cast<struct dirent64 *>(buffer.data() + pos);
+            pos += entry->d_reclen;
+            page.next_offset = static_cast<uint64_t>(entry->d_off);
+            if (std::strcmp(entry->d_name, ".") == 0 ||
+                std::strcmp(entry->d_name, "..") == 0) {
+                continue;
+            }
+
+            std::string full_path =
+                (dir_path / entry->d_name).lexically_normal().string();
+            FileInfo file_info;
+            result =
+                fill_file_info(dirfd, entry->d_name, full_path, file_info);
+            if (result != FileOperationResult::SUCCESS) {
+                break;
+            }
+            page.entries.push_back(std::move(file_info));
+        }
+        if (page.entries.size() >= page_size) {
+            page_full = true;
         }
-        file_info_list.push_back(file_info);
     }
+    close(dirfd);
 
-    return {file_info_list, FileOperationResult::SUCCESS};
+    return {page, result};
 }
 
 FileOperationResult change_directory(const std::string &dirpath)
@@ -449,45 +1139,336 @@ std::pair<std::string, FileOperationResult> get_current_directory()
     return {current_path.string(), FileOperationResult::SUCCESS};
 }
 
+namespace {
+
+// Make a rename durable: the entry added under newpath's parent and the one
+// removed from oldpath's parent, when that is another directory
+FileOperationResult sync_rename(const std::string &oldpath,
+                                const std::string &newpath)
+{
+    bool synced = sync_parent_directory(newpath);
+    if (fs::path(oldpath).parent_path() != fs::path(newpath).parent_path()) {
+        synced = sync_parent_directory(oldpath) && synced;
+    }
+    return synced ? FileOperationResult::SUCCESS
+                  : FileOperationResult::IO_ERROR;
+}
+
+} // namespace
+
 FileOperationResult rename_path(const std::string &oldpath,
                                 const std::string &newpath)
+{
+    // RENAME_NOREPLACE makes the existence check and the rename one atomic
+    // step, so a concurrent create at newpath is never overwritten
+    if (renameat2(AT_FDCWD,
+                  oldpath.c_str(),
+                  AT_FDCWD,
+                  newpath.c_str(),
+                  RENAME_NOREPLACE) == 0) {
+        return sync_rename(oldpath, newpath);
+    }
+
+    int error = errno;
+    if (error == EINVAL || error == ENOSYS) {
+        // Filesystems without RENAME_NOREPLACE support
+        std::error_code ec;
+        if (!fs::exists(oldpath, ec)) {
+            return FileOperationResult::FILE_NOT_FOUND;
+        }
+        if (fs::exists(newpath, ec)) {
+            return FileOperationResult::FILE_ALREADY_EXISTS;
+        }
+        fs::rename(oldpath, newpath, ec);
+        return ec ? system_error_to_file_operation_result(ec)
+                  : sync_rename(oldpath, newpath);
+    }
+    return errno_to_file_operation_result(error);
+}
+
+namespace {
+
+// Copy size bytes from in to out inside the kernel. copy_file_range lets
+// the filesystem share extents or offload the copy; filesystems that do
+// not support it fall back to sendfile, which still avoids user space.
+bool copy_file_contents(int in, int out, uint64_t size)
+{
+    uint64_t copied = 0;
+    bool use_copy_range = true;
+    while (copied < size) {
+        size_t chunk = static_cast<size_t>(
+            std::min<uint64_t>(size - copied, SSIZE_MAX));
+        ssize_t n;
+        if (use_copy_range) {
+            n = copy_file_range(in, nullptr, out, nullptr, chunk, 0);
+            if (n < 0 && (errno == EXDEV || errno == ENOSYS ||
+                          errno == EOPNOTSUPP || errno == EINVAL)) {
+                use_copy_range = false;
+                continue;
+            }
+        } else {
+            off_t offset = static_cast<off_t>(copied);
+            n = sendfile(out, in, &offset, chunk);
+        }
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        if (n == 0) {
+            // The source shrank while it was being copied
+            break;
+        }
+        copied += static_cast<uint64_t>(n);
+    }
+    return true;
+}
+
+} // namespace
+
+std::pair<std::string, FileOperationResult>
+create_staging_directory(const std::string &directory)
+{
+    fs::path path(directory);
+    std::string staging =
+        (path.parent_path() / ("." + path.filename().string() + ".XXXXXX"))
+            .string();
+    if (mkdtemp(staging.data()) == nullptr) {
+        return {"", errno_to_file_operation_result(errno)};
+    }
+    return {staging, FileOperationResult::SUCCESS};
+}
+
+FileOperationResult commit_staging_directory(const std::string &staging,
+                                             const std::string &directory)
+{
+    // Never replaces whatever appeared at directory while staging, and
+    // syncs the parent once the rename is done
+    auto result = rename_path(staging, directory);
+    if (result != FileOperationResult::SUCCESS) {
+        discard_staging_directory(staging);
+    }
+    return result;
+}
+
+void discard_staging_directory(const std::string &staging)
 {
     std::error_code ec;
+    fs::remove_all(staging, ec);
+}
 
-    if (!fs::exists(oldpath, ec)) {
-        return FileOperationResult::FILE_NOT_FOUND;
+namespace {
+
+// Make the entries of a directory durable according to the current mode
+bool sync_directory(const fs::path &path)
+{
+    if (get_durability_mode() == DurabilityMode::NONE) {
+        return true;
     }
+    int fd = open(path.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0) {
+        return false;
+    }
+    bool synced = sync_file(fd);
+    close(fd);
+    return synced;
+}
 
-    if (fs::exists(newpath, ec)) {
-        return FileOperationResult::FILE_ALREADY_EXISTS;
+// Fill out with the contents and checksums of in. A deduplicated source is
+// copied by sharing its manifest. Otherwise a reflink shares the source
+// extents, so the copy is constant time on filesystems that support it
+// (btrfs, xfs, bcachefs)
+bool copy_open_file(int in, const struct stat &st, int out)
+{
+    auto [shared, share_result] = copy_placeholder(in, out);
+    bool copied = share_result == FileOperationResult::SUCCESS &&
+                  (shared || ioctl(out, FICLONE, in) == 0 ||
+                   copy_file_contents(in, out, st.st_size));
+    // The copy has the same contents, so the same block checksums
+    return copied && copy_checksums(in, out) == FileOperationResult::SUCCESS;
+}
+
+// Copy source to target, which must not exist yet
+FileOperationResult copy_to_new_file(const std::string &source,
+                                     const std::string &target)
+{
+    int in = open(source.c_str(), O_RDONLY | O_CLOEXEC);
+    if (in < 0) {
+        return errno_to_file_operation_result(errno);
+    }
+    struct stat st;
+    if (fstat(in, &st) != 0 || !S_ISREG(st.st_mode)) {
+        close(in);
+        return FileOperationResult::FILE_NOT_FOUND;
     }
 
-    fs::rename(oldpath, newpath, ec);
-    if (ec) {
-        return system_error_to_file_operation_result(ec);
+    int out = open(target.c_str(),
+                   O_WRONLY | O_CREAT | O_EXCL | O_NOFOLLOW | O_CLOEXEC,
+                   st.st_mode & 0777);
+    if (out < 0) {
+        int error = errno;
+        close(in);
+        return errno_to_file_operation_result(error);
     }
 
+    bool copied = copy_open_file(in, st, out) && sync_file(out);
+    close(in);
+    if (close(out) != 0) {
+        copied = false;
+    }
+    if (!copied) {
+        unlink(target.c_str());
+        return FileOperationResult::IO_ERROR;
+    }
     return FileOperationResult::SUCCESS;
 }
 
+} // namespace
+
+std::pair<StagingFile, FileOperationResult>
+stage_file_copy(const std::string &source, const std::string &destination)
+{
+    int in = open(source.c_str(), O_RDONLY | O_CLOEXEC);
+    if (in < 0) {
+        return {StagingFile(), errno_to_file_operation_result(errno)};
+    }
+
+    struct stat st;
+    if (fstat(in, &st) != 0 || !S_ISREG(st.st_mode)) {
+        close(in);
+        return {StagingFile(), FileOperationResult::FILE_NOT_FOUND};
+    }
+
+    // Copying a file onto itself is refused
+    struct stat out_st;
+    if (stat(destination.c_str(), &out_st) == 0 &&
+        out_st.st_dev == st.st_dev && out_st.st_ino == st.st_ino) {
+        close(in);
+        return {StagingFile(), FileOperationResult::INVALID_PATH};
+    }
+
+    auto [staging, result] =
+        create_staging_file(destination, st.st_mode & 0777);
+    if (result != FileOperationResult::SUCCESS) {
+        close(in);
+        return {staging, result};
+    }
+
+    bool copied = copy_open_file(in, st, staging.fd);
+    close(in);
+    if (!copied) {
+        discard_staging_file(staging);
+        return {staging, FileOperationResult::IO_ERROR};
+    }
+    return {staging, FileOperationResult::SUCCESS};
+}
+
 FileOperationResult copy_file(const std::string &source,
                               const std::string &destination)
+{
+    auto [staging, result] = stage_file_copy(source, destination);
+    if (result != FileOperationResult::SUCCESS) {
+        return result;
+    }
+    return commit_staging_file(staging, destination);
+}
+
+std::pair<std::string, FileOperationResult>
+stage_directory_copy(const std::string &source, const std::string &destination)
 {
     std::error_code ec;
 
-    if (!fs::exists(source, ec) || !fs::is_regular_file(source, ec)) {
-        return FileOperationResult::FILE_NOT_FOUND;
+    auto status = fs::status(source, ec);
+    if (!fs::exists(status)) {
+        return {"", FileOperationResult::FILE_NOT_FOUND};
+    }
+    if (!fs::is_directory(status)) {
+        return {"", FileOperationResult::INVALID_PATH};
+    }
+    if (fs::exists(destination, ec)) {
+        return {"", FileOperationResult::DIRECTORY_ALREADY_EXISTS};
+    }
+
+    // Refuse to copy a directory into its own subtree
+    fs::path from = fs::weakly_canonical(source, ec);
+    fs::path to = fs::weakly_canonical(destination, ec);
+    auto [from_end, to_it] = std::mismatch(from.begin(),
+                                           from.end(),
+                                           to.begin(),
+                                           to.end());
+    if (ec || from_end == from.end()) {
+        return {"", FileOperationResult::INVALID_PATH};
+    }
+
+    auto [staging, result] = create_staging_directory(destination);
+    if (result != FileOperationResult::SUCCESS) {
+        return {"", result};
     }
+    fs::path root(staging);
+
+    fs::recursive_directory_iterator it(from, ec);
+    for (; !ec && it != fs::recursive_directory_iterator(); it.increment(ec)) {
+        fs::path target = root / it->path().lexically_relative(from);
+        auto entry_status = it->symlink_status(ec);
+        if (ec) {
+            break;
+        }
 
-    fs::copy_file(source,
-                  destination,
-                  fs::copy_options::overwrite_existing,
-                  ec);
+        if (fs::is_directory(entry_status)) {
+            if (mkdir(target.c_str(), 0755) != 0) {
+                result = errno_to_file_operation_result(errno);
+            }
+        } else if (fs::is_regular_file(entry_status)) {
+            result = copy_to_new_file(it->path().string(), target.string());
+        } else if (fs::is_symlink(entry_status)) {
+            fs::copy_symlink(it->path(), target, ec);
+        }
+        // Sockets, FIFOs and devices are not copied
+
+        if (result != FileOperationResult::SUCCESS) {
+            break;
+        }
+    }
     if (ec) {
-        return system_error_to_file_operation_result(ec);
+        result = system_error_to_file_operation_result(ec);
+    }
+    if (result != FileOperationResult::SUCCESS) {
+        // Do not leave a partial copy behind
+        discard_staging_directory(staging);
+        return {"", result};
     }
 
-    return FileOperationResult::SUCCESS;
+    // Directory modes are copied last so read-only directories can be
+    // filled; each directory's entries are synced on the same pass
+    bool synced = sync_directory(root);
+    fs::permissions(root, status.permissions(), ec);
+    for (it = fs::recursive_directory_iterator(from, ec);
+         !ec && it != fs::recursive_directory_iterator();
+         it.increment(ec)) {
+        auto entry_status = it->symlink_status(ec);
+        if (fs::is_directory(entry_status)) {
+            fs::path target = root / it->path().lexically_relative(from);
+            synced = sync_directory(target) && synced;
+            fs::permissions(target, entry_status.permissions(), ec);
+        }
+    }
+    if (!synced) {
+        discard_staging_directory(staging);
+        return {"", FileOperationResult::IO_ERROR};
+    }
+
+    return {staging, FileOperationResult::SUCCESS};
+}
+
+FileOperationResult copy_directory(const std::string &source,
+                                   const std::string &destination)
+{
+    auto [staging, result] = stage_directory_copy(source, destination);
+    if (result != FileOperationResult::SUCCESS) {
+        return result;
+    }
+    return commit_staging_directory(staging, destination);
 }
 
 std::pair<uintmax_t, FileOperationResult>
@@ -196,6 +196,23 @@ NetworkResult receive_prefixed_data(uint32_t socket,
     return NetworkResult::SUCCESS;
 }
 
+NetworkResult
+send_frame(uint32_t socket, std::vector<uint8_t> &frame, bool non_blocking_mode)
+{
+    if (frame.size() < FRAME_HEADER_SIZE || frame.size() > UINT32_MAX) {
+        return NetworkResult::SEND_ERROR;
+    }
+
+    uint32_t size_net =
+        htonl(static_cast<uint32_t>(frame.size() - FRAME_HEADER_SIZE));
+    std::memcpy(frame.data(), &size_net, FRAME_HEADER_SIZE);
+
+    return send_data(socket,
+                     frame,
+                     static_cast<uint32_t>(frame.size()),
+                     non_blocking_mode);
+}
+
 } // namespace network
 } // namespace common
 } // namespace fenris
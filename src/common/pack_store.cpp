@@ -0,0 +1,736 @@
+#include "common/pack_store.hpp"
+#include "common/checksum.hpp"
+#include "common/chunk_store.hpp"
+#include "common/durability.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstdio>
+#include <fcntl.h>
+#include <filesystem>
+#include <sys/xattr.h>
+#include <system_error>
+#include <unistd.h>
+#include <vector>
+
+namespace fs = std::filesystem;
+
+namespace fenris {
+namespace common {
+
+namespace {
+
+// Encoded PackLocation: pack and length as u32, offset as u64 and crc as
+// u32, all little-endian
+constexpr size_t LOCATION_SIZE = 20;
+
+std::string encode_location(const PackLocation &location)
+{
+    std::string bytes(LOCATION_SIZE, '\0');
+    for (int i = 0; i < 4; i++) {
+        bytes[i] = static_cast<char>(location.pack >> (8 * i));
+        bytes[4 + i] = static_cast<char>(location.length >> (8 * i));
+    }
+    for (int i = 0; i < 8; i++) {
+        bytes[8 + i] = static_cast<char>(location.offset >> (8 * i));
+    }
+    for (int i = 0; i < 4; i++) {
+        bytes[16 + i] = static_cast<char>(location.crc >> (8 * i));
+    }
+    return bytes;
+}
+
+bool decode_location(const char *bytes, size_t size, PackLocation &location)
+{
+    if (size != LOCATION_SIZE) {
+        return false;
+    }
+    auto byte = [bytes](int i) {
+        return static_cast<uint64_t>(static_cast<uint8_t>(bytes[i]));
+    };
+    location = PackLocation{};
+    for (int i = 0; i < 4; i++) {
+        location.pack |= static_cast<uint32_t>(byte(i) << (8 * i));
+        location.length |= static_cast<uint32_t>(byte(4 + i) << (8 * i));
+    }
+    for (int i = 0; i < 8; i++) {
+        location.offset |= byte(8 + i) << (8 * i);
+    }
+    for (int i = 0; i < 4; i++) {
+        location.crc |= static_cast<uint32_t>(byte(16 + i) << (8 * i));
+    }
+    return location.length != 0 && location.length < MAX_PACKED_FILE_SIZE;
+}
+
+// Pack files are named by their id: 8 hex digits and ".pack"
+bool parse_pack_name(const std::string &name, uint32_t &id)
+{
+    unsigned int value;
+    char suffix[6] = {};
+    if (name.size() != 13 ||
+        std::sscanf(name.c_str(), "%8x.%4s", &value, suffix) != 2 ||
+        std::string(suffix) != "pack") {
+        return false;
+    }
+    id = value;
+    return true;
+}
+
+bool pread_all(int fd, char *buffer, size_t size, uint64_t offset)
+{
+    size_t total_read = 0;
+    while (total_read < size) {
+        ssize_t bytes = pread(fd,
+                              buffer + total_read,
+                              size - total_read,
+                              static_cast<off_t>(offset + total_read));
+        if (bytes < 0 && errno == EINTR) {
+            continue;
+        }
+        if (bytes <= 0) {
+            return false;
+        }
+        total_read += static_cast<size_t>(bytes);
+    }
+    return true;
+}
+
+bool pwrite_all(int fd, const char *data, size_t size, uint64_t offset)
+{
+    size_t total_written = 0;
+    while (total_written < size) {
+        ssize_t bytes = pwrite(fd,
+                               data + total_written,
+                               size - total_written,
+                               static_cast<off_t>(offset + total_written));
+        if (bytes < 0 && errno == EINTR) {
+            continue;
+        }
+        if (bytes <= 0) {
+            return false;
+        }
+        total_written += static_cast<size_t>(bytes);
+    }
+    return true;
+}
+
+FileOperationResult errno_result(int error)
+{
+    return system_error_to_file_operation_result(
+        std::error_code(error, std::generic_category()));
+}
+
+bool xattrs_unsupported(int error)
+{
+    return error == ENOTSUP || error == EOPNOTSUPP;
+}
+
+// Remove an attribute that may not be there
+bool remove_xattr(int fd, const char *name)
+{
+    return fremovexattr(fd, name) == 0 || errno == ENODATA ||
+           xattrs_unsupported(errno);
+}
+
+bool same_location(const PackLocation &a, const PackLocation &b)
+{
+    return a.pack == b.pack && a.offset == b.offset && a.length == b.length;
+}
+
+std::atomic<bool> g_has_pack_store{false};
+std::atomic<bool> g_pack_writes{false};
+std::mutex g_pack_store_mutex;
+std::shared_ptr<PackStore> g_pack_store;
+
+} // namespace
+
+PackStore::Pack::Pack(int fd, uint64_t size) : fd(fd), size(size) {}
+
+PackStore::Pack::~Pack()
+{
+    close(fd);
+}
+
+PackStore::PackStore(std::string root, uint64_t max_pack_size)
+    : m_root(std::move(root)), m_max_pack_size(max_pack_size)
+{
+}
+
+FileOperationResult PackStore::initialize()
+{
+    std::error_code ec;
+    fs::create_directories(m_root, ec);
+    if (ec) {
+        return system_error_to_file_operation_result(ec);
+    }
+
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_packs.clear();
+    for (fs::directory_iterator it(m_root, ec), end; !ec && it != end;
+         it.increment(ec)) {
+        uint32_t id;
+        if (!parse_pack_name(it->path().filename().string(), id)) {
+            continue;
+        }
+        int fd = open(it->path().c_str(), O_RDWR | O_CLOEXEC);
+        struct stat st;
+        if (fd < 0 || fstat(fd, &st) != 0) {
+            int error = errno;
+            if (fd >= 0) {
+                close(fd);
+            }
+            return errno_result(error);
+        }
+        m_packs.emplace(id,
+                        std::make_shared<Pack>(fd,
+                                               static_cast<uint64_t>(
+                                                   st.st_size)));
+    }
+    if (ec) {
+        return system_error_to_file_operation_result(ec);
+    }
+
+    // Appends continue in the newest pack; a record torn by a crash at its
+    // end is never referenced, and is reclaimed with the pack
+    if (m_packs.empty()) {
+        return start_pack();
+    }
+    m_active = m_packs.rbegin()->first;
+    return FileOperationResult::SUCCESS;
+}
+
+const std::string &PackStore::root() const
+{
+    return m_root;
+}
+
+size_t PackStore::pack_count() const
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_packs.size();
+}
+
+std::string PackStore::pack_path(uint32_t id) const
+{
+    char name[16];
+    std::snprintf(name, sizeof(name), "%08x.pack", id);
+    return (fs::path(m_root) / name).string();
+}
+
+std::shared_ptr<PackStore::Pack> PackStore::find_pack(uint32_t id) const
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    auto it = m_packs.find(id);
+    return it != m_packs.end() ? it->second : nullptr;
+}
+
+FileOperationResult PackStore::start_pack()
+{
+    uint32_t id = m_packs.empty() ? 1 : m_packs.rbegin()->first + 1;
+    int fd = open(pack_path(id).c_str(),
+                  O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC,
+                  0600);
+    if (fd < 0) {
+        return errno_result(errno);
+    }
+    m_packs.emplace(id, std::make_shared<Pack>(fd, 0));
+    m_active = id;
+    return FileOperationResult::SUCCESS;
+}
+
+std::pair<PackLocation, FileOperationResult>
+PackStore::append(const void *data, size_t size)
+{
+    return append_record(data, size, crc32c(data, size));
+}
+
+std::pair<PackLocation, FileOperationResult>
+PackStore::append_record(const void *data, size_t size, uint32_t crc)
+{
+    if (size == 0 || size >= MAX_PACKED_FILE_SIZE) {
+        return {{}, FileOperationResult::INVALID_PATH};
+    }
+
+    std::shared_ptr<Pack> pack;
+    PackLocation location;
+    {
+        // Appends are serialized so every record starts where the previous
+        // one ended; they are small, so this is never held for long
+        std::lock_guard<std::mutex> lock(m_mutex);
+        auto active = m_packs.find(m_active);
+        if (active == m_packs.end()) {
+            return {{}, FileOperationResult::IO_ERROR};
+        }
+        if (active->second->size + size > m_max_pack_size) {
+            auto result = start_pack();
+            if (result != FileOperationResult::SUCCESS) {
+                return {{}, result};
+            }
+            active = m_packs.find(m_active);
+        }
+
+        pack = active->second;
+        location.pack = m_active;
+        location.length = static_cast<uint32_t>(size);
+        location.offset = pack->size;
+        location.crc = crc;
+        if (!pwrite_all(pack->fd,
+                        static_cast<const char *>(data),
+                        size,
+                        location.offset)) {
+            return {{}, FileOperationResult::IO_ERROR};
+        }
+        pack->size += size;
+    }
+
+    // Outside the lock, so concurrent appends share a group commit
+    if (!sync_file(pack->fd)) {
+        return {{}, FileOperationResult::IO_ERROR};
+    }
+    return {location, FileOperationResult::SUCCESS};
+}
+
+std::pair<std::string, FileOperationResult>
+PackStore::read(const PackLocation &location,
+                uint64_t offset,
+                uint64_t length) const
+{
+    // Records are small, so checking the whole one costs little more than
+    // reading the part asked for
+    auto [content, result] = read_record(location);
+    if (result != FileOperationResult::SUCCESS) {
+        return {"", result};
+    }
+    if (crc32c(content.data(), content.size()) != location.crc) {
+        return {"", FileOperationResult::DATA_CORRUPTED};
+    }
+    if (offset != 0 || length < content.size()) {
+        content = offset < content.size() ? content.substr(offset, length)
+                                          : std::string();
+    }
+    return {content, FileOperationResult::SUCCESS};
+}
+
+std::pair<std::string, FileOperationResult>
+PackStore::read_record(const PackLocation &location) const
+{
+    auto pack = find_pack(location.pack);
+    if (!pack) {
+        return {"", FileOperationResult::IO_ERROR};
+    }
+
+    std::string content(location.length, '\0');
+    if (!pread_all(pack->fd,
+                   content.data(),
+                   content.size(),
+                   location.offset)) {
+        return {"", FileOperationResult::IO_ERROR};
+    }
+    return {content, FileOperationResult::SUCCESS};
+}
+
+FileOperationResult PackStore::pack(int fd)
+{
+    struct stat st;
+    if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode)) {
+        return FileOperationResult::INVALID_PATH;
+    }
+    auto size = static_cast<size_t>(st.st_size);
+    if (size == 0 || size >= MAX_PACKED_FILE_SIZE) {
+        return FileOperationResult::SUCCESS;
+    }
+
+    std::string content(size, '\0');
+    if (!pread_all(fd, content.data(), size, 0)) {
+        return FileOperationResult::IO_ERROR;
+    }
+    auto [location, result] = append(content.data(), size);
+    if (result != FileOperationResult::SUCCESS) {
+        return result;
+    }
+
+    std::string encoded = encode_location(location);
+    if (fsetxattr(fd, PACK_XATTR, encoded.data(), encoded.size(), 0) != 0) {
+        // The record is reclaimed by compaction
+        return xattrs_unsupported(errno) ? FileOperationResult::SUCCESS
+                                         : FileOperationResult::IO_ERROR;
+    }
+
+    // Dropping the contents and extending the file again leaves a hole of
+    // the original size
+    if (ftruncate(fd, 0) != 0 || ftruncate(fd, st.st_size) != 0) {
+        return FileOperationResult::IO_ERROR;
+    }
+    return FileOperationResult::SUCCESS;
+}
+
+void PackStore::remember(const struct stat &st, const PackLocation &location)
+{
+    std::lock_guard<std::mutex> lock(m_index_mutex);
+    InodeKey key{st.st_dev, st.st_ino};
+    if (m_index.size() >= MAX_PACK_INDEX_SIZE && !m_index.count(key)) {
+        return;
+    }
+    m_index[key] = IndexEntry{location, st.st_ctim};
+}
+
+std::pair<std::optional<PackLocation>, FileOperationResult>
+PackStore::locate(int fd, const struct stat &st)
+{
+    // Only small files can be packed, so larger ones need no lookup
+    if (!S_ISREG(st.st_mode) || st.st_size == 0 ||
+        static_cast<uint64_t>(st.st_size) >= MAX_PACKED_FILE_SIZE) {
+        return {std::nullopt, FileOperationResult::SUCCESS};
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(m_index_mutex);
+        auto it = m_index.find(InodeKey{st.st_dev, st.st_ino});
+        if (it != m_index.end() &&
+            it->second.ctime.tv_sec == st.st_ctim.tv_sec &&
+            it->second.ctime.tv_nsec == st.st_ctim.tv_nsec) {
+            return {it->second.location, FileOperationResult::SUCCESS};
+        }
+    }
+
+    char bytes[LOCATION_SIZE];
+    ssize_t size = fgetxattr(fd, PACK_XATTR, bytes, sizeof(bytes));
+    if (size < 0) {
+        if (errno == ENODATA || xattrs_unsupported(errno)) {
+            return {std::nullopt, FileOperationResult::SUCCESS};
+        }
+        return {std::nullopt, FileOperationResult::IO_ERROR};
+    }
+
+    // The placeholder holds none of the data, so there is nothing to fall
+    // back to if its record is unusable
+    PackLocation location;
+    if (!decode_location(bytes, static_cast<size_t>(size), location) ||
+        location.length != static_cast<uint64_t>(st.st_size)) {
+        return {std::nullopt, FileOperationResult::IO_ERROR};
+    }
+    remember(st, location);
+    return {location, FileOperationResult::SUCCESS};
+}
+
+std::pair<bool, FileOperationResult> PackStore::copy(int source_fd,
+                                                     int destination_fd)
+{
+    struct stat st;
+    if (fstat(source_fd, &st) != 0) {
+        return {false, FileOperationResult::IO_ERROR};
+    }
+
+    std::lock_guard<std::mutex> lock(m_placeholder_mutex);
+    auto [location, result] = locate(source_fd, st);
+    if (result != FileOperationResult::SUCCESS) {
+        return {false, result};
+    }
+    if (!location) {
+        // A plain copy must not inherit the record of the file it replaces
+        if (!remove_xattr(destination_fd, PACK_XATTR)) {
+            return {false, FileOperationResult::IO_ERROR};
+        }
+        return {false, FileOperationResult::SUCCESS};
+    }
+
+    auto [content, read_result] = read_record(*location);
+    if (read_result != FileOperationResult::SUCCESS) {
+        return {true, read_result};
+    }
+    if (m_retired.count(location->pack)) {
+        // Compaction may have walked past the destination already, so it
+        // must not refer to a pack about to be removed
+        auto [fresh, append_result] =
+            append_record(content.data(), content.size(), location->crc);
+        if (append_result != FileOperationResult::SUCCESS) {
+            return {true, append_result};
+        }
+        location = fresh;
+    }
+
+    std::string encoded = encode_location(*location);
+    if (!remove_xattr(destination_fd, MANIFEST_XATTR) ||
+        fsetxattr(destination_fd,
+                  PACK_XATTR,
+                  encoded.data(),
+                  encoded.size(),
+                  0) != 0) {
+        // A destination that cannot hold a placeholder gets the contents,
+        // as long as they are intact
+        if (xattrs_unsupported(errno) &&
+            crc32c(content.data(), content.size()) != location->crc) {
+            return {true, FileOperationResult::DATA_CORRUPTED};
+        }
+        bool written = xattrs_unsupported(errno) &&
+                       pwrite_all(destination_fd,
+                                  content.data(),
+                                  content.size(),
+                                  0);
+        return {true,
+                written ? FileOperationResult::SUCCESS
+                        : FileOperationResult::IO_ERROR};
+    }
+    if (ftruncate(destination_fd, st.st_size) != 0) {
+        return {true, FileOperationResult::IO_ERROR};
+    }
+    return {true, FileOperationResult::SUCCESS};
+}
+
+std::pair<PackCompactionStats, FileOperationResult>
+PackStore::compact(const std::string &namespace_root,
+                   double ratio,
+                   std::chrono::seconds grace_period)
+{
+    PackCompactionStats stats;
+
+    // Find every placeholder, and rebuild the index from them on the way.
+    // A partial walk could miss references, so any error stops compaction
+    struct Reference {
+        std::string path;
+        PackLocation location;
+    };
+    std::map<uint32_t, std::vector<Reference>> references;
+    // Unique records per pack, by offset, so shared records count once
+    std::map<uint32_t, std::map<uint64_t, PackLocation>> records;
+    std::unordered_map<InodeKey, IndexEntry, InodeKeyHash> index;
+    std::error_code ec;
+    for (fs::recursive_directory_iterator it(namespace_root, ec), end;
+         !ec && it != end;
+         it.increment(ec)) {
+        struct stat st;
+        if (lstat(it->path().c_str(), &st) != 0 || !S_ISREG(st.st_mode) ||
+            st.st_size == 0 ||
+            static_cast<uint64_t>(st.st_size) >= MAX_PACKED_FILE_SIZE) {
+            continue;
+        }
+        char bytes[LOCATION_SIZE];
+        ssize_t size =
+            lgetxattr(it->path().c_str(), PACK_XATTR, bytes, sizeof(bytes));
+        PackLocation location;
+        if (size < 0 ||
+            !decode_location(bytes, static_cast<size_t>(size), location)) {
+            continue;
+        }
+        references[location.pack].push_back({it->path().string(), location});
+        records[location.pack][location.offset] = location;
+        if (index.size() < MAX_PACK_INDEX_SIZE) {
+            index[InodeKey{st.st_dev, st.st_ino}] =
+                IndexEntry{location, st.st_ctim};
+        }
+    }
+    if (ec) {
+        return {stats, system_error_to_file_operation_result(ec)};
+    }
+    {
+        // Entries of deleted files go with the old index
+        std::lock_guard<std::mutex> lock(m_index_mutex);
+        m_index = std::move(index);
+    }
+
+    std::vector<std::pair<uint32_t, std::shared_ptr<Pack>>> sealed;
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        for (const auto &[id, pack] : m_packs) {
+            if (id != m_active) {
+                sealed.emplace_back(id, pack);
+            }
+        }
+    }
+
+    auto cutoff = std::chrono::system_clock::to_time_t(
+        std::chrono::system_clock::now() - grace_period);
+    for (const auto &[id, pack] : sealed) {
+        uint64_t pack_size;
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            pack_size = pack->size;
+        }
+
+        bool retired;
+        {
+            std::lock_guard<std::mutex> lock(m_placeholder_mutex);
+            retired = m_retired.count(id) != 0;
+        }
+        auto referenced = references.find(id);
+        if (retired && referenced == references.end()) {
+            // Retired by an earlier pass and still unreferenced
+            {
+                std::lock_guard<std::mutex> lock(m_mutex);
+                m_packs.erase(id);
+            }
+            {
+                std::lock_guard<std::mutex> lock(m_placeholder_mutex);
+                m_retired.erase(id);
+            }
+            if (unlink(pack_path(id).c_str()) == 0) {
+                stats.packs_removed++;
+                stats.bytes_freed += pack_size;
+            }
+            continue;
+        }
+
+        if (!retired) {
+            struct stat st;
+            if (fstat(pack->fd, &st) != 0 || st.st_mtime >= cutoff) {
+                continue;
+            }
+            uint64_t live = 0;
+            for (const auto &[offset, record] : records[id]) {
+                live += record.length;
+            }
+            if (live > 0 && static_cast<double>(live) >=
+                                ratio * static_cast<double>(pack_size)) {
+                continue;
+            }
+            std::lock_guard<std::mutex> lock(m_placeholder_mutex);
+            m_retired.insert(id);
+        }
+        if (referenced == references.end()) {
+            continue;
+        }
+
+        // Copy each live record to the newest pack once, make the copies
+        // durable, and only then point the placeholders at them
+        std::map<uint64_t, PackLocation> moved;
+        std::set<uint32_t> written;
+        for (const auto &[offset, record] : records[id]) {
+            auto [content, read_result] = read_record(record);
+            if (read_result != FileOperationResult::SUCCESS) {
+                return {stats, read_result};
+            }
+            auto [location, append_result] =
+                append_record(content.data(), content.size(), record.crc);
+            if (append_result != FileOperationResult::SUCCESS) {
+                return {stats, append_result};
+            }
+            moved[offset] = location;
+            written.insert(location.pack);
+        }
+        for (uint32_t written_id : written) {
+            auto written_pack = find_pack(written_id);
+            if (!written_pack || fdatasync(written_pack->fd) != 0) {
+                return {stats, FileOperationResult::IO_ERROR};
+            }
+        }
+
+        for (const auto &reference : referenced->second) {
+            int fd = open(reference.path.c_str(),
+                          O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+            if (fd < 0) {
+                // Deleted or replaced since the walk
+                continue;
+            }
+
+            // The placeholder may have been rewritten since the walk
+            std::lock_guard<std::mutex> lock(m_placeholder_mutex);
+            char bytes[LOCATION_SIZE];
+            ssize_t size = fgetxattr(fd, PACK_XATTR, bytes, sizeof(bytes));
+            PackLocation current;
+            if (size >= 0 &&
+                decode_location(bytes, static_cast<size_t>(size), current) &&
+                same_location(current, reference.location)) {
+                std::string encoded =
+                    encode_location(moved[reference.location.offset]);
+                if (fsetxattr(fd,
+                              PACK_XATTR,
+                              encoded.data(),
+                              encoded.size(),
+                              XATTR_REPLACE) == 0) {
+                    stats.files_moved++;
+                }
+            }
+            close(fd);
+        }
+    }
+
+    return {stats, FileOperationResult::SUCCESS};
+}
+
+void set_pack_store(std::shared_ptr<PackStore> store, bool pack_writes)
+{
+    std::lock_guard<std::mutex> lock(g_pack_store_mutex);
+    g_has_pack_store = store != nullptr;
+    g_pack_writes = store != nullptr && pack_writes;
+    g_pack_store = std::move(store);
+}
+
+std::shared_ptr<PackStore> get_pack_store()
+{
+    // Every read checks for a store, so the common case takes no lock
+    if (!g_has_pack_store) {
+        return nullptr;
+    }
+    std::lock_guard<std::mutex> lock(g_pack_store_mutex);
+    return g_pack_store;
+}
+
+FileOperationResult pack_file(int fd)
+{
+    if (!g_pack_writes) {
+        return FileOperationResult::SUCCESS;
+    }
+    auto store = get_pack_store();
+    return store ? store->pack(fd) : FileOperationResult::SUCCESS;
+}
+
+std::pair<std::optional<std::string>, FileOperationResult>
+read_packed_range(int fd,
+                  const struct stat &st,
+                  uint64_t offset,
+                  uint64_t length)
+{
+    auto store = get_pack_store();
+    if (!store) {
+        return {std::nullopt, FileOperationResult::SUCCESS};
+    }
+    auto [location, result] = store->locate(fd, st);
+    if (result != FileOperationResult::SUCCESS || !location) {
+        return {std::nullopt, result};
+    }
+    auto [content, read_result] = store->read(*location, offset, length);
+    if (read_result != FileOperationResult::SUCCESS) {
+        return {std::nullopt, read_result};
+    }
+    return {std::move(content), FileOperationResult::SUCCESS};
+}
+
+std::pair<int, FileOperationResult>
+open_packed_range(int fd, uint64_t offset, uint64_t length)
+{
+    auto store = get_pack_store();
+    struct stat st;
+    if (!store || fstat(fd, &st) != 0) {
+        return {-1, FileOperationResult::SUCCESS};
+    }
+    auto [content, result] = read_packed_range(fd, st, offset, length);
+    if (result != FileOperationResult::SUCCESS || !content) {
+        return {-1, result};
+    }
+
+    int range_fd =
+        open(store->root().c_str(), O_RDWR | O_TMPFILE | O_CLOEXEC, 0600);
+    if (range_fd < 0) {
+        return {-1, errno_result(errno)};
+    }
+    if (!pwrite_all(range_fd, content->data(), content->size(), 0)) {
+        close(range_fd);
+        return {-1, FileOperationResult::IO_ERROR};
+    }
+    return {range_fd, FileOperationResult::SUCCESS};
+}
+
+std::pair<bool, FileOperationResult> copy_packed_placeholder(
+    int source_fd,
+    int destination_fd)
+{
+    auto store = get_pack_store();
+    if (!store) {
+        return {false, FileOperationResult::SUCCESS};
+    }
+    return store->copy(source_fd, destination_fd);
+}
+
+} // namespace common
+} // namespace fenris
@@ -0,0 +1,366 @@
+#include "common/page_cache.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+// cachestat(2) was added in Linux 6.5; older headers do not define it
+#ifndef __NR_cachestat
+#define __NR_cachestat 451
+#endif
+
+namespace fenris {
+namespace common {
+
+namespace {
+
+// From linux/mman.h, which older kernel headers do not ship
+struct CachestatRange {
+    uint64_t off;
+    uint64_t len;
+};
+
+struct Cachestat {
+    uint64_t nr_cache;
+    uint64_t nr_dirty;
+    uint64_t nr_writeback;
+    uint64_t nr_evicted;
+    uint64_t nr_recently_evicted;
+};
+
+std::atomic<BulkIoPolicy> g_bulk_io_policy{BulkIoPolicy::CACHED};
+std::atomic<uint64_t> g_bulk_size{DEFAULT_BULK_TRANSFER_SIZE};
+std::atomic<uint64_t> g_hot_size{DEFAULT_HOT_FILE_SIZE};
+
+// Cleared on the first ENOSYS, so old kernels pay for one failed call
+std::atomic<bool> g_has_cachestat{true};
+
+struct Counters {
+    std::atomic<uint64_t> reads{0};
+    std::atomic<uint64_t> read_bytes{0};
+    std::atomic<uint64_t> cached_bytes{0};
+    std::atomic<uint64_t> bulk_reads{0};
+    std::atomic<uint64_t> bulk_read_bytes{0};
+    std::atomic<uint64_t> direct_reads{0};
+    std::atomic<uint64_t> bulk_writes{0};
+    std::atomic<uint64_t> dropped_bytes{0};
+    std::atomic<uint64_t> prefetches{0};
+};
+
+Counters g_counters;
+
+void count(std::atomic<uint64_t> &counter, uint64_t amount = 1)
+{
+    counter.fetch_add(amount, std::memory_order_relaxed);
+}
+
+uint64_t page_size()
+{
+    static const auto size = static_cast<uint64_t>(sysconf(_SC_PAGESIZE));
+    return size;
+}
+
+// Bytes of the range currently in the page cache
+std::optional<uint64_t> resident_bytes(int fd, uint64_t offset, uint64_t length)
+{
+    if (!g_has_cachestat.load(std::memory_order_relaxed)) {
+        return std::nullopt;
+    }
+
+    CachestatRange range{offset, length};
+    Cachestat stat{};
+    if (syscall(__NR_cachestat, fd, &range, &stat, 0) != 0) {
+        if (errno == ENOSYS) {
+            g_has_cachestat = false;
+        }
+        return std::nullopt;
+    }
+    return std::min(stat.nr_cache * page_size(), length);
+}
+
+} // namespace
+
+std::string bulk_io_policy_to_string(BulkIoPolicy policy)
+{
+    switch (policy) {
+    case BulkIoPolicy::CACHED:
+        return "cached";
+    case BulkIoPolicy::DROP:
+        return "drop";
+    case BulkIoPolicy::DIRECT:
+        return "direct";
+    default:
+        return "unknown";
+    }
+}
+
+std::optional<BulkIoPolicy> bulk_io_policy_from_string(const std::string &name)
+{
+    if (name == "cached") {
+        return BulkIoPolicy::CACHED;
+    }
+    if (name == "drop") {
+        return BulkIoPolicy::DROP;
+    }
+    if (name == "direct") {
+        return BulkIoPolicy::DIRECT;
+    }
+    return std::nullopt;
+}
+
+void set_page_cache_policy(BulkIoPolicy policy,
+                           uint64_t bulk_size,
+                           uint64_t hot_size)
+{
+    g_bulk_size = std::max<uint64_t>(bulk_size, 1);
+    g_hot_size = hot_size;
+    g_bulk_io_policy = policy;
+}
+
+BulkIoPolicy get_bulk_io_policy()
+{
+    return g_bulk_io_policy;
+}
+
+bool is_bulk_transfer(uint64_t length)
+{
+    return g_bulk_io_policy.load(std::memory_order_relaxed) !=
+               BulkIoPolicy::CACHED &&
+           length >= g_bulk_size.load(std::memory_order_relaxed);
+}
+
+double PageCacheStats::hit_rate() const
+{
+    if (read_bytes == 0) {
+        return 0.0;
+    }
+    return static_cast<double>(cached_bytes) / static_cast<double>(read_bytes);
+}
+
+PageCacheStats get_page_cache_stats()
+{
+    PageCacheStats stats;
+    stats.reads = g_counters.reads;
+    stats.read_bytes = g_counters.read_bytes;
+    stats.cached_bytes = g_counters.cached_bytes;
+    stats.bulk_reads = g_counters.bulk_reads;
+    stats.bulk_read_bytes = g_counters.bulk_read_bytes;
+    stats.direct_reads = g_counters.direct_reads;
+    stats.bulk_writes = g_counters.bulk_writes;
+    stats.dropped_bytes = g_counters.dropped_bytes;
+    stats.prefetches = g_counters.prefetches;
+    return stats;
+}
+
+void reset_page_cache_stats()
+{
+    g_counters.reads = 0;
+    g_counters.read_bytes = 0;
+    g_counters.cached_bytes = 0;
+    g_counters.bulk_reads = 0;
+    g_counters.bulk_read_bytes = 0;
+    g_counters.direct_reads = 0;
+    g_counters.bulk_writes = 0;
+    g_counters.dropped_bytes = 0;
+    g_counters.prefetches = 0;
+}
+
+ReadHint::ReadHint(int fd, uint64_t offset, uint64_t length)
+    : m_fd(fd), m_released(offset), m_end(offset + length)
+{
+    if (length == 0) {
+        return;
+    }
+
+    auto cached = resident_bytes(fd, offset, length);
+    if (!is_bulk_transfer(length)) {
+        count(g_counters.reads);
+        if (cached) {
+            count(g_counters.read_bytes, length);
+            count(g_counters.cached_bytes, *cached);
+        }
+        return;
+    }
+
+    count(g_counters.bulk_reads);
+    count(g_counters.bulk_read_bytes, length);
+    if (cached && *cached >= length / 2) {
+        return;
+    }
+    m_drop = true;
+    m_direct = g_bulk_io_policy == BulkIoPolicy::DIRECT;
+    // Hints only; a failure here does not affect correctness
+    posix_fadvise(fd,
+                  static_cast<off_t>(offset),
+                  static_cast<off_t>(length),
+                  POSIX_FADV_SEQUENTIAL);
+}
+
+bool ReadHint::dropping() const
+{
+    return m_drop;
+}
+
+bool ReadHint::direct() const
+{
+    return m_direct;
+}
+
+void ReadHint::release(uint64_t end)
+{
+    end = std::min(end, m_end);
+    if (!m_drop || end <= m_released) {
+        return;
+    }
+
+    // The kernel only drops whole pages, so start from the page the last
+    // release ended in
+    uint64_t start = m_released - m_released % page_size();
+    posix_fadvise(m_fd,
+                  static_cast<off_t>(start),
+                  static_cast<off_t>(end - start),
+                  POSIX_FADV_DONTNEED);
+    count(g_counters.dropped_bytes, end - m_released);
+    m_released = end;
+}
+
+DirectReader::DirectReader(int fd)
+{
+    // Reopening through /proc gives a descriptor with its own flags
+    std::string path = "/proc/self/fd/" + std::to_string(fd);
+    m_fd = open(path.c_str(), O_RDONLY | O_DIRECT | O_CLOEXEC);
+    if (m_fd < 0) {
+        // Filesystems without O_DIRECT reject it with EINVAL
+        return;
+    }
+
+    m_buffer = static_cast<uint8_t *>(
+        std::aligned_alloc(DIRECT_IO_ALIGNMENT, DIRECT_IO_BUFFER_SIZE));
+    if (m_buffer == nullptr) {
+        close(m_fd);
+        m_fd = -1;
+        return;
+    }
+    count(g_counters.direct_reads);
+}
+
+DirectReader::~DirectReader()
+{
+    if (m_fd >= 0) {
+        close(m_fd);
+    }
+    std::free(m_buffer);
+}
+
+bool DirectReader::valid() const
+{
+    return m_fd >= 0;
+}
+
+ssize_t DirectReader::read(void *buffer, size_t size, uint64_t offset)
+{
+    if (offset < m_buffer_offset ||
+        offset >= m_buffer_offset + m_buffer_length) {
+        uint64_t aligned = offset - offset % DIRECT_IO_ALIGNMENT;
+        ssize_t bytes;
+        do {
+            bytes = pread(m_fd,
+                          m_buffer,
+                          DIRECT_IO_BUFFER_SIZE,
+                          static_cast<off_t>(aligned));
+        } while (bytes < 0 && errno == EINTR);
+        if (bytes < 0) {
+            return -1;
+        }
+        m_buffer_offset = aligned;
+        m_buffer_length = static_cast<size_t>(bytes);
+        if (offset >= m_buffer_offset + m_buffer_length) {
+            return 0;
+        }
+    }
+
+    size_t available =
+        static_cast<size_t>(m_buffer_offset + m_buffer_length - offset);
+    size_t take = std::min(size, available);
+    std::memcpy(buffer, m_buffer + (offset - m_buffer_offset), take);
+    return static_cast<ssize_t>(take);
+}
+
+WriteBehind::WriteBehind(int fd, uint64_t start, uint64_t length)
+    : m_fd(fd), m_active(is_bulk_transfer(length)), m_started(start),
+      m_dropped(start)
+{
+}
+
+void WriteBehind::written(uint64_t end)
+{
+    while (m_active && end >= m_started + WRITE_BEHIND_WINDOW) {
+        if (sync_file_range(m_fd,
+                            static_cast<off_t>(m_started),
+                            static_cast<off_t>(WRITE_BEHIND_WINDOW),
+                            SYNC_FILE_RANGE_WRITE) != 0) {
+            // Not supported on this file; the cache is left to the kernel
+            m_active = false;
+            return;
+        }
+        m_started += WRITE_BEHIND_WINDOW;
+
+        // The window before has had a whole window's worth of writing to
+        // reach the disk, so waiting for it rarely blocks
+        if (m_started - m_dropped > WRITE_BEHIND_WINDOW) {
+            sync_file_range(m_fd,
+                            static_cast<off_t>(m_dropped),
+                            static_cast<off_t>(WRITE_BEHIND_WINDOW),
+                            SYNC_FILE_RANGE_WAIT_BEFORE |
+                                SYNC_FILE_RANGE_WRITE |
+                                SYNC_FILE_RANGE_WAIT_AFTER);
+            posix_fadvise(m_fd,
+                          static_cast<off_t>(m_dropped),
+                          static_cast<off_t>(WRITE_BEHIND_WINDOW),
+                          POSIX_FADV_DONTNEED);
+            m_dropped += WRITE_BEHIND_WINDOW;
+        }
+    }
+}
+
+void prefetch_hot_file(int fd)
+{
+    uint64_t hot_size = g_hot_size.load(std::memory_order_relaxed);
+    struct stat st;
+    if (hot_size == 0 || fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) ||
+        st.st_size == 0 || static_cast<uint64_t>(st.st_size) > hot_size) {
+        return;
+    }
+    if (posix_fadvise(fd, 0, 0, POSIX_FADV_WILLNEED) == 0) {
+        count(g_counters.prefetches);
+    }
+}
+
+void drop_written(int fd, uint64_t offset, uint64_t length)
+{
+    if (!is_bulk_transfer(length)) {
+        return;
+    }
+
+    // Dirty pages cannot be dropped, so the range is written back first
+    sync_file_range(fd,
+                    static_cast<off_t>(offset),
+                    static_cast<off_t>(length),
+                    SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE |
+                        SYNC_FILE_RANGE_WAIT_AFTER);
+    posix_fadvise(fd,
+                  static_cast<off_t>(offset),
+                  static_cast<off_t>(length),
+                  POSIX_FADV_DONTNEED);
+    count(g_counters.bulk_writes);
+    count(g_counters.dropped_bytes, length);
+}
+
+} // namespace common
+} // namespace fenris
@@ -0,0 +1,701 @@
+#include "common/payload.hpp"
+#include "common/append_coalescer.hpp"
+#include "common/chunk_store.hpp"
+#include "common/durability.hpp"
+#include "common/network_utils.hpp"
+#include "common/pack_store.hpp"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <system_error>
+#include <unistd.h>
+#include <utility>
+
+namespace fenris {
+namespace common {
+
+using namespace common::network;
+using namespace common::crypto;
+
+std::string payload_result_to_string(PayloadResult result)
+{
+    switch (result) {
+    case PayloadResult::SUCCESS:
+        return "success";
+    case PayloadResult::NETWORK_ERROR:
+        return "network error during payload transfer";
+    case PayloadResult::ENCRYPTION_ERROR:
+        return "payload encryption error";
+    case PayloadResult::SOURCE_ERROR:
+        return "failed to read payload source";
+    case PayloadResult::SINK_ERROR:
+        return "failed to write payload sink";
+    case PayloadResult::INVALID_FRAME:
+        return "invalid payload frame";
+    case PayloadResult::ALREADY_CONSUMED:
+        return "payload already consumed";
+    default:
+        return "unrecognized payload result";
+    }
+}
+
+BufferPayloadSource::BufferPayloadSource(const void *data, size_t size)
+    : m_data(static_cast<const uint8_t *>(data)), m_size(size)
+{
+}
+
+uint64_t BufferPayloadSource::size() const
+{
+    return m_size;
+}
+
+bool BufferPayloadSource::read(uint8_t *buffer, size_t size)
+{
+    if (size > m_size - m_offset) {
+        return false;
+    }
+
+    std::copy(m_data + m_offset, m_data + m_offset + size, buffer);
+    m_offset += size;
+    return true;
+}
+
+FilePayloadSource::FilePayloadSource(
+    int fd,
+    uint64_t size,
+    uint64_t offset,
+    std::shared_ptr<const BlockChecksums> checksums)
+    : m_fd(fd), m_size(size), m_offset(offset), m_hint(fd, offset, size)
+{
+    if (checksums && size > 0) {
+        m_verifier.emplace(std::move(checksums), offset);
+    }
+    if (m_hint.direct()) {
+        m_direct = std::make_unique<DirectReader>(fd);
+        if (!m_direct->valid()) {
+            m_direct.reset();
+        }
+    }
+}
+
+FilePayloadSource::~FilePayloadSource()
+{
+    if (m_fd >= 0) {
+        close(m_fd);
+    }
+}
+
+uint64_t FilePayloadSource::size() const
+{
+    return m_size;
+}
+
+bool FilePayloadSource::read(uint8_t *buffer, size_t size)
+{
+    if (size > m_size - m_position) {
+        return false;
+    }
+    if (m_verifier && m_position == 0 &&
+        !m_verifier->update_from(m_fd, m_offset)) {
+        return false;
+    }
+
+    size_t total_read = 0;
+    while (total_read < size) {
+        ssize_t bytes =
+            m_direct ? m_direct->read(buffer + total_read,
+                                      size - total_read,
+                                      m_offset + m_position)
+                     : pread(m_fd,
+                             buffer + total_read,
+                             size - total_read,
+                             static_cast<off_t>(m_offset + m_position));
+        if (bytes < 0 && errno == EINTR) {
+            continue;
+        }
+        if (bytes <= 0) {
+            // Error, or the file shrank underneath us
+            return false;
+        }
+        total_read += static_cast<size_t>(bytes);
+        m_position += static_cast<uint64_t>(bytes);
+    }
+    m_hint.release(m_offset + m_position);
+
+    if (m_verifier) {
+        if (!m_verifier->update(buffer, size)) {
+            return false;
+        }
+        // Finish the block the payload ends in
+        if (m_position == m_size &&
+            !m_verifier->update_from(m_fd, m_verifier->block_end())) {
+            return false;
+        }
+    }
+    return true;
+}
+
+MappedPayloadSource::MappedPayloadSource(
+    std::shared_ptr<const MappedFile> file)
+    : m_file(std::move(file))
+{
+    if (m_file->checksums()) {
+        m_verifier.emplace(m_file->checksums(), 0);
+    }
+}
+
+uint64_t MappedPayloadSource::size() const
+{
+    return m_file->size();
+}
+
+bool MappedPayloadSource::read(uint8_t *buffer, size_t size)
+{
+    if (size > m_file->size() - m_offset) {
+        return false;
+    }
+
+    std::copy(m_file->data() + m_offset,
+              m_file->data() + m_offset + size,
+              buffer);
+    m_offset += size;
+    m_file->release(m_offset);
+    return !m_verifier || m_verifier->update(buffer, size);
+}
+
+namespace {
+
+// Build the source of an open file, taking ownership of fd
+std::pair<std::unique_ptr<PayloadSource>, FileOperationResult>
+make_file_payload(int fd, uint64_t offset, uint64_t length)
+{
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        close(fd);
+        return {nullptr, FileOperationResult::IO_ERROR};
+    }
+    if (!S_ISREG(st.st_mode)) {
+        close(fd);
+        return {nullptr, FileOperationResult::INVALID_PATH};
+    }
+
+    // A deduplicated file is streamed from its chunks
+    auto [chunked, chunked_result] = open_chunked_payload(fd, offset, length);
+    if (chunked_result != FileOperationResult::SUCCESS || chunked) {
+        close(fd);
+        return {std::move(chunked), chunked_result};
+    }
+    auto checksums = load_checksums(fd, st);
+
+    auto file_size = static_cast<uint64_t>(st.st_size);
+    uint64_t available = offset < file_size ? file_size - offset : 0;
+    return {std::make_unique<FilePayloadSource>(fd,
+                                                std::min(length, available),
+                                                offset,
+                                                std::move(checksums)),
+            FileOperationResult::SUCCESS};
+}
+
+} // namespace
+
+std::pair<std::unique_ptr<PayloadSource>, FileOperationResult>
+open_file_payload(const std::string &filepath,
+                  uint64_t offset,
+                  uint64_t length)
+{
+    int fd = open(filepath.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return {nullptr,
+                system_error_to_file_operation_result(
+                    std::error_code(errno, std::generic_category()))};
+    }
+    return make_file_payload(fd, offset, length);
+}
+
+std::pair<std::unique_ptr<PayloadSource>, FileOperationResult>
+open_file_payload(int fd, uint64_t offset, uint64_t length)
+{
+    int source_fd = fcntl(fd, F_DUPFD_CLOEXEC, 0);
+    if (source_fd < 0) {
+        return {nullptr, FileOperationResult::IO_ERROR};
+    }
+    return make_file_payload(source_fd, offset, length);
+}
+
+BufferPayloadSink::BufferPayloadSink(std::string &buffer) : m_buffer(buffer)
+{
+}
+
+bool BufferPayloadSink::write(const uint8_t *data, size_t size)
+{
+    m_buffer.append(reinterpret_cast<const char *>(data), size);
+    return true;
+}
+
+bool DiscardPayloadSink::write(const uint8_t *, size_t)
+{
+    return true;
+}
+
+namespace {
+
+// Passes a payload on to a file sink, checksumming it on the way
+class ChecksummingSink : public PayloadSink {
+  public:
+    explicit ChecksummingSink(PayloadSink &sink) : m_sink(sink) {}
+
+    bool write(const uint8_t *data, size_t size) override
+    {
+        m_checksums.update(data, size);
+        return m_sink.write(data, size);
+    }
+
+    BlockChecksums checksums() const
+    {
+        return m_checksums.finish();
+    }
+
+  private:
+    PayloadSink &m_sink;
+    ChecksumBuilder m_checksums;
+};
+
+bool is_zero(const uint8_t *data, size_t size)
+{
+    return size == 0 ||
+           (data[0] == 0 && std::memcmp(data, data + 1, size - 1) == 0);
+}
+
+} // namespace
+
+FilePayloadSink::FilePayloadSink(int fd, bool sparse, uint64_t expected_size)
+    : m_fd(fd), m_sparse(sparse)
+{
+    if (is_bulk_transfer(expected_size)) {
+        off_t position = lseek(fd, 0, SEEK_CUR);
+        if (position >= 0) {
+            m_position = static_cast<uint64_t>(position);
+            m_write_behind.emplace(fd, m_position, expected_size);
+        }
+    }
+}
+
+bool FilePayloadSink::write(const uint8_t *data, size_t size)
+{
+    if (!m_sparse) {
+        return write_all(data, size) && written(size);
+    }
+
+    // Split the chunk into alternating runs of data and whole zero blocks
+    size_t start = 0;
+    while (start < size) {
+        size_t block = std::min(SPARSE_BLOCK_SIZE, size - start);
+        bool zero = block == SPARSE_BLOCK_SIZE && is_zero(data + start, block);
+        size_t end = start + block;
+        while (end < size) {
+            block = std::min(SPARSE_BLOCK_SIZE, size - end);
+            bool next_zero =
+                block == SPARSE_BLOCK_SIZE && is_zero(data + end, block);
+            if (next_zero != zero) {
+                break;
+            }
+            end += block;
+        }
+
+        if (!(zero && skip_hole(end - start)) &&
+            !write_all(data + start, end - start)) {
+            return false;
+        }
+        start = end;
+    }
+    return written(size);
+}
+
+bool FilePayloadSink::finish()
+{
+    off_t position = lseek(m_fd, 0, SEEK_CUR);
+    struct stat st;
+    if (position < 0 || fstat(m_fd, &st) != 0) {
+        return false;
+    }
+    // Seeking over a trailing hole does not move the end of the file
+    return st.st_size >= position || ftruncate(m_fd, position) == 0;
+}
+
+bool FilePayloadSink::skip_hole(size_t size)
+{
+    off_t position = lseek(m_fd, 0, SEEK_CUR);
+    if (position < 0) {
+        return false;
+    }
+    if (fallocate(m_fd,
+                  FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+                  position,
+                  static_cast<off_t>(size)) != 0) {
+        // Nothing has moved yet; the zeros get written instead
+        m_sparse = false;
+        return false;
+    }
+    return lseek(m_fd, static_cast<off_t>(size), SEEK_CUR) >= 0;
+}
+
+bool FilePayloadSink::written(size_t size)
+{
+    if (m_write_behind) {
+        m_position += size;
+        m_write_behind->written(m_position);
+    }
+    return true;
+}
+
+bool FilePayloadSink::write_all(const uint8_t *data, size_t size)
+{
+    size_t total_written = 0;
+    while (total_written < size) {
+        ssize_t bytes =
+            ::write(m_fd, data + total_written, size - total_written);
+        if (bytes < 0 && errno == EINTR) {
+            continue;
+        }
+        if (bytes <= 0) {
+            return false;
+        }
+        total_written += static_cast<size_t>(bytes);
+    }
+    return true;
+}
+
+PayloadResult send_payload(uint32_t socket,
+                           PayloadSource &source,
+                           CryptoManager &crypto_manager,
+                           const std::vector<uint8_t> &key,
+                           bool non_blocking_mode)
+{
+    constexpr size_t headroom = FRAME_HEADER_SIZE + AES_GCM_IV_SIZE;
+
+    // One frame buffer is reused for every chunk
+    uint64_t remaining = source.size();
+    std::vector<uint8_t> frame;
+
+    while (remaining > 0) {
+        size_t chunk_size = static_cast<size_t>(
+            std::min<uint64_t>(remaining, PAYLOAD_CHUNK_SIZE));
+        frame.resize(headroom + chunk_size + AES_GCM_TAG_SIZE);
+
+        if (!source.read(frame.data() + headroom, chunk_size)) {
+            return PayloadResult::SOURCE_ERROR;
+        }
+
+        auto [iv, iv_result] = crypto_manager.generate_random_iv();
+        if (iv_result != EncryptionResult::SUCCESS) {
+            return PayloadResult::ENCRYPTION_ERROR;
+        }
+        std::copy(iv.begin(), iv.end(), frame.begin() + FRAME_HEADER_SIZE);
+
+        if (crypto_manager.encrypt_in_place(frame.data() + headroom,
+                                            chunk_size,
+                                            key,
+                                            frame.data() + FRAME_HEADER_SIZE) !=
+            EncryptionResult::SUCCESS) {
+            return PayloadResult::ENCRYPTION_ERROR;
+        }
+
+        if (send_frame(socket, frame, non_blocking_mode) !=
+            NetworkResult::SUCCESS) {
+            return PayloadResult::NETWORK_ERROR;
+        }
+
+        remaining -= chunk_size;
+    }
+
+    return PayloadResult::SUCCESS;
+}
+
+PayloadResult receive_payload(uint32_t socket,
+                              uint64_t size,
+                              PayloadSink &sink,
+                              CryptoManager &crypto_manager,
+                              const std::vector<uint8_t> &key,
+                              bool non_blocking_mode)
+{
+    uint64_t remaining = size;
+    bool sink_failed = false;
+    std::vector<uint8_t> frame;
+
+    while (remaining > 0) {
+        if (receive_prefixed_data(socket, frame, non_blocking_mode) !=
+            NetworkResult::SUCCESS) {
+            return PayloadResult::NETWORK_ERROR;
+        }
+
+        size_t expected_size = static_cast<size_t>(
+            std::min<uint64_t>(remaining, PAYLOAD_CHUNK_SIZE));
+        if (frame.size() !=
+            AES_GCM_IV_SIZE + expected_size + AES_GCM_TAG_SIZE) {
+            return PayloadResult::INVALID_FRAME;
+        }
+
+        uint8_t *chunk = frame.data() + AES_GCM_IV_SIZE;
+        if (crypto_manager.decrypt_in_place(chunk,
+                                            expected_size + AES_GCM_TAG_SIZE,
+                                            key,
+                                            frame.data()) !=
+            EncryptionResult::SUCCESS) {
+            return PayloadResult::ENCRYPTION_ERROR;
+        }
+
+        if (!sink_failed && !sink.write(chunk, expected_size)) {
+            // Keep draining so the next message starts on a frame boundary
+            sink_failed = true;
+        }
+
+        remaining -= expected_size;
+    }
+
+    return sink_failed ? PayloadResult::SINK_ERROR : PayloadResult::SUCCESS;
+}
+
+PayloadResult IncomingPayload::read_into(PayloadSink &sink)
+{
+    if (m_consumed) {
+        return PayloadResult::ALREADY_CONSUMED;
+    }
+
+    m_consumed = true;
+    m_result = do_read(&sink);
+    return m_result;
+}
+
+PayloadResult IncomingPayload::discard()
+{
+    if (m_consumed) {
+        return PayloadResult::ALREADY_CONSUMED;
+    }
+
+    m_consumed = true;
+    m_result = do_read(nullptr);
+    return m_result;
+}
+
+bool IncomingPayload::consumed() const
+{
+    return m_consumed;
+}
+
+PayloadResult IncomingPayload::result() const
+{
+    return m_result;
+}
+
+InlineIncomingPayload::InlineIncomingPayload(std::string_view data)
+    : m_data(data)
+{
+}
+
+uint64_t InlineIncomingPayload::size() const
+{
+    return m_data.size();
+}
+
+PayloadResult InlineIncomingPayload::do_read(PayloadSink *sink)
+{
+    if (sink != nullptr &&
+        !sink->write(reinterpret_cast<const uint8_t *>(m_data.data()),
+                     m_data.size())) {
+        return PayloadResult::SINK_ERROR;
+    }
+
+    return PayloadResult::SUCCESS;
+}
+
+StreamedIncomingPayload::StreamedIncomingPayload(
+    uint32_t socket,
+    uint64_t size,
+    CryptoManager &crypto_manager,
+    const std::vector<uint8_t> &key,
+    bool non_blocking_mode)
+    : m_socket(socket), m_size(size), m_crypto_manager(crypto_manager),
+      m_key(key), m_non_blocking_mode(non_blocking_mode)
+{
+}
+
+uint64_t StreamedIncomingPayload::size() const
+{
+    return m_size;
+}
+
+PayloadResult StreamedIncomingPayload::do_read(PayloadSink *sink)
+{
+    DiscardPayloadSink discard_sink;
+    return receive_payload(m_socket,
+                           m_size,
+                           sink != nullptr ? *sink : discard_sink,
+                           m_crypto_manager,
+                           m_key,
+                           m_non_blocking_mode);
+}
+
+FileOperationResult
+write_file_from_payload(const std::string &filepath,
+                        IncomingPayload &payload,
+                        std::optional<uint64_t> offset,
+                        uint64_t expected_size)
+{
+    // The announced size is only used to reserve space, and only the body's
+    // own range is ever reserved
+    uint64_t start = offset.value_or(0);
+    bool reserve = expected_size != 0;
+    if (reserve && expected_size != start + payload.size()) {
+        return FileOperationResult::IO_ERROR;
+    }
+
+    // Same permission rules as write_file, checked before the body is read
+    struct stat st;
+    bool exists = stat(filepath.c_str(), &st) == 0;
+    if (exists) {
+        if ((st.st_mode & S_IWUSR) == 0) {
+            return FileOperationResult::PERMISSION_DENIED;
+        }
+    } else if (errno != ENOENT) {
+        return system_error_to_file_operation_result(
+            std::error_code(errno, std::generic_category()));
+    }
+
+    if (!offset) {
+        // Whole-file writes are staged in a temporary file next to the
+        // target and committed by renaming it over the target once the last
+        // chunk is on disk, so an interrupted transfer never leaves a
+        // truncated file behind
+        auto [staging, staging_result] = create_staging_file(
+            filepath,
+            exists ? (st.st_mode & 07777) : 0644);
+        if (staging_result != FileOperationResult::SUCCESS) {
+            return staging_result;
+        }
+
+        // Nobody else sees the staging file, so it is sized up front; zero
+        // runs punched out of it then free their share of the reservation
+        auto reserve_result = FileOperationResult::SUCCESS;
+        if (reserve) {
+            reserve_result =
+                ftruncate(staging.fd, static_cast<off_t>(payload.size())) == 0
+                    ? preallocate_file(staging.fd, 0, payload.size())
+                    : FileOperationResult::IO_ERROR;
+        }
+        if (reserve_result != FileOperationResult::SUCCESS) {
+            discard_staging_file(staging);
+            return reserve_result;
+        }
+
+        // Deduplication reads the whole file back, so it is only dropped
+        // from the page cache once it has been stored
+        FilePayloadSink file_sink(staging.fd,
+                                  true,
+                                  deduplicating_writes() ? 0 : payload.size());
+        ChecksummingSink sink(file_sink);
+        if (payload.read_into(sink) != PayloadResult::SUCCESS) {
+            discard_staging_file(staging);
+            return FileOperationResult::IO_ERROR;
+        }
+        // The file ends where the body did, past any trailing hole
+        off_t written = lseek(staging.fd, 0, SEEK_CUR);
+        if (written < 0 || ftruncate(staging.fd, written) != 0) {
+            discard_staging_file(staging);
+            return FileOperationResult::IO_ERROR;
+        }
+        auto store_result = pack_file(staging.fd);
+        if (store_result == FileOperationResult::SUCCESS) {
+            store_result = deduplicate_file(staging.fd);
+        }
+        if (store_result == FileOperationResult::SUCCESS) {
+            store_result = store_checksums(staging.fd, sink.checksums());
+        }
+        if (store_result != FileOperationResult::SUCCESS) {
+            discard_staging_file(staging);
+            return store_result;
+        }
+        drop_written(staging.fd, 0, static_cast<uint64_t>(written));
+        return commit_staging_file(staging, filepath);
+    }
+
+    // Deduplicated files are rewritten as plain files before any in-place
+    // change
+    if (exists) {
+        auto materialize_result = materialize_file(filepath);
+        if (materialize_result != FileOperationResult::SUCCESS) {
+            return materialize_result;
+        }
+    }
+
+    int fd = open(filepath.c_str(), O_WRONLY | O_CREAT | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        if (errno == EACCES || errno == EPERM) {
+            return FileOperationResult::PERMISSION_DENIED;
+        }
+        return FileOperationResult::IO_ERROR;
+    }
+    if (lseek(fd, static_cast<off_t>(*offset), SEEK_SET) < 0 ||
+        drop_checksums(fd) != FileOperationResult::SUCCESS) {
+        close(fd);
+        return FileOperationResult::IO_ERROR;
+    }
+    auto reserve_result = reserve ? preallocate_file(fd, start, payload.size())
+                                  : FileOperationResult::SUCCESS;
+    if (reserve_result != FileOperationResult::SUCCESS) {
+        close(fd);
+        return reserve_result;
+    }
+
+    // Zero runs are punched out, which also clears older data under them
+    FilePayloadSink sink(fd, true, payload.size());
+    PayloadResult result = payload.read_into(sink);
+    if (result == PayloadResult::SUCCESS && !sink.finish()) {
+        result = PayloadResult::SINK_ERROR;
+    }
+    if (result == PayloadResult::SUCCESS && !sync_file(fd)) {
+        result = PayloadResult::SINK_ERROR;
+    }
+    if (result == PayloadResult::SUCCESS) {
+        drop_written(fd, *offset, payload.size());
+    } else if (reserve && fstat(fd, &st) == 0) {
+        // Space reserved past the end of the file for the rest of an
+        // interrupted body is given back
+        ftruncate(fd, st.st_size);
+    }
+    if (close(fd) != 0) {
+        result = PayloadResult::SINK_ERROR;
+    }
+    if (result == PayloadResult::SUCCESS && !exists &&
+        !sync_parent_directory(filepath)) {
+        result = PayloadResult::SINK_ERROR;
+    }
+
+    return result == PayloadResult::SUCCESS ? FileOperationResult::SUCCESS
+                                            : FileOperationResult::IO_ERROR;
+}
+
+FileOperationResult append_file_from_payload(const std::string &filepath,
+                                             IncomingPayload &payload)
+{
+    // Same rules and cached descriptor as append_file, checked before the
+    // body is read
+    auto [handle, open_result] = open_append_handle(filepath);
+    if (open_result != FileOperationResult::SUCCESS) {
+        return open_result;
+    }
+
+    FilePayloadSink sink(handle->fd);
+    PayloadResult result = payload.read_into(sink);
+    if (result == PayloadResult::SUCCESS && !sync_file(handle->fd)) {
+        result = PayloadResult::SINK_ERROR;
+    }
+
+    return result == PayloadResult::SUCCESS ? FileOperationResult::SUCCESS
+                                            : FileOperationResult::IO_ERROR;
+}
+
+} // namespace common
+} // namespace fenris
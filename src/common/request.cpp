@@ -1,6 +1,9 @@
 #include "common/request.hpp"
 #include "fenris.pb.h"
+#include <climits>
+#include <google/protobuf/io/coded_stream.h>
 #include <google/protobuf/util/json_util.h>
+#include <google/protobuf/wire_format_lite.h>
 #include <string>
 
 namespace fenris {
@@ -10,29 +13,139 @@ using namespace google::protobuf::util;
 
 std::vector<uint8_t> serialize_request(const fenris::Request &request)
 {
-    std::string serialized;
-    if (!request.SerializeToString(&serialized)) {
+    std::vector<uint8_t> serialized;
+    if (!serialize_request_into(request, serialized, 0, 0)) {
         // Handle serialization error (return empty vector)
         return {};
     }
 
-    // Convert string to vector<uint8_t>
-    return std::vector<uint8_t>(serialized.begin(), serialized.end());
+    return serialized;
+}
+
+bool serialize_request_into(const fenris::Request &request,
+                            std::vector<uint8_t> &buffer,
+                            size_t headroom,
+                            size_t tailroom)
+{
+    size_t message_size = request.ByteSizeLong();
+    if (message_size > static_cast<size_t>(INT_MAX)) {
+        return false;
+    }
+
+    // Size the buffer once and let protobuf write straight into it
+    buffer.resize(headroom + message_size + tailroom);
+    return request.SerializeToArray(buffer.data() + headroom,
+                                    static_cast<int>(message_size));
 }
 
 fenris::Request deserialize_request(const std::vector<uint8_t> &data)
+{
+    return deserialize_request(data.data(), data.size());
+}
+
+fenris::Request deserialize_request(const uint8_t *data, size_t size)
 {
     fenris::Request request;
-    
-    // Convert vector<uint8_t> to string
-    std::string serialized(data.begin(), data.end());
+    deserialize_request_into(data, size, request);
+    return request;
+}
 
-    if (!request.ParseFromString(serialized)) {
-        // Handle parse error (return empty request)
-        return fenris::Request();
+bool deserialize_request_into(const uint8_t *data,
+                              size_t size,
+                              fenris::Request &request)
+{
+    if (size > static_cast<size_t>(INT_MAX) ||
+        !request.ParseFromArray(data, static_cast<int>(size))) {
+        // Handle parse error (leave an empty request)
+        request.Clear();
+        return false;
     }
 
-    return request;
+    return true;
+}
+
+namespace {
+
+// Merges a run of encoded fields into request
+bool merge_request_fields(const uint8_t *data,
+                          size_t size,
+                          fenris::Request &request)
+{
+    if (size == 0) {
+        return true;
+    }
+
+    google::protobuf::io::CodedInputStream input(data, static_cast<int>(size));
+    return request.MergeFromCodedStream(&input) &&
+           input.ConsumedEntireMessage();
+}
+
+} // namespace
+
+bool deserialize_request_header(const uint8_t *data,
+                                size_t size,
+                                fenris::Request &request,
+                                std::string_view &body)
+{
+    using google::protobuf::internal::WireFormatLite;
+
+    request.Clear();
+    body = {};
+    if (size > static_cast<size_t>(INT_MAX)) {
+        return false;
+    }
+
+    // Walk the encoded fields, parsing everything around the data field and
+    // recording where its bytes are instead of copying them
+    google::protobuf::io::CodedInputStream input(data, static_cast<int>(size));
+    size_t segment_start = 0;
+    while (true) {
+        size_t tag_start = static_cast<size_t>(input.CurrentPosition());
+        uint32_t tag = input.ReadTag();
+        if (tag == 0) {
+            break;
+        }
+
+        if (WireFormatLite::GetTagFieldNumber(tag) !=
+                fenris::Request::kDataFieldNumber ||
+            WireFormatLite::GetTagWireType(tag) !=
+                WireFormatLite::WIRETYPE_LENGTH_DELIMITED) {
+            if (!WireFormatLite::SkipField(&input, tag)) {
+                request.Clear();
+                return false;
+            }
+            continue;
+        }
+
+        uint32_t length = 0;
+        if (!input.ReadVarint32(&length)) {
+            request.Clear();
+            return false;
+        }
+        size_t body_start = static_cast<size_t>(input.CurrentPosition());
+        if (!input.Skip(static_cast<int>(length)) ||
+            !merge_request_fields(data + segment_start,
+                                  tag_start - segment_start,
+                                  request)) {
+            request.Clear();
+            return false;
+        }
+
+        body = std::string_view(
+            reinterpret_cast<const char *>(data + body_start), length);
+        segment_start = static_cast<size_t>(input.CurrentPosition());
+    }
+
+    if (!input.ConsumedEntireMessage() ||
+        !merge_request_fields(data + segment_start,
+                              size - segment_start,
+                              request)) {
+        request.Clear();
+        body = {};
+        return false;
+    }
+
+    return true;
 }
 
 std::string request_to_json(const fenris::Request &request)
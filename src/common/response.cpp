@@ -1,5 +1,7 @@
 #include "common/response.hpp"
+#include "common/compression_manager.hpp"
 #include "fenris.pb.h"
+#include <climits>
 #include <google/protobuf/util/json_util.h>
 #include <string>
 
@@ -10,24 +12,42 @@ using namespace google::protobuf::util;
 
 std::vector<uint8_t> serialize_response(const fenris::Response &response)
 {
-    std::string serialized;
-    if (!response.SerializeToString(&serialized)) {
+    std::vector<uint8_t> serialized;
+    if (!serialize_response_into(response, serialized, 0, 0)) {
         // Handle serialization error (return empty vector)
         return {};
     }
 
-    // Convert string to vector<uint8_t>
-    return std::vector<uint8_t>(serialized.begin(), serialized.end());
+    return serialized;
+}
+
+bool serialize_response_into(const fenris::Response &response,
+                             std::vector<uint8_t> &buffer,
+                             size_t headroom,
+                             size_t tailroom)
+{
+    size_t message_size = response.ByteSizeLong();
+    if (message_size > static_cast<size_t>(INT_MAX)) {
+        return false;
+    }
+
+    // Size the buffer once and let protobuf write straight into it
+    buffer.resize(headroom + message_size + tailroom);
+    return response.SerializeToArray(buffer.data() + headroom,
+                                     static_cast<int>(message_size));
 }
 
 fenris::Response deserialize_response(const std::vector<uint8_t> &data)
+{
+    return deserialize_response(data.data(), data.size());
+}
+
+fenris::Response deserialize_response(const uint8_t *data, size_t size)
 {
     fenris::Response response;
-    
-    // Convert vector<uint8_t> to string
-    std::string serialized(data.begin(), data.end());
 
-    if (!response.ParseFromString(serialized)) {
+    if (size > static_cast<size_t>(INT_MAX) ||
+        !response.ParseFromArray(data, static_cast<int>(size))) {
         // Handle parse error (return empty response)
         return fenris::Response();
     }
@@ -46,5 +66,105 @@ std::string response_to_json(const fenris::Response &response)
     return json_output;
 }
 
+std::optional<fenris::Response>
+compress_response(const fenris::Response &response,
+                  const std::vector<uint8_t> &dictionary,
+                  size_t max_payload_size)
+{
+    if (dictionary.empty() ||
+        response.compression() != fenris::CompressionType::COMPRESSION_NONE) {
+        return std::nullopt;
+    }
+
+    std::vector<uint8_t> payload;
+    if (response.type() == fenris::ResponseType::FILE_CONTENT) {
+        if (response.data().empty() ||
+            response.data().size() > max_payload_size) {
+            return std::nullopt;
+        }
+        payload.assign(response.data().begin(), response.data().end());
+    } else if (response.type() == fenris::ResponseType::DIR_LISTING &&
+               response.has_directory_listing()) {
+        const auto &listing = response.directory_listing();
+        size_t listing_size = listing.ByteSizeLong();
+        if (listing_size == 0 || listing_size > max_payload_size) {
+            return std::nullopt;
+        }
+        payload.resize(listing_size);
+        if (!listing.SerializeToArray(payload.data(),
+                                      static_cast<int>(listing_size))) {
+            return std::nullopt;
+        }
+    } else {
+        return std::nullopt;
+    }
+
+    compress::CompressionManager compression_manager;
+    auto [compressed, result] =
+        compression_manager.compress_with_dictionary(payload, 6, dictionary);
+    if (result != compress::CompressionResult::SUCCESS ||
+        compressed.size() >= payload.size()) {
+        return std::nullopt;
+    }
+
+    fenris::Response compressed_response;
+    compressed_response.set_type(response.type());
+    compressed_response.set_success(response.success());
+    compressed_response.set_error_message(response.error_message());
+    compressed_response.set_data(compressed.data(), compressed.size());
+    compressed_response.set_compression(
+        fenris::CompressionType::COMPRESSION_ZLIB_DICTIONARY);
+    compressed_response.set_uncompressed_size(payload.size());
+    return compressed_response;
+}
+
+bool decompress_response(fenris::Response &response,
+                         const std::vector<uint8_t> &dictionary,
+                         size_t max_payload_size)
+{
+    if (response.compression() == fenris::CompressionType::COMPRESSION_NONE) {
+        return true;
+    }
+
+    if (response.compression() !=
+        fenris::CompressionType::COMPRESSION_ZLIB_DICTIONARY) {
+        return false;
+    }
+
+    // The size comes from the peer; never allocate more than a compressed
+    // payload can legitimately hold
+    if (response.uncompressed_size() == 0 ||
+        response.uncompressed_size() > max_payload_size) {
+        return false;
+    }
+
+    compress::CompressionManager compression_manager;
+    std::vector<uint8_t> compressed(response.data().begin(),
+                                    response.data().end());
+    auto [payload, result] =
+        compression_manager.decompress_with_dictionary(
+            compressed,
+            response.uncompressed_size(),
+            dictionary);
+    if (result != compress::CompressionResult::SUCCESS) {
+        return false;
+    }
+
+    if (response.type() == fenris::ResponseType::DIR_LISTING) {
+        if (!response.mutable_directory_listing()->ParseFromArray(
+                payload.data(),
+                static_cast<int>(payload.size()))) {
+            return false;
+        }
+        response.clear_data();
+    } else {
+        response.set_data(payload.data(), payload.size());
+    }
+
+    response.clear_compression();
+    response.clear_uncompressed_size();
+    return true;
+}
+
 } // namespace common
 } // namespace fenris
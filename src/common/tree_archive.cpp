@@ -0,0 +1,600 @@
+#include "common/tree_archive.hpp"
+#include "common/chunk_store.hpp"
+#include "common/durability.hpp"
+#include "common/pack_store.hpp"
+#include "common/page_cache.hpp"
+
+#include <algorithm>
+#include <cerrno>
+#include <condition_variable>
+#include <deque>
+#include <dirent.h>
+#include <fcntl.h>
+#include <mutex>
+#include <sys/stat.h>
+#include <system_error>
+#include <thread>
+#include <unistd.h>
+
+namespace fenris {
+namespace common {
+
+namespace {
+
+FileOperationResult errno_result()
+{
+    return system_error_to_file_operation_result(
+        std::error_code(errno, std::generic_category()));
+}
+
+void put_le(std::string &out, uint64_t value, size_t bytes)
+{
+    for (size_t i = 0; i < bytes; i++) {
+        out.push_back(static_cast<char>(value >> (8 * i)));
+    }
+}
+
+uint64_t get_le(const std::string &in, size_t offset, size_t bytes)
+{
+    uint64_t value = 0;
+    for (size_t i = 0; i < bytes; i++) {
+        value |= static_cast<uint64_t>(static_cast<uint8_t>(in[offset + i]))
+                 << (8 * i);
+    }
+    return value;
+}
+
+// Path length field of a header whose fixed part is complete
+size_t header_path_size(const std::string &header)
+{
+    return static_cast<size_t>(get_le(header, 21, 4));
+}
+
+// List the entries of one directory of the tree below root
+FileOperationResult list_directory(const std::string &root,
+                                   const std::string &directory,
+                                   std::vector<TreeEntry> &found)
+{
+    std::string path = directory.empty() ? root : root + "/" + directory;
+    int fd = open(path.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0) {
+        return errno_result();
+    }
+    DIR *dir = fdopendir(fd);
+    if (dir == nullptr) {
+        close(fd);
+        return FileOperationResult::IO_ERROR;
+    }
+
+    FileOperationResult result = FileOperationResult::SUCCESS;
+    errno = 0;
+    while (struct dirent *item = readdir(dir)) {
+        std::string name = item->d_name;
+        if (name == "." || name == "..") {
+            continue;
+        }
+
+        struct stat st;
+        if (fstatat(fd, item->d_name, &st, AT_SYMLINK_NOFOLLOW) != 0) {
+            if (errno == ENOENT) {
+                // Deleted while the directory was being listed
+                errno = 0;
+                continue;
+            }
+            result = errno_result();
+            break;
+        }
+        if (!S_ISDIR(st.st_mode) && !S_ISREG(st.st_mode)) {
+            continue;
+        }
+
+        TreeEntry entry;
+        entry.path = directory.empty() ? name : directory + "/" + name;
+        if (entry.path.size() > MAX_TREE_PATH_SIZE) {
+            result = FileOperationResult::INVALID_PATH;
+            break;
+        }
+        entry.type = S_ISDIR(st.st_mode) ? TreeEntryType::DIRECTORY
+                                         : TreeEntryType::FILE;
+        entry.mode = static_cast<uint32_t>(st.st_mode & 0777);
+        entry.mtime = static_cast<int64_t>(st.st_mtim.tv_sec) * 1000000000 +
+                      st.st_mtim.tv_nsec;
+        entry.size = S_ISREG(st.st_mode) ? static_cast<uint64_t>(st.st_size)
+                                         : 0;
+        found.push_back(std::move(entry));
+        errno = 0;
+    }
+    if (result == FileOperationResult::SUCCESS && errno != 0) {
+        result = errno_result();
+    }
+    closedir(dir);
+    return result;
+}
+
+} // namespace
+
+std::string encode_tree_header(const TreeEntry &entry)
+{
+    std::string header;
+    header.reserve(TREE_HEADER_SIZE + entry.path.size());
+    header.push_back(static_cast<char>(entry.type));
+    put_le(header, entry.mode, 4);
+    put_le(header, static_cast<uint64_t>(entry.mtime), 8);
+    put_le(header, entry.size, 8);
+    put_le(header, entry.path.size(), 4);
+    header += entry.path;
+    return header;
+}
+
+bool is_valid_tree_path(const std::string &path)
+{
+    if (path.empty() || path.size() > MAX_TREE_PATH_SIZE || path[0] == '/' ||
+        path.find('\0') != std::string::npos) {
+        return false;
+    }
+
+    size_t start = 0;
+    while (start <= path.size()) {
+        size_t end = path.find('/', start);
+        if (end == std::string::npos) {
+            end = path.size();
+        }
+        std::string component = path.substr(start, end - start);
+        if (component.empty() || component == "." || component == "..") {
+            return false;
+        }
+        start = end + 1;
+    }
+    return true;
+}
+
+std::pair<std::vector<TreeEntry>, FileOperationResult>
+walk_tree(const std::string &root, size_t walkers)
+{
+    struct stat st;
+    if (stat(root.c_str(), &st) != 0) {
+        return {{}, errno_result()};
+    }
+    if (!S_ISDIR(st.st_mode)) {
+        return {{}, FileOperationResult::INVALID_PATH};
+    }
+
+    std::mutex mutex;
+    std::condition_variable condition;
+    // Directories left to list, relative to root ("" is root itself), and
+    // how many are being listed
+    std::deque<std::string> queue{""};
+    size_t listing = 0;
+    std::vector<TreeEntry> entries;
+    FileOperationResult result = FileOperationResult::SUCCESS;
+
+    auto walk = [&]() {
+        std::unique_lock<std::mutex> lock(mutex);
+        while (true) {
+            condition.wait(lock, [&]() {
+                return !queue.empty() || listing == 0 ||
+                       result != FileOperationResult::SUCCESS;
+            });
+            // An empty queue with nothing being listed means the whole
+            // tree has been seen
+            if (queue.empty() || result != FileOperationResult::SUCCESS) {
+                return;
+            }
+            std::string directory = std::move(queue.front());
+            queue.pop_front();
+            listing++;
+            lock.unlock();
+
+            std::vector<TreeEntry> found;
+            auto list_result = list_directory(root, directory, found);
+
+            lock.lock();
+            listing--;
+            if (list_result != FileOperationResult::SUCCESS &&
+                result == FileOperationResult::SUCCESS) {
+                result = list_result;
+            }
+            for (auto &entry : found) {
+                if (entry.type == TreeEntryType::DIRECTORY) {
+                    queue.push_back(entry.path);
+                }
+                entries.push_back(std::move(entry));
+            }
+            condition.notify_all();
+        }
+    };
+
+    std::vector<std::thread> threads;
+    for (size_t i = 1; i < std::max<size_t>(walkers, 1); i++) {
+        threads.emplace_back(walk);
+    }
+    walk();
+    for (auto &thread : threads) {
+        thread.join();
+    }
+
+    if (result != FileOperationResult::SUCCESS) {
+        return {{}, result};
+    }
+    // A path sorts after every prefix of it, so parents come first
+    std::sort(entries.begin(),
+              entries.end(),
+              [](const TreeEntry &a, const TreeEntry &b) {
+                  return a.path < b.path;
+              });
+    return {std::move(entries), FileOperationResult::SUCCESS};
+}
+
+TreeArchiveSource::TreeArchiveSource(std::string root,
+                                     std::vector<TreeEntry> entries)
+    : m_root(std::move(root)), m_entries(std::move(entries))
+{
+    for (const auto &entry : m_entries) {
+        m_size += TREE_HEADER_SIZE + entry.path.size() + entry.size;
+    }
+}
+
+uint64_t TreeArchiveSource::size() const
+{
+    return m_size;
+}
+
+const std::vector<TreeEntry> &TreeArchiveSource::entries() const
+{
+    return m_entries;
+}
+
+uint64_t TreeArchiveSource::padded_files() const
+{
+    return m_padded;
+}
+
+bool TreeArchiveSource::read(uint8_t *buffer, size_t size)
+{
+    size_t filled = 0;
+    while (filled < size) {
+        if (m_header_offset < m_header.size()) {
+            size_t take =
+                std::min(size - filled, m_header.size() - m_header_offset);
+            std::copy(m_header.data() + m_header_offset,
+                      m_header.data() + m_header_offset + take,
+                      buffer + filled);
+            m_header_offset += take;
+            filled += take;
+        } else if (m_body_remaining > 0) {
+            size_t take = static_cast<size_t>(
+                std::min<uint64_t>(size - filled, m_body_remaining));
+            size_t from_file =
+                static_cast<size_t>(std::min<uint64_t>(take, m_body_available));
+            if (from_file > 0 && !m_body->read(buffer + filled, from_file)) {
+                // The file changed under the read; what is left goes out
+                // as zeros
+                m_body_available = 0;
+                from_file = 0;
+                m_padded++;
+            }
+            m_body_available -= from_file;
+            std::fill(buffer + filled + from_file, buffer + filled + take, 0);
+            m_body_remaining -= take;
+            filled += take;
+            if (m_body_remaining == 0) {
+                // Close each file as soon as it has been sent
+                m_body.reset();
+            }
+        } else if (!next_entry()) {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool TreeArchiveSource::next_entry()
+{
+    if (m_index >= m_entries.size()) {
+        return false;
+    }
+    const TreeEntry &entry = m_entries[m_index++];
+    m_header = encode_tree_header(entry);
+    m_header_offset = 0;
+    m_body_remaining = 0;
+    if (entry.type != TreeEntryType::FILE || entry.size == 0) {
+        return true;
+    }
+
+    // The header is already promised by the archive size, so a file that
+    // shrank or vanished since the listing is padded rather than failed
+    auto [body, result] =
+        open_file_payload(m_root + "/" + entry.path, 0, entry.size);
+    m_body_available = 0;
+    if (result == FileOperationResult::SUCCESS) {
+        m_body_available = std::min(body->size(), entry.size);
+        m_body = std::move(body);
+    }
+    if (m_body_available < entry.size) {
+        m_padded++;
+    }
+    m_body_remaining = entry.size;
+    return true;
+}
+
+std::pair<std::unique_ptr<TreeArchiveSource>, FileOperationResult>
+open_tree_archive(const std::string &root, size_t walkers)
+{
+    auto [entries, result] = walk_tree(root, walkers);
+    if (result != FileOperationResult::SUCCESS) {
+        return {nullptr, result};
+    }
+    return {std::make_unique<TreeArchiveSource>(root, std::move(entries)),
+            FileOperationResult::SUCCESS};
+}
+
+TreeArchiveSink::TreeArchiveSink(std::string root, bool store)
+    : m_root(std::move(root)), m_store(store)
+{
+}
+
+TreeArchiveSink::~TreeArchiveSink()
+{
+    if (m_fd >= 0) {
+        close(m_fd);
+    }
+}
+
+bool TreeArchiveSink::write(const uint8_t *data, size_t size)
+{
+    if (m_result != FileOperationResult::SUCCESS) {
+        return false;
+    }
+
+    while (size > 0) {
+        if (m_body_remaining > 0) {
+            size_t take =
+                static_cast<size_t>(std::min<uint64_t>(size, m_body_remaining));
+            if (!m_file->write(data, take)) {
+                return fail(FileOperationResult::IO_ERROR);
+            }
+            if (m_store) {
+                m_checksums.update(data, take);
+            }
+            m_body_remaining -= take;
+            m_bytes += take;
+            data += take;
+            size -= take;
+            if (m_body_remaining == 0 && !finish_file()) {
+                return false;
+            }
+            continue;
+        }
+
+        // The fixed part of a header tells how long its path is
+        size_t needed = TREE_HEADER_SIZE;
+        if (m_header.size() >= TREE_HEADER_SIZE) {
+            needed += header_path_size(m_header);
+        }
+        size_t take = std::min(size, needed - m_header.size());
+        m_header.append(reinterpret_cast<const char *>(data), take);
+        data += take;
+        size -= take;
+
+        if (m_header.size() == TREE_HEADER_SIZE) {
+            size_t path_size = header_path_size(m_header);
+            if (path_size == 0 || path_size > MAX_TREE_PATH_SIZE) {
+                return fail(FileOperationResult::INVALID_PATH);
+            }
+        } else if (m_header.size() == needed && !start_entry()) {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool TreeArchiveSink::start_entry()
+{
+    m_entry.type = static_cast<TreeEntryType>(m_header[0]);
+    // Only permission bits; an archive never creates setuid, setgid or
+    // sticky entries
+    m_entry.mode = static_cast<uint32_t>(get_le(m_header, 1, 4)) & 0777;
+    m_entry.mtime = static_cast<int64_t>(get_le(m_header, 5, 8));
+    m_entry.size = get_le(m_header, 13, 8);
+    m_entry.path = m_header.substr(TREE_HEADER_SIZE);
+    m_header.clear();
+
+    if (!is_valid_tree_path(m_entry.path)) {
+        return fail(FileOperationResult::INVALID_PATH);
+    }
+    std::string path = m_root + "/" + m_entry.path;
+
+    if (m_entry.type == TreeEntryType::DIRECTORY) {
+        if (m_entry.size != 0) {
+            return fail(FileOperationResult::INVALID_PATH);
+        }
+        // Owner access is kept until finish() so the contents can be
+        // created whatever the archived permissions are
+        if (mkdir(path.c_str(), 0700) != 0) {
+            return fail(errno_result());
+        }
+        m_directories.push_back(m_entry);
+        return true;
+    }
+    if (m_entry.type != TreeEntryType::FILE) {
+        return fail(FileOperationResult::INVALID_PATH);
+    }
+
+    // O_EXCL also refuses to follow a symbolic link at the path
+    m_fd = open(path.c_str(),
+                O_WRONLY | O_CREAT | O_EXCL | O_NOFOLLOW | O_CLOEXEC,
+                0600);
+    if (m_fd < 0) {
+        return fail(errno_result());
+    }
+    // Deduplication reads the file back, so it stays in the page cache
+    // until it has been stored
+    m_file = std::make_unique<FilePayloadSink>(
+        m_fd,
+        true,
+        m_store && deduplicating_writes() ? 0 : m_entry.size);
+    m_checksums = ChecksumBuilder();
+    m_body_remaining = m_entry.size;
+    return m_entry.size > 0 || finish_file();
+}
+
+bool TreeArchiveSink::finish_file()
+{
+    // Extend the file over a trailing run of zeros left as a hole
+    if (!m_file->finish()) {
+        return fail(FileOperationResult::IO_ERROR);
+    }
+    m_file.reset();
+
+    if (m_store) {
+        auto result = pack_file(m_fd);
+        if (result == FileOperationResult::SUCCESS) {
+            result = deduplicate_file(m_fd);
+        }
+        if (result == FileOperationResult::SUCCESS) {
+            result = store_checksums(m_fd, m_checksums.finish());
+        }
+        if (result != FileOperationResult::SUCCESS) {
+            return fail(result);
+        }
+    }
+
+    // Times last, since storing the file may change its contents
+    struct timespec times[2];
+    times[0].tv_sec = 0;
+    times[0].tv_nsec = UTIME_OMIT;
+    times[1].tv_sec = m_entry.mtime / 1000000000;
+    times[1].tv_nsec = m_entry.mtime % 1000000000;
+    if (fchmod(m_fd, m_entry.mode) != 0 || !sync_file(m_fd) ||
+        futimens(m_fd, times) != 0) {
+        return fail(FileOperationResult::IO_ERROR);
+    }
+    drop_written(m_fd, 0, m_entry.size);
+
+    int fd = m_fd;
+    m_fd = -1;
+    if (close(fd) != 0) {
+        return fail(FileOperationResult::IO_ERROR);
+    }
+    m_files++;
+    return true;
+}
+
+bool TreeArchiveSink::fail(FileOperationResult result)
+{
+    if (m_result == FileOperationResult::SUCCESS) {
+        m_result = result;
+    }
+    m_file.reset();
+    if (m_fd >= 0) {
+        close(m_fd);
+        m_fd = -1;
+    }
+    return false;
+}
+
+FileOperationResult TreeArchiveSink::finish()
+{
+    if (m_result != FileOperationResult::SUCCESS) {
+        return m_result;
+    }
+    if (m_fd >= 0 || !m_header.empty()) {
+        // The archive stopped in the middle of an entry
+        fail(FileOperationResult::IO_ERROR);
+        return m_result;
+    }
+
+    // Contents before their directory, so restricted permissions and the
+    // times are applied once nothing more is created inside
+    bool durable = get_durability_mode() != DurabilityMode::NONE;
+    for (auto it = m_directories.rbegin(); it != m_directories.rend(); ++it) {
+        std::string path = m_root + "/" + it->path;
+        int fd = open(path.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (fd < 0) {
+            fail(FileOperationResult::IO_ERROR);
+            return m_result;
+        }
+        struct timespec times[2];
+        times[0].tv_sec = 0;
+        times[0].tv_nsec = UTIME_OMIT;
+        times[1].tv_sec = it->mtime / 1000000000;
+        times[1].tv_nsec = it->mtime % 1000000000;
+        bool ok = (!durable || sync_file(fd)) && fchmod(fd, it->mode) == 0 &&
+                  futimens(fd, times) == 0;
+        close(fd);
+        if (!ok) {
+            fail(FileOperationResult::IO_ERROR);
+            return m_result;
+        }
+    }
+    return FileOperationResult::SUCCESS;
+}
+
+uint64_t TreeArchiveSink::directories() const
+{
+    return m_directories.size();
+}
+
+uint64_t TreeArchiveSink::files() const
+{
+    return m_files;
+}
+
+uint64_t TreeArchiveSink::bytes() const
+{
+    return m_bytes;
+}
+
+std::pair<std::string, FileOperationResult>
+stage_tree_from_payload(const std::string &directory,
+                        IncomingPayload &payload)
+{
+    // Refused before the body is read, which the caller then discards
+    struct stat st;
+    if (lstat(directory.c_str(), &st) == 0) {
+        return {"",
+                S_ISDIR(st.st_mode)
+                    ? FileOperationResult::DIRECTORY_ALREADY_EXISTS
+                    : FileOperationResult::FILE_ALREADY_EXISTS};
+    }
+    if (errno != ENOENT) {
+        return {"", errno_result()};
+    }
+
+    auto [staging, result] = create_staging_directory(directory);
+    if (result != FileOperationResult::SUCCESS) {
+        return {"", result};
+    }
+
+    {
+        TreeArchiveSink sink(staging, true);
+        PayloadResult received = payload.read_into(sink);
+        result = sink.finish();
+        if (result == FileOperationResult::SUCCESS &&
+            received != PayloadResult::SUCCESS) {
+            result = FileOperationResult::IO_ERROR;
+        }
+    }
+    if (result == FileOperationResult::SUCCESS &&
+        chmod(staging.c_str(), 0755) != 0) {
+        result = errno_result();
+    }
+    if (result != FileOperationResult::SUCCESS) {
+        discard_staging_directory(staging);
+        return {"", result};
+    }
+    return {staging, FileOperationResult::SUCCESS};
+}
+
+FileOperationResult extract_tree_from_payload(const std::string &directory,
+                                              IncomingPayload &payload)
+{
+    auto [staging, result] = stage_tree_from_payload(directory, payload);
+    if (result != FileOperationResult::SUCCESS) {
+        return result;
+    }
+    return commit_staging_directory(staging, directory);
+}
+
+} // namespace common
+} // namespace fenris
@@ -0,0 +1,246 @@
+#include "server/background_deleter.hpp"
+#include "server/io_priority.hpp"
+
+#include <algorithm>
+#include <cerrno>
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace fenris {
+namespace server {
+
+using namespace common;
+
+BackgroundDeleter::BackgroundDeleter(const std::string &trash_dir,
+                                     size_t num_threads,
+                                     size_t max_unlinks_per_second,
+                                     const std::string &logger_name)
+    : m_trash_dir(trash_dir), m_num_threads(std::max<size_t>(num_threads, 1)),
+      m_unlink_interval(max_unlinks_per_second == 0
+                            ? 0
+                            : 1000000000 / max_unlinks_per_second),
+      m_logger(get_logger(logger_name))
+{
+    // Names in the trash only have to be unique, and a time-based start
+    // keeps them from colliding with entries left by an earlier run
+    m_sequence = static_cast<uint64_t>(
+        std::chrono::system_clock::now().time_since_epoch().count());
+}
+
+BackgroundDeleter::~BackgroundDeleter()
+{
+    stop();
+}
+
+FileOperationResult BackgroundDeleter::remove(const std::string &path)
+{
+    if (!start()) {
+        return FileOperationResult::IO_ERROR;
+    }
+
+    struct stat path_st;
+    struct stat trash_st;
+    if (lstat(path.c_str(), &path_st) != 0) {
+        return system_error_to_file_operation_result(
+            std::error_code(errno, std::generic_category()));
+    }
+    if (stat(m_trash_dir.c_str(), &trash_st) != 0 ||
+        path_st.st_dev != trash_st.st_dev) {
+        // A rename cannot cross filesystems, so delete in place
+        m_logger->warn("'{}' is not on the trash filesystem, deleting now",
+                       path);
+        return S_ISDIR(path_st.st_mode) ? delete_directory(path, true)
+                                        : delete_file(path);
+    }
+
+    std::string name = path;
+    while (name.size() > 1 && name.back() == '/') {
+        name.pop_back();
+    }
+    name = name.substr(name.find_last_of('/') + 1);
+
+    std::unique_lock<std::mutex> lock(m_mutex);
+    std::string entry = std::to_string(++m_sequence) + "." + name;
+    FileOperationResult result = rename_path(path, m_trash_dir + "/" + entry);
+    if (result != FileOperationResult::SUCCESS) {
+        return result;
+    }
+
+    m_logger->debug("moved '{}' to trash as '{}'", path, entry);
+    m_queue.push_back(entry);
+    lock.unlock();
+    m_condition.notify_one();
+    return FileOperationResult::SUCCESS;
+}
+
+size_t BackgroundDeleter::pending() const
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_queue.size() + m_active;
+}
+
+void BackgroundDeleter::stop()
+{
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_stopping = true;
+    }
+    m_condition.notify_all();
+
+    for (auto &thread : m_threads) {
+        if (thread.joinable()) {
+            thread.join();
+        }
+    }
+    m_threads.clear();
+}
+
+bool BackgroundDeleter::start()
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    if (m_started) {
+        return !m_stopping;
+    }
+
+    FileOperationResult result = create_directories(m_trash_dir);
+    if (result != FileOperationResult::SUCCESS) {
+        m_logger->error("failed to create trash directory '{}': {}",
+                        m_trash_dir,
+                        file_operation_result_to_string(result));
+        return false;
+    }
+
+    // Reclaim whatever an earlier run did not get to
+    if (DIR *dir = opendir(m_trash_dir.c_str())) {
+        while (struct dirent *entry = readdir(dir)) {
+            std::string name = entry->d_name;
+            if (name != "." && name != "..") {
+                m_queue.push_back(name);
+            }
+        }
+        closedir(dir);
+    }
+    if (!m_queue.empty()) {
+        m_logger->info("reclaiming {} entries left in trash",
+                       m_queue.size());
+    }
+
+    for (size_t i = 0; i < m_num_threads; i++) {
+        m_threads.emplace_back(&BackgroundDeleter::worker, this);
+    }
+    m_started = true;
+    return true;
+}
+
+void BackgroundDeleter::worker()
+{
+    lower_thread_priority();
+
+    std::unique_lock<std::mutex> lock(m_mutex);
+    while (true) {
+        m_condition.wait(lock,
+                         [this]() { return m_stopping || !m_queue.empty(); });
+        if (m_stopping) {
+            return;
+        }
+
+        std::string entry = std::move(m_queue.front());
+        m_queue.pop_front();
+        m_active++;
+        lock.unlock();
+
+        int trash_fd =
+            open(m_trash_dir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        bool removed = trash_fd >= 0 && remove_tree(trash_fd, entry);
+        if (trash_fd >= 0) {
+            close(trash_fd);
+        }
+        if (removed) {
+            m_logger->debug("reclaimed '{}'", entry);
+        } else {
+            m_logger->warn("failed to reclaim '{}' from trash", entry);
+        }
+
+        lock.lock();
+        m_active--;
+    }
+}
+
+bool BackgroundDeleter::remove_tree(int parent_fd, const std::string &name)
+{
+    int fd = openat(parent_fd,
+                    name.c_str(),
+                    O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+    if (fd < 0) {
+        if (errno != ENOTDIR && errno != ELOOP) {
+            return errno == ENOENT;
+        }
+        // Files and symlinks are unlinked directly
+        throttle();
+        return unlinkat(parent_fd, name.c_str(), 0) == 0 || errno == ENOENT;
+    }
+
+    // Read-only directories would otherwise refuse the unlinks below
+    fchmod(fd, S_IRWXU);
+
+    DIR *dir = fdopendir(fd);
+    if (dir == nullptr) {
+        close(fd);
+        return false;
+    }
+
+    bool ok = true;
+    while (struct dirent *entry = readdir(dir)) {
+        if (m_stopping) {
+            // Left for the next run to pick up from the trash
+            closedir(dir);
+            return false;
+        }
+
+        std::string child = entry->d_name;
+        if (child == "." || child == "..") {
+            continue;
+        }
+
+        bool is_directory = entry->d_type == DT_DIR;
+        if (entry->d_type == DT_UNKNOWN) {
+            struct stat st;
+            is_directory =
+                fstatat(fd, child.c_str(), &st, AT_SYMLINK_NOFOLLOW) == 0 &&
+                S_ISDIR(st.st_mode);
+        }
+
+        if (is_directory) {
+            ok = remove_tree(fd, child) && ok;
+        } else {
+            throttle();
+            ok = (unlinkat(fd, child.c_str(), 0) == 0 || errno == ENOENT) &&
+                 ok;
+        }
+    }
+    closedir(dir);
+
+    throttle();
+    return ok && (unlinkat(parent_fd, name.c_str(), AT_REMOVEDIR) == 0 ||
+                  errno == ENOENT);
+}
+
+void BackgroundDeleter::throttle()
+{
+    if (m_unlink_interval.count() == 0) {
+        return;
+    }
+
+    std::chrono::steady_clock::time_point slot;
+    {
+        std::lock_guard<std::mutex> lock(m_throttle_mutex);
+        slot = std::max(std::chrono::steady_clock::now(), m_next_unlink);
+        m_next_unlink = slot + m_unlink_interval;
+    }
+    std::this_thread::sleep_until(slot);
+}
+
+} // namespace server
+} // namespace fenris
@@ -34,14 +34,18 @@ std::string CacheManager::read_file(const std::string &filename)
 
     m_logger->debug("cache miss for file: {}", filename);
 
-    // Cache miss: read from file system using existing file operations
-    auto [data, result] = common::read_file(filename);
+    // Cache miss: copy the entry straight out of a mapped view, which skips
+    // the zero-filled buffer and stream copy of read_file. The entry stays a
+    // snapshot, unaffected by later changes to the file on disk.
+    auto [mapping, result] = common::map_file(filename);
     if (result != common::FileOperationResult::SUCCESS) {
         m_logger->warn("failed to read file: {}, error: {}",
                        filename,
                        common::file_operation_result_to_string(result));
         return "";
     }
+    std::string data(mapping->view());
+    mapping.reset();
 
     // Add to cache if not empty
     {
@@ -6,6 +6,32 @@
 namespace fenris {
 namespace server {
 
+void Node::release()
+{
+    {
+        std::lock_guard<std::mutex> lock(access_mutex);
+        access_count--;
+    }
+    access_condition.notify_all();
+}
+
+void Node::wait_unused()
+{
+    std::unique_lock<std::mutex> lock(access_mutex);
+    access_condition.wait(lock, [this]() { return access_count <= 0; });
+}
+
+std::unique_lock<std::mutex> Node::lock_unused()
+{
+    std::unique_lock<std::mutex> lock(node_mutex);
+    while (access_count > 0) {
+        lock.unlock();
+        wait_unused();
+        lock.lock();
+    }
+    return lock;
+}
+
 FileSystemTree::FileSystemTree()
 {
     root = std::make_shared<Node>();
@@ -57,6 +83,37 @@ bool FileSystemTree::remove_node(const std::string &path)
     return true;
 }
 
+bool FileSystemTree::move_node(const std::string &from, const std::string &to)
+{
+    std::lock_guard<std::mutex> lock(tree_mutex);
+    auto node = traverse(from);
+    auto new_parent = traverse(to.substr(0, to.find_last_of('/')));
+    if (!node || node == root || !new_parent || !new_parent->is_directory) {
+        return false;
+    }
+
+    // A directory cannot become its own descendant
+    for (auto ancestor = new_parent; ancestor;
+         ancestor = ancestor->parent.lock()) {
+        if (ancestor == node) {
+            return false;
+        }
+    }
+
+    auto old_parent = node->parent.lock();
+    if (old_parent) {
+        auto it = std::remove(old_parent->children.begin(),
+                              old_parent->children.end(),
+                              node);
+        old_parent->children.erase(it, old_parent->children.end());
+    }
+
+    node->name = to.substr(to.find_last_of('/') + 1);
+    node->parent = new_parent;
+    new_parent->children.push_back(node);
+    return true;
+}
+
 std::shared_ptr<Node> FileSystemTree::find_node(const std::string &path)
 {
     std::lock_guard<std::mutex> lock(tree_mutex);
@@ -1,6 +1,8 @@
 #include "server/connection_manager.hpp"
+#include "common/compression_manager.hpp"
 #include "common/logging.hpp"
 #include "common/network_utils.hpp"
+#include "common/payload.hpp"
 #include "common/request.hpp"
 #include "common/response.hpp"
 #include "fenris.pb.h"
@@ -11,6 +13,7 @@
 #include <arpa/inet.h>
 #include <cstring>
 #include <fcntl.h>
+#include <google/protobuf/arena.h>
 #include <iostream>
 #include <netdb.h>
 #include <sys/socket.h>
@@ -24,6 +27,29 @@ using namespace common;
 using namespace common::network;
 using namespace common::crypto;
 
+void IClientHandler::handle_request_into(const fenris::Request &request,
+                                         ClientInfo &client_info,
+                                         fenris::Response &response)
+{
+    if (!client_info.request_payload) {
+        response = handle_request(request, client_info);
+        return;
+    }
+
+    // Handlers written against handle_request expect the body in data
+    fenris::Request full_request(request);
+    BufferPayloadSink sink(*full_request.mutable_data());
+    if (client_info.request_payload->read_into(sink) !=
+        PayloadResult::SUCCESS) {
+        response.set_type(fenris::ResponseType::ERROR);
+        response.set_success(false);
+        response.set_error_message("Failed to receive request data");
+        return;
+    }
+
+    response = handle_request(full_request, client_info);
+}
+
 ConnectionManager::ConnectionManager(const std::string &hostname,
                                      const std::string &port,
                                      const std::string &logger_name)
@@ -207,6 +233,16 @@ size_t ConnectionManager::get_active_client_count() const
     return m_client_sockets.size();
 }
 
+void ConnectionManager::set_compression_dictionary(
+    std::vector<uint8_t> dictionary)
+{
+    if (m_running) {
+        m_logger->warn("cannot change compression dictionary while running");
+        return;
+    }
+    m_compression_dictionary = std::move(dictionary);
+}
+
 void ConnectionManager::listen_for_connection()
 {
     struct sockaddr_storage client_addr;
@@ -248,6 +284,9 @@ void ConnectionManager::listen_for_connection()
             m_client_sockets[client_id] = client_fd;
         }
 
+        // Every connection gets its own handler thread and is answered one
+        // request at a time, so its file operations run right on that
+        // thread: a stalled volume only holds up the connections using it
         m_client_threads.emplace_back(&ConnectionManager::handle_client,
                                       this,
                                       client_fd,
@@ -306,6 +345,18 @@ bool ConnectionManager::perform_key_exchange(ClientInfo &client_info)
     }
 
     client_info.encryption_key = std::move(derived_key);
+
+    // Hand the client the dictionary it needs to read compressed responses
+    fenris::Response dictionary_response;
+    dictionary_response.set_type(fenris::ResponseType::DICTIONARY);
+    dictionary_response.set_success(true);
+    dictionary_response.set_data(m_compression_dictionary.data(),
+                                 m_compression_dictionary.size());
+    if (!send_response(client_info, dictionary_response)) {
+        m_logger->error("failed to send compression dictionary");
+        return false;
+    }
+
     return true;
 }
 
@@ -329,22 +380,52 @@ void ConnectionManager::handle_client(uint32_t client_socket,
         return;
     }
 
+    // Request and response messages live on a per-connection arena that is
+    // reset after every round trip, so building a large response (such as a
+    // directory listing with thousands of entries) costs a few block
+    // allocations instead of one malloc per sub-message. The initial block
+    // survives Reset(), so small round trips do not allocate at all.
+    std::vector<char> arena_block(ARENA_INITIAL_BLOCK_SIZE);
+    google::protobuf::ArenaOptions arena_options;
+    arena_options.initial_block = arena_block.data();
+    arena_options.initial_block_size = arena_block.size();
+    arena_options.max_block_size = ARENA_MAX_BLOCK_SIZE;
+    google::protobuf::Arena arena(arena_options);
+
+    // Receive buffer reused across requests; inline request bodies are
+    // handed to the handler as slices of it
+    std::vector<uint8_t> receive_buffer;
+
     // Process client requests
     while (m_running && client_info.keep_connection) {
 
-        auto request_opt = receive_request(client_info);
-        if (!request_opt.has_value()) {
+        auto *request =
+            google::protobuf::Arena::CreateMessage<fenris::Request>(&arena);
+        if (!receive_request_header(client_info, *request, receive_buffer)) {
             m_logger->error("failed to receive request from client: {}",
                             client_info.client_id);
             break;
         }
 
-        auto response =
-            m_client_handler->handle_request(request_opt.value(), client_info);
+        auto *response =
+            google::protobuf::Arena::CreateMessage<fenris::Response>(&arena);
+        m_client_handler->handle_request_into(*request, client_info, *response);
         m_logger->debug("handling request from client {}",
                         client_info.client_id);
 
-        if (!send_response(client_info, response)) {
+        // Drop whatever part of the body the handler did not consume, before
+        // answering, so the stream is positioned at the next request
+        if (!finish_request_payload(client_info)) {
+            break;
+        }
+
+        bool sent = send_response(client_info, *response);
+        if (sent && client_info.response_payload) {
+            sent = send_payload(client_info, *client_info.response_payload);
+        }
+        client_info.response_payload.reset();
+        arena.Reset();
+        if (!sent) {
             m_logger->error("failed to send response to client: {}",
                             client_info.client_id);
             break;
@@ -355,6 +436,28 @@ void ConnectionManager::handle_client(uint32_t client_socket,
     remove_client(client_id);
 }
 
+bool ConnectionManager::finish_request_payload(ClientInfo &client_info)
+{
+    auto payload = std::move(client_info.request_payload);
+    if (!payload) {
+        return true;
+    }
+
+    PayloadResult result =
+        payload->consumed() ? payload->result() : payload->discard();
+    if (result != PayloadResult::SUCCESS &&
+        result != PayloadResult::SINK_ERROR) {
+        // The rest of the payload is still on the wire; the connection
+        // cannot be resynchronized
+        m_logger->error("failed to consume request payload from client {}: {}",
+                        client_info.client_id,
+                        payload_result_to_string(result));
+        return false;
+    }
+
+    return true;
+}
+
 uint32_t ConnectionManager::generate_client_id()
 {
     return m_next_client_id++;
@@ -370,8 +473,26 @@ bool ConnectionManager::send_response(const ClientInfo &client_info,
                                       const fenris::Response &response)
 {
     m_logger->debug("sending response to client {}", client_info.client_id);
-    // Serialize the response
-    std::vector<uint8_t> serialized_response = serialize_response(response);
+    // Dictionary-compress small payloads before serializing
+    auto compressed_response =
+        compress_response(response,
+                          m_compression_dictionary,
+                          compress::DICTIONARY_PAYLOAD_LIMIT);
+    const fenris::Response &wire_response =
+        compressed_response.has_value() ? *compressed_response : response;
+
+    // Serialize straight into the frame, leaving room for the size prefix
+    // and IV in front and the authentication tag behind
+    constexpr size_t headroom = FRAME_HEADER_SIZE + AES_GCM_IV_SIZE;
+    std::vector<uint8_t> frame;
+    if (!serialize_response_into(wire_response,
+                                 frame,
+                                 headroom,
+                                 AES_GCM_TAG_SIZE)) {
+        m_logger->error("failed to serialize response for client {}",
+                        client_info.client_id);
+        return false;
+    }
 
     // Generate random IV
     auto [iv, iv_gen_result] = m_crypto_manager.generate_random_iv();
@@ -380,32 +501,25 @@ bool ConnectionManager::send_response(const ClientInfo &client_info,
                         crypto::encryption_result_to_string(iv_gen_result));
         return false;
     }
-
-    // Encrypt the serialized response using client's key and generated IV
-    auto [encrypted_response, encrypt_result] =
-        m_crypto_manager.encrypt_data(serialized_response,
-                                      client_info.encryption_key,
-                                      iv);
+    std::copy(iv.begin(), iv.end(), frame.begin() + FRAME_HEADER_SIZE);
+
+    // Encrypt the serialized response in place using client's key and IV
+    auto encrypt_result = m_crypto_manager.encrypt_in_place(
+        frame.data() + headroom,
+        frame.size() - headroom - AES_GCM_TAG_SIZE,
+        client_info.encryption_key,
+        frame.data() + FRAME_HEADER_SIZE);
     if (encrypt_result != crypto::EncryptionResult::SUCCESS) {
         m_logger->error("failed to encrypt response: {}",
                         crypto::encryption_result_to_string(encrypt_result));
         return false;
     }
 
-    // Create the final message with IV prefixed to encrypted data
-    std::vector<uint8_t> message_with_iv;
-    message_with_iv.reserve(iv.size() + encrypted_response.size());
-    message_with_iv.insert(message_with_iv.end(), iv.begin(), iv.end());
-    message_with_iv.insert(message_with_iv.end(),
-                           encrypted_response.begin(),
-                           encrypted_response.end());
-
     // Send the IV-prefixed encrypted response
-    NetworkResult send_result = send_prefixed_data(client_info.socket,
-                                                   message_with_iv,
-                                                   m_non_blocking_mode);
+    NetworkResult send_result =
+        send_frame(client_info.socket, frame, m_non_blocking_mode);
     m_logger->debug("sent {} bytes of encrypted response to client {}",
-                    message_with_iv.size(),
+                    frame.size() - FRAME_HEADER_SIZE,
                     client_info.client_id);
     if (send_result != NetworkResult::SUCCESS) {
         m_logger->error("failed to send encrypted response to client {}: {}",
@@ -417,48 +531,102 @@ bool ConnectionManager::send_response(const ClientInfo &client_info,
     return true;
 }
 
-std::optional<fenris::Request>
-ConnectionManager::receive_request(const ClientInfo &client_info)
+bool ConnectionManager::send_payload(const ClientInfo &client_info,
+                                     PayloadSource &payload)
+{
+    m_logger->debug("sending {} byte payload to client {}",
+                    payload.size(),
+                    client_info.client_id);
+    PayloadResult result = common::send_payload(client_info.socket,
+                                                payload,
+                                                m_crypto_manager,
+                                                client_info.encryption_key,
+                                                m_non_blocking_mode);
+    if (result != PayloadResult::SUCCESS) {
+        m_logger->error("failed to send payload to client {}: {}",
+                        client_info.client_id,
+                        payload_result_to_string(result));
+        return false;
+    }
+
+    return true;
+}
+
+bool ConnectionManager::receive_request_header(ClientInfo &client_info,
+                                               fenris::Request &request,
+                                               std::vector<uint8_t> &buffer)
+{
+    client_info.request_payload.reset();
+
+    uint8_t *message = nullptr;
+    size_t message_size = 0;
+    if (!receive_message(client_info, buffer, message, message_size)) {
+        return false;
+    }
+
+    // An unparsable request is handed on as an empty one
+    std::string_view body;
+    if (!deserialize_request_header(message, message_size, request, body)) {
+        m_logger->warn("failed to parse request from client {}",
+                       client_info.client_id);
+    }
+
+    // Leave the body where it is until the handler asks for it
+    if (request.payload_size() > 0) {
+        client_info.request_payload =
+            std::make_shared<StreamedIncomingPayload>(
+                client_info.socket,
+                request.payload_size(),
+                m_crypto_manager,
+                client_info.encryption_key,
+                m_non_blocking_mode);
+    } else if (!body.empty()) {
+        client_info.request_payload =
+            std::make_shared<InlineIncomingPayload>(body);
+    }
+
+    return true;
+}
+
+bool ConnectionManager::receive_message(const ClientInfo &client_info,
+                                        std::vector<uint8_t> &buffer,
+                                        uint8_t *&message,
+                                        size_t &message_size)
 {
     // Receive encrypted data (includes IV + encrypted request)
-    std::vector<uint8_t> encrypted_data;
-    NetworkResult recv_result = receive_prefixed_data(client_info.socket,
-                                                      encrypted_data,
-                                                      m_non_blocking_mode);
+    NetworkResult recv_result =
+        receive_prefixed_data(client_info.socket, buffer, m_non_blocking_mode);
     if (recv_result != NetworkResult::SUCCESS) {
         m_logger->error("failed to receive request from client: {}",
                         client_info.client_id);
-        return std::nullopt;
+        return false;
     }
 
-    if (encrypted_data.size() < AES_GCM_IV_SIZE) {
+    if (buffer.size() < AES_GCM_IV_SIZE) {
         m_logger->error("received data too small to contain IV from client: {}",
                         client_info.client_id);
-        return std::nullopt;
+        return false;
     }
 
-    // Extract IV from the beginning of the message
-    std::vector<uint8_t> iv(encrypted_data.begin(),
-                            encrypted_data.begin() + AES_GCM_IV_SIZE);
-
-    // Extract the encrypted request data (after the IV)
-    std::vector<uint8_t> encrypted_request(encrypted_data.begin() +
-                                               AES_GCM_IV_SIZE,
-                                           encrypted_data.end());
-
-    // Decrypt the request using client's key and extracted IV
-    auto [decrypted_data, decrypt_result] =
-        m_crypto_manager.decrypt_data(encrypted_request,
-                                      client_info.encryption_key,
-                                      iv);
+    // Decrypt the request in place; the IV leads the message and the
+    // plaintext overwrites the ciphertext that follows it
+    uint8_t *encrypted_request = buffer.data() + AES_GCM_IV_SIZE;
+    size_t encrypted_size = buffer.size() - AES_GCM_IV_SIZE;
+    auto decrypt_result =
+        m_crypto_manager.decrypt_in_place(encrypted_request,
+                                          encrypted_size,
+                                          client_info.encryption_key,
+                                          buffer.data());
     if (decrypt_result != crypto::EncryptionResult::SUCCESS) {
         m_logger->error("failed to decrypt request from client {}: {}",
                         client_info.client_id,
                         crypto::encryption_result_to_string(decrypt_result));
-        return std::nullopt;
+        return false;
     }
 
-    return deserialize_request(decrypted_data);
+    message = encrypted_request;
+    message_size = encrypted_size - AES_GCM_TAG_SIZE;
+    return true;
 }
 
 } // namespace server
@@ -0,0 +1,137 @@
+#include "server/descriptor_cache.hpp"
+#include "common/page_cache.hpp"
+
+#include <fcntl.h>
+#include <unistd.h>
+
+namespace fenris {
+namespace server {
+
+Descriptor::Descriptor(int fd) : m_fd(fd)
+{
+}
+
+Descriptor::~Descriptor()
+{
+    close(m_fd);
+}
+
+int Descriptor::get() const
+{
+    return m_fd;
+}
+
+DescriptorCache::DescriptorCache(size_t capacity) : m_capacity(capacity)
+{
+}
+
+std::shared_ptr<const Descriptor>
+DescriptorCache::directory(const std::shared_ptr<Node> &node,
+                           const std::string &path)
+{
+    uint64_t generation;
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        if (auto descriptor = lookup(node.get())) {
+            return descriptor;
+        }
+        generation = m_generation;
+    }
+
+    // Opened outside the lock; a concurrent miss on the same node just
+    // loses the race in insert
+    int fd = open(path.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0) {
+        return nullptr;
+    }
+    return insert(node, fd, generation);
+}
+
+std::shared_ptr<const Descriptor>
+DescriptorCache::file(const std::shared_ptr<Node> &node,
+                      int dirfd,
+                      const std::string &name)
+{
+    uint64_t generation;
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        if (auto descriptor = lookup(node.get())) {
+            return descriptor;
+        }
+        generation = m_generation;
+    }
+
+    int fd = openat(dirfd, name.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return nullptr;
+    }
+    // A small file read once is likely to be read again while it is cached
+    common::prefetch_hot_file(fd);
+    return insert(node, fd, generation);
+}
+
+void DescriptorCache::invalidate(const std::shared_ptr<Node> &node)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_generation++;
+    auto it = m_entries.find(node.get());
+    if (it != m_entries.end()) {
+        m_lru_list.erase(it->second.position);
+        m_entries.erase(it);
+    }
+}
+
+void DescriptorCache::clear()
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_generation++;
+    m_entries.clear();
+    m_lru_list.clear();
+}
+
+size_t DescriptorCache::size() const
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_entries.size();
+}
+
+std::shared_ptr<const Descriptor> DescriptorCache::lookup(const Node *node)
+{
+    auto it = m_entries.find(node);
+    if (it == m_entries.end()) {
+        return nullptr;
+    }
+    m_lru_list.splice(m_lru_list.begin(), m_lru_list, it->second.position);
+    return it->second.descriptor;
+}
+
+std::shared_ptr<const Descriptor>
+DescriptorCache::insert(const std::shared_ptr<Node> &node,
+                        int fd,
+                        uint64_t generation)
+{
+    auto descriptor = std::make_shared<const Descriptor>(fd);
+
+    std::lock_guard<std::mutex> lock(m_mutex);
+    if (auto cached = lookup(node.get())) {
+        return cached;
+    }
+    if (generation != m_generation || m_capacity == 0) {
+        // The file may have been replaced since it was opened; serve this
+        // request from the descriptor but do not keep it
+        return descriptor;
+    }
+
+    if (m_entries.size() >= m_capacity) {
+        // Holders of the evicted descriptor keep it open until they finish
+        m_entries.erase(m_lru_list.back());
+        m_lru_list.pop_back();
+    }
+    m_lru_list.push_front(node.get());
+    m_entries.emplace(node.get(),
+                      Entry{node, descriptor, m_lru_list.begin()});
+    return descriptor;
+}
+
+} // namespace server
+} // namespace fenris
@@ -0,0 +1,30 @@
+#include "server/io_priority.hpp"
+
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+namespace fenris {
+namespace server {
+
+namespace {
+
+// From linux/ioprio.h, which older kernel headers do not ship
+constexpr int IOPRIO_WHO_PROCESS = 1;
+constexpr int IOPRIO_CLASS_IDLE = 3;
+constexpr int IOPRIO_CLASS_SHIFT = 13;
+
+} // namespace
+
+void lower_thread_priority()
+{
+    pid_t tid = static_cast<pid_t>(syscall(SYS_gettid));
+    setpriority(PRIO_PROCESS, tid, 19);
+    syscall(SYS_ioprio_set,
+            IOPRIO_WHO_PROCESS,
+            tid,
+            IOPRIO_CLASS_IDLE << IOPRIO_CLASS_SHIFT);
+}
+
+} // namespace server
+} // namespace fenris
@@ -1,9 +1,18 @@
+#include "common/append_coalescer.hpp"
+#include "common/checksum.hpp"
+#include "common/chunk_store.hpp"
+#include "common/durability.hpp"
 #include "common/logging.hpp"
+#include "common/pack_store.hpp"
+#include "common/page_cache.hpp"
+#include "server/pack_compactor.hpp"
 #include "server/request_manager.hpp"
+#include "server/scrubber.hpp"
 #include "server/server.hpp"
 #include <argparse/argparse.hpp>
 #include <atomic>
 #include <csignal>
+#include <filesystem>
 #include <iostream>
 #include <stdexcept>
 
@@ -37,6 +46,66 @@ void setup_argument_parser(argparse::ArgumentParser &program)
         .help("Enable logging to file")
         .default_value(false)
         .implicit_value(true);
+
+    program.add_argument("--durability")
+        .help("When writes reach stable storage: none, fsync (every write) or "
+              "group (concurrent writes flushed together)")
+        .default_value(std::string("none"));
+
+    program.add_argument("--group-commit-window")
+        .help("Microseconds a group commit waits for more writers")
+        .default_value(std::string("2000"));
+
+    program.add_argument("--append-buffer")
+        .help("Bytes of concurrent appends to one file written with one "
+              "writev (0 writes every append on its own)")
+        .default_value(
+            std::to_string(fenris::common::DEFAULT_APPEND_BUFFER_SIZE));
+
+    program.add_argument("--append-delay")
+        .help("Microseconds appends queued behind a write of the same file "
+              "wait for more before they are written")
+        .default_value(
+            std::to_string(fenris::common::DEFAULT_APPEND_DELAY.count()));
+
+    program.add_argument("--dedup")
+        .help("Store uploaded files as content-defined chunks, keeping each "
+              "unique chunk once")
+        .default_value(false)
+        .implicit_value(true);
+
+    program.add_argument("--pack")
+        .help("Store small uploaded files in append-only pack files instead "
+              "of a block each")
+        .default_value(false)
+        .implicit_value(true);
+
+    program.add_argument("--bulk-io")
+        .help("How transfers of at least --bulk-size bytes use the page "
+              "cache: cached, drop (dropped once streamed) or direct "
+              "(O_DIRECT reads)")
+        .default_value(std::string("drop"));
+
+    program.add_argument("--bulk-size")
+        .help("Bytes from which a read or write is a bulk transfer")
+        .default_value(
+            std::to_string(fenris::common::DEFAULT_BULK_TRANSFER_SIZE));
+
+    program.add_argument("--cache-stats-interval")
+        .help("Seconds between two logs of the page cache counters (0 "
+              "disables them)")
+        .default_value(std::string("300"));
+
+    program.add_argument("--scrub-interval")
+        .help("Seconds between two background checks of every stored file "
+              "against its checksums (0 disables them)")
+        .default_value(std::to_string(
+            fenris::server::DEFAULT_SCRUB_INTERVAL.count()));
+
+    program.add_argument("--no-compression-dictionary")
+        .help("Do not train a dictionary for compressing small payloads")
+        .default_value(false)
+        .implicit_value(true);
 }
 
 /**
@@ -70,9 +139,33 @@ create_server(const argparse::ArgumentParser &program)
         std::make_unique<fenris::server::ClientHandler>(logger_name);
     server->set_client_handler(std::move(file_handler));
 
+    if (!program.get<bool>("--no-compression-dictionary")) {
+        server->train_compression_dictionary(
+            fenris::server::DEFAULT_SERVER_DIR);
+    }
+
     return server;
 }
 
+/**
+ * Log the page cache counters of the file operations
+ */
+void log_page_cache_stats(const fenris::common::Logger &logger)
+{
+    auto stats = fenris::common::get_page_cache_stats();
+    logger->info("Page cache: {:.1f}% hit rate over {} reads ({} bytes), "
+                 "{} bulk reads ({} direct), {} bulk writes, {} bytes "
+                 "dropped, {} hot files prefetched",
+                 100.0 * stats.hit_rate(),
+                 stats.reads,
+                 stats.read_bytes,
+                 stats.bulk_reads,
+                 stats.direct_reads,
+                 stats.bulk_writes,
+                 stats.dropped_bytes,
+                 stats.prefetches);
+}
+
 int main(int argc, char *argv[])
 {
     argparse::ArgumentParser program("fenris_server");
@@ -91,6 +184,157 @@ int main(int argc, char *argv[])
     logger->info("Starting Fenris server with logging level: {}",
                  program.get("--log-level"));
 
+    auto durability = fenris::common::durability_mode_from_string(
+        program.get("--durability"));
+    if (!durability) {
+        std::cerr << "Unknown durability mode: " << program.get("--durability")
+                  << std::endl;
+        return 1;
+    }
+    try {
+        std::chrono::microseconds window(
+            std::stoul(program.get("--group-commit-window")));
+        fenris::common::set_durability_mode(*durability, window);
+    } catch (const std::exception &) {
+        std::cerr << "Invalid group commit window: "
+                  << program.get("--group-commit-window") << std::endl;
+        return 1;
+    }
+    logger->info("Durability mode: {}",
+                 fenris::common::durability_mode_to_string(*durability));
+
+    try {
+        fenris::common::set_append_coalescing(
+            std::stoul(program.get("--append-buffer")),
+            std::chrono::microseconds(
+                std::stoul(program.get("--append-delay"))));
+    } catch (const std::exception &) {
+        std::cerr << "Invalid append buffer size or delay" << std::endl;
+        return 1;
+    }
+    logger->info("Append coalescing: {} bytes, {}us",
+                 program.get("--append-buffer"),
+                 program.get("--append-delay"));
+
+    auto bulk_io = fenris::common::bulk_io_policy_from_string(
+        program.get("--bulk-io"));
+    if (!bulk_io) {
+        std::cerr << "Unknown bulk I/O policy: " << program.get("--bulk-io")
+                  << std::endl;
+        return 1;
+    }
+    std::chrono::seconds cache_stats_interval;
+    try {
+        fenris::common::set_page_cache_policy(
+            *bulk_io,
+            std::stoull(program.get("--bulk-size")));
+        cache_stats_interval = std::chrono::seconds(
+            std::stoul(program.get("--cache-stats-interval")));
+    } catch (const std::exception &) {
+        std::cerr << "Invalid bulk size or cache stats interval" << std::endl;
+        return 1;
+    }
+    logger->info("Bulk I/O: {} from {} bytes",
+                 fenris::common::bulk_io_policy_to_string(*bulk_io),
+                 program.get("--bulk-size"));
+
+    // Files deduplicated earlier stay readable with deduplication off, so
+    // the chunk store is opened whenever it exists
+    bool dedup = program.get<bool>("--dedup");
+    std::error_code ec;
+    if (dedup ||
+        std::filesystem::exists(fenris::server::DEFAULT_CHUNK_STORE_DIR, ec)) {
+        auto store = std::make_shared<fenris::common::ChunkStore>(
+            fenris::server::DEFAULT_CHUNK_STORE_DIR);
+        if (store->initialize() !=
+            fenris::common::FileOperationResult::SUCCESS) {
+            std::cerr << "Could not create chunk store in "
+                      << fenris::server::DEFAULT_CHUNK_STORE_DIR << std::endl;
+            return 1;
+        }
+
+        // No upload can be in flight before the server starts, so nothing
+        // needs the grace period
+        auto [stats, result] =
+            store->collect_garbage(fenris::server::DEFAULT_SERVER_DIR,
+                                   std::chrono::seconds(0));
+        if (result == fenris::common::FileOperationResult::SUCCESS) {
+            logger->info("Chunk store: removed {} manifests and {} chunks "
+                         "({} bytes)",
+                         stats.manifests_removed,
+                         stats.chunks_removed,
+                         stats.bytes_freed);
+        } else {
+            logger->warn("Chunk store collection skipped: {}",
+                         fenris::common::file_operation_result_to_string(
+                             result));
+        }
+        fenris::common::set_chunk_store(store, dedup);
+    }
+    logger->info("Deduplication: {}", dedup ? "on" : "off");
+
+    // Likewise, packed files stay readable with packing off
+    bool pack = program.get<bool>("--pack");
+    std::unique_ptr<fenris::server::PackCompactor> compactor;
+    if (pack ||
+        std::filesystem::exists(fenris::server::DEFAULT_PACK_STORE_DIR, ec)) {
+        auto store = std::make_shared<fenris::common::PackStore>(
+            fenris::server::DEFAULT_PACK_STORE_DIR);
+        if (store->initialize() !=
+            fenris::common::FileOperationResult::SUCCESS) {
+            std::cerr << "Could not create pack store in "
+                      << fenris::server::DEFAULT_PACK_STORE_DIR << std::endl;
+            return 1;
+        }
+
+        auto [stats, result] =
+            store->compact(fenris::server::DEFAULT_SERVER_DIR,
+                           fenris::common::DEFAULT_COMPACTION_RATIO,
+                           std::chrono::seconds(0));
+        if (result == fenris::common::FileOperationResult::SUCCESS) {
+            logger->info("Pack store: moved {} files, removed {} packs "
+                         "({} bytes)",
+                         stats.files_moved,
+                         stats.packs_removed,
+                         stats.bytes_freed);
+        } else {
+            logger->warn("Pack store compaction skipped: {}",
+                         fenris::common::file_operation_result_to_string(
+                             result));
+        }
+        fenris::common::set_pack_store(store, pack);
+
+        compactor = std::make_unique<fenris::server::PackCompactor>(
+            store,
+            fenris::server::DEFAULT_SERVER_DIR,
+            fenris::server::DEFAULT_PACK_COMPACTION_INTERVAL,
+            "fenris_server");
+        compactor->start();
+    }
+    logger->info("Packing: {}", pack ? "on" : "off");
+
+    std::unique_ptr<fenris::server::Scrubber> scrubber;
+    try {
+        std::chrono::seconds interval(
+            std::stoul(program.get("--scrub-interval")));
+        if (interval.count() > 0) {
+            scrubber = std::make_unique<fenris::server::Scrubber>(
+                fenris::server::DEFAULT_SERVER_DIR,
+                interval,
+                fenris::server::DEFAULT_SEAL_GRACE_PERIOD,
+                "fenris_server");
+            scrubber->start();
+        }
+    } catch (const std::exception &) {
+        std::cerr << "Invalid scrub interval: "
+                  << program.get("--scrub-interval") << std::endl;
+        return 1;
+    }
+    logger->info("Checksums: CRC32C ({}), scrub {}",
+                 fenris::common::crc32c_hardware() ? "hardware" : "software",
+                 scrubber ? "every " + program.get("--scrub-interval") + "s"
+                          : std::string("off"));
+
     // Flag to track running state
     static std::atomic<bool> running{true};
 
@@ -115,13 +359,30 @@ int main(int argc, char *argv[])
         logger->info("Press Ctrl+C to stop the server");
 
         // Keep the main thread alive until interrupted
+        auto last_stats = std::chrono::steady_clock::now();
         while (running) {
             std::this_thread::sleep_for(std::chrono::seconds(1));
+            auto now = std::chrono::steady_clock::now();
+            if (cache_stats_interval.count() > 0 &&
+                now - last_stats >= cache_stats_interval) {
+                log_page_cache_stats(logger);
+                last_stats = now;
+            }
         }
 
         // Graceful shutdown
         logger->info("Stopping server...");
         server->stop();
+        if (compactor) {
+            compactor->stop();
+        }
+        if (scrubber) {
+            scrubber->stop();
+        }
+        if (!fenris::common::flush_appends()) {
+            logger->error("Failed to write pending appends");
+        }
+        log_page_cache_stats(logger);
         logger->info("Server stopped successfully");
 
     } catch (const std::exception &e) {
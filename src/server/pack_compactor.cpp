@@ -0,0 +1,80 @@
+#include "server/pack_compactor.hpp"
+
+#include <utility>
+
+namespace fenris {
+namespace server {
+
+using namespace common;
+
+PackCompactor::PackCompactor(std::shared_ptr<PackStore> store,
+                             std::string namespace_root,
+                             std::chrono::seconds interval,
+                             const std::string &logger_name)
+    : m_store(std::move(store)), m_namespace_root(std::move(namespace_root)),
+      m_interval(interval), m_logger(get_logger(logger_name))
+{
+}
+
+PackCompactor::~PackCompactor()
+{
+    stop();
+}
+
+void PackCompactor::start()
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    if (m_thread.joinable() || m_stopping) {
+        return;
+    }
+    m_thread = std::thread(&PackCompactor::worker, this);
+}
+
+void PackCompactor::stop()
+{
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_stopping = true;
+    }
+    m_condition.notify_all();
+
+    if (m_thread.joinable()) {
+        m_thread.join();
+    }
+}
+
+uint64_t PackCompactor::passes() const
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_passes;
+}
+
+void PackCompactor::worker()
+{
+    std::unique_lock<std::mutex> lock(m_mutex);
+    while (true) {
+        m_condition.wait_for(lock, m_interval, [this]() { return m_stopping; });
+        if (m_stopping) {
+            return;
+        }
+        lock.unlock();
+
+        auto [stats, result] = m_store->compact(m_namespace_root);
+        if (result != FileOperationResult::SUCCESS) {
+            m_logger->warn("pack compaction failed: {}",
+                           file_operation_result_to_string(result));
+        } else if (stats.files_moved > 0 || stats.packs_removed > 0) {
+            m_logger->info("pack compaction moved {} files, removed {} packs "
+                           "({} bytes)",
+                           stats.files_moved,
+                           stats.packs_removed,
+                           stats.bytes_freed);
+        }
+
+        lock.lock();
+        m_passes++;
+    }
+}
+
+} // namespace server
+} // namespace fenris
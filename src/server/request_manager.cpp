@@ -1,8 +1,101 @@
 #include "server/request_manager.hpp"
+#include "common/checksum.hpp"
+#include "common/chunk_store.hpp"
+#include "common/delta.hpp"
+#include "common/page_cache.hpp"
+#include "common/payload.hpp"
+#include "common/tree_archive.hpp"
+#include <algorithm>
+#include <cstdint>
+#include <filesystem>
+#include <memory>
+#include <optional>
+#include <sstream>
+#include <sys/stat.h>
 #include <utility>
+#include <vector>
 namespace fenris {
 namespace server {
 
+namespace {
+
+// A listing cursor is the directory offset of the next entry, as 8 bytes
+std::string encode_list_cursor(uint64_t offset)
+{
+    std::string cursor(sizeof(offset), '\0');
+    for (size_t i = 0; i < sizeof(offset); i++) {
+        cursor[i] = static_cast<char>(offset >> (8 * i));
+    }
+    return cursor;
+}
+
+bool decode_list_cursor(const std::string &cursor, uint64_t &offset)
+{
+    offset = 0;
+    if (cursor.empty()) {
+        return true;
+    }
+    if (cursor.size() != sizeof(offset)) {
+        return false;
+    }
+    for (size_t i = 0; i < sizeof(offset); i++) {
+        offset |= static_cast<uint64_t>(static_cast<uint8_t>(cursor[i]))
+                  << (8 * i);
+    }
+    return true;
+}
+
+// Send body inline, or as a payload once it is large enough to be streamed
+void set_response_body(fenris::Response &response,
+                       ClientInfo &client_info,
+                       std::string body)
+{
+    if (body.size() < common::PAYLOAD_THRESHOLD) {
+        response.set_data(std::move(body));
+        return;
+    }
+
+    auto owned = std::make_shared<std::string>(std::move(body));
+    response.set_payload_size(owned->size());
+    client_info.response_payload = std::shared_ptr<common::PayloadSource>(
+        new common::BufferPayloadSource(owned->data(), owned->size()),
+        [owned](common::PayloadSource *source) { delete source; });
+}
+
+// Resolve a tree path such as "/a/b" against the client's directory
+// lexically, without walking the tree; ".." never climbs above the root
+std::string resolve_tree_path(const std::string &current_directory,
+                              const std::string &path)
+{
+    std::string full = (!path.empty() && path[0] == '/')
+                           ? path
+                           : current_directory + "/" + path;
+
+    std::vector<std::string> parts;
+    std::istringstream stream(full);
+    std::string segment;
+    while (std::getline(stream, segment, '/')) {
+        if (segment.empty() || segment == ".") {
+            continue;
+        }
+        if (segment == "..") {
+            if (!parts.empty()) {
+                parts.pop_back();
+            }
+            continue;
+        }
+        parts.push_back(segment);
+    }
+
+    std::string resolved;
+    for (const auto &part : parts) {
+        resolved += "/" + part;
+    }
+    return resolved.empty() ? "/" : resolved;
+}
+
+} // namespace
+
 bool ClientHandler::step_directory_with_mutex(
     std::string &current_directory,
     const std::string &new_directory,
@@ -22,7 +115,7 @@ bool ClientHandler::step_directory_with_mutex(
                 current_directory = current_directory.substr(0, pos);
                 depth--;
             }
-            current_node->access_count--;
+            current_node->release();
             current_node = current_node->parent.lock();
             m_logger->debug("Moved up one directory to '{}'",
                             current_directory);
@@ -99,16 +192,24 @@ void ClientHandler::destroy_node(std::string &current_directory,
 {
     m_logger->debug("Destroying node at '{}'", current_directory);
     traverse_back(current_directory, depth, current_node);
-    current_node->access_count--;
+    current_node->release();
     m_logger->debug("Node destroyed, access_count decreased");
 }
 
 fenris::Response ClientHandler::handle_request(const fenris::Request &request,
                                                ClientInfo &client_info)
+{
+    fenris::Response response;
+    handle_request_into(request, client_info, response);
+    return response;
+}
+
+void ClientHandler::handle_request_into(const fenris::Request &request,
+                                        ClientInfo &client_info,
+                                        fenris::Response &response)
 {
     m_logger->debug("Handling request of type: {}",
                     static_cast<int>(request.command()));
-    fenris::Response response;
     response.set_type(fenris::ResponseType::ERROR);
     response.set_success(false);
 
@@ -118,7 +219,7 @@ fenris::Response ClientHandler::handle_request(const fenris::Request &request,
         response.set_type(fenris::ResponseType::PONG);
         response.set_success(true);
         response.set_data("PONG");
-        return response;
+        return;
     }
 
     case fenris::RequestType::TERMINATE: {
@@ -132,7 +233,7 @@ fenris::Response ClientHandler::handle_request(const fenris::Request &request,
                       client_info.current_node);
 
         client_info.keep_connection = false;
-        return response;
+        return;
     }
     default:
         break;
@@ -176,7 +277,7 @@ fenris::Response ClientHandler::handle_request(const fenris::Request &request,
         if (client_info.current_node == nullptr) {
             destroy_node(new_directory, new_depth, new_node);
         }
-        return response;
+        return;
     }
 
     std::string _file = request.filename().substr(ind);
@@ -207,7 +308,11 @@ fenris::Response ClientHandler::handle_request(const fenris::Request &request,
         m_logger->debug("Processing CREATE_FILE request for '{}'", filename);
         std::lock_guard<std::mutex> lock(new_node->node_mutex);
 
-        auto result = common::create_file(absolute_filepath);
+        // Only the new name is resolved, relative to the open directory
+        auto directory = directory_descriptor(new_node, new_directory);
+        auto result = directory
+                          ? common::create_file_at(directory->get(), _file)
+                          : common::create_file(absolute_filepath);
 
         if (result == common::FileOperationResult::SUCCESS) {
             m_logger->debug("File created successfully");
@@ -246,23 +351,96 @@ fenris::Response ClientHandler::handle_request(const fenris::Request &request,
             m_logger->debug("Incremented access count for file");
         }
 
-        auto [content, result] = common::read_file(absolute_filepath);
+        // A mapping is always read through the page cache, so bulk files
+        // are streamed with pread when they are to bypass it. Deduplicated
+        // files are streamed from their chunks, since mapping one would
+        // assemble a copy of it first
+        bool streamed = false;
+        if (!request.has_offset() &&
+            common::get_bulk_io_policy() == common::BulkIoPolicy::DIRECT) {
+            struct stat st;
+            streamed = stat(absolute_filepath.c_str(), &st) == 0 &&
+                       common::is_bulk_transfer(
+                           static_cast<uint64_t>(st.st_size));
+        }
+        if (!request.has_offset() && !streamed) {
+            streamed = common::is_deduplicated_file(absolute_filepath);
+        }
 
-        {
-            std::lock_guard<std::mutex> lock((it)->node_mutex);
-            (it)->access_count--;
-            m_logger->debug("Decremented access count for file");
+        common::FileOperationResult result;
+        std::unique_ptr<common::PayloadSource> payload;
+        if (!request.has_offset() && !streamed) {
+            // Hot files are read through a descriptor kept open
+            auto file = file_descriptor(new_node, new_directory, it, _file);
+            auto [mapping, map_result] =
+                file ? common::map_file(file->get())
+                     : common::map_file(absolute_filepath);
+            result = map_result;
+            if (result == common::FileOperationResult::SUCCESS &&
+                mapping->size() < common::PAYLOAD_THRESHOLD) {
+                // Small files go inline, where they can still be compressed
+                response.set_data(mapping->data(), mapping->size());
+            } else if (result == common::FileOperationResult::SUCCESS) {
+                payload = std::make_unique<common::MappedPayloadSource>(
+                    std::move(mapping));
+            }
+        } else {
+            // Ranged reads use pread so the rest of the file is never
+            // touched; streamed reads are whole-file reads from offset 0
+            uint64_t length =
+                request.length() != 0 ? request.length() : UINT64_MAX;
+            m_logger->debug("Reading up to {} bytes at offset {}",
+                            length,
+                            request.offset());
+            auto file = file_descriptor(new_node, new_directory, it, _file);
+            if (length < common::PAYLOAD_THRESHOLD) {
+                auto [data, range_result] =
+                    file ? common::read_file_range(file->get(),
+                                                   request.offset(),
+                                                   length)
+                         : common::read_file_range(absolute_filepath,
+                                                   request.offset(),
+                                                   length);
+                result = range_result;
+                response.set_data(std::move(data));
+            } else {
+                auto [source, open_result] =
+                    file ? common::open_file_payload(file->get(),
+                                                     request.offset(),
+                                                     length)
+                         : common::open_file_payload(absolute_filepath,
+                                                     request.offset(),
+                                                     length);
+                result = open_result;
+                payload = std::move(source);
+            }
         }
 
-        if (result == common::FileOperationResult::SUCCESS) {
+        // The mapping or descriptor keeps the contents readable even if the
+        // file is rewritten or deleted meanwhile, so the file is not held in
+        // use while a payload is sent
+        (it)->release();
+        m_logger->debug("Decremented access count for file");
+
+        if (payload) {
+            m_logger->debug("Sending file as {} byte payload",
+                            payload->size());
+            response.set_payload_size(payload->size());
+            client_info.response_payload = std::move(payload);
+        } else if (result == common::FileOperationResult::SUCCESS) {
             m_logger->debug("File read successfully, content size: {}",
-                            content.size());
+                            response.data().size());
+        }
+
+        if (result == common::FileOperationResult::SUCCESS) {
             response.set_type(fenris::ResponseType::FILE_CONTENT);
             response.set_success(true);
-            response.set_data(content.data(), content.size());
         } else if (result == common::FileOperationResult::FILE_NOT_FOUND) {
             m_logger->error("File not found: '{}'", filename);
             response.set_error_message("File not found");
+        } else if (result == common::FileOperationResult::DATA_CORRUPTED) {
+            m_logger->error("Checksum mismatch reading '{}'", filename);
+            response.set_error_message("File is corrupted");
         } else {
             m_logger->error("Failed to read file: '{}'", filename);
             response.set_error_message("Failed to read file");
@@ -301,31 +479,696 @@ fenris::Response ClientHandler::handle_request(const fenris::Request &request,
             }
         }
 
+        // Wait for readers to finish, without holding the lock meanwhile
+        auto lock = (it)->lock_unused();
+
+        common::FileOperationResult result;
+        std::optional<uint64_t> offset;
+        if (request.has_offset()) {
+            // Ranged writes overwrite in place instead of truncating
+            offset = request.offset();
+        }
+        if (client_info.request_payload) {
+            // Stream the body from the connection straight into the file
+            result = common::write_file_from_payload(
+                absolute_filepath,
+                *client_info.request_payload,
+                offset,
+                request.expected_size());
+        } else if (offset) {
+            result = common::write_file_range(absolute_filepath,
+                                              *offset,
+                                              request.data());
+        } else {
+            result = common::write_file(absolute_filepath, request.data());
+        }
+        // Whole-file writes put a new file in place of the cached one
+        m_descriptors.invalidate(it);
+        if (result == common::FileOperationResult::SUCCESS) {
+            m_logger->debug("File written successfully");
+            response.set_type(fenris::ResponseType::SUCCESS);
+            response.set_success(true);
+            response.set_data("The file has been written successfully");
+
+        } else if (result == common::FileOperationResult::PERMISSION_DENIED) {
+            m_logger->error("Permission denied to write to the file: '{}'",
+                            filename);
+            response.set_error_message(
+                "Permission denied to write to the file");
+        } else {
+            m_logger->error("Failed to write file: '{}'", filename);
+            response.set_error_message("Failed to write file");
+        }
+        break;
+    }
+    case fenris::RequestType::APPEND_FILE: {
+        m_logger->debug("Processing APPEND_FILE request for '{}'", filename);
+        auto it = FST.find_file(new_node, _file);
+
+        if (it == nullptr) {
+            m_logger->error("File not found: '{}'", filename);
+            response.set_error_message("File not found");
+            break;
+        }
+
+        // Appends only extend the file, so readers streaming the current
+        // contents do not have to finish first
         std::lock_guard<std::mutex> lock((it)->node_mutex);
-        while ((it)->access_count > 0) {
-            // Wait for access count to be zero
+
+        common::FileOperationResult result;
+        if (client_info.request_payload) {
+            result = common::append_file_from_payload(
+                absolute_filepath,
+                *client_info.request_payload);
+        } else {
+            result = common::append_file(absolute_filepath, request.data());
+        }
+        // Appending to a deduplicated file rewrites it as a new plain file
+        m_descriptors.invalidate(it);
+        if (result == common::FileOperationResult::SUCCESS) {
+            m_logger->debug("Data appended successfully");
+            response.set_type(fenris::ResponseType::SUCCESS);
+            response.set_success(true);
+            response.set_data("The data has been appended successfully");
+        } else if (result == common::FileOperationResult::FILE_NOT_FOUND) {
+            m_logger->error("File not found: '{}'", filename);
+            response.set_error_message("File not found");
+        } else if (result == common::FileOperationResult::PERMISSION_DENIED) {
+            m_logger->error("Permission denied to append to the file: '{}'",
+                            filename);
+            response.set_error_message(
+                "Permission denied to append to the file");
+        } else {
+            m_logger->error("Failed to append to file: '{}'", filename);
+            response.set_error_message("Failed to append to file");
+        }
+        break;
+    }
+    case fenris::RequestType::GET_SIGNATURE: {
+        m_logger->debug("Processing GET_SIGNATURE request for '{}'",
+                        filename);
+        auto it = FST.find_file(new_node, _file);
+
+        if (it == nullptr) {
+            m_logger->error("File not found: '{}'", filename);
+            response.set_error_message("File not found");
+            break;
         }
 
+        {
+            std::lock_guard<std::mutex> lock((it)->node_mutex);
+            (it)->access_count++;
+            m_logger->debug("Incremented access count for file signature");
+        }
+
+        auto [signature, result] =
+            common::compute_file_signature(absolute_filepath);
+
+        (it)->release();
+        m_logger->debug("Decremented access count for file signature");
+
+        if (result != common::FileOperationResult::SUCCESS) {
+            m_logger->error("Failed to compute signature: '{}'", filename);
+            response.set_error_message("Failed to compute signature");
+            break;
+        }
+
+        m_logger->debug("Computed signature of {} blocks of {} bytes",
+                        signature.weak_sums_size(),
+                        signature.block_size());
+        // Signatures of large files are streamed like file contents
+        std::string encoded;
+        signature.SerializeToString(&encoded);
+        set_response_body(response, client_info, std::move(encoded));
+        response.set_type(fenris::ResponseType::FILE_SIGNATURE);
+        response.set_success(true);
+        break;
+    }
+    case fenris::RequestType::PATCH_FILE: {
+        m_logger->debug("Processing PATCH_FILE request for '{}'", filename);
+        auto it = FST.find_file(new_node, _file);
+
+        if (it == nullptr) {
+            m_logger->error("File not found: '{}'", filename);
+            response.set_error_message("File not found");
+            break;
+        }
+        if (!client_info.request_payload) {
+            m_logger->error("Missing delta for '{}'", filename);
+            response.set_error_message("Missing delta");
+            break;
+        }
+
+        // Wait for readers to finish, without holding the lock meanwhile
+        auto lock = (it)->lock_unused();
+
+        // The delta is read from the connection as it is applied, so like
+        // streamed writes this stays on the connection thread
         auto result =
-            common::write_file(absolute_filepath,
-                               {request.data().begin(), request.data().end()});
+            common::patch_file_from_payload(absolute_filepath,
+                                            *client_info.request_payload);
+        m_descriptors.invalidate(it);
         if (result == common::FileOperationResult::SUCCESS) {
-            m_logger->debug("File written successfully");
+            m_logger->debug("File patched successfully");
             response.set_type(fenris::ResponseType::SUCCESS);
             response.set_success(true);
-            response.set_data("The file has been written successfully");
+            response.set_data("The file has been patched successfully");
+        } else if (result == common::FileOperationResult::PERMISSION_DENIED) {
+            m_logger->error("Permission denied to write to the file: '{}'",
+                            filename);
+            response.set_error_message(
+                "Permission denied to write to the file");
+        } else {
+            m_logger->error("Failed to patch file: '{}'", filename);
+            response.set_error_message("Failed to patch file");
+        }
+        break;
+    }
+    case fenris::RequestType::HAS_CHUNKS: {
+        m_logger->debug("Processing HAS_CHUNKS request for '{}'", filename);
+        auto store = common::get_chunk_store();
+        if (!store || !common::deduplicating_writes()) {
+            m_logger->error("Deduplication is not enabled");
+            response.set_error_message("Deduplication is not enabled");
+            break;
+        }
+
+        const std::string &hashes = request.manifest().hashes();
+        if (hashes.size() % common::CHUNK_HASH_SIZE != 0) {
+            m_logger->error("Invalid chunk list for '{}'", filename);
+            response.set_error_message("Invalid chunk list");
+            break;
+        }
+
+        // One byte per chunk of the manifest, 1 if it is already stored
+        std::string present;
+        for (size_t offset = 0; offset < hashes.size();
+             offset += common::CHUNK_HASH_SIZE) {
+            std::string hash = hashes.substr(offset, common::CHUNK_HASH_SIZE);
+            present.push_back(store->has_chunk(hash) ? 1 : 0);
+        }
+
+        m_logger->debug("{} of {} chunks already stored",
+                        std::count(present.begin(), present.end(), 1),
+                        present.size());
+        set_response_body(response, client_info, std::move(present));
+        response.set_type(fenris::ResponseType::SUCCESS);
+        response.set_success(true);
+        break;
+    }
+    case fenris::RequestType::PUT_CHUNKS: {
+        m_logger->debug("Processing PUT_CHUNKS request for '{}'", filename);
+        if (!common::get_chunk_store() || !common::deduplicating_writes()) {
+            m_logger->error("Deduplication is not enabled");
+            response.set_error_message("Deduplication is not enabled");
+            break;
+        }
 
+        auto it = FST.find_file(new_node, _file);
+        if (it == nullptr) {
+            std::lock_guard<std::mutex> lock(new_node->node_mutex);
+            auto result = common::create_file(absolute_filepath);
+
+            if (result != common::FileOperationResult::SUCCESS ||
+                !FST.add_node(filename, false)) {
+                m_logger->error("Failed to create file: '{}'", filename);
+                response.set_error_message("Failed to create file");
+                break;
+            }
+            it = FST.find_file(new_node, _file);
+        }
+
+        // Wait for readers to finish, without holding the lock meanwhile
+        auto lock = (it)->lock_unused();
+
+        // Missing chunks are read from the connection as they are stored,
+        // so like streamed writes this stays on the connection thread
+        auto result = common::write_file_from_chunks(
+            absolute_filepath,
+            request.manifest(),
+            client_info.request_payload.get());
+        m_descriptors.invalidate(it);
+        if (result == common::FileOperationResult::SUCCESS) {
+            m_logger->debug("File written from {} chunks",
+                            request.manifest().lengths_size());
+            response.set_type(fenris::ResponseType::SUCCESS);
+            response.set_success(true);
+            response.set_data("The file has been written successfully");
         } else if (result == common::FileOperationResult::PERMISSION_DENIED) {
             m_logger->error("Permission denied to write to the file: '{}'",
                             filename);
             response.set_error_message(
                 "Permission denied to write to the file");
+        } else if (result == common::FileOperationResult::FILE_NOT_FOUND) {
+            m_logger->error("Chunks missing for '{}'", filename);
+            response.set_error_message("Missing chunks");
         } else {
             m_logger->error("Failed to write file: '{}'", filename);
             response.set_error_message("Failed to write file");
         }
         break;
     }
+    case fenris::RequestType::VERIFY_FILE: {
+        m_logger->debug("Processing VERIFY_FILE request for '{}'", filename);
+        auto it = FST.find_file(new_node, _file);
+
+        if (it == nullptr) {
+            m_logger->error("File not found: '{}'", filename);
+            response.set_error_message("File not found");
+            break;
+        }
+
+        {
+            std::lock_guard<std::mutex> lock((it)->node_mutex);
+            (it)->access_count++;
+            m_logger->debug("Incremented access count for file verification");
+        }
+
+        auto file = file_descriptor(new_node, new_directory, it, _file);
+        auto [report, result] = file ? common::verify_file(file->get())
+                                     : common::verify_file(absolute_filepath);
+
+        (it)->release();
+        m_logger->debug("Decremented access count for file verification");
+
+        if (result != common::FileOperationResult::SUCCESS) {
+            m_logger->error("Failed to verify file: '{}'", filename);
+            response.set_error_message("Failed to verify file");
+            break;
+        }
+
+        auto *verification = response.mutable_verification();
+        verification->set_checked(report.checked);
+        verification->set_blocks(report.blocks);
+        for (uint64_t offset : report.corrupted_offsets) {
+            verification->add_corrupted_offsets(offset);
+        }
+        if (!report.corrupted_offsets.empty()) {
+            m_logger->error("{} corrupted blocks in '{}'",
+                            report.corrupted_offsets.size(),
+                            filename);
+            response.set_error_message("File is corrupted");
+        }
+        response.set_type(fenris::ResponseType::FILE_VERIFICATION);
+        response.set_success(report.corrupted_offsets.empty());
+        break;
+    }
+    case fenris::RequestType::COPY_FILE: {
+        m_logger->debug("Processing COPY_FILE request for '{}' to '{}'",
+                        filename,
+                        request.destination());
+        auto it = FST.find_file(new_node, _file);
+
+        if (it == nullptr) {
+            m_logger->error("File not found: '{}'", filename);
+            response.set_error_message("File not found");
+            break;
+        }
+
+        std::string destination =
+            resolve_tree_path(client_info.current_directory,
+                              request.destination());
+        std::string destination_name =
+            destination.substr(destination.find_last_of('/') + 1);
+        auto parent = FST.find_node(
+            destination.substr(0, destination.find_last_of('/')));
+        if (destination == "/" || parent == nullptr ||
+            !parent->is_directory) {
+            m_logger->error("Invalid destination: '{}'", destination);
+            response.set_error_message("Invalid destination");
+            break;
+        }
+        if (FST.find_directory(parent, destination_name) != nullptr) {
+            m_logger->error("Destination is a directory: '{}'", destination);
+            response.set_error_message("Destination is a directory");
+            break;
+        }
+        auto target = FST.find_file(parent, destination_name);
+        if (target == it) {
+            m_logger->error("Cannot copy '{}' onto itself", filename);
+            response.set_error_message("Source and destination are the same");
+            break;
+        }
+
+        {
+            std::lock_guard<std::mutex> lock((it)->node_mutex);
+            (it)->access_count++;
+            m_logger->debug("Incremented access count for copy source");
+        }
+
+        // The data is copied into a hidden staging file without any lock,
+        // so a slow copy holds up nobody
+        auto [staging, result] =
+            common::stage_file_copy(absolute_filepath,
+                                    DEFAULT_SERVER_DIR + destination);
+
+        (it)->release();
+        m_logger->debug("Decremented access count for copy source");
+
+        // Overwriting waits for readers like WRITE_FILE does; most of the
+        // wait happens here, before the destination directory is locked
+        if (result == common::FileOperationResult::SUCCESS &&
+            target != nullptr) {
+            target->wait_unused();
+        }
+
+        if (result == common::FileOperationResult::SUCCESS) {
+            std::lock_guard<std::mutex> parent_lock(parent->node_mutex);
+            // The name may have changed while the copy was staged
+            target = FST.find_file(parent, destination_name);
+            std::unique_lock<std::mutex> target_lock;
+            if (target != nullptr) {
+                target_lock = target->lock_unused();
+            }
+
+            if (FST.find_directory(parent, destination_name) != nullptr) {
+                common::discard_staging_file(staging);
+                result = common::FileOperationResult::INVALID_PATH;
+            } else {
+                result = common::commit_staging_file(
+                    staging, DEFAULT_SERVER_DIR + destination);
+            }
+            if (result == common::FileOperationResult::SUCCESS &&
+                target == nullptr && !FST.add_node(destination, false)) {
+                m_logger->error("FST not synchronized with file system");
+            }
+            if (target != nullptr) {
+                m_descriptors.invalidate(target);
+            }
+        }
+
+        if (result == common::FileOperationResult::SUCCESS) {
+            m_logger->debug("File copied successfully");
+            response.set_type(fenris::ResponseType::SUCCESS);
+            response.set_success(true);
+            response.set_data("The file has been copied successfully");
+        } else if (result == common::FileOperationResult::PERMISSION_DENIED) {
+            m_logger->error("Permission denied to copy the file: '{}'",
+                            filename);
+            response.set_error_message("Permission denied to copy the file");
+        } else {
+            m_logger->error("Failed to copy file: '{}'", filename);
+            response.set_error_message("Failed to copy file");
+        }
+        break;
+    }
+    case fenris::RequestType::COPY_DIR: {
+        m_logger->debug("Processing COPY_DIR request for '{}' to '{}'",
+                        filename,
+                        request.destination());
+        auto it = FST.find_directory(new_node, _file);
+
+        if (it == nullptr) {
+            m_logger->error("Directory does not exist: '{}'", filename);
+            response.set_error_message("Directory does not exist");
+            break;
+        }
+
+        std::string destination =
+            resolve_tree_path(client_info.current_directory,
+                              request.destination());
+        auto parent = FST.find_node(
+            destination.substr(0, destination.find_last_of('/')));
+        if (destination == "/" || parent == nullptr ||
+            !parent->is_directory) {
+            m_logger->error("Invalid destination: '{}'", destination);
+            response.set_error_message("Invalid destination");
+            break;
+        }
+        if (FST.find_node(destination) != nullptr) {
+            m_logger->error("Destination already exists: '{}'", destination);
+            response.set_error_message("Destination already exists");
+            break;
+        }
+        if (destination.rfind(filename + "/", 0) == 0) {
+            m_logger->error("Cannot copy '{}' into itself", filename);
+            response.set_error_message(
+                "Cannot copy a directory into itself");
+            break;
+        }
+
+        // Keeps the source from being deleted while it is copied
+        {
+            std::lock_guard<std::mutex> lock((it)->node_mutex);
+            (it)->access_count++;
+            m_logger->debug("Incremented access count for copy source");
+        }
+
+        // The tree is copied into a hidden staging directory without the
+        // destination's lock; only moving it into place is done under it
+        auto [staging, result] =
+            common::stage_directory_copy(absolute_filepath,
+                                         DEFAULT_SERVER_DIR + destination);
+
+        (it)->release();
+        m_logger->debug("Decremented access count for copy source");
+
+        if (result == common::FileOperationResult::SUCCESS) {
+            std::lock_guard<std::mutex> lock(parent->node_mutex);
+            if (FST.find_node(destination) != nullptr) {
+                common::discard_staging_directory(staging);
+                result = common::FileOperationResult::DIRECTORY_ALREADY_EXISTS;
+            } else {
+                result = common::commit_staging_directory(
+                    staging, DEFAULT_SERVER_DIR + destination);
+                if (result == common::FileOperationResult::SUCCESS) {
+                    add_subtree(destination);
+                }
+            }
+        }
+
+        if (result == common::FileOperationResult::SUCCESS) {
+            m_logger->debug("Directory copied successfully");
+            response.set_type(fenris::ResponseType::SUCCESS);
+            response.set_success(true);
+            response.set_data("The directory has been copied successfully");
+        } else if (result == common::FileOperationResult::PERMISSION_DENIED) {
+            m_logger->error("Permission denied to copy the directory: '{}'",
+                            filename);
+            response.set_error_message(
+                "Permission denied to copy the directory");
+        } else {
+            m_logger->error("Failed to copy directory: '{}'", filename);
+            response.set_error_message("Failed to copy directory");
+        }
+        break;
+    }
+    case fenris::RequestType::GET_TREE: {
+        m_logger->debug("Processing GET_TREE request for '{}'", filename);
+        auto it = FST.find_directory(new_node, _file);
+
+        if (it == nullptr) {
+            m_logger->error("Directory does not exist: '{}'", filename);
+            response.set_error_message("Directory does not exist");
+            break;
+        }
+
+        // Keeps the tree from being deleted while it is listed; files that
+        // change after that are padded by the archive, so the stream itself
+        // does not hold the tree
+        {
+            std::lock_guard<std::mutex> lock((it)->node_mutex);
+            (it)->access_count++;
+        }
+        auto [archive, result] = common::open_tree_archive(absolute_filepath);
+        (it)->release();
+
+        if (result == common::FileOperationResult::SUCCESS &&
+            archive->size() < common::PAYLOAD_THRESHOLD) {
+            // Small trees go inline, where they can still be compressed
+            std::string data(archive->size(), '\0');
+            if (archive->read(reinterpret_cast<uint8_t *>(data.data()),
+                              data.size())) {
+                response.set_data(std::move(data));
+            } else {
+                result = common::FileOperationResult::IO_ERROR;
+            }
+            archive.reset();
+        }
+
+        if (archive) {
+            m_logger->debug("Sending {} entries as {} byte payload",
+                            archive->entries().size(),
+                            archive->size());
+            response.set_payload_size(archive->size());
+            auto logger = m_logger;
+            auto path = filename;
+            client_info.response_payload =
+                std::shared_ptr<common::PayloadSource>(
+                    archive.release(),
+                    [logger, path](common::PayloadSource *source) {
+                        auto *tree =
+                            static_cast<common::TreeArchiveSource *>(source);
+                        if (tree->padded_files() > 0) {
+                            logger->warn("{} files of '{}' changed while "
+                                         "being sent and were padded",
+                                         tree->padded_files(),
+                                         path);
+                        }
+                        delete tree;
+                    });
+        }
+
+        if (result == common::FileOperationResult::SUCCESS) {
+            response.set_type(fenris::ResponseType::TREE_ARCHIVE);
+            response.set_success(true);
+        } else if (result == common::FileOperationResult::PERMISSION_DENIED) {
+            m_logger->error("Permission denied to read the directory: '{}'",
+                            filename);
+            response.set_error_message(
+                "Permission denied to read the directory");
+        } else {
+            m_logger->error("Failed to read directory tree: '{}'", filename);
+            response.set_error_message("Failed to read directory tree");
+        }
+        break;
+    }
+    case fenris::RequestType::PUT_TREE: {
+        m_logger->debug("Processing PUT_TREE request for '{}'", filename);
+        if (_file.empty() || FST.find_node(filename) != nullptr) {
+            m_logger->error("Destination already exists: '{}'", filename);
+            response.set_error_message("Destination already exists");
+            break;
+        }
+
+        // An empty tree is sent without a body
+        common::InlineIncomingPayload empty{std::string_view()};
+        common::IncomingPayload &payload =
+            client_info.request_payload ? *client_info.request_payload
+                                        : empty;
+
+        // The archive is read from the connection into a hidden staging
+        // directory without the parent's lock, so a slow upload holds up
+        // nobody; only moving it into place is done under the lock
+        auto [staging, result] =
+            common::stage_tree_from_payload(absolute_filepath, payload);
+        if (result == common::FileOperationResult::SUCCESS) {
+            std::lock_guard<std::mutex> lock(new_node->node_mutex);
+            if (FST.find_node(filename) != nullptr) {
+                common::discard_staging_directory(staging);
+                result = common::FileOperationResult::DIRECTORY_ALREADY_EXISTS;
+            } else {
+                result = common::commit_staging_directory(staging,
+                                                          absolute_filepath);
+                if (result == common::FileOperationResult::SUCCESS) {
+                    add_subtree(filename);
+                }
+            }
+        }
+        if (result == common::FileOperationResult::SUCCESS) {
+            m_logger->debug("Directory tree stored at '{}'", filename);
+            response.set_type(fenris::ResponseType::SUCCESS);
+            response.set_success(true);
+            response.set_data("The directory has been uploaded successfully");
+        } else if (result ==
+                       common::FileOperationResult::DIRECTORY_ALREADY_EXISTS ||
+                   result ==
+                       common::FileOperationResult::FILE_ALREADY_EXISTS) {
+            m_logger->error("Destination already exists: '{}'", filename);
+            response.set_error_message("Destination already exists");
+        } else if (result == common::FileOperationResult::PERMISSION_DENIED) {
+            m_logger->error("Permission denied to create the directory: '{}'",
+                            filename);
+            response.set_error_message(
+                "Permission denied to create the directory");
+        } else if (result == common::FileOperationResult::INVALID_PATH) {
+            m_logger->error("Invalid tree archive for '{}'", filename);
+            response.set_error_message("Invalid tree archive");
+        } else {
+            m_logger->error("Failed to upload directory: '{}'", filename);
+            response.set_error_message("Failed to upload directory");
+        }
+        break;
+    }
+    case fenris::RequestType::RENAME: {
+        m_logger->debug("Processing RENAME request for '{}' to '{}'",
+                        filename,
+                        request.destination());
+        auto it = FST.find_file(new_node, _file);
+        if (it == nullptr) {
+            it = FST.find_directory(new_node, _file);
+        }
+        if (it == nullptr) {
+            m_logger->error("File not found: '{}'", filename);
+            response.set_error_message("File not found");
+            break;
+        }
+
+        std::string destination =
+            resolve_tree_path(client_info.current_directory,
+                              request.destination());
+        auto parent = FST.find_node(
+            destination.substr(0, destination.find_last_of('/')));
+        if (destination == "/" || parent == nullptr ||
+            !parent->is_directory) {
+            m_logger->error("Invalid destination: '{}'", destination);
+            response.set_error_message("Invalid destination");
+            break;
+        }
+        if (FST.find_node(destination) != nullptr) {
+            m_logger->error("Destination already exists: '{}'", destination);
+            response.set_error_message("Destination already exists");
+            break;
+        }
+        if (it->is_directory && destination.rfind(filename + "/", 0) == 0) {
+            m_logger->error("Cannot move '{}' into itself", filename);
+            response.set_error_message(
+                "Cannot move a directory into itself");
+            break;
+        }
+
+        // Readers of a file are waited for before its directories are
+        // locked, so they are only held for a reader that starts meanwhile
+        if (!it->is_directory) {
+            (it)->wait_unused();
+        }
+
+        // Lock both parent directories without risking lock-order inversion
+        std::unique_lock<std::mutex> source_lock(new_node->node_mutex,
+                                                 std::defer_lock);
+        std::unique_lock<std::mutex> destination_lock(parent->node_mutex,
+                                                      std::defer_lock);
+        if (parent == new_node) {
+            source_lock.lock();
+        } else {
+            std::lock(source_lock, destination_lock);
+        }
+
+        std::unique_lock<std::mutex> lock;
+        if (it->is_directory) {
+            lock = std::unique_lock<std::mutex>((it)->node_mutex);
+            // Clients inside the directory hold paths that would go stale
+            if ((it)->access_count > 0) {
+                m_logger->warn("Directory is in use: '{}'", filename);
+                response.set_error_message("Directory is in use");
+                break;
+            }
+        } else {
+            lock = (it)->lock_unused();
+        }
+
+        auto result = common::rename_path(absolute_filepath,
+                                          DEFAULT_SERVER_DIR + destination);
+        if (result == common::FileOperationResult::SUCCESS) {
+            if (!FST.move_node(filename, destination)) {
+                m_logger->error("FST not synchronized with file system");
+            }
+            m_logger->debug("Moved '{}' to '{}'", filename, destination);
+            response.set_type(fenris::ResponseType::SUCCESS);
+            response.set_success(true);
+            response.set_data("Renamed successfully");
+        } else if (result == common::FileOperationResult::FILE_ALREADY_EXISTS) {
+            m_logger->error("Destination already exists: '{}'", destination);
+            response.set_error_message("Destination already exists");
+        } else if (result == common::FileOperationResult::PERMISSION_DENIED) {
+            m_logger->error("Permission denied to rename: '{}'", filename);
+            response.set_error_message("Permission denied to rename");
+        } else {
+            m_logger->error("Failed to rename: '{}'", filename);
+            response.set_error_message("Failed to rename");
+        }
+        break;
+    }
     case fenris::RequestType::DELETE_FILE: {
         m_logger->debug("Processing DELETE_FILE request for '{}'", filename);
         std::lock_guard<std::mutex> lock(new_node->node_mutex);
@@ -339,11 +1182,13 @@ fenris::Response ClientHandler::handle_request(const fenris::Request &request,
         }
         fenris::common::FileOperationResult result;
         {
-            std::lock_guard<std::mutex> lock((it)->node_mutex);
-            while ((it)->access_count > 0) {
-                // Wait for access count to be zero
-            }
-            result = fenris::common::delete_file(absolute_filepath);
+            auto lock = (it)->lock_unused();
+            auto directory = directory_descriptor(new_node, new_directory);
+            result = directory
+                         ? common::delete_file_at(directory->get(), _file)
+                         : common::delete_file(absolute_filepath);
+            // A cached descriptor would keep the deleted file allocated
+            m_descriptors.invalidate(it);
         }
         // `result` stores the outcome of the file deletion operation.
         if (result == fenris::common::FileOperationResult::SUCCESS) {
@@ -374,9 +1219,12 @@ fenris::Response ClientHandler::handle_request(const fenris::Request &request,
             m_logger->debug("Incremented access count for file info");
         }
 
-        auto [content, result] = common::get_file_info(absolute_filepath);
+        auto directory = directory_descriptor(new_node, new_directory);
+        auto [content, result] =
+            directory ? common::get_file_info_at(directory->get(), _file)
+                      : common::get_file_info(absolute_filepath);
 
-        (it)->access_count--;
+        (it)->release();
         m_logger->debug("Decremented access count for file info");
 
         if (result == common::FileOperationResult::SUCCESS) {
@@ -384,7 +1232,8 @@ fenris::Response ClientHandler::handle_request(const fenris::Request &request,
             response.set_type(fenris::ResponseType::FILE_INFO);
             response.set_success(true);
             fenris::FileInfo *file_info = response.mutable_file_info();
-            file_info->set_name(content.name());
+            // Reported by path, whichever way the entry was looked up
+            file_info->set_name(absolute_filepath);
             file_info->set_size(content.size());
             file_info->set_is_directory(content.is_directory());
             file_info->set_modified_time(content.modified_time());
@@ -421,6 +1270,11 @@ fenris::Response ClientHandler::handle_request(const fenris::Request &request,
     case fenris::RequestType::LIST_DIR: {
         m_logger->debug("Processing LIST_DIR request for '{}'", filename);
         std::lock_guard<std::mutex> lock(new_node->node_mutex);
+        if (request.page_size() != 0) {
+            handle_list_page(request, absolute_filepath, response);
+            break;
+        }
+
         auto [entries, result] = common::list_directory(absolute_filepath);
         if (result == common::FileOperationResult::SUCCESS) {
             m_logger->debug("Directory listed successfully, found {} entries",
@@ -462,7 +1316,7 @@ fenris::Response ClientHandler::handle_request(const fenris::Request &request,
             m_logger->error("Invalid Path: '{}'", e.what());
             response.set_error_message("Invalid Path!");
             destroy_node(new_directory, new_depth, new_node);
-            return response;
+            return;
         }
         std::swap(new_directory, client_info.current_directory);
         std::swap(new_node, client_info.current_node);
@@ -495,13 +1349,21 @@ fenris::Response ClientHandler::handle_request(const fenris::Request &request,
                 break;
             }
         }
-        auto result = common::delete_directory(absolute_filepath, true);
+        common::FileOperationResult result;
+        if (request.background()) {
+            // Only the rename into the trash happens under the lock
+            result = m_deleter.remove(absolute_filepath);
+        } else {
+            result = common::delete_directory(absolute_filepath, true);
+        }
         if (result == common::FileOperationResult::SUCCESS) {
             m_logger->debug("Directory deleted successfully");
             response.set_type(fenris::ResponseType::SUCCESS);
             response.set_success(true);
             response.set_data("Directory deleted successfully");
             FST.remove_node(filename);
+            // Descriptors anywhere below would keep the tree allocated
+            m_descriptors.clear();
         } else if (result == common::FileOperationResult::DIRECTORY_NOT_EMPTY) {
             m_logger->warn("Directory is not empty: '{}'", filename);
             response.set_error_message("Directory is not empty");
@@ -538,8 +1400,91 @@ fenris::Response ClientHandler::handle_request(const fenris::Request &request,
             destroy_node(new_directory, new_depth, new_node);
         }
     }
+}
 
-    return response;
+void ClientHandler::add_subtree(const std::string &path)
+{
+    namespace fs = std::filesystem;
+
+    if (!FST.add_node(path, true)) {
+        m_logger->error("FST not synchronized with file system");
+        return;
+    }
+
+    // Parents are visited before their children, so every add_node call
+    // finds its parent already in the tree
+    fs::path root = DEFAULT_SERVER_DIR + path;
+    std::error_code ec;
+    for (fs::recursive_directory_iterator it(root, ec), end;
+         !ec && it != end;
+         it.increment(ec)) {
+        std::string node_path =
+            path + "/" + it->path().lexically_relative(root).string();
+        FST.add_node(node_path, it->is_directory(ec));
+    }
+}
+
+std::shared_ptr<const Descriptor>
+ClientHandler::directory_descriptor(const std::shared_ptr<Node> &directory,
+                                    const std::string &directory_path)
+{
+    return m_descriptors.directory(directory,
+                                   DEFAULT_SERVER_DIR + directory_path);
+}
+
+std::shared_ptr<const Descriptor>
+ClientHandler::file_descriptor(const std::shared_ptr<Node> &directory,
+                               const std::string &directory_path,
+                               const std::shared_ptr<Node> &file,
+                               const std::string &name)
+{
+    auto parent = directory_descriptor(directory, directory_path);
+    if (!parent) {
+        return nullptr;
+    }
+    return m_descriptors.file(file, parent->get(), name);
+}
+
+void ClientHandler::handle_list_page(const fenris::Request &request,
+                                     const std::string &absolute_filepath,
+                                     fenris::Response &response)
+{
+    uint64_t offset;
+    if (!decode_list_cursor(request.cursor(), offset)) {
+        m_logger->error("Invalid listing cursor for '{}'", request.filename());
+        response.set_error_message("Invalid listing cursor");
+        return;
+    }
+
+    size_t page_size = std::min(request.page_size(), MAX_LIST_PAGE_SIZE);
+    auto [page, result] =
+        common::list_directory_page(absolute_filepath, offset, page_size);
+    if (result == common::FileOperationResult::SUCCESS) {
+        m_logger->debug("Listed page of {} entries from offset {}",
+                        page.entries.size(),
+                        offset);
+        response.set_type(fenris::ResponseType::DIR_LISTING);
+        response.set_success(true);
+
+        fenris::DirectoryListing *dir_listing =
+            response.mutable_directory_listing();
+        for (auto &entry : page.entries) {
+            entry.clear_permissions();
+            *dir_listing->add_entries() = std::move(entry);
+        }
+        if (!page.complete) {
+            dir_listing->set_next_cursor(encode_list_cursor(page.next_offset));
+        }
+    } else if (result == common::FileOperationResult::FILE_NOT_FOUND) {
+        m_logger->error("Directory not found: '{}'", request.filename());
+        response.set_error_message("Directory not found");
+    } else if (result == common::FileOperationResult::INVALID_PATH) {
+        m_logger->error("Path is not a directory: '{}'", request.filename());
+        response.set_error_message("Path is not a directory");
+    } else {
+        m_logger->error("Failed to list directory: '{}'", request.filename());
+        response.set_error_message("Failed to list directory");
+    }
 }
 
 } // namespace server
@@ -0,0 +1,154 @@
+#include "server/scrubber.hpp"
+#include "common/checksum.hpp"
+#include "server/io_priority.hpp"
+
+#include <fcntl.h>
+#include <filesystem>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <utility>
+
+namespace fenris {
+namespace server {
+
+using namespace common;
+
+namespace fs = std::filesystem;
+
+Scrubber::Scrubber(std::string namespace_root,
+                   std::chrono::seconds interval,
+                   std::chrono::seconds grace_period,
+                   const std::string &logger_name)
+    : m_namespace_root(std::move(namespace_root)), m_interval(interval),
+      m_grace_period(grace_period), m_logger(get_logger(logger_name))
+{
+}
+
+Scrubber::~Scrubber()
+{
+    stop();
+}
+
+void Scrubber::start()
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    if (m_thread.joinable() || m_stopping) {
+        return;
+    }
+    m_thread = std::thread(&Scrubber::worker, this);
+}
+
+void Scrubber::stop()
+{
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_stopping = true;
+    }
+    m_condition.notify_all();
+
+    if (m_thread.joinable()) {
+        m_thread.join();
+    }
+}
+
+uint64_t Scrubber::passes() const
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_passes;
+}
+
+bool Scrubber::stopping() const
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_stopping;
+}
+
+ScrubStats Scrubber::scrub()
+{
+    ScrubStats stats;
+    auto cutoff = std::chrono::system_clock::to_time_t(
+        std::chrono::system_clock::now() - m_grace_period);
+
+    std::error_code ec;
+    for (fs::recursive_directory_iterator it(m_namespace_root, ec), end;
+         !ec && it != end && !stopping();
+         it.increment(ec)) {
+        int fd =
+            open(it->path().c_str(), O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+        if (fd < 0) {
+            // Deleted since the walk, or not a file we can read
+            continue;
+        }
+        struct stat st;
+        if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode)) {
+            close(fd);
+            continue;
+        }
+
+        auto [report, result] = verify_file(fd);
+        if (result != FileOperationResult::SUCCESS) {
+            m_logger->warn("could not verify '{}': {}",
+                           it->path().string(),
+                           file_operation_result_to_string(result));
+        } else if (!report.corrupted_offsets.empty()) {
+            stats.files_corrupted++;
+            m_logger->error("'{}' is corrupted: {} of {} blocks do not match, "
+                            "first at offset {}",
+                            it->path().string(),
+                            report.corrupted_offsets.size(),
+                            report.blocks,
+                            report.corrupted_offsets.front());
+        } else if (!report.checked && st.st_mtime < cutoff) {
+            auto [sealed, seal_result] = seal_file(fd);
+            if (sealed) {
+                stats.files_sealed++;
+            } else if (seal_result != FileOperationResult::SUCCESS) {
+                m_logger->warn("could not seal '{}': {}",
+                               it->path().string(),
+                               file_operation_result_to_string(seal_result));
+            }
+        }
+        if (report.checked) {
+            stats.files_checked++;
+            stats.bytes_checked += report.bytes;
+        }
+        close(fd);
+    }
+    if (ec) {
+        m_logger->warn("scrub of '{}' stopped early: {}",
+                       m_namespace_root,
+                       ec.message());
+    }
+    return stats;
+}
+
+void Scrubber::worker()
+{
+    // Scrubbing reads everything, so it must not compete with clients
+    lower_thread_priority();
+
+    std::unique_lock<std::mutex> lock(m_mutex);
+    while (true) {
+        m_condition.wait_for(lock, m_interval, [this]() { return m_stopping; });
+        if (m_stopping) {
+            return;
+        }
+        lock.unlock();
+
+        auto stats = scrub();
+        if (stats.files_corrupted > 0) {
+            m_logger->error("scrub found {} corrupted files",
+                            stats.files_corrupted);
+        }
+        m_logger->info("scrub checked {} files ({} bytes), sealed {}",
+                       stats.files_checked,
+                       stats.bytes_checked,
+                       stats.files_sealed);
+
+        lock.lock();
+        m_passes++;
+    }
+}
+
+} // namespace server
+} // namespace fenris
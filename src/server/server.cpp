@@ -1,7 +1,11 @@
 #include "server/server.hpp"
+#include "common/compression_manager.hpp"
+#include "common/file_operations.hpp"
 #include "common/logging.hpp"
 #include "server/connection_manager.hpp"
 
+#include <filesystem>
+
 namespace fenris {
 namespace server {
 
@@ -56,6 +60,82 @@ void Server::set_non_blocking_mode(bool enabled)
     m_logger->debug("Non-blocking mode set to: {}", enabled);
 }
 
+size_t Server::train_compression_dictionary(const std::string &root_dir)
+{
+    // Bound the sampling work so startup stays fast on huge trees
+    constexpr size_t MAX_SAMPLED_FILES = 1024;
+    constexpr size_t MAX_SAMPLED_DIRECTORIES = 64;
+
+    namespace fs = std::filesystem;
+
+    if (is_running()) {
+        m_logger->warn("Cannot train dictionary while server is running");
+        return 0;
+    }
+
+    std::vector<std::vector<uint8_t>> samples;
+    size_t sampled_files = 0;
+    size_t sampled_directories = 0;
+
+    auto sample_directory = [&](const std::string &path) {
+        auto [entries, result] = list_directory(path);
+        if (result != FileOperationResult::SUCCESS || entries.empty()) {
+            return;
+        }
+        fenris::DirectoryListing listing;
+        for (const auto &entry : entries) {
+            *listing.add_entries() = entry;
+        }
+        std::vector<uint8_t> sample(listing.ByteSizeLong());
+        if (listing.SerializeToArray(sample.data(),
+                                     static_cast<int>(sample.size()))) {
+            samples.push_back(std::move(sample));
+            sampled_directories++;
+        }
+    };
+
+    std::error_code ec;
+    sample_directory(root_dir);
+    for (fs::recursive_directory_iterator
+             it(root_dir, fs::directory_options::skip_permission_denied, ec),
+         end;
+         !ec && it != end && sampled_files < MAX_SAMPLED_FILES;
+         it.increment(ec)) {
+        if (it->is_directory(ec)) {
+            if (sampled_directories < MAX_SAMPLED_DIRECTORIES) {
+                sample_directory(it->path().string());
+            }
+            continue;
+        }
+
+        if (!it->is_regular_file(ec) ||
+            it->file_size(ec) > compress::DICTIONARY_PAYLOAD_LIMIT) {
+            continue;
+        }
+
+        auto [content, result] = read_file(it->path().string());
+        if (result == FileOperationResult::SUCCESS && !content.empty()) {
+            samples.emplace_back(content.begin(), content.end());
+            sampled_files++;
+        }
+    }
+
+    compress::CompressionManager compression_manager;
+    std::vector<uint8_t> dictionary =
+        compression_manager.train_dictionary(samples);
+    size_t dictionary_size = dictionary.size();
+
+    m_logger->info("Trained {} byte compression dictionary from {} files and "
+                   "{} directories under {}",
+                   dictionary_size,
+                   sampled_files,
+                   sampled_directories,
+                   root_dir);
+
+    m_connection_manager->set_compression_dictionary(std::move(dictionary));
+    return dictionary_size;
+}
+
 bool Server::start()
 {
     if (is_running()) {
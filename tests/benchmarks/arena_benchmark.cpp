@@ -0,0 +1,100 @@
+// Time building a large DIR_LISTING response on the heap and on a
+// per-connection arena set up the way ConnectionManager does it.
+//
+// Usage: arena_benchmark [entries] [iterations]
+
+#include "fenris.pb.h"
+#include "server/connection_manager.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <google/protobuf/arena.h>
+#include <iostream>
+#include <string>
+#include <vector>
+
+namespace {
+
+using Clock = std::chrono::steady_clock;
+
+void fill_listing(fenris::Response &response,
+                  const std::vector<std::string> &names)
+{
+    response.set_type(fenris::ResponseType::DIR_LISTING);
+    response.set_success(true);
+    fenris::DirectoryListing *listing = response.mutable_directory_listing();
+    for (const auto &name : names) {
+        fenris::FileInfo *file_info = listing->add_entries();
+        file_info->set_name(name);
+        file_info->set_size(4096);
+        file_info->set_is_directory(false);
+        file_info->set_modified_time(1700000000);
+    }
+}
+
+struct Timings {
+    double min_us;
+    double median_us;
+};
+
+template <typename Build> Timings measure(int iterations, Build build)
+{
+    std::vector<double> samples;
+    samples.reserve(iterations);
+    for (int i = 0; i < iterations; i++) {
+        auto start = Clock::now();
+        build();
+        std::chrono::duration<double, std::micro> elapsed =
+            Clock::now() - start;
+        samples.push_back(elapsed.count());
+    }
+    std::sort(samples.begin(), samples.end());
+    return {samples.front(), samples[samples.size() / 2]};
+}
+
+} // namespace
+
+int main(int argc, char **argv)
+{
+    int entries = argc > 1 ? std::atoi(argv[1]) : 5000;
+    int iterations = argc > 2 ? std::atoi(argv[2]) : 200;
+    if (entries <= 0 || iterations <= 0) {
+        std::cerr << "usage: " << argv[0] << " [entries] [iterations]\n";
+        return 1;
+    }
+
+    std::vector<std::string> names;
+    for (int i = 0; i < entries; i++) {
+        names.push_back("file_" + std::to_string(i) + ".txt");
+    }
+
+    size_t checksum = 0;
+    Timings heap = measure(iterations, [&]() {
+        fenris::Response response;
+        fill_listing(response, names);
+        checksum += response.directory_listing().entries_size();
+    });
+
+    std::vector<char> arena_block(fenris::server::ARENA_INITIAL_BLOCK_SIZE);
+    google::protobuf::ArenaOptions arena_options;
+    arena_options.initial_block = arena_block.data();
+    arena_options.initial_block_size = arena_block.size();
+    arena_options.max_block_size = fenris::server::ARENA_MAX_BLOCK_SIZE;
+    google::protobuf::Arena arena(arena_options);
+    Timings arena_timings = measure(iterations, [&]() {
+        auto *response =
+            google::protobuf::Arena::CreateMessage<fenris::Response>(&arena);
+        fill_listing(*response, names);
+        checksum += response->directory_listing().entries_size();
+        arena.Reset();
+    });
+
+    std::cout << "DIR_LISTING of " << entries << " entries, " << iterations
+              << " iterations\n";
+    std::cout << "  heap:  min " << heap.min_us << " us, median "
+              << heap.median_us << " us\n";
+    std::cout << "  arena: min " << arena_timings.min_us << " us, median "
+              << arena_timings.median_us << " us\n";
+    return checksum == 0 ? 1 : 0;
+}
@@ -199,6 +199,15 @@ class MockServer {
 
         std::cout << "MockServer: Key exchange successful" << std::endl;
 
+        // Handshake ends with the (here empty) compression dictionary
+        fenris::Response dictionary_response;
+        dictionary_response.set_type(fenris::ResponseType::DICTIONARY);
+        dictionary_response.set_success(true);
+        if (!send_response(socket, encryption_key, dictionary_response)) {
+            std::cerr << "MockServer: Failed to send dictionary" << std::endl;
+            return;
+        }
+
         while (m_running) {
             auto request_opt = receive_request(socket, encryption_key);
             if (!request_opt.has_value()) {
@@ -64,6 +64,7 @@ TEST_F(RequestManagerTest, GenerateLsRequest)
     EXPECT_EQ(request_opt_with_path.value().command(),
               fenris::RequestType::LIST_DIR);
     EXPECT_EQ(request_opt_with_path.value().filename(), "/some/dir");
+    EXPECT_EQ(request_opt_with_path.value().page_size(), LIST_DIR_PAGE_SIZE);
 }
 
 TEST_F(RequestManagerTest, GenerateReadFileRequest)
@@ -85,6 +86,45 @@ TEST_F(RequestManagerTest, GenerateWriteFileRequestInline)
     EXPECT_EQ(request_opt.value().data(), "Hello World");
 }
 
+TEST_F(RequestManagerTest, GenerateRangedRequests)
+{
+    auto read_opt =
+        request_manager.generate_request(create_args({"cat", "big", "4096"}));
+    ASSERT_TRUE(read_opt.has_value());
+    EXPECT_TRUE(read_opt.value().has_offset());
+    EXPECT_EQ(read_opt.value().offset(), 4096);
+    EXPECT_EQ(read_opt.value().length(), 0);
+
+    read_opt = request_manager.generate_request(
+        create_args({"cat", "big", "4096", "512"}));
+    ASSERT_TRUE(read_opt.has_value());
+    EXPECT_EQ(read_opt.value().offset(), 4096);
+    EXPECT_EQ(read_opt.value().length(), 512);
+
+    auto write_opt = request_manager.generate_request(
+        create_args({"write", "big", "-o", "100", "patch"}));
+    ASSERT_TRUE(write_opt.has_value());
+    EXPECT_EQ(write_opt.value().filename(), "big");
+    EXPECT_TRUE(write_opt.value().has_offset());
+    EXPECT_EQ(write_opt.value().offset(), 100);
+    EXPECT_EQ(write_opt.value().data(), "patch");
+
+    // Whole-file requests carry no offset
+    auto plain_opt =
+        request_manager.generate_request(create_args({"cat", "big"}));
+    ASSERT_TRUE(plain_opt.has_value());
+    EXPECT_FALSE(plain_opt.value().has_offset());
+
+    EXPECT_FALSE(request_manager
+                     .generate_request(create_args({"cat", "big", "-1"}))
+                     .has_value());
+    auto bad_offset = create_args({"write", "big", "-o", "x", "y"});
+    EXPECT_FALSE(request_manager.generate_request(bad_offset).has_value());
+    EXPECT_FALSE(request_manager
+                     .generate_request(create_args({"write", "big", "-o", "1"}))
+                     .has_value());
+}
+
 TEST_F(RequestManagerTest, GenerateWriteFileRequestFromFile)
 {
     std::string content = "Content from file";
@@ -101,6 +141,128 @@ TEST_F(RequestManagerTest, GenerateWriteFileRequestFromFile)
     unlink(temp_filename.c_str()); // Clean up temp file
 }
 
+TEST_F(RequestManagerTest, LargeLocalFileIsStreamed)
+{
+    std::string content(common::PAYLOAD_THRESHOLD + 1, 'L');
+    std::string temp_filename = create_temp_file(content);
+    ASSERT_FALSE(temp_filename.empty());
+
+    auto args = create_args({"upload", temp_filename.c_str(), "big.bin"});
+    auto request_opt = request_manager.generate_request(args);
+    ASSERT_TRUE(request_opt.has_value());
+    EXPECT_EQ(request_opt.value().filename(), "big.bin");
+    EXPECT_TRUE(request_opt.value().data().empty());
+    EXPECT_EQ(request_opt.value().expected_size(), content.size());
+
+    auto payload = request_manager.take_payload();
+    ASSERT_NE(payload, nullptr);
+    EXPECT_EQ(payload->size(), content.size());
+    EXPECT_EQ(request_manager.take_payload(), nullptr);
+
+    // Small files stay inline
+    std::string small_filename = create_temp_file("small");
+    auto small_args = create_args({"upload", small_filename.c_str(), "s"});
+    auto small_opt = request_manager.generate_request(small_args);
+    ASSERT_TRUE(small_opt.has_value());
+    EXPECT_EQ(small_opt.value().data(), "small");
+    EXPECT_EQ(small_opt.value().expected_size(), 0u);
+    EXPECT_EQ(request_manager.take_payload(), nullptr);
+
+    unlink(temp_filename.c_str());
+    unlink(small_filename.c_str());
+}
+
+TEST_F(RequestManagerTest, GenerateDownloadRequest)
+{
+    auto args = create_args({"download", "remote.bin", "local.bin"});
+    auto request_opt = request_manager.generate_request(args);
+    ASSERT_TRUE(request_opt.has_value());
+    EXPECT_EQ(request_opt.value().command(), fenris::RequestType::READ_FILE);
+    EXPECT_EQ(request_opt.value().filename(), "remote.bin");
+
+    EXPECT_FALSE(request_manager
+                     .generate_request(create_args({"download", "remote.bin"}))
+                     .has_value());
+}
+
+TEST_F(RequestManagerTest, GenerateCopyRequests)
+{
+    auto file_opt =
+        request_manager.generate_request(create_args({"cp", "a.txt", "b.txt"}));
+    ASSERT_TRUE(file_opt.has_value());
+    EXPECT_EQ(file_opt.value().command(), fenris::RequestType::COPY_FILE);
+    EXPECT_EQ(file_opt.value().filename(), "a.txt");
+    EXPECT_EQ(file_opt.value().destination(), "b.txt");
+
+    auto dir_opt = request_manager.generate_request(
+        create_args({"cp", "-r", "src", "/backup/src"}));
+    ASSERT_TRUE(dir_opt.has_value());
+    EXPECT_EQ(dir_opt.value().command(), fenris::RequestType::COPY_DIR);
+    EXPECT_EQ(dir_opt.value().filename(), "src");
+    EXPECT_EQ(dir_opt.value().destination(), "/backup/src");
+
+    EXPECT_FALSE(
+        request_manager.generate_request(create_args({"cp", "a.txt"}))
+            .has_value());
+    EXPECT_FALSE(
+        request_manager.generate_request(create_args({"cp", "-r", "src"}))
+            .has_value());
+}
+
+TEST_F(RequestManagerTest, GenerateRenameRequest)
+{
+    auto request_opt = request_manager.generate_request(
+        create_args({"mv", "old.txt", "/archive/new.txt"}));
+    ASSERT_TRUE(request_opt.has_value());
+    EXPECT_EQ(request_opt.value().command(), fenris::RequestType::RENAME);
+    EXPECT_EQ(request_opt.value().filename(), "old.txt");
+    EXPECT_EQ(request_opt.value().destination(), "/archive/new.txt");
+
+    EXPECT_FALSE(
+        request_manager.generate_request(create_args({"mv", "old.txt"}))
+            .has_value());
+}
+
+TEST_F(RequestManagerTest, GenerateSyncRequest)
+{
+    // A sync starts by asking for the signature of the remote copy
+    auto request_opt = request_manager.generate_request(
+        create_args({"sync", "local.bin", "remote.bin"}));
+    ASSERT_TRUE(request_opt.has_value());
+    EXPECT_EQ(request_opt.value().command(),
+              fenris::RequestType::GET_SIGNATURE);
+    EXPECT_EQ(request_opt.value().filename(), "remote.bin");
+    EXPECT_EQ(request_manager.take_payload(), nullptr);
+
+    EXPECT_FALSE(
+        request_manager.generate_request(create_args({"sync", "local.bin"}))
+            .has_value());
+}
+
+TEST_F(RequestManagerTest, GenerateDedupRequest)
+{
+    // A deduplicated upload starts by asking which chunks the server has
+    std::string content(200000, 'D');
+    std::string temp_filename = create_temp_file(content);
+    ASSERT_FALSE(temp_filename.empty());
+
+    auto request_opt = request_manager.generate_request(
+        create_args({"dedup", temp_filename.c_str(), "remote.bin"}));
+    ASSERT_TRUE(request_opt.has_value());
+    EXPECT_EQ(request_opt.value().command(), fenris::RequestType::HAS_CHUNKS);
+    EXPECT_EQ(request_opt.value().filename(), "remote.bin");
+    EXPECT_EQ(request_opt.value().manifest().file_size(), content.size());
+    EXPECT_GT(request_opt.value().manifest().lengths_size(), 0);
+    EXPECT_EQ(request_manager.take_payload(), nullptr);
+
+    EXPECT_FALSE(request_manager
+                     .generate_request(create_args(
+                         {"dedup", "/nonexistent/local.bin", "remote.bin"}))
+                     .has_value());
+
+    unlink(temp_filename.c_str());
+}
+
 TEST_F(RequestManagerTest, GenerateAppendFileRequestInline)
 {
     auto args = create_args({"append", "logfile.log", "More data"});
@@ -171,6 +333,13 @@ TEST_F(RequestManagerTest, GenerateDeleteDirRequest)
     ASSERT_TRUE(request_opt.has_value());
     EXPECT_EQ(request_opt.value().command(), fenris::RequestType::DELETE_DIR);
     EXPECT_EQ(request_opt.value().filename(), "empty_dir");
+    EXPECT_FALSE(request_opt.value().background());
+
+    auto background_opt =
+        request_manager.generate_request(create_args({"rmdir", "-b", "big"}));
+    ASSERT_TRUE(background_opt.has_value());
+    EXPECT_EQ(background_opt.value().filename(), "big");
+    EXPECT_TRUE(background_opt.value().background());
 }
 
 TEST_F(RequestManagerTest, GenerateTerminateRequest)
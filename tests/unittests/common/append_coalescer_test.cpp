@@ -0,0 +1,255 @@
+#include "common/append_coalescer.hpp"
+#include "common/durability.hpp"
+#include "common/file_operations.hpp"
+#include <algorithm>
+#include <chrono>
+#include <fcntl.h>
+#include <filesystem>
+#include <gtest/gtest.h>
+#include <sstream>
+#include <string>
+#include <sys/stat.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+namespace fs = std::filesystem;
+namespace fenris {
+namespace common {
+namespace tests {
+
+class AppendCoalescerTest : public ::testing::Test {
+  protected:
+    void SetUp() override
+    {
+        test_dir = fs::temp_directory_path() / "fenris_append_coalescer_test";
+        fs::remove_all(test_dir);
+        fs::create_directory(test_dir);
+        path = (test_dir / "log").string();
+        ASSERT_EQ(create_file(path), FileOperationResult::SUCCESS);
+    }
+
+    void TearDown() override
+    {
+        set_append_coalescing(0);
+        set_durability_mode(DurabilityMode::NONE);
+        fs::remove_all(test_dir);
+    }
+
+    std::string read_back()
+    {
+        auto [content, result] = read_file(path);
+        EXPECT_EQ(result, FileOperationResult::SUCCESS);
+        return std::string(content.begin(), content.end());
+    }
+
+    static std::string record(int writer, int index)
+    {
+        std::ostringstream line;
+        line << "writer " << writer << " record " << index << "\n";
+        return line.str();
+    }
+
+    // Append handle on a pipe that holds one page, so a larger write stays
+    // in flight until the other end is read
+    static std::shared_ptr<AppendHandle> pipe_handle(int &read_end)
+    {
+        int fds[2];
+        EXPECT_EQ(pipe2(fds, O_CLOEXEC), 0);
+        fcntl(fds[1], F_SETPIPE_SZ, 4096);
+        struct stat st;
+        EXPECT_EQ(fstat(fds[1], &st), 0);
+        read_end = fds[0];
+        return std::make_shared<AppendHandle>(fds[1], st.st_dev, st.st_ino);
+    }
+
+    // Read size bytes from fd
+    static std::string drain(int fd, size_t size)
+    {
+        std::string data(size, '\0');
+        size_t done = 0;
+        while (done < size) {
+            ssize_t n = read(fd, data.data() + done, size - done);
+            if (n <= 0) {
+                break;
+            }
+            done += static_cast<size_t>(n);
+        }
+        data.resize(done);
+        return data;
+    }
+
+    static void wait_for_appends(const AppendCoalescer &coalescer,
+                                 uint64_t count)
+    {
+        auto deadline =
+            std::chrono::steady_clock::now() + std::chrono::seconds(5);
+        while (coalescer.append_count() < count &&
+               std::chrono::steady_clock::now() < deadline) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+    }
+
+    fs::path test_dir;
+    std::string path;
+};
+
+// Test that concurrent appends are never torn, and that each is on disk
+// once it is acknowledged
+TEST_F(AppendCoalescerTest, ConcurrentAppendsStayWhole)
+{
+    set_append_coalescing(1024 * 1024, std::chrono::milliseconds(2));
+
+    constexpr int writers = 8;
+    constexpr int records = 50;
+    std::vector<std::thread> threads;
+    for (int writer = 0; writer < writers; writer++) {
+        threads.emplace_back([this, writer]() {
+            for (int i = 0; i < records; i++) {
+                EXPECT_EQ(append_file(path, record(writer, i)),
+                          FileOperationResult::SUCCESS);
+                EXPECT_NE(read_back().find(record(writer, i)),
+                          std::string::npos);
+            }
+        });
+    }
+    for (auto &thread : threads) {
+        thread.join();
+    }
+
+    std::vector<std::string> lines;
+    std::istringstream content(read_back());
+    for (std::string line; std::getline(content, line);) {
+        lines.push_back(line + "\n");
+    }
+    ASSERT_EQ(lines.size(), static_cast<size_t>(writers * records));
+    for (int writer = 0; writer < writers; writer++) {
+        // Each writer's records are whole and in its own order
+        auto previous = lines.begin();
+        for (int i = 0; i < records; i++) {
+            auto it = std::find(previous, lines.end(), record(writer, i));
+            ASSERT_NE(it, lines.end());
+            previous = it;
+        }
+    }
+
+    auto coalescer = get_append_coalescer();
+    EXPECT_EQ(coalescer->append_count(),
+              static_cast<uint64_t>(writers * records));
+    EXPECT_LE(coalescer->write_count(), coalescer->append_count());
+}
+
+// Test that an append to an idle file is written at once, whatever the
+// delay
+TEST_F(AppendCoalescerTest, LoneAppendSkipsDelay)
+{
+    set_append_coalescing(1024 * 1024, std::chrono::seconds(60));
+    auto start = std::chrono::steady_clock::now();
+    std::string expected;
+    for (int i = 0; i < 100; i++) {
+        ASSERT_EQ(append_file(path, record(0, i)),
+                  FileOperationResult::SUCCESS);
+        expected += record(0, i);
+    }
+    EXPECT_LT(std::chrono::steady_clock::now() - start,
+              std::chrono::seconds(10));
+    EXPECT_EQ(read_back(), expected);
+    EXPECT_EQ(get_append_coalescer()->write_count(), 100u);
+}
+
+// Test that a full batch queued behind a write does not wait for its delay
+TEST_F(AppendCoalescerTest, SizeBoundWritesEarly)
+{
+    int read_end;
+    auto handle = pipe_handle(read_end);
+    AppendCoalescer coalescer(1000, std::chrono::seconds(60));
+
+    // The first write fills the pipe and stays in flight until it is read
+    std::vector<std::thread> threads;
+    threads.emplace_back([&]() {
+        EXPECT_TRUE(coalescer.append(handle, std::string(8192, 'b')));
+    });
+    wait_for_appends(coalescer, 1);
+    for (int i = 0; i < 4; i++) {
+        threads.emplace_back([&]() {
+            EXPECT_TRUE(coalescer.append(handle, std::string(300, 'a')));
+        });
+    }
+    wait_for_appends(coalescer, 5);
+
+    EXPECT_EQ(drain(read_end, 8192 + 1200), std::string(8192, 'b') +
+                                                std::string(1200, 'a'));
+    for (auto &thread : threads) {
+        thread.join();
+    }
+    EXPECT_EQ(coalescer.write_count(), 2u);
+    close(read_end);
+}
+
+// Test that flushing writes a batch queued behind a write before its delay
+TEST_F(AppendCoalescerTest, FlushWritesWaitingBatch)
+{
+    int read_end;
+    auto handle = pipe_handle(read_end);
+    AppendCoalescer coalescer(1024 * 1024, std::chrono::seconds(60));
+
+    std::thread first([&]() {
+        EXPECT_TRUE(coalescer.append(handle, std::string(8192, 'b')));
+    });
+    wait_for_appends(coalescer, 1);
+    std::thread waiting([&]() {
+        EXPECT_TRUE(coalescer.append(handle, "waiting\n"));
+    });
+    wait_for_appends(coalescer, 2);
+
+    EXPECT_EQ(drain(read_end, 8192), std::string(8192, 'b'));
+    first.join();
+    EXPECT_TRUE(coalescer.flush());
+    waiting.join();
+    EXPECT_EQ(drain(read_end, 8), "waiting\n");
+    close(read_end);
+}
+
+// Test that a failed write is reported to the appenders of its batch and
+// not to later ones
+TEST_F(AppendCoalescerTest, FailureReachesItsBatch)
+{
+    struct stat st;
+    ASSERT_EQ(stat(path.c_str(), &st), 0);
+    AppendCoalescer coalescer(1024 * 1024, std::chrono::milliseconds(50));
+
+    // Writing through a read-only descriptor fails
+    auto broken = std::make_shared<AppendHandle>(
+        open(path.c_str(), O_RDONLY), st.st_dev, st.st_ino);
+    std::vector<std::thread> threads;
+    for (int i = 0; i < 2; i++) {
+        threads.emplace_back([&coalescer, &broken]() {
+            EXPECT_FALSE(coalescer.append(broken, "lost\n"));
+        });
+    }
+    for (auto &thread : threads) {
+        thread.join();
+    }
+
+    auto working = std::make_shared<AppendHandle>(
+        open(path.c_str(), O_WRONLY | O_APPEND), st.st_dev, st.st_ino);
+    EXPECT_TRUE(coalescer.append(working, "kept\n"));
+    EXPECT_TRUE(coalescer.flush());
+    EXPECT_EQ(read_back(), "kept\n");
+}
+
+// Test that appends bypass a disabled coalescer
+TEST_F(AppendCoalescerTest, DisabledWritesDirectly)
+{
+    set_append_coalescing(1024 * 1024, std::chrono::milliseconds(1));
+    ASSERT_EQ(append_file(path, "kept\n"), FileOperationResult::SUCCESS);
+
+    set_append_coalescing(0);
+    EXPECT_EQ(get_append_coalescer(), nullptr);
+    ASSERT_EQ(append_file(path, "direct\n"), FileOperationResult::SUCCESS);
+    EXPECT_EQ(read_back(), "kept\ndirect\n");
+}
+
+} // namespace tests
+} // namespace common
+} // namespace fenris
@@ -0,0 +1,231 @@
+#include "common/checksum.hpp"
+#include "common/file_operations.hpp"
+#include "common/pack_store.hpp"
+#include "common/payload.hpp"
+#include <cstdint>
+#include <fcntl.h>
+#include <filesystem>
+#include <gtest/gtest.h>
+#include <string>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <vector>
+
+namespace fs = std::filesystem;
+namespace fenris {
+namespace common {
+namespace tests {
+
+class ChecksumTest : public ::testing::Test {
+  protected:
+    void SetUp() override
+    {
+        test_dir = fs::temp_directory_path() / "fenris_checksum_test";
+        fs::remove_all(test_dir);
+        fs::create_directories(test_dir);
+    }
+
+    void TearDown() override
+    {
+        set_pack_store(nullptr, false);
+        fs::remove_all(test_dir);
+    }
+
+    std::string path(const std::string &name)
+    {
+        return (test_dir / name).string();
+    }
+
+    static std::string make_data(size_t size)
+    {
+        std::string data(size, '\0');
+        uint32_t state = 12345;
+        for (auto &c : data) {
+            state = state * 1103515245 + 12345;
+            c = static_cast<char>(state >> 16);
+        }
+        return data;
+    }
+
+    // Flip a byte behind the file system's back, keeping size and mtime as
+    // they were, the way a failing disk would
+    static void corrupt(const std::string &filepath, uint64_t offset)
+    {
+        struct stat st;
+        ASSERT_EQ(stat(filepath.c_str(), &st), 0);
+        int fd = open(filepath.c_str(), O_RDWR);
+        ASSERT_GE(fd, 0);
+        char byte;
+        ASSERT_EQ(pread(fd, &byte, 1, static_cast<off_t>(offset)), 1);
+        byte = static_cast<char>(byte ^ 0x01);
+        ASSERT_EQ(pwrite(fd, &byte, 1, static_cast<off_t>(offset)), 1);
+        struct timespec times[2] = {st.st_atim, st.st_mtim};
+        ASSERT_EQ(futimens(fd, times), 0);
+        close(fd);
+    }
+
+    static ChecksumReport verify(const std::string &filepath)
+    {
+        auto [report, result] = verify_file(filepath);
+        EXPECT_EQ(result, FileOperationResult::SUCCESS);
+        return report;
+    }
+
+    fs::path test_dir;
+};
+
+// Test the checksum against the standard check value and its identities
+TEST_F(ChecksumTest, Crc32c)
+{
+    EXPECT_EQ(crc32c("123456789", 9), 0xE3069283u);
+    EXPECT_EQ(crc32c("", 0), 0u);
+
+    // Long enough for the interleaved streams, split at odd boundaries
+    std::string data = make_data(100003);
+    uint32_t whole = crc32c(data.data(), data.size());
+    uint32_t crc = 0;
+    for (size_t offset = 0; offset < data.size(); offset += 777) {
+        size_t length = std::min<size_t>(777, data.size() - offset);
+        crc = crc32c(data.data() + offset, length, crc);
+    }
+    EXPECT_EQ(crc, whole);
+
+    uint32_t first = crc32c(data.data(), 40000);
+    uint32_t second = crc32c(data.data() + 40000, data.size() - 40000);
+    EXPECT_EQ(crc32c_combine(first, second, data.size() - 40000), whole);
+}
+
+// Test that large files get larger blocks, each checksummed correctly
+TEST_F(ChecksumTest, BuilderCoarsens)
+{
+    std::string chunk = make_data(MIN_CHECKSUM_BLOCK_SIZE);
+    ChecksumBuilder builder;
+    uint64_t size = 0;
+    for (size_t i = 0; i <= MAX_CHECKSUM_BLOCKS; i++) {
+        chunk[0] = static_cast<char>(i);
+        builder.update(chunk.data(), chunk.size());
+        size += chunk.size();
+    }
+
+    auto checksums = builder.finish();
+    EXPECT_EQ(checksums.file_size, size);
+    EXPECT_EQ(checksums.block_size, 2 * MIN_CHECKSUM_BLOCK_SIZE);
+    EXPECT_LE(checksums.crcs.size(), MAX_CHECKSUM_BLOCKS);
+
+    std::string block = chunk;
+    block[0] = 0;
+    uint32_t crc = crc32c(block.data(), block.size());
+    block[0] = 1;
+    EXPECT_EQ(checksums.crcs[0], crc32c(block.data(), block.size(), crc));
+}
+
+// Test that every read path refuses contents that no longer match
+TEST_F(ChecksumTest, ReadsDetectCorruption)
+{
+    std::string data = make_data(5 * MIN_CHECKSUM_BLOCK_SIZE + 100);
+    ASSERT_EQ(write_file(path("a.bin"), data), FileOperationResult::SUCCESS);
+    auto report = verify(path("a.bin"));
+    EXPECT_TRUE(report.checked);
+    EXPECT_EQ(report.blocks, 6u);
+    EXPECT_TRUE(report.corrupted_offsets.empty());
+
+    uint64_t damaged = 3 * MIN_CHECKSUM_BLOCK_SIZE + 10;
+    corrupt(path("a.bin"), damaged);
+
+    EXPECT_EQ(read_file(path("a.bin")).second,
+              FileOperationResult::DATA_CORRUPTED);
+    // Only reads touching the damaged block fail
+    auto [head, head_result] = read_file_range(path("a.bin"), 0, 100);
+    EXPECT_EQ(head_result, FileOperationResult::SUCCESS);
+    EXPECT_EQ(head, data.substr(0, 100));
+    EXPECT_EQ(read_file_range(path("a.bin"), damaged - 5, 10).second,
+              FileOperationResult::DATA_CORRUPTED);
+
+    report = verify(path("a.bin"));
+    ASSERT_EQ(report.corrupted_offsets.size(), 1u);
+    EXPECT_EQ(report.corrupted_offsets[0], 3 * MIN_CHECKSUM_BLOCK_SIZE);
+
+    // Streams stop at the damaged block
+    auto [source, open_result] =
+        open_file_payload(path("a.bin"), damaged - 1000, 2000);
+    ASSERT_EQ(open_result, FileOperationResult::SUCCESS);
+    std::vector<uint8_t> buffer(2000);
+    EXPECT_FALSE(source->read(buffer.data(), buffer.size()));
+
+    auto [mapping, map_result] = map_file(path("a.bin"));
+    ASSERT_EQ(map_result, FileOperationResult::SUCCESS);
+    MappedPayloadSource mapped(mapping);
+    buffer.resize(data.size());
+    EXPECT_FALSE(mapped.read(buffer.data(), buffer.size()));
+}
+
+// Test that a single-block file is checked as soon as it is mapped
+TEST_F(ChecksumTest, MapDetectsCorruption)
+{
+    ASSERT_EQ(write_file(path("small.txt"), make_data(1000)),
+              FileOperationResult::SUCCESS);
+    EXPECT_EQ(map_file(path("small.txt")).second,
+              FileOperationResult::SUCCESS);
+
+    corrupt(path("small.txt"), 999);
+    EXPECT_EQ(map_file(path("small.txt")).second,
+              FileOperationResult::DATA_CORRUPTED);
+}
+
+// Test that in-place changes leave the file unchecked until sealed again
+TEST_F(ChecksumTest, InPlaceWritesUnseal)
+{
+    std::string data = make_data(2 * MIN_CHECKSUM_BLOCK_SIZE);
+    ASSERT_EQ(write_file(path("a.bin"), data), FileOperationResult::SUCCESS);
+    ASSERT_EQ(write_file_range(path("a.bin"), 10, "changed"),
+              FileOperationResult::SUCCESS);
+    EXPECT_FALSE(verify(path("a.bin")).checked);
+    EXPECT_EQ(read_file(path("a.bin")).second, FileOperationResult::SUCCESS);
+
+    int fd = open(path("a.bin").c_str(), O_RDONLY);
+    ASSERT_GE(fd, 0);
+    auto [sealed, result] = seal_file(fd);
+    close(fd);
+    EXPECT_EQ(result, FileOperationResult::SUCCESS);
+    EXPECT_TRUE(sealed);
+    auto report = verify(path("a.bin"));
+    EXPECT_TRUE(report.checked);
+    EXPECT_TRUE(report.corrupted_offsets.empty());
+
+    // Copies carry the checksums with them
+    ASSERT_EQ(copy_file(path("a.bin"), path("b.bin")),
+              FileOperationResult::SUCCESS);
+    EXPECT_TRUE(verify(path("b.bin")).checked);
+
+    // Appends change the size, which is enough to invalidate them
+    ASSERT_EQ(append_file(path("b.bin"), "more"),
+              FileOperationResult::SUCCESS);
+    EXPECT_FALSE(verify(path("b.bin")).checked);
+}
+
+// Test that damaged pack records are detected and not copied on
+TEST_F(ChecksumTest, PackedRecordsAreChecked)
+{
+    auto store = std::make_shared<PackStore>(path("packs"));
+    ASSERT_EQ(store->initialize(), FileOperationResult::SUCCESS);
+    set_pack_store(store, true);
+
+    ASSERT_EQ(write_file(path("a.txt"), "a small packed file"),
+              FileOperationResult::SUCCESS);
+    auto report = verify(path("a.txt"));
+    EXPECT_TRUE(report.checked);
+    EXPECT_TRUE(report.corrupted_offsets.empty());
+
+    for (const auto &entry : fs::directory_iterator(path("packs"))) {
+        corrupt(entry.path().string(), 2);
+    }
+    EXPECT_EQ(read_file(path("a.txt")).second,
+              FileOperationResult::DATA_CORRUPTED);
+    report = verify(path("a.txt"));
+    ASSERT_EQ(report.corrupted_offsets.size(), 1u);
+    EXPECT_EQ(report.corrupted_offsets[0], 0u);
+}
+
+} // namespace tests
+} // namespace common
+} // namespace fenris
@@ -0,0 +1,328 @@
+#include "common/chunk_store.hpp"
+#include "common/durability.hpp"
+#include "common/file_operations.hpp"
+#include <algorithm>
+#include <chrono>
+#include <fcntl.h>
+#include <filesystem>
+#include <fstream>
+#include <gtest/gtest.h>
+#include <random>
+#include <set>
+#include <string>
+#include <sys/stat.h>
+#include <sys/xattr.h>
+#include <unistd.h>
+#include <vector>
+
+namespace fs = std::filesystem;
+namespace fenris {
+namespace common {
+namespace tests {
+
+class ChunkStoreTest : public ::testing::Test {
+  protected:
+    void SetUp() override
+    {
+        test_dir = fs::temp_directory_path() / "fenris_chunk_store_test";
+        fs::remove_all(test_dir);
+        fs::create_directories(test_dir / "files");
+
+        store = std::make_shared<ChunkStore>((test_dir / "store").string());
+        ASSERT_EQ(store->initialize(), FileOperationResult::SUCCESS);
+        set_chunk_store(store, true);
+    }
+
+    void TearDown() override
+    {
+        set_chunk_store(nullptr, false);
+        fs::remove_all(test_dir);
+    }
+
+    std::string random_bytes(size_t size, unsigned seed)
+    {
+        std::mt19937 generator(seed);
+        std::string bytes(size, '\0');
+        for (auto &byte : bytes) {
+            byte = static_cast<char>(generator());
+        }
+        return bytes;
+    }
+
+    std::string path(const std::string &name)
+    {
+        return (test_dir / "files" / name).string();
+    }
+
+    std::string read_back(const std::string &filepath)
+    {
+        auto [content, result] = read_file(filepath);
+        EXPECT_EQ(result, FileOperationResult::SUCCESS);
+        return content;
+    }
+
+    bool is_placeholder(const std::string &filepath)
+    {
+        return getxattr(filepath.c_str(), MANIFEST_XATTR, nullptr, 0) > 0;
+    }
+
+    size_t stored_chunks()
+    {
+        size_t count = 0;
+        for (auto &entry :
+             fs::recursive_directory_iterator(test_dir / "store" / "chunks")) {
+            count += entry.is_regular_file() ? 1 : 0;
+        }
+        return count;
+    }
+
+    std::set<std::string> hashes(const fenris::ChunkManifest &manifest)
+    {
+        std::set<std::string> result;
+        for (size_t i = 0; i < manifest.hashes().size(); i += CHUNK_HASH_SIZE) {
+            result.insert(manifest.hashes().substr(i, CHUNK_HASH_SIZE));
+        }
+        return result;
+    }
+
+    fs::path test_dir;
+    std::shared_ptr<ChunkStore> store;
+};
+
+// Test that an insertion only changes the chunks around it
+TEST_F(ChunkStoreTest, BoundariesSurviveInsertion)
+{
+    std::string data = random_bytes(2 * 1024 * 1024, 1);
+    std::string edited =
+        data.substr(0, 1000000) + "inserted" + data.substr(1000000);
+    std::ofstream(path("a.bin"), std::ios::binary) << data;
+    std::ofstream(path("b.bin"), std::ios::binary) << edited;
+
+    auto [original, original_result] = chunk_file(path("a.bin"));
+    auto [changed, changed_result] = chunk_file(path("b.bin"));
+    ASSERT_EQ(original_result, FileOperationResult::SUCCESS);
+    ASSERT_EQ(changed_result, FileOperationResult::SUCCESS);
+    EXPECT_EQ(original.file_size(), data.size());
+
+    for (uint32_t length : original.lengths()) {
+        EXPECT_LE(length, MAX_CHUNK_SIZE);
+    }
+    for (int i = 0; i + 1 < original.lengths_size(); i++) {
+        EXPECT_GE(original.lengths(i), MIN_CHUNK_SIZE);
+    }
+
+    auto before = hashes(original);
+    size_t shared = 0;
+    for (const auto &hash : hashes(changed)) {
+        shared += before.count(hash);
+    }
+    EXPECT_GE(shared + 2, before.size());
+}
+
+// Test that identical files share their chunks and still read back whole
+TEST_F(ChunkStoreTest, DuplicateWritesShareChunks)
+{
+    std::string data = random_bytes(1024 * 1024, 2);
+    ASSERT_EQ(write_file(path("a.bin"), data), FileOperationResult::SUCCESS);
+    size_t chunks = stored_chunks();
+    EXPECT_GT(chunks, 1u);
+    ASSERT_EQ(write_file(path("b.bin"), data), FileOperationResult::SUCCESS);
+    EXPECT_EQ(stored_chunks(), chunks);
+
+    // The placeholder has the right size but no data blocks of its own; at
+    // most the extended attribute takes one
+    EXPECT_TRUE(is_placeholder(path("b.bin")));
+    struct stat st;
+    ASSERT_EQ(stat(path("b.bin").c_str(), &st), 0);
+    EXPECT_EQ(static_cast<size_t>(st.st_size), data.size());
+    EXPECT_LE(st.st_blocks * 512, 4096);
+
+    EXPECT_EQ(read_back(path("b.bin")), data);
+    auto [range, range_result] = read_file_range(path("b.bin"), 70000, 200000);
+    EXPECT_EQ(range_result, FileOperationResult::SUCCESS);
+    EXPECT_EQ(range, data.substr(70000, 200000));
+
+    auto [mapping, map_result] = map_file(path("b.bin"));
+    ASSERT_EQ(map_result, FileOperationResult::SUCCESS);
+    EXPECT_EQ(mapping->view(), data);
+
+    auto [source, source_result] = open_file_payload(path("b.bin"), 1000, 10);
+    ASSERT_EQ(source_result, FileOperationResult::SUCCESS);
+    std::string streamed(source->size(), '\0');
+    ASSERT_TRUE(source->read(reinterpret_cast<uint8_t *>(streamed.data()),
+                             streamed.size()));
+    EXPECT_EQ(streamed, data.substr(1000, 10));
+
+    // Small files are not worth a manifest
+    ASSERT_EQ(write_file(path("small.txt"), "small"),
+              FileOperationResult::SUCCESS);
+    EXPECT_FALSE(is_placeholder(path("small.txt")));
+}
+
+// Test that modifying a deduplicated file in place turns it into a plain one
+TEST_F(ChunkStoreTest, InPlaceChangesMaterialize)
+{
+    std::string data = random_bytes(300000, 3);
+    ASSERT_EQ(write_file(path("a.bin"), data), FileOperationResult::SUCCESS);
+    ASSERT_EQ(copy_file(path("a.bin"), path("copy.bin")),
+              FileOperationResult::SUCCESS);
+    EXPECT_TRUE(is_placeholder(path("copy.bin")));
+
+    ASSERT_EQ(write_file_range(path("a.bin"), 10, "patched"),
+              FileOperationResult::SUCCESS);
+    EXPECT_FALSE(is_placeholder(path("a.bin")));
+    std::string expected = data;
+    expected.replace(10, 7, "patched");
+    EXPECT_EQ(read_back(path("a.bin")), expected);
+
+    ASSERT_EQ(append_file(path("copy.bin"), "tail"),
+              FileOperationResult::SUCCESS);
+    EXPECT_EQ(read_back(path("copy.bin")), data + "tail");
+
+    // A plain copy over a placeholder does not keep its manifest
+    ASSERT_EQ(write_file(path("b.bin"), data), FileOperationResult::SUCCESS);
+    ASSERT_EQ(copy_file(path("a.bin"), path("b.bin")),
+              FileOperationResult::SUCCESS);
+    EXPECT_FALSE(is_placeholder(path("b.bin")));
+    EXPECT_EQ(read_back(path("b.bin")), expected);
+}
+
+// Test that an upload only carries the chunks the store is missing
+TEST_F(ChunkStoreTest, UploadSendsMissingChunks)
+{
+    std::string data = random_bytes(1024 * 1024, 4);
+    ASSERT_EQ(write_file(path("old.bin"), data), FileOperationResult::SUCCESS);
+
+    std::string edited = data.substr(0, 500000) + random_bytes(1000, 5) +
+                         data.substr(500000);
+    std::string local = (test_dir / "local.bin").string();
+    std::ofstream(local, std::ios::binary) << edited;
+    auto [manifest, result] = chunk_file(local);
+    ASSERT_EQ(result, FileOperationResult::SUCCESS);
+
+    std::vector<uint32_t> missing;
+    for (int i = 0; i < manifest.lengths_size(); i++) {
+        if (!store->has_chunk(
+                manifest.hashes().substr(i * CHUNK_HASH_SIZE,
+                                         CHUNK_HASH_SIZE))) {
+            missing.push_back(static_cast<uint32_t>(i));
+        }
+    }
+    ASSERT_FALSE(missing.empty());
+
+    auto [file, map_result] = map_file(local);
+    ChunkUploadSource source(file, manifest, missing);
+    EXPECT_LT(source.size(), edited.size() / 4);
+    std::string body(source.size(), '\0');
+    // Read in uneven pieces, as the payload frames would
+    for (size_t offset = 0; offset < body.size(); offset += 1000) {
+        size_t length = std::min<size_t>(1000, body.size() - offset);
+        ASSERT_TRUE(source.read(
+            reinterpret_cast<uint8_t *>(body.data()) + offset,
+            length));
+    }
+
+    // Without the missing chunks the file cannot be written
+    EXPECT_EQ(write_file_from_chunks(path("new.bin"), manifest, nullptr),
+              FileOperationResult::FILE_NOT_FOUND);
+
+    InlineIncomingPayload payload(body);
+    ASSERT_EQ(write_file_from_chunks(path("new.bin"), manifest, &payload),
+              FileOperationResult::SUCCESS);
+    EXPECT_TRUE(is_placeholder(path("new.bin")));
+    EXPECT_EQ(read_back(path("new.bin")), edited);
+
+    // Chunks that do not match their hash are rejected
+    body.back() ^= 1;
+    InlineIncomingPayload corrupt(body);
+    EXPECT_EQ(write_file_from_chunks(path("bad.bin"), manifest, &corrupt),
+              FileOperationResult::IO_ERROR);
+}
+
+// Test that a stream from the chunks outlives the file it was opened from
+TEST_F(ChunkStoreTest, StreamKeepsChunksOfDeletedFile)
+{
+    std::string data = random_bytes(600000, 8);
+    ASSERT_EQ(write_file(path("a.bin"), data), FileOperationResult::SUCCESS);
+
+    // Make every object look older than the grace period
+    auto old = fs::file_time_type::clock::now() - std::chrono::hours(2);
+    for (auto &entry : fs::recursive_directory_iterator(test_dir / "store")) {
+        fs::last_write_time(entry.path(), old);
+    }
+
+    auto [source, result] = open_file_payload(path("a.bin"), 100, UINT64_MAX);
+    ASSERT_EQ(result, FileOperationResult::SUCCESS);
+    ASSERT_EQ(source->size(), data.size() - 100);
+    ASSERT_EQ(delete_file(path("a.bin")), FileOperationResult::SUCCESS);
+
+    // Opening the stream marked the manifest as in use
+    auto [stats, collect_result] =
+        store->collect_garbage((test_dir / "files").string());
+    ASSERT_EQ(collect_result, FileOperationResult::SUCCESS);
+    EXPECT_EQ(stats.chunks_removed, 0u);
+
+    std::string streamed(source->size(), '\0');
+    for (size_t offset = 0; offset < streamed.size(); offset += 70000) {
+        size_t length = std::min<size_t>(70000, streamed.size() - offset);
+        ASSERT_TRUE(source->read(
+            reinterpret_cast<uint8_t *>(streamed.data()) + offset,
+            length));
+    }
+    EXPECT_EQ(streamed, data.substr(100));
+    uint8_t extra;
+    EXPECT_FALSE(source->read(&extra, 1));
+}
+
+// Test that chunks flushed as one batch are all published
+TEST_F(ChunkStoreTest, BatchedChunksUnderFsync)
+{
+    set_durability_mode(DurabilityMode::FSYNC);
+    std::string data = random_bytes(1024 * 1024, 9);
+    EXPECT_EQ(write_file(path("a.bin"), data), FileOperationResult::SUCCESS);
+    set_durability_mode(DurabilityMode::NONE);
+
+    EXPECT_TRUE(is_placeholder(path("a.bin")));
+    EXPECT_EQ(read_back(path("a.bin")), data);
+    // No staging file is left next to the chunks
+    for (auto &entry :
+         fs::recursive_directory_iterator(test_dir / "store" / "chunks")) {
+        if (entry.is_regular_file()) {
+            EXPECT_EQ(entry.path().filename().string().size(),
+                      2 * CHUNK_HASH_SIZE);
+        }
+    }
+}
+
+// Test that collection keeps what placeholders use and removes the rest
+TEST_F(ChunkStoreTest, GarbageCollection)
+{
+    std::string kept = random_bytes(200000, 6);
+    std::string dropped = random_bytes(200000, 7);
+    ASSERT_EQ(write_file(path("kept.bin"), kept), FileOperationResult::SUCCESS);
+    ASSERT_EQ(write_file(path("dropped.bin"), dropped),
+              FileOperationResult::SUCCESS);
+    size_t chunks = stored_chunks();
+    ASSERT_EQ(delete_file(path("dropped.bin")), FileOperationResult::SUCCESS);
+
+    // Recent objects are protected by the grace period
+    auto [recent, recent_result] =
+        store->collect_garbage((test_dir / "files").string());
+    ASSERT_EQ(recent_result, FileOperationResult::SUCCESS);
+    EXPECT_EQ(recent.chunks_removed, 0u);
+
+    // A negative grace period makes every object old enough
+    auto [stats, result] = store->collect_garbage(
+        (test_dir / "files").string(),
+        std::chrono::seconds(-1));
+    ASSERT_EQ(result, FileOperationResult::SUCCESS);
+    EXPECT_EQ(stats.manifests_removed, 1u);
+    EXPECT_GT(stats.chunks_removed, 0u);
+    EXPECT_GE(stats.bytes_freed, dropped.size());
+    EXPECT_EQ(stored_chunks(), chunks - stats.chunks_removed);
+    EXPECT_EQ(read_back(path("kept.bin")), kept);
+}
+
+} // namespace tests
+} // namespace common
+} // namespace fenris
@@ -176,6 +176,72 @@ TEST_F(CompressionTest, DecompressTooSmallBuffer)
     EXPECT_EQ(decompress_success, CompressionResult::BUFFER_TOO_SMALL);
 }
 
+// Test round trip through a preset dictionary
+TEST_F(CompressionTest, DictionaryRoundTrip)
+{
+    std::string dictionary_text = "{\"name\": \"config\", \"enabled\": true}";
+    std::vector<uint8_t> dictionary(dictionary_text.begin(),
+                                    dictionary_text.end());
+    std::string test_data = "{\"name\": \"service\", \"enabled\": false}";
+    std::vector<uint8_t> input(test_data.begin(), test_data.end());
+
+    auto [compressed, compress_success] =
+        compression_manager.compress_with_dictionary(input, 6, dictionary);
+    EXPECT_EQ(compress_success, CompressionResult::SUCCESS);
+
+    auto [decompressed, decompress_success] =
+        compression_manager.decompress_with_dictionary(compressed,
+                                                       input.size(),
+                                                       dictionary);
+    EXPECT_EQ(decompress_success, CompressionResult::SUCCESS);
+    EXPECT_EQ(decompressed, input);
+
+    // Without the dictionary the stream cannot be decoded
+    auto [missing, missing_success] =
+        compression_manager.decompress_with_dictionary(compressed,
+                                                       input.size(),
+                                                       {});
+    EXPECT_EQ(missing_success, CompressionResult::INVALID_DATA);
+}
+
+// Test that a trained dictionary pays off on small similar payloads
+TEST_F(CompressionTest, TrainedDictionaryShrinksSmallPayloads)
+{
+    auto make_record = [](int id) {
+        std::string record = "{\"apiVersion\": \"v1\", \"kind\": "
+                             "\"ConfigMap\", \"metadata\": {\"name\": "
+                             "\"service-" +
+                             std::to_string(id) +
+                             "\", \"namespace\": \"default\"}}";
+        return std::vector<uint8_t>(record.begin(), record.end());
+    };
+
+    std::vector<std::vector<uint8_t>> samples;
+    for (int i = 0; i < 32; ++i) {
+        samples.push_back(make_record(i));
+    }
+
+    std::vector<uint8_t> dictionary =
+        compression_manager.train_dictionary(samples);
+    EXPECT_FALSE(dictionary.empty());
+    EXPECT_LE(dictionary.size(), MAX_DICTIONARY_SIZE);
+
+    std::vector<uint8_t> input = make_record(1000);
+    auto [plain, plain_success] = compression_manager.compress(input, 6);
+    auto [primed, primed_success] =
+        compression_manager.compress_with_dictionary(input, 6, dictionary);
+    EXPECT_EQ(plain_success, CompressionResult::SUCCESS);
+    EXPECT_EQ(primed_success, CompressionResult::SUCCESS);
+    EXPECT_LT(primed.size(), plain.size());
+
+    auto [decompressed, decompress_success] =
+        compression_manager.decompress_with_dictionary(primed,
+                                                       input.size(),
+                                                       dictionary);
+    EXPECT_EQ(decompress_success, CompressionResult::SUCCESS);
+    EXPECT_EQ(decompressed, input);
+}
+
 } // namespace tests
 } // namespace compress
 } // namespace common
@@ -0,0 +1,170 @@
+#include "common/delta.hpp"
+#include "common/file_operations.hpp"
+#include <fcntl.h>
+#include <filesystem>
+#include <fstream>
+#include <gtest/gtest.h>
+#include <random>
+#include <string>
+#include <unistd.h>
+
+namespace fs = std::filesystem;
+namespace fenris {
+namespace common {
+namespace tests {
+
+class DeltaTest : public ::testing::Test {
+  protected:
+    void SetUp() override
+    {
+        test_dir = fs::temp_directory_path() / "fenris_delta_test";
+        fs::remove_all(test_dir);
+        fs::create_directory(test_dir);
+    }
+
+    void TearDown() override
+    {
+        fs::remove_all(test_dir);
+    }
+
+    std::string random_bytes(size_t size, unsigned seed)
+    {
+        std::mt19937 generator(seed);
+        std::string bytes(size, '\0');
+        for (auto &byte : bytes) {
+            byte = static_cast<char>(generator());
+        }
+        return bytes;
+    }
+
+    std::string write_test_file(const std::string &name,
+                                const std::string &content)
+    {
+        fs::path path = test_dir / name;
+        std::ofstream(path, std::ios::binary) << content;
+        return path.string();
+    }
+
+    std::string read_back(const std::string &path)
+    {
+        auto [content, result] = read_file(path);
+        EXPECT_EQ(result, FileOperationResult::SUCCESS);
+        return std::string(content.begin(), content.end());
+    }
+
+    fs::path test_dir;
+};
+
+// Test that rolling the window matches recomputing it from scratch
+TEST_F(DeltaTest, RollingChecksum)
+{
+    std::string data = random_bytes(4096, 1);
+    auto bytes = reinterpret_cast<const uint8_t *>(data.data());
+    constexpr size_t window = 512;
+
+    RollingChecksum rolling;
+    rolling.reset(bytes, window);
+    for (size_t i = 1; i + window <= data.size(); i++) {
+        rolling.roll(bytes[i - 1], bytes[i + window - 1]);
+        RollingChecksum fresh;
+        fresh.reset(bytes + i, window);
+        ASSERT_EQ(rolling.value(), fresh.value()) << "offset " << i;
+    }
+
+    EXPECT_EQ(delta_block_size(0), MIN_DELTA_BLOCK_SIZE);
+    EXPECT_EQ(delta_block_size(2ULL << 30), 65536u);
+    EXPECT_EQ(delta_block_size(1ULL << 50), MAX_DELTA_BLOCK_SIZE);
+}
+
+// Test that a small edit produces a small delta that rebuilds the file
+TEST_F(DeltaTest, PatchRebuildsEditedFile)
+{
+    std::string base = random_bytes(300000, 2);
+    std::string edited = base.substr(0, 100000) + "inserted bytes" +
+                         base.substr(100000, 150000) +
+                         random_bytes(5000, 3) + base.substr(255000);
+    std::string remote = write_test_file("remote.bin", base);
+    std::string local = write_test_file("local.bin", edited);
+
+    auto [signature, signature_result] = compute_file_signature(remote);
+    ASSERT_EQ(signature_result, FileOperationResult::SUCCESS);
+    EXPECT_EQ(signature.file_size(), base.size());
+
+    std::string delta;
+    BufferPayloadSink sink(delta);
+    auto [stats, delta_result] = compute_delta(local, signature, sink);
+    ASSERT_EQ(delta_result, FileOperationResult::SUCCESS);
+    EXPECT_EQ(stats.literal_bytes + stats.copied_bytes, edited.size());
+    EXPECT_EQ(stats.delta_bytes, delta.size());
+    EXPECT_LT(delta.size(), edited.size() / 10);
+
+    InlineIncomingPayload payload(delta);
+    EXPECT_EQ(patch_file_from_payload(remote, payload),
+              FileOperationResult::SUCCESS);
+    EXPECT_EQ(read_back(remote), edited);
+}
+
+// Test that the applier accepts the delta in arbitrary pieces
+TEST_F(DeltaTest, ApplierHandlesSplitInput)
+{
+    std::string base = random_bytes(20000, 4);
+    std::string edited = "head" + base.substr(3000) + "tail";
+    std::string remote = write_test_file("remote.bin", base);
+    std::string local = write_test_file("local.bin", edited);
+
+    auto [signature, signature_result] = compute_file_signature(remote);
+    std::string delta;
+    BufferPayloadSink sink(delta);
+    compute_delta(local, signature, sink);
+
+    int base_fd = open(remote.c_str(), O_RDONLY);
+    int output_fd = open((test_dir / "out.bin").c_str(),
+                         O_WRONLY | O_CREAT | O_TRUNC,
+                         0644);
+    ASSERT_GE(base_fd, 0);
+    ASSERT_GE(output_fd, 0);
+    DeltaApplier applier(base_fd, base.size(), output_fd);
+    for (size_t offset = 0; offset < delta.size(); offset += 7) {
+        size_t length = std::min<size_t>(7, delta.size() - offset);
+        ASSERT_TRUE(applier.write(
+            reinterpret_cast<const uint8_t *>(delta.data()) + offset,
+            length));
+    }
+    EXPECT_TRUE(applier.finish());
+    close(base_fd);
+    close(output_fd);
+    EXPECT_EQ(read_back((test_dir / "out.bin").string()), edited);
+}
+
+// Test that a delta against an outdated signature leaves the file alone
+TEST_F(DeltaTest, StaleSignatureRejected)
+{
+    std::string base = random_bytes(50000, 5);
+    std::string remote = write_test_file("remote.bin", base);
+    std::string local = write_test_file("local.bin", base + "more");
+
+    auto [signature, signature_result] = compute_file_signature(remote);
+    std::string delta;
+    BufferPayloadSink sink(delta);
+    compute_delta(local, signature, sink);
+
+    // The remote copy changes between the signature and the patch
+    std::string changed = random_bytes(50000, 6);
+    write_test_file("remote.bin", changed);
+
+    InlineIncomingPayload payload(delta);
+    EXPECT_EQ(patch_file_from_payload(remote, payload),
+              FileOperationResult::IO_ERROR);
+    EXPECT_EQ(read_back(remote), changed);
+
+    // Garbage is rejected without touching the file either
+    std::string not_a_delta = "not a delta";
+    InlineIncomingPayload garbage(not_a_delta);
+    EXPECT_EQ(patch_file_from_payload(remote, garbage),
+              FileOperationResult::IO_ERROR);
+    EXPECT_EQ(read_back(remote), changed);
+}
+
+} // namespace tests
+} // namespace common
+} // namespace fenris
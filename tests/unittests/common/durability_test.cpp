@@ -0,0 +1,211 @@
+#include "common/durability.hpp"
+#include "common/file_operations.hpp"
+#include <atomic>
+#include <fcntl.h>
+#include <filesystem>
+#include <gtest/gtest.h>
+#include <string>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+namespace fs = std::filesystem;
+namespace fenris {
+namespace common {
+namespace tests {
+
+class DurabilityTest : public ::testing::Test {
+  protected:
+    void SetUp() override
+    {
+        test_dir = fs::temp_directory_path() / "fenris_durability_test";
+        fs::remove_all(test_dir);
+        fs::create_directory(test_dir);
+    }
+
+    void TearDown() override
+    {
+        set_durability_mode(DurabilityMode::NONE);
+        fs::remove_all(test_dir);
+    }
+
+    std::string read_back(const fs::path &path)
+    {
+        auto [content, result] = read_file(path.string());
+        EXPECT_EQ(result, FileOperationResult::SUCCESS);
+        return std::string(content.begin(), content.end());
+    }
+
+    fs::path test_dir;
+};
+
+// Test parsing and printing durability modes
+TEST_F(DurabilityTest, ModeStrings)
+{
+    for (auto mode : {DurabilityMode::NONE,
+                      DurabilityMode::FSYNC,
+                      DurabilityMode::GROUP_COMMIT}) {
+        auto parsed =
+            durability_mode_from_string(durability_mode_to_string(mode));
+        ASSERT_TRUE(parsed.has_value());
+        EXPECT_EQ(*parsed, mode);
+    }
+    EXPECT_FALSE(durability_mode_from_string("sometimes").has_value());
+}
+
+// Test that concurrent commits share flushes
+TEST_F(DurabilityTest, GroupCommitBatchesWriters)
+{
+    constexpr int writers = 16;
+    GroupCommitter committer(std::chrono::milliseconds(50), writers);
+
+    std::atomic<int> succeeded{0};
+    std::vector<std::thread> threads;
+    for (int i = 0; i < writers; i++) {
+        threads.emplace_back([&, i]() {
+            fs::path path = test_dir / ("w" + std::to_string(i));
+            int fd = open(path.c_str(), O_WRONLY | O_CREAT, 0644);
+            ASSERT_GE(fd, 0);
+            ASSERT_EQ(::write(fd, "data", 4), 4);
+            if (committer.commit(fd)) {
+                succeeded++;
+            }
+            close(fd);
+        });
+    }
+    for (auto &thread : threads) {
+        thread.join();
+    }
+
+    EXPECT_EQ(succeeded, writers);
+    EXPECT_GE(committer.flush_count(), 1);
+    EXPECT_LT(committer.flush_count(), writers);
+}
+
+// Test that a batch mixing files and a shared parent directory succeeds
+TEST_F(DurabilityTest, GroupCommitFlushesSharedDirectory)
+{
+    constexpr int writers = 8;
+    GroupCommitter committer(std::chrono::milliseconds(50), writers * 2);
+
+    std::atomic<int> succeeded{0};
+    std::vector<std::thread> threads;
+    for (int i = 0; i < writers; i++) {
+        threads.emplace_back([&, i]() {
+            fs::path path = test_dir / ("d" + std::to_string(i));
+            int fd = open(path.c_str(), O_WRONLY | O_CREAT, 0644);
+            ASSERT_GE(fd, 0);
+            ASSERT_EQ(::write(fd, "data", 4), 4);
+            if (committer.commit(fd)) {
+                succeeded++;
+            }
+            close(fd);
+        });
+        threads.emplace_back([&]() {
+            int fd = open(test_dir.c_str(), O_RDONLY | O_DIRECTORY);
+            ASSERT_GE(fd, 0);
+            if (committer.commit(fd)) {
+                succeeded++;
+            }
+            close(fd);
+        });
+    }
+    for (auto &thread : threads) {
+        thread.join();
+    }
+
+    EXPECT_EQ(succeeded, writers * 2);
+    EXPECT_LT(committer.flush_count(), writers * 2);
+}
+
+// Test that writes behave the same under every mode and stay atomic
+TEST_F(DurabilityTest, WritesUnderEachMode)
+{
+    for (auto mode : {DurabilityMode::NONE,
+                      DurabilityMode::FSYNC,
+                      DurabilityMode::GROUP_COMMIT}) {
+        set_durability_mode(mode, std::chrono::microseconds(100));
+        EXPECT_EQ(get_durability_mode(), mode);
+
+        fs::path path = test_dir / "file.txt";
+        std::string name = durability_mode_to_string(mode);
+        EXPECT_EQ(write_file(path.string(), name),
+                  FileOperationResult::SUCCESS);
+        EXPECT_EQ(append_file(path.string(), "+"),
+                  FileOperationResult::SUCCESS);
+        EXPECT_EQ(write_file_range(path.string(), 0, "*"),
+                  FileOperationResult::SUCCESS);
+        EXPECT_EQ(read_back(path), "*" + name.substr(1) + "+");
+    }
+
+    // Only the target is left; no staging files survive a commit
+    size_t entries = std::distance(fs::directory_iterator(test_dir),
+                                   fs::directory_iterator());
+    EXPECT_EQ(entries, 1);
+}
+
+// Test that copies and renames are flushed before they return
+TEST_F(DurabilityTest, CopiesAndRenamesUnderEachMode)
+{
+    for (auto mode : {DurabilityMode::NONE,
+                      DurabilityMode::FSYNC,
+                      DurabilityMode::GROUP_COMMIT}) {
+        set_durability_mode(mode, std::chrono::microseconds(100));
+        std::string name = durability_mode_to_string(mode);
+        fs::path dir = test_dir / name;
+        ASSERT_TRUE(fs::create_directories(dir / "tree" / "sub"));
+        ASSERT_EQ(write_file((dir / "tree" / "sub" / "leaf.txt").string(),
+                             name),
+                  FileOperationResult::SUCCESS);
+
+        uint64_t flushes = group_commit_flush_count();
+        EXPECT_EQ(copy_file((dir / "tree" / "sub" / "leaf.txt").string(),
+                            (dir / "copy.txt").string()),
+                  FileOperationResult::SUCCESS);
+        uint64_t after_copy_file = group_commit_flush_count();
+        EXPECT_EQ(copy_directory((dir / "tree").string(),
+                                 (dir / "copy").string()),
+                  FileOperationResult::SUCCESS);
+        uint64_t after_copy_directory = group_commit_flush_count();
+        EXPECT_EQ(rename_path((dir / "copy.txt").string(),
+                              (dir / "copy" / "moved.txt").string()),
+                  FileOperationResult::SUCCESS);
+        uint64_t after_rename = group_commit_flush_count();
+
+        if (mode == DurabilityMode::GROUP_COMMIT) {
+            EXPECT_GT(after_copy_file, flushes);
+            EXPECT_GT(after_copy_directory, after_copy_file);
+            EXPECT_GT(after_rename, after_copy_directory);
+        } else {
+            EXPECT_EQ(after_rename, 0);
+        }
+
+        EXPECT_EQ(read_back(dir / "copy" / "sub" / "leaf.txt"), name);
+        EXPECT_EQ(read_back(dir / "copy" / "moved.txt"), name);
+
+        // No staging files or directories survive a commit
+        size_t entries = std::distance(fs::directory_iterator(dir),
+                                       fs::directory_iterator());
+        EXPECT_EQ(entries, 2);
+    }
+}
+
+// Test that a failed write leaves the old contents in place
+TEST_F(DurabilityTest, DiscardedStagingKeepsTarget)
+{
+    fs::path path = test_dir / "keep.txt";
+    ASSERT_EQ(write_file(path.string(), "original"),
+              FileOperationResult::SUCCESS);
+
+    auto [staging, result] = create_staging_file(path.string(), 0644);
+    ASSERT_EQ(result, FileOperationResult::SUCCESS);
+    ASSERT_EQ(::write(staging.fd, "partial", 7), 7);
+    discard_staging_file(staging);
+
+    EXPECT_EQ(read_back(path), "original");
+    EXPECT_FALSE(fs::exists(staging.path));
+}
+
+} // namespace tests
+} // namespace common
+} // namespace fenris
@@ -270,6 +270,45 @@ TEST(EncryptionTest, DifferentKeySizes)
     }
 }
 
+// Test in-place encryption interoperates with the copying API
+TEST(EncryptionTest, InPlaceMatchesCopyingApi)
+{
+    auto crypto_manager = CryptoManager();
+
+    std::string message = "Encrypted where it lies";
+    std::vector<uint8_t> plaintext(message.begin(), message.end());
+    std::vector<uint8_t> key(AES_GCM_KEY_SIZE, 7);
+    std::vector<uint8_t> iv(AES_GCM_IV_SIZE, 9);
+
+    std::vector<uint8_t> buffer(plaintext);
+    buffer.resize(plaintext.size() + AES_GCM_TAG_SIZE);
+    EXPECT_EQ(crypto_manager.encrypt_in_place(buffer.data(),
+                                              plaintext.size(),
+                                              key,
+                                              iv.data()),
+              EncryptionResult::SUCCESS);
+
+    auto [ciphertext, encrypt_result] =
+        crypto_manager.encrypt_data(plaintext, key, iv);
+    EXPECT_EQ(encrypt_result, EncryptionResult::SUCCESS);
+    EXPECT_EQ(buffer, ciphertext);
+
+    EXPECT_EQ(crypto_manager.decrypt_in_place(buffer.data(),
+                                              buffer.size(),
+                                              key,
+                                              iv.data()),
+              EncryptionResult::SUCCESS);
+    EXPECT_EQ(0, memcmp(buffer.data(), plaintext.data(), plaintext.size()));
+
+    // A corrupted tag must be rejected
+    ciphertext.back() ^= 0xFF;
+    EXPECT_EQ(crypto_manager.decrypt_in_place(ciphertext.data(),
+                                              ciphertext.size(),
+                                              key,
+                                              iv.data()),
+              EncryptionResult::DECRYPTION_FAILED);
+}
+
 } // namespace tests
 } // namespace crypto
 } // namespace common
@@ -94,6 +94,68 @@ TEST_F(FileOperationsTest, ReadFile)
     EXPECT_TRUE(invalid_content.empty());
 }
 
+// Test reading and writing byte ranges in place
+TEST_F(FileOperationsTest, ReadWriteFileRange)
+{
+    std::string filepath = (test_dir / "test_range.txt").string();
+    create_test_file("test_range.txt", "0123456789");
+
+    auto [middle, error] = read_file_range(filepath, 3, 4);
+    EXPECT_EQ(error, FileOperationResult::SUCCESS);
+    EXPECT_EQ(middle, "3456");
+
+    // Ranges are clamped to the end of the file
+    auto [tail, tail_error] = read_file_range(filepath, 8, 100);
+    EXPECT_EQ(tail_error, FileOperationResult::SUCCESS);
+    EXPECT_EQ(tail, "89");
+    auto [past, past_error] = read_file_range(filepath, 50, 10);
+    EXPECT_EQ(past_error, FileOperationResult::SUCCESS);
+    EXPECT_TRUE(past.empty());
+
+    // Writes overwrite in place without truncating
+    EXPECT_EQ(write_file_range(filepath, 2, "ab"),
+              FileOperationResult::SUCCESS);
+    EXPECT_EQ(read_file(filepath).first, "01ab456789");
+
+    // Writes past the end extend the file with a hole
+    EXPECT_EQ(write_file_range(filepath, 12, "xy"),
+              FileOperationResult::SUCCESS);
+    EXPECT_EQ(read_file(filepath).first,
+              std::string("01ab456789\0\0xy", 14));
+
+    auto [missing, missing_error] =
+        read_file_range(filepath + ".nonexistent", 0, 1);
+    EXPECT_EQ(missing_error, FileOperationResult::FILE_NOT_FOUND);
+}
+
+// Test mapping a file into a read-only view
+TEST_F(FileOperationsTest, MapFile)
+{
+    std::string test_content(3 * 4096 + 5, 'm');
+    create_test_file("test_map.bin", test_content);
+    create_test_file("test_map_empty.bin", "");
+
+    auto [mapping, error] = map_file((test_dir / "test_map.bin").string());
+    ASSERT_EQ(error, FileOperationResult::SUCCESS);
+    EXPECT_EQ(mapping->size(), test_content.size());
+    EXPECT_EQ(mapping->view(), test_content);
+
+    // Empty files map to an empty view
+    auto [empty, empty_error] =
+        map_file((test_dir / "test_map_empty.bin").string());
+    ASSERT_EQ(empty_error, FileOperationResult::SUCCESS);
+    EXPECT_EQ(empty->size(), 0);
+    EXPECT_TRUE(empty->view().empty());
+
+    auto [missing, missing_error] =
+        map_file((test_dir / "test_map_missing.bin").string());
+    EXPECT_EQ(missing_error, FileOperationResult::FILE_NOT_FOUND);
+    EXPECT_EQ(missing, nullptr);
+
+    auto [directory, directory_error] = map_file(test_dir.string());
+    EXPECT_EQ(directory_error, FileOperationResult::INVALID_PATH);
+}
+
 // Test writing to a file
 TEST_F(FileOperationsTest, WriteFile)
 {
@@ -152,6 +214,34 @@ TEST_F(FileOperationsTest, AppendFile)
     EXPECT_EQ(append_result, FileOperationResult::FILE_NOT_FOUND);
 }
 
+// Test that a cached append descriptor follows the file that replaces it
+TEST_F(FileOperationsTest, AppendFollowsReplacedFile)
+{
+    std::string filepath = (test_dir / "test_append_replace.txt").string();
+    std::string other = (test_dir / "test_append_other.txt").string();
+
+    create_test_file("test_append_replace.txt", "old");
+    EXPECT_EQ(append_file(filepath, "+1"), FileOperationResult::SUCCESS);
+
+    // Delete and recreate under the same name
+    ASSERT_EQ(delete_file(filepath), FileOperationResult::SUCCESS);
+    create_test_file("test_append_replace.txt", "new");
+    EXPECT_EQ(append_file(filepath, "+2"), FileOperationResult::SUCCESS);
+
+    auto [content, error] = read_file(filepath);
+    EXPECT_EQ(error, FileOperationResult::SUCCESS);
+    EXPECT_EQ(std::string(content.begin(), content.end()), "new+2");
+
+    // Rename another file over it
+    create_test_file("test_append_other.txt", "other");
+    fs::rename(other, filepath);
+    EXPECT_EQ(append_file(filepath, "+3"), FileOperationResult::SUCCESS);
+
+    auto [renamed, renamed_error] = read_file(filepath);
+    EXPECT_EQ(renamed_error, FileOperationResult::SUCCESS);
+    EXPECT_EQ(std::string(renamed.begin(), renamed.end()), "other+3");
+}
+
 // Test deleting a file
 TEST_F(FileOperationsTest, DeleteFile)
 {
@@ -327,9 +417,13 @@ TEST_F(FileOperationsTest, ListDirectory)
         std::string name = fs::path(info.name()).filename().string();
         if (name == "subdir1" || name == "subdir2") {
             EXPECT_TRUE(info.is_directory());
+            EXPECT_EQ(info.size(), 0);
         } else {
             EXPECT_FALSE(info.is_directory());
+            EXPECT_EQ(info.size(), 14);
         }
+        EXPECT_GT(info.modified_time(), 0);
+        EXPECT_NE(info.permissions() & 0700, 0);
     }
 
     // List contents of non-existent directory
@@ -345,6 +439,42 @@ TEST_F(FileOperationsTest, ListDirectory)
     EXPECT_TRUE(file_infos_error.empty());
 }
 
+// Test listing a directory one page at a time
+TEST_F(FileOperationsTest, ListDirectoryPage)
+{
+    for (int i = 0; i < 25; i++) {
+        create_test_file("page" + std::to_string(i) + ".txt", "x");
+    }
+
+    std::vector<std::string> names;
+    uint64_t offset = 0;
+    size_t pages = 0;
+    while (true) {
+        auto [page, error] = list_directory_page(test_dir.string(), offset, 10);
+        ASSERT_EQ(error, FileOperationResult::SUCCESS);
+        EXPECT_LE(page.entries.size(), 10);
+        for (const auto &info : page.entries) {
+            names.push_back(fs::path(info.name()).filename().string());
+        }
+        pages++;
+        if (page.complete) {
+            break;
+        }
+        offset = page.next_offset;
+        ASSERT_LT(pages, 10);
+    }
+
+    // Every entry is returned exactly once across the pages
+    std::sort(names.begin(), names.end());
+    EXPECT_EQ(names.size(), 25);
+    EXPECT_EQ(std::unique(names.begin(), names.end()), names.end());
+    EXPECT_GE(pages, 3);
+
+    auto [missing, missing_error] =
+        list_directory_page((test_dir / "nonexistent").string(), 0, 10);
+    EXPECT_EQ(missing_error, FileOperationResult::FILE_NOT_FOUND);
+}
+
 // Test changing directory
 TEST_F(FileOperationsTest, ChangeDirectory)
 {
@@ -403,6 +533,21 @@ TEST_F(FileOperationsTest, RenamePath)
 
     result = rename_path(another_file, new_path);
     EXPECT_EQ(result, FileOperationResult::FILE_ALREADY_EXISTS);
+
+    // The existing file is left untouched
+    auto [content, error] = read_file(new_path);
+    EXPECT_EQ(error, FileOperationResult::SUCCESS);
+    EXPECT_EQ(std::string(content.begin(), content.end()),
+              "File for renaming test");
+
+    // Directories move with their contents
+    fs::create_directories(test_dir / "move_src" / "inner");
+    create_test_file("move_src/inner/f.txt", "moved");
+    fs::create_directory(test_dir / "move_dst");
+    result = rename_path((test_dir / "move_src").string(),
+                         (test_dir / "move_dst" / "moved").string());
+    EXPECT_EQ(result, FileOperationResult::SUCCESS);
+    EXPECT_TRUE(fs::exists(test_dir / "move_dst/moved/inner/f.txt"));
 }
 
 // Test copying files
@@ -432,6 +577,99 @@ TEST_F(FileOperationsTest, CopyFile)
     EXPECT_EQ(result, FileOperationResult::FILE_NOT_FOUND);
 }
 
+// Test copying a large file, onto itself and over an existing file
+TEST_F(FileOperationsTest, CopyFileContents)
+{
+    std::string source_path = (test_dir / "big_source.bin").string();
+    std::string dest_path = (test_dir / "big_dest.bin").string();
+
+    std::string content(3 * 1024 * 1024 + 17, '\0');
+    for (size_t i = 0; i < content.size(); i++) {
+        content[i] = static_cast<char>(i % 253);
+    }
+    create_test_file("big_source.bin", content);
+    create_test_file("big_dest.bin", std::string(8 * 1024 * 1024, 'd'));
+
+    EXPECT_EQ(copy_file(source_path, dest_path), FileOperationResult::SUCCESS);
+    auto [copied, error] = read_file(dest_path);
+    EXPECT_EQ(error, FileOperationResult::SUCCESS);
+    EXPECT_TRUE(std::string(copied.begin(), copied.end()) == content);
+
+    EXPECT_EQ(copy_file(source_path, source_path),
+              FileOperationResult::INVALID_PATH);
+    EXPECT_EQ(fs::file_size(source_path), content.size());
+}
+
+// Test that a staged copy leaves the destination alone until committed
+TEST_F(FileOperationsTest, StagedCopyKeepsDestination)
+{
+    create_test_file("new.txt", "new contents");
+    create_test_file("old.txt", "old contents");
+    std::string source_path = (test_dir / "new.txt").string();
+    std::string dest_path = (test_dir / "old.txt").string();
+
+    auto [discarded, result] = stage_file_copy(source_path, dest_path);
+    ASSERT_EQ(result, FileOperationResult::SUCCESS);
+    discard_staging_file(discarded);
+    auto [kept, error] = read_file(dest_path);
+    EXPECT_EQ(std::string(kept.begin(), kept.end()), "old contents");
+
+    auto [staging, staged] = stage_file_copy(source_path, dest_path);
+    ASSERT_EQ(staged, FileOperationResult::SUCCESS);
+    EXPECT_EQ(commit_staging_file(staging, dest_path),
+              FileOperationResult::SUCCESS);
+    auto [copied, copy_error] = read_file(dest_path);
+    EXPECT_EQ(std::string(copied.begin(), copied.end()), "new contents");
+
+    // Only the source and the destination are left
+    size_t entries = std::distance(fs::directory_iterator(test_dir),
+                                   fs::directory_iterator());
+    EXPECT_EQ(entries, 2u);
+
+    fs::create_directory(test_dir / "tree");
+    std::string destination = (test_dir / "tree_copy").string();
+    auto [tree, tree_result] =
+        stage_directory_copy((test_dir / "tree").string(), destination);
+    ASSERT_EQ(tree_result, FileOperationResult::SUCCESS);
+    EXPECT_FALSE(fs::exists(destination));
+    EXPECT_EQ(commit_staging_directory(tree, destination),
+              FileOperationResult::SUCCESS);
+    EXPECT_TRUE(fs::is_directory(destination));
+    EXPECT_FALSE(fs::exists(tree));
+}
+
+// Test copying a directory tree
+TEST_F(FileOperationsTest, CopyDirectory)
+{
+    fs::create_directories(test_dir / "tree" / "sub" / "deep");
+    create_test_file("tree/a.txt", "alpha");
+    create_test_file("tree/sub/b.txt", "beta");
+    create_test_file("tree/sub/deep/c.txt", "gamma");
+    fs::create_symlink("a.txt", test_dir / "tree" / "link");
+
+    std::string source = (test_dir / "tree").string();
+    std::string destination = (test_dir / "copy").string();
+    EXPECT_EQ(copy_directory(source, destination),
+              FileOperationResult::SUCCESS);
+
+    auto [content, error] =
+        read_file((test_dir / "copy" / "sub" / "deep" / "c.txt").string());
+    EXPECT_EQ(error, FileOperationResult::SUCCESS);
+    EXPECT_EQ(std::string(content.begin(), content.end()), "gamma");
+    EXPECT_TRUE(fs::is_symlink(test_dir / "copy" / "link"));
+    EXPECT_EQ(fs::read_symlink(test_dir / "copy" / "link"), "a.txt");
+
+    // The destination must not exist or lie inside the source
+    EXPECT_EQ(copy_directory(source, destination),
+              FileOperationResult::DIRECTORY_ALREADY_EXISTS);
+    EXPECT_EQ(copy_directory(source, (test_dir / "tree/sub/copy").string()),
+              FileOperationResult::INVALID_PATH);
+    EXPECT_FALSE(fs::exists(test_dir / "tree/sub/copy"));
+    EXPECT_EQ(copy_directory((test_dir / "missing").string(),
+                             (test_dir / "other").string()),
+              FileOperationResult::FILE_NOT_FOUND);
+}
+
 // Test getting file size
 TEST_F(FileOperationsTest, GetFileSize)
 {
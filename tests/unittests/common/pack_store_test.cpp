@@ -0,0 +1,201 @@
+#include "common/chunk_store.hpp"
+#include "common/file_operations.hpp"
+#include "common/pack_store.hpp"
+#include <chrono>
+#include <fcntl.h>
+#include <filesystem>
+#include <gtest/gtest.h>
+#include <string>
+#include <sys/stat.h>
+#include <sys/xattr.h>
+#include <unistd.h>
+
+namespace fs = std::filesystem;
+namespace fenris {
+namespace common {
+namespace tests {
+
+class PackStoreTest : public ::testing::Test {
+  protected:
+    void SetUp() override
+    {
+        test_dir = fs::temp_directory_path() / "fenris_pack_store_test";
+        fs::remove_all(test_dir);
+        fs::create_directories(test_dir / "files");
+        open_store(DEFAULT_MAX_PACK_SIZE);
+    }
+
+    void TearDown() override
+    {
+        set_pack_store(nullptr, false);
+        fs::remove_all(test_dir);
+    }
+
+    void open_store(uint64_t max_pack_size)
+    {
+        store = std::make_shared<PackStore>((test_dir / "packs").string(),
+                                            max_pack_size);
+        ASSERT_EQ(store->initialize(), FileOperationResult::SUCCESS);
+        set_pack_store(store, true);
+    }
+
+    std::string path(const std::string &name)
+    {
+        return (test_dir / "files" / name).string();
+    }
+
+    std::string read_back(const std::string &filepath)
+    {
+        auto [content, result] = read_file(filepath);
+        EXPECT_EQ(result, FileOperationResult::SUCCESS);
+        return content;
+    }
+
+    bool is_packed(const std::string &filepath)
+    {
+        return getxattr(filepath.c_str(), PACK_XATTR, nullptr, 0) > 0;
+    }
+
+    // Compact ignoring the grace period, so packs written this second count
+    PackCompactionStats compact()
+    {
+        auto [stats, result] = store->compact((test_dir / "files").string(),
+                                              DEFAULT_COMPACTION_RATIO,
+                                              std::chrono::seconds(-1));
+        EXPECT_EQ(result, FileOperationResult::SUCCESS);
+        return stats;
+    }
+
+    fs::path test_dir;
+    std::shared_ptr<PackStore> store;
+};
+
+// Test that small files are packed and read back through every path
+TEST_F(PackStoreTest, SmallWritesArePacked)
+{
+    std::string data = "a small file that fits in a pack";
+    ASSERT_EQ(write_file(path("a.txt"), data), FileOperationResult::SUCCESS);
+    ASSERT_TRUE(is_packed(path("a.txt")));
+
+    // The placeholder keeps its size but has no data blocks of its own; at
+    // most the extended attribute takes one
+    struct stat st;
+    ASSERT_EQ(stat(path("a.txt").c_str(), &st), 0);
+    EXPECT_EQ(static_cast<size_t>(st.st_size), data.size());
+    EXPECT_LE(st.st_blocks * 512, 4096);
+
+    EXPECT_EQ(read_back(path("a.txt")), data);
+    auto [range, range_result] = read_file_range(path("a.txt"), 2, 5);
+    EXPECT_EQ(range_result, FileOperationResult::SUCCESS);
+    EXPECT_EQ(range, data.substr(2, 5));
+
+    int fd = open(path("a.txt").c_str(), O_RDONLY);
+    ASSERT_GE(fd, 0);
+    auto [tail, tail_result] = read_file_range(fd, 10, UINT64_MAX);
+    EXPECT_EQ(tail_result, FileOperationResult::SUCCESS);
+    EXPECT_EQ(tail, data.substr(10));
+    auto [mapping, map_result] = map_file(fd);
+    close(fd);
+    ASSERT_EQ(map_result, FileOperationResult::SUCCESS);
+    EXPECT_EQ(mapping->view(), data);
+
+    auto [source, source_result] = open_file_payload(path("a.txt"), 6, 4);
+    ASSERT_EQ(source_result, FileOperationResult::SUCCESS);
+    std::string streamed(source->size(), '\0');
+    ASSERT_TRUE(source->read(reinterpret_cast<uint8_t *>(streamed.data()),
+                             streamed.size()));
+    EXPECT_EQ(streamed, data.substr(6, 4));
+
+    // Empty files and files at the threshold keep the plain layout
+    ASSERT_EQ(write_file(path("empty.txt"), ""), FileOperationResult::SUCCESS);
+    EXPECT_FALSE(is_packed(path("empty.txt")));
+    std::string large(MAX_PACKED_FILE_SIZE, 'x');
+    ASSERT_EQ(write_file(path("large.txt"), large),
+              FileOperationResult::SUCCESS);
+    EXPECT_FALSE(is_packed(path("large.txt")));
+    EXPECT_EQ(read_back(path("large.txt")), large);
+
+    // Packed files stay readable with packing turned off
+    set_pack_store(store, false);
+    ASSERT_EQ(write_file(path("b.txt"), data), FileOperationResult::SUCCESS);
+    EXPECT_FALSE(is_packed(path("b.txt")));
+    EXPECT_EQ(read_back(path("a.txt")), data);
+}
+
+// Test that copies share the record and in-place changes materialize
+TEST_F(PackStoreTest, InPlaceChangesMaterialize)
+{
+    std::string data = "contents of a packed file";
+    ASSERT_EQ(write_file(path("a.txt"), data), FileOperationResult::SUCCESS);
+    ASSERT_EQ(copy_file(path("a.txt"), path("copy.txt")),
+              FileOperationResult::SUCCESS);
+    ASSERT_TRUE(is_packed(path("copy.txt")));
+
+    ASSERT_EQ(write_file_range(path("a.txt"), 0, "CONTENTS"),
+              FileOperationResult::SUCCESS);
+    EXPECT_FALSE(is_packed(path("a.txt")));
+    EXPECT_EQ(read_back(path("a.txt")), "CONTENTS" + data.substr(8));
+
+    ASSERT_EQ(append_file(path("copy.txt"), "!"),
+              FileOperationResult::SUCCESS);
+    EXPECT_FALSE(is_packed(path("copy.txt")));
+    EXPECT_EQ(read_back(path("copy.txt")), data + "!");
+
+    // A plain copy over a placeholder does not keep its record
+    ASSERT_EQ(write_file(path("b.txt"), data), FileOperationResult::SUCCESS);
+    ASSERT_EQ(copy_file(path("a.txt"), path("b.txt")),
+              FileOperationResult::SUCCESS);
+    EXPECT_FALSE(is_packed(path("b.txt")));
+    EXPECT_EQ(read_back(path("b.txt")), "CONTENTS" + data.substr(8));
+}
+
+// Test that compaction moves live records out of sparse packs
+TEST_F(PackStoreTest, Compaction)
+{
+    // Small packs, so the files below span several of them
+    open_store(4096);
+    std::string keep(1000, 'k');
+    for (int i = 0; i < 12; i++) {
+        std::string name = "f" + std::to_string(i) + ".txt";
+        ASSERT_EQ(write_file(path(name), std::string(1000, 'a' + i)),
+                  FileOperationResult::SUCCESS);
+    }
+    ASSERT_EQ(write_file(path("keep.txt"), keep), FileOperationResult::SUCCESS);
+    size_t packs = store->pack_count();
+    EXPECT_GT(packs, 3u);
+
+    // Overwrite or delete everything but keep.txt
+    for (int i = 0; i < 12; i++) {
+        std::string name = "f" + std::to_string(i) + ".txt";
+        if (i % 2 == 0) {
+            ASSERT_EQ(delete_file(path(name)), FileOperationResult::SUCCESS);
+        } else {
+            set_pack_store(store, false);
+            ASSERT_EQ(write_file(path(name), "plain"),
+                      FileOperationResult::SUCCESS);
+            set_pack_store(store, true);
+        }
+    }
+
+    // The first pass retires the sparse packs and moves what is live out
+    // of them; the next one removes them
+    auto first = compact();
+    EXPECT_EQ(first.packs_removed, 0u);
+    EXPECT_EQ(read_back(path("keep.txt")), keep);
+    auto second = compact();
+    EXPECT_GT(second.packs_removed, 0u);
+    EXPECT_GT(second.bytes_freed, 0u);
+    EXPECT_LT(store->pack_count(), packs);
+
+    EXPECT_TRUE(is_packed(path("keep.txt")));
+    EXPECT_EQ(read_back(path("keep.txt")), keep);
+    EXPECT_EQ(read_back(path("f1.txt")), "plain");
+
+    // A reopened store finds the remaining packs
+    open_store(4096);
+    EXPECT_EQ(read_back(path("keep.txt")), keep);
+}
+
+} // namespace tests
+} // namespace common
+} // namespace fenris
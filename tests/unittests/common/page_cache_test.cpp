@@ -0,0 +1,351 @@
+#include "common/file_operations.hpp"
+#include "common/page_cache.hpp"
+#include "common/payload.hpp"
+#include <cstdint>
+#include <fcntl.h>
+#include <filesystem>
+#include <gtest/gtest.h>
+#include <string>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <vector>
+
+namespace fs = std::filesystem;
+namespace fenris {
+namespace common {
+namespace tests {
+
+constexpr uint64_t BULK_SIZE = 1024 * 1024;
+
+class PageCacheTest : public ::testing::Test {
+  protected:
+    void SetUp() override
+    {
+        test_dir = fs::temp_directory_path() / "fenris_page_cache_test";
+        fs::remove_all(test_dir);
+        fs::create_directories(test_dir);
+        set_page_cache_policy(BulkIoPolicy::DROP, BULK_SIZE);
+        reset_page_cache_stats();
+    }
+
+    void TearDown() override
+    {
+        set_page_cache_policy(BulkIoPolicy::CACHED);
+        fs::remove_all(test_dir);
+    }
+
+    std::string path(const std::string &name)
+    {
+        return (test_dir / name).string();
+    }
+
+    static std::string make_data(size_t size)
+    {
+        std::string data(size, '\0');
+        uint32_t state = 54321;
+        for (auto &c : data) {
+            state = state * 1103515245 + 12345;
+            c = static_cast<char>(state >> 16);
+        }
+        return data;
+    }
+
+    // Bytes of the file currently in the page cache
+    static uint64_t resident(const std::string &filepath)
+    {
+        int fd = open(filepath.c_str(), O_RDONLY);
+        EXPECT_GE(fd, 0);
+        struct stat st;
+        EXPECT_EQ(fstat(fd, &st), 0);
+        auto size = static_cast<size_t>(st.st_size);
+        void *address = mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+        close(fd);
+        EXPECT_NE(address, MAP_FAILED);
+
+        auto page_size = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+        std::vector<unsigned char> pages((size + page_size - 1) / page_size);
+        EXPECT_EQ(mincore(address, size, pages.data()), 0);
+        munmap(address, size);
+
+        uint64_t cached = 0;
+        for (unsigned char page : pages) {
+            cached += (page & 1) ? page_size : 0;
+        }
+        return cached;
+    }
+
+    // Write the file back and drop it from the page cache; false if the
+    // filesystem keeps it cached regardless (tmpfs)
+    static bool evict(const std::string &filepath)
+    {
+        int fd = open(filepath.c_str(), O_RDONLY);
+        EXPECT_GE(fd, 0);
+        fsync(fd);
+        posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+        close(fd);
+        return resident(filepath) == 0;
+    }
+
+    fs::path test_dir;
+};
+
+// Test parsing and printing bulk I/O policies
+TEST_F(PageCacheTest, PolicyStrings)
+{
+    for (auto policy :
+         {BulkIoPolicy::CACHED, BulkIoPolicy::DROP, BulkIoPolicy::DIRECT}) {
+        auto parsed =
+            bulk_io_policy_from_string(bulk_io_policy_to_string(policy));
+        ASSERT_TRUE(parsed.has_value());
+        EXPECT_EQ(*parsed, policy);
+    }
+    EXPECT_FALSE(bulk_io_policy_from_string("sometimes").has_value());
+
+    EXPECT_TRUE(is_bulk_transfer(BULK_SIZE));
+    EXPECT_FALSE(is_bulk_transfer(BULK_SIZE - 1));
+    set_page_cache_policy(BulkIoPolicy::CACHED, BULK_SIZE);
+    EXPECT_FALSE(is_bulk_transfer(BULK_SIZE));
+}
+
+// Test that small reads are measured against the page cache
+TEST_F(PageCacheTest, SmallReadsCountCacheHits)
+{
+    std::string data = make_data(64 * 1024);
+    ASSERT_EQ(write_file(path("small"), data), FileOperationResult::SUCCESS);
+
+    for (int i = 0; i < 2; i++) {
+        auto [content, result] = read_file_range(path("small"), 0, UINT64_MAX);
+        ASSERT_EQ(result, FileOperationResult::SUCCESS);
+        EXPECT_EQ(content, data);
+    }
+
+    auto stats = get_page_cache_stats();
+    EXPECT_EQ(stats.reads, 2u);
+    EXPECT_EQ(stats.bulk_reads, 0u);
+    if (stats.read_bytes == 0) {
+        GTEST_SKIP() << "cachestat is not supported by this kernel";
+    }
+    // The file was just written, so every read is a hit
+    EXPECT_EQ(stats.read_bytes, 2 * data.size());
+    EXPECT_GT(stats.hit_rate(), 0.99);
+}
+
+// Test that a bulk read does not stay in the page cache
+TEST_F(PageCacheTest, BulkReadsAreDropped)
+{
+    std::string data = make_data(8 * BULK_SIZE);
+    ASSERT_EQ(write_file(path("bulk"), data), FileOperationResult::SUCCESS);
+    if (!evict(path("bulk"))) {
+        GTEST_SKIP() << "the page cache cannot be dropped on this filesystem";
+    }
+    reset_page_cache_stats();
+
+    auto [content, result] = read_file_range(path("bulk"), 0, UINT64_MAX);
+    ASSERT_EQ(result, FileOperationResult::SUCCESS);
+    EXPECT_EQ(content, data);
+
+    auto stats = get_page_cache_stats();
+    EXPECT_EQ(stats.bulk_reads, 1u);
+    EXPECT_EQ(stats.dropped_bytes, data.size());
+    EXPECT_EQ(resident(path("bulk")), 0u);
+}
+
+// Test that a bulk read of a file already cached leaves it cached
+TEST_F(PageCacheTest, CachedBulkReadsAreKept)
+{
+    std::string data = make_data(4 * BULK_SIZE);
+    ASSERT_EQ(write_file(path("hot"), data), FileOperationResult::SUCCESS);
+    int fd = open(path("hot").c_str(), O_RDONLY);
+    ASSERT_GE(fd, 0);
+    std::string warm(data.size(), '\0');
+    ASSERT_EQ(pread(fd, warm.data(), warm.size(), 0),
+              static_cast<ssize_t>(warm.size()));
+    close(fd);
+    reset_page_cache_stats();
+
+    auto [content, result] = read_file_range(path("hot"), 0, UINT64_MAX);
+    ASSERT_EQ(result, FileOperationResult::SUCCESS);
+    EXPECT_EQ(content, data);
+    EXPECT_EQ(get_page_cache_stats().dropped_bytes, 0u);
+    EXPECT_EQ(resident(path("hot")), data.size());
+}
+
+// Test that the cached policy leaves bulk reads to the kernel
+TEST_F(PageCacheTest, CachedPolicyKeepsBulkReads)
+{
+    set_page_cache_policy(BulkIoPolicy::CACHED, BULK_SIZE);
+    std::string data = make_data(4 * BULK_SIZE);
+    ASSERT_EQ(write_file(path("kept"), data), FileOperationResult::SUCCESS);
+    if (!evict(path("kept"))) {
+        GTEST_SKIP() << "the page cache cannot be dropped on this filesystem";
+    }
+
+    auto [content, result] = read_file_range(path("kept"), 0, UINT64_MAX);
+    ASSERT_EQ(result, FileOperationResult::SUCCESS);
+    EXPECT_EQ(content, data);
+    EXPECT_EQ(get_page_cache_stats().bulk_reads, 0u);
+    EXPECT_EQ(resident(path("kept")), data.size());
+}
+
+// Test that streaming a mapped bulk file drops what has been sent
+TEST_F(PageCacheTest, MappedBulkFilesAreDropped)
+{
+    std::string data = make_data(4 * BULK_SIZE + 77);
+    ASSERT_EQ(write_file(path("mapped"), data), FileOperationResult::SUCCESS);
+    if (!evict(path("mapped"))) {
+        GTEST_SKIP() << "the page cache cannot be dropped on this filesystem";
+    }
+
+    auto [mapping, result] = map_file(path("mapped"));
+    ASSERT_EQ(result, FileOperationResult::SUCCESS);
+    MappedPayloadSource source(mapping);
+    std::string content(data.size(), '\0');
+    for (size_t offset = 0; offset < content.size();
+         offset += PAYLOAD_CHUNK_SIZE) {
+        size_t size = std::min(PAYLOAD_CHUNK_SIZE, content.size() - offset);
+        ASSERT_TRUE(source.read(
+            reinterpret_cast<uint8_t *>(content.data() + offset),
+            size));
+    }
+    EXPECT_EQ(content, data);
+
+    // Only the page holding the odd tail may be left
+    EXPECT_LE(resident(path("mapped")),
+              static_cast<uint64_t>(sysconf(_SC_PAGESIZE)));
+}
+
+// Test that O_DIRECT reads at unaligned offsets match buffered ones
+TEST_F(PageCacheTest, DirectReaderMatchesPread)
+{
+    std::string data = make_data(3 * DIRECT_IO_BUFFER_SIZE + 123);
+    ASSERT_EQ(write_file(path("direct"), data), FileOperationResult::SUCCESS);
+
+    int fd = open(path("direct").c_str(), O_RDONLY);
+    ASSERT_GE(fd, 0);
+    DirectReader reader(fd);
+    if (!reader.valid()) {
+        close(fd);
+        GTEST_SKIP() << "O_DIRECT is not supported on this filesystem";
+    }
+
+    for (uint64_t offset : {uint64_t{0},
+                            uint64_t{1},
+                            uint64_t{DIRECT_IO_ALIGNMENT - 1},
+                            uint64_t{DIRECT_IO_BUFFER_SIZE - 10},
+                            uint64_t{2 * DIRECT_IO_BUFFER_SIZE + 5000},
+                            uint64_t{data.size() - 50}}) {
+        std::string chunk(100000, '\0');
+        size_t total = 0;
+        while (total < chunk.size()) {
+            ssize_t bytes =
+                reader.read(chunk.data() + total, chunk.size() - total,
+                            offset + total);
+            ASSERT_GE(bytes, 0);
+            if (bytes == 0) {
+                break;
+            }
+            total += static_cast<size_t>(bytes);
+        }
+        EXPECT_EQ(chunk.substr(0, total), data.substr(offset, chunk.size()));
+    }
+
+    char byte;
+    EXPECT_EQ(reader.read(&byte, 1, data.size()), 0);
+    close(fd);
+}
+
+// Test that a bulk payload streams correctly under the direct policy
+TEST_F(PageCacheTest, DirectPayloadsStream)
+{
+    set_page_cache_policy(BulkIoPolicy::DIRECT, BULK_SIZE);
+    std::string data = make_data(5 * BULK_SIZE + 999);
+    ASSERT_EQ(write_file(path("stream"), data), FileOperationResult::SUCCESS);
+    bool evicted = evict(path("stream"));
+
+    auto [source, result] = open_file_payload(path("stream"), 100, UINT64_MAX);
+    ASSERT_EQ(result, FileOperationResult::SUCCESS);
+    ASSERT_EQ(source->size(), data.size() - 100);
+    std::string content(source->size(), '\0');
+    for (size_t offset = 0; offset < content.size();
+         offset += PAYLOAD_CHUNK_SIZE) {
+        size_t size = std::min(PAYLOAD_CHUNK_SIZE, content.size() - offset);
+        ASSERT_TRUE(source->read(
+            reinterpret_cast<uint8_t *>(content.data() + offset),
+            size));
+    }
+    EXPECT_EQ(content, data.substr(100));
+    EXPECT_EQ(get_page_cache_stats().bulk_reads, 1u);
+    if (evicted) {
+        EXPECT_LE(resident(path("stream")),
+                  static_cast<uint64_t>(sysconf(_SC_PAGESIZE)));
+    }
+}
+
+// Test that bulk writes are flushed and dropped
+TEST_F(PageCacheTest, BulkWritesAreDropped)
+{
+    std::string data = make_data(4 * BULK_SIZE);
+    ASSERT_EQ(write_file(path("written"), data), FileOperationResult::SUCCESS);
+    EXPECT_EQ(get_page_cache_stats().bulk_writes, 1u);
+    uint64_t cached = resident(path("written"));
+
+    ASSERT_EQ(write_file(path("small"), data.substr(0, 4096)),
+              FileOperationResult::SUCCESS);
+    EXPECT_EQ(get_page_cache_stats().bulk_writes, 1u);
+    if (resident(path("small")) == 0 || cached == data.size()) {
+        GTEST_SKIP() << "the page cache cannot be dropped on this filesystem";
+    }
+    EXPECT_EQ(cached, 0u);
+
+    auto [content, result] = read_file(path("written"));
+    ASSERT_EQ(result, FileOperationResult::SUCCESS);
+    EXPECT_EQ(content, data);
+}
+
+// Test that a streamed bulk write keeps at most two windows cached
+TEST_F(PageCacheTest, WriteBehindBoundsDirtyPages)
+{
+    int fd = open(path("behind").c_str(), O_WRONLY | O_CREAT, 0644);
+    ASSERT_GE(fd, 0);
+    constexpr size_t size = 4 * WRITE_BEHIND_WINDOW;
+    std::string data = make_data(size);
+    FilePayloadSink sink(fd, false, size);
+    for (size_t offset = 0; offset < size; offset += PAYLOAD_CHUNK_SIZE) {
+        ASSERT_TRUE(sink.write(
+            reinterpret_cast<const uint8_t *>(data.data() + offset),
+            PAYLOAD_CHUNK_SIZE));
+    }
+    close(fd);
+
+    uint64_t cached = resident(path("behind"));
+    if (cached == size) {
+        GTEST_SKIP() << "the page cache cannot be dropped on this filesystem";
+    }
+    EXPECT_LE(cached, 2 * WRITE_BEHIND_WINDOW);
+
+    auto [content, result] = read_file(path("behind"));
+    ASSERT_EQ(result, FileOperationResult::SUCCESS);
+    EXPECT_EQ(content, data);
+}
+
+// Test that only small files are prefetched
+TEST_F(PageCacheTest, HotFilesArePrefetched)
+{
+    ASSERT_EQ(write_file(path("hot"), make_data(4096)),
+              FileOperationResult::SUCCESS);
+    ASSERT_EQ(write_file(path("cold"), make_data(2 * DEFAULT_HOT_FILE_SIZE)),
+              FileOperationResult::SUCCESS);
+
+    for (const char *name : {"hot", "cold"}) {
+        int fd = open(path(name).c_str(), O_RDONLY);
+        ASSERT_GE(fd, 0);
+        prefetch_hot_file(fd);
+        close(fd);
+    }
+    EXPECT_EQ(get_page_cache_stats().prefetches, 1u);
+}
+
+} // namespace tests
+} // namespace common
+} // namespace fenris
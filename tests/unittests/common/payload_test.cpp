@@ -0,0 +1,371 @@
+#include "common/payload.hpp"
+#include "common/append_coalescer.hpp"
+#include "common/file_operations.hpp"
+#include <chrono>
+#include <fcntl.h>
+#include <filesystem>
+#include <fstream>
+#include <gtest/gtest.h>
+#include <string>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+namespace fs = std::filesystem;
+namespace fenris {
+namespace common {
+namespace tests {
+
+using namespace common::crypto;
+
+// Sink that fails after accepting a fixed number of bytes
+class FailingPayloadSink : public PayloadSink {
+  public:
+    explicit FailingPayloadSink(size_t limit) : m_limit(limit) {}
+
+    bool write(const uint8_t *data, size_t size) override
+    {
+        if (m_written + size > m_limit) {
+            return false;
+        }
+        m_written += size;
+        return true;
+    }
+
+  private:
+    size_t m_limit;
+    size_t m_written{0};
+};
+
+class PayloadTest : public ::testing::Test {
+  protected:
+    void SetUp() override
+    {
+        ASSERT_EQ(socketpair(AF_UNIX, SOCK_STREAM, 0, sockets), 0);
+        key.assign(AES_GCM_KEY_SIZE, 0x42);
+    }
+
+    void TearDown() override
+    {
+        close(sockets[0]);
+        close(sockets[1]);
+    }
+
+    // Sends the payload from a separate thread and receives it into sink
+    PayloadResult transfer(PayloadSource &source, PayloadSink &sink)
+    {
+        PayloadResult send_result = PayloadResult::SUCCESS;
+        std::thread sender([&]() {
+            CryptoManager sender_crypto;
+            send_result = send_payload(sockets[0], source, sender_crypto, key);
+        });
+
+        PayloadResult receive_result =
+            receive_payload(sockets[1], source.size(), sink, crypto, key);
+        sender.join();
+        EXPECT_EQ(send_result, PayloadResult::SUCCESS);
+        return receive_result;
+    }
+
+    int sockets[2];
+    std::vector<uint8_t> key;
+    CryptoManager crypto;
+};
+
+// Test a multi-chunk payload from a buffer
+TEST_F(PayloadTest, BufferRoundTrip)
+{
+    std::string body(2 * PAYLOAD_CHUNK_SIZE + 12345, '\0');
+    for (size_t i = 0; i < body.size(); i++) {
+        body[i] = static_cast<char>(i % 251);
+    }
+
+    BufferPayloadSource source(body.data(), body.size());
+    std::string received;
+    BufferPayloadSink sink(received);
+
+    EXPECT_EQ(transfer(source, sink), PayloadResult::SUCCESS);
+    EXPECT_EQ(received, body);
+}
+
+// Test streaming a payload from one file into another
+TEST_F(PayloadTest, FileRoundTrip)
+{
+    fs::path dir = fs::temp_directory_path() / "fenris_payload_test";
+    fs::remove_all(dir);
+    fs::create_directory(dir);
+
+    std::string body(PAYLOAD_CHUNK_SIZE + 7, 'p');
+    std::ofstream(dir / "in.bin", std::ios::binary) << body;
+
+    auto [source, result] = open_file_payload((dir / "in.bin").string());
+    ASSERT_EQ(result, FileOperationResult::SUCCESS);
+    ASSERT_EQ(source->size(), body.size());
+
+    int fd = open((dir / "out.bin").c_str(), O_WRONLY | O_CREAT, 0644);
+    ASSERT_GE(fd, 0);
+    FilePayloadSink sink(fd);
+    EXPECT_EQ(transfer(*source, sink), PayloadResult::SUCCESS);
+    close(fd);
+
+    std::ifstream out(dir / "out.bin", std::ios::binary);
+    std::string written((std::istreambuf_iterator<char>(out)),
+                        std::istreambuf_iterator<char>());
+    EXPECT_EQ(written, body);
+
+    auto [missing, missing_result] =
+        open_file_payload((dir / "missing.bin").string());
+    EXPECT_EQ(missing, nullptr);
+    EXPECT_EQ(missing_result, FileOperationResult::FILE_NOT_FOUND);
+
+    fs::remove_all(dir);
+}
+
+// Test streaming a payload from a mapped file
+TEST_F(PayloadTest, MappedRoundTrip)
+{
+    fs::path dir = fs::temp_directory_path() / "fenris_payload_test";
+    fs::remove_all(dir);
+    fs::create_directory(dir);
+
+    std::string body(PAYLOAD_CHUNK_SIZE + 4099, 'v');
+    std::ofstream(dir / "in.bin", std::ios::binary) << body;
+
+    auto [mapping, result] = map_file((dir / "in.bin").string());
+    ASSERT_EQ(result, FileOperationResult::SUCCESS);
+    MappedPayloadSource source(mapping);
+    mapping.reset();
+
+    std::string received;
+    BufferPayloadSink sink(received);
+    EXPECT_EQ(transfer(source, sink), PayloadResult::SUCCESS);
+    EXPECT_EQ(received, body);
+
+    fs::remove_all(dir);
+}
+
+// Test that a failing sink still drains the stream
+TEST_F(PayloadTest, SinkFailureDrainsFrames)
+{
+    std::string body(3 * PAYLOAD_CHUNK_SIZE, 'x');
+    BufferPayloadSource source(body.data(), body.size());
+    FailingPayloadSink sink(PAYLOAD_CHUNK_SIZE);
+
+    EXPECT_EQ(transfer(source, sink), PayloadResult::SINK_ERROR);
+
+    // Nothing of the payload is left on the socket
+    std::string next(16, 'n');
+    BufferPayloadSource next_source(next.data(), next.size());
+    std::string received;
+    BufferPayloadSink next_sink(received);
+    EXPECT_EQ(transfer(next_source, next_sink), PayloadResult::SUCCESS);
+    EXPECT_EQ(received, next);
+}
+
+// Test that an inline body is delivered once and can be discarded
+TEST_F(PayloadTest, InlineIncomingPayload)
+{
+    std::string body = "inline body";
+    InlineIncomingPayload payload(body);
+    EXPECT_EQ(payload.size(), body.size());
+    EXPECT_FALSE(payload.consumed());
+
+    std::string received;
+    BufferPayloadSink sink(received);
+    EXPECT_EQ(payload.read_into(sink), PayloadResult::SUCCESS);
+    EXPECT_EQ(received, body);
+    EXPECT_TRUE(payload.consumed());
+    EXPECT_EQ(payload.read_into(sink), PayloadResult::ALREADY_CONSUMED);
+    EXPECT_EQ(payload.discard(), PayloadResult::ALREADY_CONSUMED);
+}
+
+// Test that a discarded streamed body leaves the socket at the next frame
+TEST_F(PayloadTest, StreamedIncomingPayloadDiscard)
+{
+    std::string body(PAYLOAD_CHUNK_SIZE + 99, 's');
+    std::string next = "next";
+    std::thread sender([&]() {
+        CryptoManager sender_crypto;
+        BufferPayloadSource source(body.data(), body.size());
+        BufferPayloadSource next_source(next.data(), next.size());
+        send_payload(sockets[0], source, sender_crypto, key);
+        send_payload(sockets[0], next_source, sender_crypto, key);
+    });
+
+    StreamedIncomingPayload payload(sockets[1],
+                                    body.size(),
+                                    crypto,
+                                    key,
+                                    false);
+    EXPECT_EQ(payload.discard(), PayloadResult::SUCCESS);
+    EXPECT_TRUE(payload.consumed());
+
+    std::string received;
+    BufferPayloadSink sink(received);
+    EXPECT_EQ(receive_payload(sockets[1], next.size(), sink, crypto, key),
+              PayloadResult::SUCCESS);
+    EXPECT_EQ(received, next);
+    sender.join();
+}
+
+// Test writing a request body to a file and rejecting read-only targets
+TEST_F(PayloadTest, WriteFileFromPayload)
+{
+    fs::path dir = fs::temp_directory_path() / "fenris_payload_test";
+    fs::remove_all(dir);
+    fs::create_directory(dir);
+
+    std::string body = "streamed to disk";
+    InlineIncomingPayload payload(body);
+    EXPECT_EQ(write_file_from_payload((dir / "out.txt").string(), payload),
+              FileOperationResult::SUCCESS);
+    std::ifstream out(dir / "out.txt", std::ios::binary);
+    std::string written((std::istreambuf_iterator<char>(out)),
+                        std::istreambuf_iterator<char>());
+    EXPECT_EQ(written, body);
+
+    // A read-only file is rejected before the body is read
+    fs::permissions(dir / "out.txt", fs::perms::owner_read);
+    InlineIncomingPayload rejected(body);
+    EXPECT_EQ(write_file_from_payload((dir / "out.txt").string(), rejected),
+              FileOperationResult::PERMISSION_DENIED);
+    EXPECT_FALSE(rejected.consumed());
+
+    fs::permissions(dir / "out.txt", fs::perms::owner_all);
+    fs::remove_all(dir);
+}
+
+// Test appending a request body to an existing file
+TEST_F(PayloadTest, AppendFileFromPayload)
+{
+    fs::path dir = fs::temp_directory_path() / "fenris_payload_test";
+    fs::remove_all(dir);
+    fs::create_directory(dir);
+    std::ofstream(dir / "log.txt", std::ios::binary) << "head ";
+
+    std::string body = "tail";
+    InlineIncomingPayload payload(body);
+    EXPECT_EQ(append_file_from_payload((dir / "log.txt").string(), payload),
+              FileOperationResult::SUCCESS);
+    std::ifstream in(dir / "log.txt", std::ios::binary);
+    std::string contents((std::istreambuf_iterator<char>(in)),
+                         std::istreambuf_iterator<char>());
+    EXPECT_EQ(contents, "head tail");
+
+    // Appending never creates the file
+    InlineIncomingPayload missing(body);
+    EXPECT_EQ(append_file_from_payload((dir / "none.txt").string(), missing),
+              FileOperationResult::FILE_NOT_FOUND);
+    EXPECT_FALSE(missing.consumed());
+
+    // A streamed body lands after a coalesced append to the file
+    set_append_coalescing(1024 * 1024, std::chrono::milliseconds(1));
+    ASSERT_EQ(append_file((dir / "log.txt").string(), " buffered"),
+              FileOperationResult::SUCCESS);
+    std::string streamed = " streamed";
+    InlineIncomingPayload next(streamed);
+    EXPECT_EQ(append_file_from_payload((dir / "log.txt").string(), next),
+              FileOperationResult::SUCCESS);
+    set_append_coalescing(0);
+    std::ifstream again(dir / "log.txt", std::ios::binary);
+    contents.assign(std::istreambuf_iterator<char>(again),
+                    std::istreambuf_iterator<char>());
+    EXPECT_EQ(contents, "head tail buffered streamed");
+
+    fs::remove_all(dir);
+}
+
+// Test that zero runs become holes and announced sizes are reserved
+TEST_F(PayloadTest, SparsePreallocatedWrite)
+{
+    fs::path dir = fs::temp_directory_path() / "fenris_payload_test";
+    fs::remove_all(dir);
+    fs::create_directory(dir);
+    std::string path = (dir / "image.bin").string();
+
+    std::string body = std::string(SPARSE_BLOCK_SIZE, 'a') +
+                       std::string(PAYLOAD_CHUNK_SIZE, '\0') +
+                       std::string(SPARSE_BLOCK_SIZE, 'b') +
+                       std::string(16 * SPARSE_BLOCK_SIZE, '\0');
+    InlineIncomingPayload payload(body);
+    EXPECT_EQ(write_file_from_payload(path, payload, std::nullopt, body.size()),
+              FileOperationResult::SUCCESS);
+
+    // The trailing hole still counts towards the size
+    struct stat st;
+    ASSERT_EQ(stat(path.c_str(), &st), 0);
+    EXPECT_EQ(static_cast<size_t>(st.st_size), body.size());
+    EXPECT_LT(static_cast<size_t>(st.st_blocks) * 512, body.size() / 2);
+    auto [contents, read_result] = read_file(path);
+    EXPECT_EQ(read_result, FileOperationResult::SUCCESS);
+    EXPECT_EQ(contents, body);
+
+    // Zeros written in place clear the data that was there
+    std::string zeros(SPARSE_BLOCK_SIZE, '\0');
+    InlineIncomingPayload overwrite(zeros);
+    EXPECT_EQ(write_file_from_payload(path, overwrite, 0),
+              FileOperationResult::SUCCESS);
+    auto [cleared, cleared_result] = read_file_range(path, 0, zeros.size());
+    EXPECT_EQ(cleared, zeros);
+
+    // An announced size has to match the body; it never grows the file
+    InlineIncomingPayload oversized(zeros);
+    EXPECT_EQ(write_file_from_payload(path, oversized, 0, 1ull << 40),
+              FileOperationResult::IO_ERROR);
+    std::string tail = "tail";
+    InlineIncomingPayload ranged(tail);
+    EXPECT_EQ(write_file_from_payload(path,
+                                      ranged,
+                                      body.size(),
+                                      body.size() + tail.size()),
+              FileOperationResult::SUCCESS);
+    ASSERT_EQ(stat(path.c_str(), &st), 0);
+    EXPECT_EQ(static_cast<size_t>(st.st_size), body.size() + tail.size());
+
+    fs::remove_all(dir);
+}
+
+// Test that an interrupted whole-file write leaves the old file intact
+TEST_F(PayloadTest, InterruptedWriteKeepsFile)
+{
+    fs::path dir = fs::temp_directory_path() / "fenris_payload_test";
+    fs::remove_all(dir);
+    fs::create_directory(dir);
+    std::ofstream(dir / "keep.txt", std::ios::binary) << "original";
+
+    // The sender stops one chunk short of the announced size
+    std::string body(PAYLOAD_CHUNK_SIZE, 'i');
+    std::thread sender([&]() {
+        CryptoManager sender_crypto;
+        BufferPayloadSource source(body.data(), body.size());
+        send_payload(sockets[0], source, sender_crypto, key);
+        shutdown(sockets[0], SHUT_WR);
+    });
+
+    StreamedIncomingPayload payload(sockets[1],
+                                    2 * PAYLOAD_CHUNK_SIZE,
+                                    crypto,
+                                    key,
+                                    false);
+    EXPECT_EQ(write_file_from_payload((dir / "keep.txt").string(), payload),
+              FileOperationResult::IO_ERROR);
+    sender.join();
+
+    std::ifstream in(dir / "keep.txt", std::ios::binary);
+    std::string contents((std::istreambuf_iterator<char>(in)),
+                         std::istreambuf_iterator<char>());
+    EXPECT_EQ(contents, "original");
+
+    // No staging file is left behind
+    size_t entries = std::distance(fs::directory_iterator(dir),
+                                   fs::directory_iterator());
+    EXPECT_EQ(entries, 1);
+
+    fs::remove_all(dir);
+}
+
+} // namespace tests
+} // namespace common
+} // namespace fenris
@@ -1,4 +1,5 @@
 #include "common/request.hpp"
+#include <algorithm>
 #include <cstring>
 #include <gtest/gtest.h>
 #include <string>
@@ -109,6 +110,71 @@ TEST(RequestTest, InvalidData)
     EXPECT_TRUE(deserialized.data().empty());
 }
 
+// Test serialization into a buffer with frame headroom and tailroom
+TEST(RequestTest, SerializeIntoFrameBuffer)
+{
+    fenris::Request request;
+    request.set_command(fenris::RequestType::WRITE_FILE);
+    request.set_filename("framed.txt");
+    request.set_data("framed payload");
+
+    constexpr size_t headroom = 16;
+    constexpr size_t tailroom = 16;
+    std::vector<uint8_t> buffer;
+    ASSERT_TRUE(serialize_request_into(request, buffer, headroom, tailroom));
+    ASSERT_EQ(buffer.size(), headroom + request.ByteSizeLong() + tailroom);
+
+    // The message in the middle matches the plain serialization
+    std::vector<uint8_t> serialized = serialize_request(request);
+    EXPECT_TRUE(std::equal(serialized.begin(),
+                           serialized.end(),
+                           buffer.begin() + headroom));
+
+    // Parse directly from the slice without copying it out
+    fenris::Request deserialized =
+        deserialize_request(buffer.data() + headroom, serialized.size());
+    EXPECT_EQ(deserialized.command(), request.command());
+    EXPECT_EQ(deserialized.filename(), request.filename());
+    EXPECT_EQ(deserialized.data(), request.data());
+}
+
+// Test decoding a request while leaving its data as a slice
+TEST(RequestTest, DeserializeHeaderLeavesDataSlice)
+{
+    fenris::Request request;
+    request.set_command(fenris::RequestType::WRITE_FILE);
+    request.set_filename("lazy.txt");
+    request.set_ip_addr(0x7F000001);
+    request.set_data(std::string(4096, 'd'));
+
+    std::vector<uint8_t> serialized = serialize_request(request);
+
+    fenris::Request header;
+    std::string_view body;
+    ASSERT_TRUE(deserialize_request_header(serialized.data(),
+                                           serialized.size(),
+                                           header,
+                                           body));
+    EXPECT_EQ(header.command(), request.command());
+    EXPECT_EQ(header.filename(), request.filename());
+    EXPECT_EQ(header.ip_addr(), request.ip_addr());
+    EXPECT_TRUE(header.data().empty());
+
+    // The body points into the serialized buffer rather than a copy
+    EXPECT_EQ(body, request.data());
+    EXPECT_GE(reinterpret_cast<const uint8_t *>(body.data()),
+              serialized.data());
+    EXPECT_LE(reinterpret_cast<const uint8_t *>(body.data() + body.size()),
+              serialized.data() + serialized.size());
+
+    // Truncated input is rejected
+    EXPECT_FALSE(deserialize_request_header(serialized.data(),
+                                            serialized.size() - 1,
+                                            header,
+                                            body));
+    EXPECT_TRUE(body.empty());
+}
+
 } // namespace tests
 } // namespace common
 } // namespace fenris
@@ -200,6 +200,87 @@ TEST(ResponseTest, InvalidData)
     EXPECT_TRUE(deserialized.data().empty());
 }
 
+// Test dictionary compression of small file contents and listings
+TEST(ResponseTest, CompressDecompressResponse)
+{
+    std::string dictionary_text = "file1.txt file2.txt subdir";
+    std::vector<uint8_t> dictionary(dictionary_text.begin(),
+                                    dictionary_text.end());
+
+    fenris::Response content;
+    content.set_type(fenris::ResponseType::FILE_CONTENT);
+    content.set_success(true);
+    content.set_data(std::string(512, 'x'));
+
+    auto compressed = compress_response(content, dictionary, 4096);
+    ASSERT_TRUE(compressed.has_value());
+    EXPECT_EQ(compressed->compression(),
+              fenris::CompressionType::COMPRESSION_ZLIB_DICTIONARY);
+    EXPECT_LT(compressed->data().size(), content.data().size());
+
+    fenris::Response restored =
+        deserialize_response(serialize_response(*compressed));
+    ASSERT_TRUE(decompress_response(restored, dictionary, 4096));
+    EXPECT_EQ(restored.data(), content.data());
+    EXPECT_EQ(restored.compression(),
+              fenris::CompressionType::COMPRESSION_NONE);
+
+    // An announced size over the limit is refused before decompressing
+    fenris::Response forged = *compressed;
+    forged.set_uncompressed_size(UINT64_MAX);
+    EXPECT_FALSE(decompress_response(forged, dictionary, 4096));
+    EXPECT_FALSE(decompress_response(*compressed, dictionary, 100));
+
+    // Payloads over the limit are left alone
+    EXPECT_FALSE(compress_response(content, dictionary, 100).has_value());
+
+    fenris::Response listing;
+    listing.set_type(fenris::ResponseType::DIR_LISTING);
+    listing.set_success(true);
+    for (int i = 0; i < 20; ++i) {
+        fenris::FileInfo *entry =
+            listing.mutable_directory_listing()->add_entries();
+        entry->set_name("file" + std::to_string(i) + ".txt");
+        entry->set_size(100);
+    }
+
+    compressed = compress_response(listing, dictionary, 4096);
+    ASSERT_TRUE(compressed.has_value());
+    EXPECT_FALSE(compressed->has_directory_listing());
+
+    ASSERT_TRUE(decompress_response(*compressed, dictionary, 4096));
+    ASSERT_TRUE(compressed->has_directory_listing());
+    EXPECT_EQ(compressed->directory_listing().entries_size(), 20);
+    EXPECT_EQ(compressed->directory_listing().entries(19).name(),
+              "file19.txt");
+}
+
+// Test serialization into a buffer with frame headroom and tailroom
+TEST(ResponseTest, SerializeIntoFrameBuffer)
+{
+    fenris::Response response;
+    response.set_type(fenris::ResponseType::FILE_CONTENT);
+    response.set_success(true);
+    response.set_data(std::string(4096, 'x'));
+
+    constexpr size_t headroom = 16;
+    constexpr size_t tailroom = 16;
+    std::vector<uint8_t> buffer;
+    ASSERT_TRUE(serialize_response_into(response, buffer, headroom, tailroom));
+    size_t message_size = buffer.size() - headroom - tailroom;
+    EXPECT_EQ(message_size, response.ByteSizeLong());
+
+    fenris::Response deserialized =
+        deserialize_response(buffer.data() + headroom, message_size);
+    EXPECT_EQ(deserialized.type(), response.type());
+    EXPECT_TRUE(deserialized.success());
+    EXPECT_EQ(deserialized.data(), response.data());
+
+    // A truncated slice must not parse into the original message
+    deserialized = deserialize_response(buffer.data() + headroom, 8);
+    EXPECT_NE(deserialized.data(), response.data());
+}
+
 } // namespace tests
 } // namespace common
 } // namespace fenris
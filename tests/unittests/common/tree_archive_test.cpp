@@ -0,0 +1,280 @@
+#include "common/file_operations.hpp"
+#include "common/payload.hpp"
+#include "common/tree_archive.hpp"
+#include <algorithm>
+#include <filesystem>
+#include <gtest/gtest.h>
+#include <string>
+#include <sys/stat.h>
+#include <vector>
+
+namespace fs = std::filesystem;
+namespace fenris {
+namespace common {
+namespace tests {
+
+class TreeArchiveTest : public ::testing::Test {
+  protected:
+    void SetUp() override
+    {
+        test_dir = fs::temp_directory_path() / "fenris_tree_archive_test";
+        fs::remove_all(test_dir);
+        fs::create_directory(test_dir);
+
+        source = (test_dir / "source").string();
+        ASSERT_EQ(create_directory(source), FileOperationResult::SUCCESS);
+        ASSERT_EQ(create_directory(source + "/docs"),
+                  FileOperationResult::SUCCESS);
+        ASSERT_EQ(create_directory(source + "/docs/empty"),
+                  FileOperationResult::SUCCESS);
+        ASSERT_EQ(create_directory(source + "/src"),
+                  FileOperationResult::SUCCESS);
+        write(source + "/README", "fenris\n");
+        write(source + "/docs/guide.txt", std::string(200000, 'g'));
+        write(source + "/src/main.cpp", "int main() {}\n");
+        write(source + "/src/empty", "");
+        fs::create_symlink("/etc/passwd", source + "/link");
+        chmod((source + "/src/main.cpp").c_str(), 0640);
+    }
+
+    void TearDown() override
+    {
+        fs::remove_all(test_dir);
+    }
+
+    static void write(const std::string &path, const std::string &content)
+    {
+        ASSERT_EQ(create_file(path), FileOperationResult::SUCCESS);
+        ASSERT_EQ(write_file(path, content), FileOperationResult::SUCCESS);
+    }
+
+    static std::string read(const std::string &path)
+    {
+        auto [content, result] = read_file(path);
+        EXPECT_EQ(result, FileOperationResult::SUCCESS);
+        return std::string(content.begin(), content.end());
+    }
+
+    // Whole archive of source
+    std::string archive()
+    {
+        auto [tree, result] = open_tree_archive(source);
+        EXPECT_EQ(result, FileOperationResult::SUCCESS);
+        std::string data(tree->size(), '\0');
+        EXPECT_TRUE(
+            tree->read(reinterpret_cast<uint8_t *>(data.data()), data.size()));
+        return data;
+    }
+
+    // Feed data to sink in pieces of chunk bytes
+    static bool feed(TreeArchiveSink &sink,
+                     const std::string &data,
+                     size_t chunk)
+    {
+        for (size_t offset = 0; offset < data.size(); offset += chunk) {
+            size_t size = std::min(chunk, data.size() - offset);
+            if (!sink.write(reinterpret_cast<const uint8_t *>(data.data()) +
+                                offset,
+                            size)) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    fs::path test_dir;
+    std::string source;
+};
+
+// Test that the walk lists directories before their contents and skips
+// symbolic links
+TEST_F(TreeArchiveTest, WalkListsTreeInOrder)
+{
+    auto [entries, result] = walk_tree(source, 4);
+    ASSERT_EQ(result, FileOperationResult::SUCCESS);
+
+    std::vector<std::string> paths;
+    for (const auto &entry : entries) {
+        paths.push_back(entry.path);
+    }
+    std::vector<std::string> expected = {"README",
+                                         "docs",
+                                         "docs/empty",
+                                         "docs/guide.txt",
+                                         "src",
+                                         "src/empty",
+                                         "src/main.cpp"};
+    EXPECT_EQ(paths, expected);
+
+    EXPECT_EQ(entries[1].type, TreeEntryType::DIRECTORY);
+    EXPECT_EQ(entries[3].type, TreeEntryType::FILE);
+    EXPECT_EQ(entries[3].size, 200000u);
+    EXPECT_EQ(entries[6].mode, 0640u);
+
+    EXPECT_EQ(walk_tree(source + "/README").second,
+              FileOperationResult::INVALID_PATH);
+}
+
+// Test that a tree survives the archive fed in odd-sized pieces
+TEST_F(TreeArchiveTest, RoundTripInPieces)
+{
+    std::string data = archive();
+    for (size_t chunk : {size_t{1}, size_t{7}, size_t{4096}, data.size()}) {
+        std::string target = (test_dir / "copy").string();
+        fs::remove_all(target);
+        ASSERT_EQ(create_directory(target), FileOperationResult::SUCCESS);
+
+        TreeArchiveSink sink(target);
+        ASSERT_TRUE(feed(sink, data, chunk));
+        ASSERT_EQ(sink.finish(), FileOperationResult::SUCCESS);
+        EXPECT_EQ(sink.directories(), 3u);
+        EXPECT_EQ(sink.files(), 4u);
+
+        EXPECT_EQ(read(target + "/README"), "fenris\n");
+        EXPECT_EQ(read(target + "/docs/guide.txt"), std::string(200000, 'g'));
+        EXPECT_EQ(read(target + "/src/main.cpp"), "int main() {}\n");
+        EXPECT_EQ(fs::file_size(target + "/src/empty"), 0u);
+        EXPECT_TRUE(fs::is_directory(target + "/docs/empty"));
+        EXPECT_FALSE(fs::exists(fs::symlink_status(target + "/link")));
+        EXPECT_EQ(fs::last_write_time(target + "/docs/guide.txt"),
+                  fs::last_write_time(source + "/docs/guide.txt"));
+
+        struct stat st;
+        ASSERT_EQ(stat((target + "/src/main.cpp").c_str(), &st), 0);
+        EXPECT_EQ(st.st_mode & 07777, 0640u);
+    }
+}
+
+// Test that entries escaping the root are refused
+TEST_F(TreeArchiveTest, RejectsUnsafePaths)
+{
+    EXPECT_TRUE(is_valid_tree_path("a/b.txt"));
+    EXPECT_FALSE(is_valid_tree_path(""));
+    EXPECT_FALSE(is_valid_tree_path("/etc/passwd"));
+    EXPECT_FALSE(is_valid_tree_path("../x"));
+    EXPECT_FALSE(is_valid_tree_path("a/../../x"));
+    EXPECT_FALSE(is_valid_tree_path("a//b"));
+    EXPECT_FALSE(is_valid_tree_path("a/./b"));
+
+    std::string target = (test_dir / "target").string();
+    ASSERT_EQ(create_directory(target), FileOperationResult::SUCCESS);
+    TreeEntry entry;
+    entry.path = "../escaped";
+    entry.size = 3;
+    std::string data = encode_tree_header(entry) + "bad";
+
+    TreeArchiveSink sink(target);
+    EXPECT_FALSE(feed(sink, data, data.size()));
+    EXPECT_EQ(sink.finish(), FileOperationResult::INVALID_PATH);
+    EXPECT_FALSE(fs::exists(test_dir / "escaped"));
+}
+
+// Test that only permission bits are applied to extracted entries
+TEST_F(TreeArchiveTest, SpecialModeBitsAreDropped)
+{
+    std::string target = (test_dir / "target").string();
+    ASSERT_EQ(create_directory(target), FileOperationResult::SUCCESS);
+    TreeEntry directory;
+    directory.path = "shared";
+    directory.type = TreeEntryType::DIRECTORY;
+    directory.mode = 01777;
+    TreeEntry file;
+    file.path = "shared/tool";
+    file.mode = 06755;
+    file.size = 2;
+    std::string data =
+        encode_tree_header(directory) + encode_tree_header(file) + "#!";
+
+    TreeArchiveSink sink(target);
+    ASSERT_TRUE(feed(sink, data, data.size()));
+    ASSERT_EQ(sink.finish(), FileOperationResult::SUCCESS);
+
+    struct stat st;
+    ASSERT_EQ(stat((target + "/shared").c_str(), &st), 0);
+    EXPECT_EQ(st.st_mode & 07777, 0777u);
+    ASSERT_EQ(stat((target + "/shared/tool").c_str(), &st), 0);
+    EXPECT_EQ(st.st_mode & 07777, 0755u);
+}
+
+// Test that files changed after the listing still fill their headers
+TEST_F(TreeArchiveTest, ChangedFilesArePadded)
+{
+    auto [tree, result] = open_tree_archive(source);
+    ASSERT_EQ(result, FileOperationResult::SUCCESS);
+    ASSERT_EQ(write_file(source + "/README", "fen"),
+              FileOperationResult::SUCCESS);
+    fs::remove(source + "/src/main.cpp");
+
+    std::string data(tree->size(), '\0');
+    ASSERT_TRUE(
+        tree->read(reinterpret_cast<uint8_t *>(data.data()), data.size()));
+    EXPECT_EQ(tree->padded_files(), 2u);
+
+    std::string target = (test_dir / "copy").string();
+    ASSERT_EQ(create_directory(target), FileOperationResult::SUCCESS);
+    TreeArchiveSink sink(target);
+    ASSERT_TRUE(feed(sink, data, data.size()));
+    ASSERT_EQ(sink.finish(), FileOperationResult::SUCCESS);
+    EXPECT_EQ(read(target + "/README"), std::string("fen\0\0\0\0", 7));
+    EXPECT_EQ(read(target + "/src/main.cpp"), std::string(14, '\0'));
+    EXPECT_EQ(read(target + "/docs/guide.txt"), std::string(200000, 'g'));
+}
+
+// Test that an archive cut inside an entry is reported by finish()
+TEST_F(TreeArchiveTest, TruncatedArchiveFails)
+{
+    std::string data = archive();
+    std::string target = (test_dir / "target").string();
+    ASSERT_EQ(create_directory(target), FileOperationResult::SUCCESS);
+
+    TreeArchiveSink sink(target);
+    ASSERT_TRUE(feed(sink, data.substr(0, data.size() - 5), 1000));
+    EXPECT_NE(sink.finish(), FileOperationResult::SUCCESS);
+}
+
+// Test that an uploaded tree appears whole at its path or not at all
+TEST_F(TreeArchiveTest, ExtractFromPayload)
+{
+    std::string data = archive();
+    std::string target = (test_dir / "uploaded").string();
+
+    InlineIncomingPayload payload(data);
+    ASSERT_EQ(extract_tree_from_payload(target, payload),
+              FileOperationResult::SUCCESS);
+    EXPECT_EQ(read(target + "/src/main.cpp"), "int main() {}\n");
+    EXPECT_EQ(read(target + "/docs/guide.txt"), std::string(200000, 'g'));
+
+    InlineIncomingPayload again(data);
+    EXPECT_EQ(extract_tree_from_payload(target, again),
+              FileOperationResult::DIRECTORY_ALREADY_EXISTS);
+
+    std::string partial = (test_dir / "partial").string();
+    InlineIncomingPayload truncated(
+        std::string_view(data).substr(0, data.size() / 2));
+    EXPECT_NE(extract_tree_from_payload(partial, truncated),
+              FileOperationResult::SUCCESS);
+    EXPECT_FALSE(fs::exists(partial));
+
+    // A staged tree stays hidden until it is committed, and is never moved
+    // over a path created meanwhile
+    std::string later = (test_dir / "later").string();
+    InlineIncomingPayload staged(data);
+    auto [staging, stage_result] = stage_tree_from_payload(later, staged);
+    ASSERT_EQ(stage_result, FileOperationResult::SUCCESS);
+    EXPECT_FALSE(fs::exists(later));
+    ASSERT_EQ(create_directory(later), FileOperationResult::SUCCESS);
+    EXPECT_NE(commit_staging_directory(staging, later),
+              FileOperationResult::SUCCESS);
+    EXPECT_FALSE(fs::exists(staging));
+    EXPECT_TRUE(fs::is_empty(later));
+    fs::remove(later);
+
+    // Nothing is left behind in the parent but the two trees it started with
+    size_t children = std::distance(fs::directory_iterator(test_dir),
+                                    fs::directory_iterator());
+    EXPECT_EQ(children, 2u);
+}
+
+} // namespace tests
+} // namespace common
+} // namespace fenris
@@ -0,0 +1,114 @@
+#include "common/file_operations.hpp"
+#include "common/logging.hpp"
+#include "server/background_deleter.hpp"
+
+#include <chrono>
+#include <filesystem>
+#include <fstream>
+#include <gtest/gtest.h>
+#include <string>
+#include <thread>
+
+namespace fenris {
+namespace server {
+namespace test {
+
+namespace fs = std::filesystem;
+
+class BackgroundDeleterTest : public ::testing::Test {
+  protected:
+    void SetUp() override
+    {
+        fs::remove_all(test_dir);
+        fs::create_directory(test_dir);
+        common::LoggingConfig log_config;
+        log_config.level = common::LogLevel::DEBUG;
+        log_config.console_logging = true;
+        log_config.file_logging = false;
+
+        common::initialize_logging(log_config, "TestBackgroundDeleter");
+    }
+
+    void TearDown() override
+    {
+        fs::remove_all(test_dir);
+    }
+
+    // Create a tree of width directories each holding width files
+    void create_tree(const fs::path &root, int width)
+    {
+        for (int i = 0; i < width; i++) {
+            fs::path dir = root / ("dir" + std::to_string(i));
+            fs::create_directories(dir);
+            for (int j = 0; j < width; j++) {
+                std::ofstream(dir / ("file" + std::to_string(j))) << "x";
+            }
+        }
+    }
+
+    // Wait until the deleter has nothing left to reclaim
+    bool wait_until_idle(BackgroundDeleter &deleter)
+    {
+        for (int i = 0; i < 500 && deleter.pending() > 0; i++) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        }
+        return deleter.pending() == 0;
+    }
+
+    const std::string test_dir = "/tmp/fenris_background_deleter_test";
+    const std::string trash_dir = test_dir + "/trash";
+};
+
+// Test that a tree leaves the namespace at once and is reclaimed later
+TEST_F(BackgroundDeleterTest, RemoveTree)
+{
+    BackgroundDeleter deleter(trash_dir, 2, 0, "TestBackgroundDeleter");
+    create_tree(test_dir + "/tree", 10);
+    fs::permissions(test_dir + "/tree/dir3", fs::perms::owner_read |
+                                                 fs::perms::owner_exec);
+
+    EXPECT_EQ(deleter.remove(test_dir + "/tree"),
+              common::FileOperationResult::SUCCESS);
+    EXPECT_FALSE(fs::exists(test_dir + "/tree"));
+
+    ASSERT_TRUE(wait_until_idle(deleter));
+    EXPECT_TRUE(fs::is_empty(trash_dir));
+
+    EXPECT_EQ(deleter.remove(test_dir + "/missing"),
+              common::FileOperationResult::FILE_NOT_FOUND);
+}
+
+// Test that entries left in the trash by an earlier run are reclaimed
+TEST_F(BackgroundDeleterTest, ReclaimLeftovers)
+{
+    create_tree(trash_dir + "/old.tree", 5);
+
+    BackgroundDeleter deleter(trash_dir, 1, 0, "TestBackgroundDeleter");
+    fs::create_directory(test_dir + "/empty");
+    EXPECT_EQ(deleter.remove(test_dir + "/empty"),
+              common::FileOperationResult::SUCCESS);
+
+    ASSERT_TRUE(wait_until_idle(deleter));
+    EXPECT_TRUE(fs::is_empty(trash_dir));
+}
+
+// Test that unlinks are spread out by the rate limit
+TEST_F(BackgroundDeleterTest, RateLimit)
+{
+    // 4 directories of 4 files plus the directories themselves: 21 unlinks
+    BackgroundDeleter deleter(trash_dir, 2, 100, "TestBackgroundDeleter");
+    create_tree(test_dir + "/tree", 4);
+
+    auto start = std::chrono::steady_clock::now();
+    EXPECT_EQ(deleter.remove(test_dir + "/tree"),
+              common::FileOperationResult::SUCCESS);
+    ASSERT_TRUE(wait_until_idle(deleter));
+    auto elapsed = std::chrono::steady_clock::now() - start;
+
+    EXPECT_GE(elapsed, std::chrono::milliseconds(150));
+    EXPECT_TRUE(fs::is_empty(trash_dir));
+}
+
+} // namespace test
+} // namespace server
+} // namespace fenris
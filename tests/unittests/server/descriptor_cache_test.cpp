@@ -0,0 +1,160 @@
+#include "common/file_operations.hpp"
+#include "server/descriptor_cache.hpp"
+
+#include <cstdint>
+#include <filesystem>
+#include <fstream>
+#include <gtest/gtest.h>
+#include <memory>
+#include <string>
+#include <unistd.h>
+
+namespace fenris {
+namespace server {
+namespace test {
+
+namespace fs = std::filesystem;
+
+class DescriptorCacheTest : public ::testing::Test {
+  protected:
+    void SetUp() override
+    {
+        fs::remove_all(test_dir);
+        fs::create_directory(test_dir);
+        directory = make_node("", true);
+    }
+
+    void TearDown() override
+    {
+        fs::remove_all(test_dir);
+    }
+
+    std::shared_ptr<Node> make_node(const std::string &name,
+                                    bool is_directory)
+    {
+        auto node = std::make_shared<Node>();
+        node->name = name;
+        node->is_directory = is_directory;
+        return node;
+    }
+
+    void write(const std::string &name, const std::string &content)
+    {
+        std::ofstream(test_dir + "/" + name, std::ios::binary) << content;
+    }
+
+    std::string read_all(int fd)
+    {
+        auto [content, result] = common::read_file_range(fd, 0, UINT64_MAX);
+        EXPECT_EQ(result, common::FileOperationResult::SUCCESS);
+        return content;
+    }
+
+    const std::string test_dir = "/tmp/fenris_descriptor_cache_test";
+    std::shared_ptr<Node> directory;
+};
+
+// Test that repeated lookups reuse one descriptor
+TEST_F(DescriptorCacheTest, ReusesDescriptors)
+{
+    DescriptorCache cache(4);
+    write("a.txt", "first");
+    auto file = make_node("a.txt", false);
+
+    auto dir = cache.directory(directory, test_dir);
+    ASSERT_NE(dir, nullptr);
+    EXPECT_EQ(cache.directory(directory, "/does/not/matter"), dir);
+
+    auto descriptor = cache.file(file, dir->get(), "a.txt");
+    ASSERT_NE(descriptor, nullptr);
+    EXPECT_EQ(cache.file(file, dir->get(), "a.txt"), descriptor);
+    EXPECT_EQ(read_all(descriptor->get()), "first");
+    EXPECT_EQ(cache.size(), 2u);
+
+    // The descriptor follows the file across a rename
+    fs::rename(test_dir + "/a.txt", test_dir + "/b.txt");
+    EXPECT_EQ(read_all(cache.file(file, dir->get(), "b.txt")->get()),
+              "first");
+
+    // Missing entries are not cached
+    EXPECT_EQ(cache.file(make_node("missing", false), dir->get(), "missing"),
+              nullptr);
+    EXPECT_EQ(cache.size(), 2u);
+}
+
+// Test that a replaced file is reopened once invalidated
+TEST_F(DescriptorCacheTest, InvalidateReopens)
+{
+    DescriptorCache cache(4);
+    auto dir = cache.directory(directory, test_dir);
+    auto file = make_node("a.txt", false);
+    write("a.txt", "old");
+    auto old_descriptor = cache.file(file, dir->get(), "a.txt");
+
+    ASSERT_EQ(common::write_file(test_dir + "/a.txt", "new"),
+              common::FileOperationResult::SUCCESS);
+    EXPECT_EQ(read_all(cache.file(file, dir->get(), "a.txt")->get()), "old");
+
+    cache.invalidate(file);
+    EXPECT_EQ(read_all(cache.file(file, dir->get(), "a.txt")->get()), "new");
+
+    // Holders keep using the descriptor they already have
+    EXPECT_EQ(read_all(old_descriptor->get()), "old");
+
+    cache.clear();
+    EXPECT_EQ(cache.size(), 0u);
+}
+
+// Test that the least recently used descriptor is evicted first
+TEST_F(DescriptorCacheTest, EvictsLeastRecentlyUsed)
+{
+    DescriptorCache cache(2);
+    auto dir = cache.directory(directory, test_dir);
+    write("a.txt", "a");
+    write("b.txt", "b");
+    auto a = make_node("a.txt", false);
+    auto b = make_node("b.txt", false);
+
+    auto a_descriptor = cache.file(a, dir->get(), "a.txt");
+    // Touch the directory so the file is the oldest entry
+    cache.directory(directory, test_dir);
+    cache.file(b, dir->get(), "b.txt");
+    EXPECT_EQ(cache.size(), 2u);
+
+    EXPECT_EQ(cache.directory(directory, test_dir), dir);
+    EXPECT_NE(cache.file(a, dir->get(), "a.txt"), a_descriptor);
+}
+
+// Test the directory-relative file operations
+TEST_F(DescriptorCacheTest, RelativeOperations)
+{
+    DescriptorCache cache;
+    int dirfd = cache.directory(directory, test_dir)->get();
+
+    EXPECT_EQ(common::create_file_at(dirfd, "new.txt"),
+              common::FileOperationResult::SUCCESS);
+    EXPECT_TRUE(fs::exists(test_dir + "/new.txt"));
+    EXPECT_EQ(common::create_file_at(dirfd, "new.txt"),
+              common::FileOperationResult::FILE_ALREADY_EXISTS);
+    EXPECT_EQ(common::create_file_at(dirfd, "../escape.txt"),
+              common::FileOperationResult::INVALID_PATH);
+
+    write("new.txt", "12345");
+    auto [info, info_result] = common::get_file_info_at(dirfd, "new.txt");
+    ASSERT_EQ(info_result, common::FileOperationResult::SUCCESS);
+    EXPECT_EQ(info.name(), "new.txt");
+    EXPECT_EQ(info.size(), 5u);
+    EXPECT_FALSE(info.is_directory());
+
+    fs::create_directory(test_dir + "/sub");
+    EXPECT_EQ(common::delete_file_at(dirfd, "sub"),
+              common::FileOperationResult::INVALID_PATH);
+    EXPECT_EQ(common::delete_file_at(dirfd, "new.txt"),
+              common::FileOperationResult::SUCCESS);
+    EXPECT_EQ(common::delete_file_at(dirfd, "new.txt"),
+              common::FileOperationResult::FILE_NOT_FOUND);
+}
+
+} // namespace test
+} // namespace server
+} // namespace fenris
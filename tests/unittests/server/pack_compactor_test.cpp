@@ -0,0 +1,71 @@
+#include "common/file_operations.hpp"
+#include "server/pack_compactor.hpp"
+
+#include <chrono>
+#include <filesystem>
+#include <gtest/gtest.h>
+#include <memory>
+#include <string>
+#include <thread>
+
+namespace fenris {
+namespace server {
+namespace test {
+
+namespace fs = std::filesystem;
+
+class PackCompactorTest : public ::testing::Test {
+  protected:
+    void SetUp() override
+    {
+        fs::remove_all(test_dir);
+        fs::create_directories(test_dir + "/files");
+        store = std::make_shared<common::PackStore>(test_dir + "/packs");
+        ASSERT_EQ(store->initialize(), common::FileOperationResult::SUCCESS);
+    }
+
+    void TearDown() override
+    {
+        fs::remove_all(test_dir);
+    }
+
+    const std::string test_dir = "/tmp/fenris_pack_compactor_test";
+    std::shared_ptr<common::PackStore> store;
+};
+
+// Test that the compactor runs periodically until stopped
+TEST_F(PackCompactorTest, RunsPeriodically)
+{
+    PackCompactor compactor(store,
+                            test_dir + "/files",
+                            std::chrono::seconds(0));
+    compactor.start();
+
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(5);
+    while (compactor.passes() < 2 &&
+           std::chrono::steady_clock::now() < deadline) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    EXPECT_GE(compactor.passes(), 2u);
+
+    compactor.stop();
+    uint64_t passes = compactor.passes();
+    std::this_thread::sleep_for(std::chrono::milliseconds(20));
+    EXPECT_EQ(compactor.passes(), passes);
+}
+
+// Test that stopping does not wait for the interval to elapse
+TEST_F(PackCompactorTest, StopsPromptly)
+{
+    auto started = std::chrono::steady_clock::now();
+    {
+        PackCompactor compactor(store, test_dir + "/files");
+        compactor.start();
+    }
+    EXPECT_LT(std::chrono::steady_clock::now() - started,
+              std::chrono::seconds(5));
+}
+
+} // namespace test
+} // namespace server
+} // namespace fenris
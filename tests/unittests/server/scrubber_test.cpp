@@ -0,0 +1,108 @@
+#include "common/checksum.hpp"
+#include "common/file_operations.hpp"
+#include "server/scrubber.hpp"
+
+#include <chrono>
+#include <fcntl.h>
+#include <filesystem>
+#include <gtest/gtest.h>
+#include <string>
+#include <sys/stat.h>
+#include <thread>
+#include <unistd.h>
+
+namespace fenris {
+namespace server {
+namespace test {
+
+namespace fs = std::filesystem;
+
+class ScrubberTest : public ::testing::Test {
+  protected:
+    void SetUp() override
+    {
+        fs::remove_all(test_dir);
+        fs::create_directories(test_dir + "/sub");
+    }
+
+    void TearDown() override
+    {
+        fs::remove_all(test_dir);
+    }
+
+    // Flip a byte keeping size and mtime, as a failing disk would
+    void corrupt(const std::string &filepath)
+    {
+        struct stat st;
+        ASSERT_EQ(stat(filepath.c_str(), &st), 0);
+        int fd = open(filepath.c_str(), O_RDWR);
+        ASSERT_GE(fd, 0);
+        ASSERT_EQ(pwrite(fd, "!", 1, 0), 1);
+        struct timespec times[2] = {st.st_atim, st.st_mtim};
+        ASSERT_EQ(futimens(fd, times), 0);
+        close(fd);
+    }
+
+    const std::string test_dir = "/tmp/fenris_scrubber_test";
+};
+
+// Test that a scrub finds corrupted files and seals unchecked ones
+TEST_F(ScrubberTest, FindsCorruptionAndSeals)
+{
+    ASSERT_EQ(common::write_file(test_dir + "/good.txt", "intact contents"),
+              common::FileOperationResult::SUCCESS);
+    ASSERT_EQ(common::write_file(test_dir + "/sub/bad.txt", "to be damaged"),
+              common::FileOperationResult::SUCCESS);
+    corrupt(test_dir + "/sub/bad.txt");
+    ASSERT_EQ(common::write_file(test_dir + "/changed.txt", "old contents"),
+              common::FileOperationResult::SUCCESS);
+    ASSERT_EQ(common::write_file_range(test_dir + "/changed.txt", 0, "new"),
+              common::FileOperationResult::SUCCESS);
+
+    // Nothing is sealed while it may still be written to
+    Scrubber recent(test_dir,
+                    DEFAULT_SCRUB_INTERVAL,
+                    std::chrono::seconds(3600));
+    auto stats = recent.scrub();
+    EXPECT_EQ(stats.files_checked, 2u);
+    EXPECT_EQ(stats.files_corrupted, 1u);
+    EXPECT_EQ(stats.files_sealed, 0u);
+
+    Scrubber scrubber(test_dir,
+                      DEFAULT_SCRUB_INTERVAL,
+                      std::chrono::seconds(-1));
+    stats = scrubber.scrub();
+    EXPECT_EQ(stats.files_corrupted, 1u);
+    EXPECT_EQ(stats.files_sealed, 1u);
+
+    auto [report, result] = common::verify_file(test_dir + "/changed.txt");
+    EXPECT_EQ(result, common::FileOperationResult::SUCCESS);
+    EXPECT_TRUE(report.checked);
+    EXPECT_EQ(scrubber.scrub().files_checked, 3u);
+}
+
+// Test that the scrubber runs periodically and stops promptly
+TEST_F(ScrubberTest, RunsPeriodically)
+{
+    Scrubber scrubber(test_dir, std::chrono::seconds(0));
+    scrubber.start();
+
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(5);
+    while (scrubber.passes() < 2 &&
+           std::chrono::steady_clock::now() < deadline) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    EXPECT_GE(scrubber.passes(), 2u);
+
+    auto started = std::chrono::steady_clock::now();
+    {
+        Scrubber idle(test_dir);
+        idle.start();
+    }
+    EXPECT_LT(std::chrono::steady_clock::now() - started,
+              std::chrono::seconds(5));
+}
+
+} // namespace test
+} // namespace server
+} // namespace fenris
@@ -348,6 +348,14 @@ class ServerConnectionManagerTest : public ::testing::Test {
         client_info.address = "127.0.0.1";
         client_info.port = m_port_str;
 
+        // The server completes the handshake with its compression dictionary
+        auto dictionary_response = receive_response(client_info);
+        if (!dictionary_response.has_value() ||
+            dictionary_response->type() != fenris::ResponseType::DICTIONARY) {
+            std::cerr << "Did not receive compression dictionary" << std::endl;
+            return {ClientInfo(0, 0), false};
+        }
+
         std::cout << "Client connected with ID: " << client_info.client_id
                   << std::endl;
 